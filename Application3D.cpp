@@ -4,6 +4,8 @@
 #include "Camera.h"
 #include "Instance.h"
 #include "Scene.h"
+#include "AssetLoader.h"
+#include "InstanceCuller.h"
 #include <imgui.h>
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
@@ -73,6 +75,11 @@ bool Application3D::startup() {
 	}
 	m_scene->setShadowTarget(&m_shadowTarget);
 
+	//the shadow, reflection and refraction passes can get away with coarser meshes than the main view
+	m_scene->setShadowLodBias(1.0f);
+	m_scene->setLodBias(1, 1.0f);
+	m_scene->setLodBias(-1, 1.0f);
+
 	//load simple shader
 	m_simpleShader.loadShader(aie::eShaderStage::VERTEX,
 		"./shaders/simple.vert");
@@ -206,25 +213,50 @@ bool Application3D::startup() {
 
 	if (m_loadMirror)
 	{
-		const unsigned int dimensions = 200;
-		
-		m_mirrorMesh.initialiseQuad(dimensions, dimensions);
-
-		glm::vec3 position = { 0,0,0 };
-		glm::vec3 eulerAngles = { 0,0,0 };
-		glm::vec3 scale = { 10.0f / dimensions, 1.0f, 10.0f / dimensions };
-
-		//create instance with a render target
-		m_waterInstance = new Instance(position, eulerAngles, scale, &m_mirrorMesh, &m_waterShader, nullptr, &m_reflectionTarget, &m_refractionTarget);
-		m_scene->AddInstance(m_waterInstance, 0);
-
 		glm::vec3 ambient  = glm::vec3(0.000000f, 0.000000f, 0.000000f);
 		glm::vec3 diffuse  = glm::vec3(0.000000f, 0.000000f, 0.000000f);
 		glm::vec3 specular = glm::vec3(1.000000f, 1.000000f, 1.000000f);
 		float specularPower = 128.0f; 
-			
-		m_waterInstance->addMaterial(ambient, diffuse, specular, specularPower);
-		m_waterInstance->setDimensions(dimensions);
+
+		//rings of one patch follow the camera, so the water can be any size for the same vertex count
+		if (WaterClipmap::isSupported(m_waterShader.getHandle()))
+		{
+			const unsigned int patchQuads = 32;
+			const float cellSize = 0.05f;
+			const unsigned int levels = 5;
+
+			m_waterClipmap.initialise(patchQuads, cellSize, levels);
+			m_useWaterClipmap = true;
+
+			//the patches carry their own world matrices
+			m_waterInstance = new Instance(glm::mat4(1), &m_waterClipmap, &m_waterShader, nullptr, &m_reflectionTarget, &m_refractionTarget);
+			m_scene->AddInstance(m_waterInstance, 0);
+
+			m_waterInstance->addMaterial(ambient, diffuse, specular, specularPower);
+			//quads along each patch's texcoords, as the fixed grid had along its own
+			m_waterInstance->setDimensions(patchQuads);
+		}
+		//shaders without the clipmap inputs keep the fixed grid
+		else
+		{
+			printf("Reflective Water Shader has no clipmap inputs, drawing a fixed grid\n");
+
+			const unsigned int dimensions = 200;
+
+			//the water is flat, so its normal needn't be stored per vertex
+			m_mirrorMesh.initialiseQuad(dimensions, dimensions, true);
+
+			glm::vec3 position = { 0,0,0 };
+			glm::vec3 eulerAngles = { 0,0,0 };
+			glm::vec3 scale = { 10.0f / dimensions, 1.0f, 10.0f / dimensions };
+
+			//create instance with a render target
+			m_waterInstance = new Instance(position, eulerAngles, scale, &m_mirrorMesh, &m_waterShader, nullptr, &m_reflectionTarget, &m_refractionTarget);
+			m_scene->AddInstance(m_waterInstance, 0);
+
+			m_waterInstance->addMaterial(ambient, diffuse, specular, specularPower);
+			m_waterInstance->setDimensions(dimensions);
+		}
 	}
 
 	if (m_loadQuad)
@@ -243,74 +275,71 @@ bool Application3D::startup() {
 		m_scene->AddInstance(new Instance(position, eulerAngles, scale, &m_quadMesh, &m_shadowUseShader), 1);
 	}
 
+	//the meshes are parsed on worker threads and only join the scene once they are uploaded,
+	//so the first frames draw without them
+	m_assetLoader = new aie::AssetLoader();
+
+	//pack the dense stanford scans to cut their vertex bandwidth and memory
+	aie::OBJMesh::ImportSettings scanSettings;
+	scanSettings.packVertices = true;
+	scanSettings.lodCount = 4;
+
 	if (m_loadBunny)
 	{
 		//load a bunny model
-		if (m_bunnyMesh.load("./stanford/bunny.obj") == false) {
-			printf("Bunny Mesh Error!\n");
-			return false;
-		}
+		m_bunnyMesh = m_assetLoader->loadMesh("./stanford/bunny.obj", scanSettings, true, false, [this]()
+		{
+			glm::vec3 position = { 2.5f,-0.1f,-2.5f };
+			glm::vec3 eulerAngles = { 0,45,0 };
+			glm::vec3 scale = { 0.3,0.3,0.3 };
 
-		glm::vec3 position = { 2.5f,-0.1f,-2.5f };
-		glm::vec3 eulerAngles = { 0,45,0 };
-		glm::vec3 scale = { 0.3,0.3,0.3 };
-
-		m_scene->AddInstance(new Instance(position, eulerAngles, scale, &m_bunnyMesh, &m_phongShader), 1);
+			m_scene->AddInstance(new Instance(position, eulerAngles, scale, m_bunnyMesh.get(), &m_phongShader), 1);
+		});
 	}
 
 	if (m_loadBuddha)
 	{
 		//load a buddha model
-		if (m_buddhaMesh.load("./stanford/buddha.obj") == false) {
-			printf("Buddha Mesh Error!\n");
-			return false;
-		}
-
-		glm::vec3 position = { -2.5f,-0.1f,2.5f };
-		glm::vec3 eulerAngles = { 0,45,0 };
-		glm::vec3 scale = { 0.3,0.3,0.3 };
+		m_buddhaMesh = m_assetLoader->loadMesh("./stanford/buddha.obj", scanSettings, true, false, [this]()
+		{
+			glm::vec3 position = { -2.5f,-0.1f,2.5f };
+			glm::vec3 eulerAngles = { 0,45,0 };
+			glm::vec3 scale = { 0.3,0.3,0.3 };
 
-		m_scene->AddInstance(new Instance(position, eulerAngles, scale, &m_buddhaMesh, &m_phongShader), 1);
+			m_scene->AddInstance(new Instance(position, eulerAngles, scale, m_buddhaMesh.get(), &m_phongShader), 1);
+		});
 	}
 
 	if (m_loadDragon)
 	{
 		//load a dragon model
-		if (m_dragonMesh.load("./stanford/dragon.obj") == false) {
-			printf("Dragon Mesh Error!\n");
-			return false;
-		}
-
-		glm::vec3 position = { -2.5f,-0.1f,-2.5f };
-		glm::vec3 eulerAngles = { 0,45,0 };
-		glm::vec3 scale = { 0.3,0.3,0.3 };
+		m_dragonMesh = m_assetLoader->loadMesh("./stanford/dragon.obj", scanSettings, true, false, [this]()
+		{
+			glm::vec3 position = { -2.5f,-0.1f,-2.5f };
+			glm::vec3 eulerAngles = { 0,45,0 };
+			glm::vec3 scale = { 0.3,0.3,0.3 };
 
-		m_scene->AddInstance(new Instance(position, eulerAngles, scale, &m_dragonMesh, &m_phongShader), 1);
+			m_scene->AddInstance(new Instance(position, eulerAngles, scale, m_dragonMesh.get(), &m_phongShader), 1);
+		});
 	}
 
 	if (m_loadSpear)
 	{
 		//load soul spear
-		if (m_spearMesh.load("./soulspear/soulspear.obj",
-			true, true) == false) {
-			printf("Soulspear Mesh Error!\n");
-			return false;
-		}
-
-		glm::vec3 position = { 2.5f,0,2.5f };
-		glm::vec3 eulerAngles = { 0,45,0 };
-		glm::vec3 scale = { 0.6,0.6,0.6 };
+		m_spearMesh = m_assetLoader->loadMesh("./soulspear/soulspear.obj", aie::OBJMesh::ImportSettings(), true, true, [this]()
+		{
+			glm::vec3 position = { 2.5f,0,2.5f };
+			glm::vec3 eulerAngles = { 0,45,0 };
+			glm::vec3 scale = { 0.6,0.6,0.6 };
 
-		m_scene->AddInstance(new Instance(position, eulerAngles, scale, &m_spearMesh, &m_normalMapShader), 1);
+			m_scene->AddInstance(new Instance(position, eulerAngles, scale, m_spearMesh.get(), &m_normalMapShader), 1);
+		});
 	}
 
 	if (m_loadWalls)
 	{
-		//load tile texture
-		if (m_tileTexture.load("./textures/Tiles.jpg") == false) {
-			printf("Failed to load texture!\n");
-			return false;
-		}
+		//the walls show a flat grey placeholder until the tile texture is compressed, or read from its cache
+		m_tileTexture = m_assetLoader->loadCompressedTexture("./textures/Tiles.jpg");
 		
 		const unsigned int dimensions = 1;
 		const float size = 5.0f;
@@ -339,53 +368,53 @@ bool Application3D::startup() {
 		glm::vec3 scale = { size / dimensions, 1.0f, size / dimensions };
 
 		//create instances for each of the 16 textured wall segments
-		Instance* tileInstance1 = new Instance(position1, eulerAngles1, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance1 = new Instance(position1, eulerAngles1, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance1, -2);
-		Instance* tileInstance2 = new Instance(position1, eulerAngles2, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance2 = new Instance(position1, eulerAngles2, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance2, 2);
-		Instance* tileInstance3 = new Instance(position2, eulerAngles1, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance3 = new Instance(position2, eulerAngles1, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance3, -2);
-		Instance* tileInstance4 = new Instance(position2, eulerAngles2, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance4 = new Instance(position2, eulerAngles2, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance4, 2);
-		Instance* tileInstance5 = new Instance(position3, eulerAngles1, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance5 = new Instance(position3, eulerAngles1, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance5, 2);
-		Instance* tileInstance6 = new Instance(position3, eulerAngles2, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance6 = new Instance(position3, eulerAngles2, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance6, -2);
-		Instance* tileInstance7 = new Instance(position4, eulerAngles1, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance7 = new Instance(position4, eulerAngles1, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance7, 2);
-		Instance* tileInstance8 = new Instance(position4, eulerAngles2, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance8 = new Instance(position4, eulerAngles2, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance8, -2);
-		Instance* tileInstance9 = new Instance(position5, eulerAngles3, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance9 = new Instance(position5, eulerAngles3, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance9, -2);
-		Instance* tileInstance10 = new Instance(position5, eulerAngles4, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance10 = new Instance(position5, eulerAngles4, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance10, 2);
-		Instance* tileInstance11 = new Instance(position6, eulerAngles3, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance11 = new Instance(position6, eulerAngles3, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance11, -2);
-		Instance* tileInstance12 = new Instance(position6, eulerAngles4, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance12 = new Instance(position6, eulerAngles4, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance12, 2);
-		Instance* tileInstance13 = new Instance(position7, eulerAngles3, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance13 = new Instance(position7, eulerAngles3, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance13, 2);
-		Instance* tileInstance14 = new Instance(position7, eulerAngles4, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance14 = new Instance(position7, eulerAngles4, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance14, -2);
-		Instance* tileInstance15 = new Instance(position8, eulerAngles3, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance15 = new Instance(position8, eulerAngles3, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance15, 2);
-		Instance* tileInstance16 = new Instance(position8, eulerAngles4, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance16 = new Instance(position8, eulerAngles4, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance16, -2);
-		Instance* tileInstance17 = new Instance(position9, eulerAngles5, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance17 = new Instance(position9, eulerAngles5, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance17, -1);
-		Instance* tileInstance18 = new Instance(position9, eulerAngles6, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance18 = new Instance(position9, eulerAngles6, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance18, -2);
-		Instance* tileInstance19 = new Instance(position10, eulerAngles5, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance19 = new Instance(position10, eulerAngles5, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance19, -1);
-		Instance* tileInstance20 = new Instance(position10, eulerAngles6, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance20 = new Instance(position10, eulerAngles6, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance20, -2);
-		Instance* tileInstance21 = new Instance(position11, eulerAngles5, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance21 = new Instance(position11, eulerAngles5, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance21, -1);
-		Instance* tileInstance22 = new Instance(position11, eulerAngles6, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance22 = new Instance(position11, eulerAngles6, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance22, -2);
-		Instance* tileInstance23 = new Instance(position12, eulerAngles5, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance23 = new Instance(position12, eulerAngles5, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance23, -1);
-		Instance* tileInstance24 = new Instance(position12, eulerAngles6, scale, &m_tileMesh, &m_texturedShader, &m_tileTexture);
+		Instance* tileInstance24 = new Instance(position12, eulerAngles6, scale, &m_tileMesh, &m_texturedShader, m_tileTexture.get());
 		m_scene->AddInstance(tileInstance24, -2);
 
 		glm::vec3 ambient  = glm::vec3(0.100000f, 0.100000f, 0.100000f);
@@ -454,8 +483,22 @@ bool Application3D::startup() {
 
 void Application3D::shutdown() {
 
+	//stop the loader first, its workers may still be writing in to the meshes
+	delete m_assetLoader;
+
 	Gizmos::destroy();
 	delete m_scene;
+
+	//release our references while the context is still alive, the registry frees anything unused
+	m_bunnyMesh.reset();
+	m_buddhaMesh.reset();
+	m_dragonMesh.reset();
+	m_spearMesh.reset();
+	m_tileTexture.reset();
+
+	//the Mesh members return their ranges after this, which needs no GL
+	aie::GeometryArena::releaseAll();
+	aie::InstanceCuller::releaseProgram();
 }
 
 
@@ -467,9 +510,24 @@ void Application3D::update(float deltaTime) {
 	//update scene time
 	m_scene->setTime(time);
 
+	//upload whatever finished loading, with a budget so a frame doesn't stall on many small assets
+	if (m_fullyLoaded == false)
+	{
+		m_assetLoader->pumpUploads(4.0f);
+		if (m_assetLoader->isIdle())
+		{
+			m_fullyLoaded = true;
+			printf("Fully loaded after %.1fms\n", time * 1000.0f);
+		}
+	}
+
 	//update camera position
 	m_camera->update(deltaTime);
 
+	//the water's rings follow the camera
+	if (m_useWaterClipmap)
+		m_waterClipmap.setViewPosition(m_camera->getPosition());
+
 	//use an ImGUI window to change the light direction and colour at runtime
 	ImGui::Begin("Light Settings");
 	ImGui::DragFloat3("Sunlight Direction", &(m_scene->getLight().direction[0]), 0.01f, -1.0f, 1.0f);
@@ -507,6 +565,9 @@ void Application3D::update(float deltaTime) {
 	{
 		m_showGrid = !m_showGrid;
 	}
+	ImGui::Text("GL state calls %u, redundant skipped %u", m_glStateCounters.issued, m_glStateCounters.skipped);
+	ImGui::Text("Culled: scene %u, reflection %u, refraction %u, shadow %u", m_scene->getCulledCount(0), m_scene->getCulledCount(1),
+		m_scene->getCulledCount(-1), m_scene->getShadowCulledCount());
 
 	ImGui::End();
 
@@ -541,6 +602,11 @@ void Application3D::update(float deltaTime) {
 
 
 void Application3D::draw() {
+
+	//the last frame's state cache counts, the ui and gizmos drew around the cache since
+	m_glStateCounters = aie::GLState::getCounters();
+	aie::GLState::resetCounters();
+	aie::GLState::invalidate();
 	
 	//get the pvm for the sunlight
 	glm::vec3 lightDirection = glm::normalize(glm::vec3(m_scene->getLight().direction * -1.0f));
@@ -550,23 +616,23 @@ void Application3D::draw() {
 	
 	// shadow pass: bind our shadow map target and clear the depth 
 	m_shadowTarget.bind();
-	glViewport(0, 0, 2048, 2048);
+	aie::GLState::setViewport(0, 0, 2048, 2048);
 	clearScreen();
 
 	m_shadowGenShader.bind();
 
 	// bind the light matrix 
-	int loc = glGetUniformLocation(m_shadowGenShader.getHandle(), "lightMatrix");
+	int loc = m_shadowGenShader.getUniform("lightMatrix");
 	glUniformMatrix4fv(loc, 1, GL_FALSE, &(lightMatrix[0][0]));
 
 	//draw all shadow casters - ie everything but the water
-	glCullFace(GL_FRONT);
-	m_scene->drawRaw(2, &m_shadowGenShader);
-	glCullFace(GL_BACK);
+	aie::GLState::setCullFace(GL_FRONT);
+	m_scene->drawRaw(2, &m_shadowGenShader, true);
+	aie::GLState::setCullFace(GL_BACK);
 
 	//unbind render target and reset viewport size
 	m_shadowTarget.unbind();
-	glViewport(0, 0, 1280, 720);
+	aie::GLState::setViewport(0, 0, 1280, 720);
 	clearScreen();
 
 	//bind the shadow use shader
@@ -610,6 +676,12 @@ void Application3D::draw() {
 	{
 		m_scene->draw(0);
 	}
+
+	if (m_firstFrameDrawn == false)
+	{
+		m_firstFrameDrawn = true;
+		printf("First frame after %.1fms\n", getTime() * 1000.0f);
+	}
 }
 
 
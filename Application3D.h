@@ -3,13 +3,17 @@
 #include "Application.h"
 #include "Shader.h"
 #include "Mesh.h"
+#include "WaterClipmap.h"
 #include "OBJMesh.h"
 #include "RenderTarget.h"
+#include "GLState.h"
 #include <glm/mat4x4.hpp>
+#include <memory>
 
 class Instance;
 class Camera;
 class Scene;
+namespace aie { class AssetLoader; }
 
 class Application3D : public aie::Application 
 {
@@ -52,17 +56,21 @@ protected:
 	bool m_postProcessingActive = false;
 	bool m_showGrid = false;
 
+	//the water, or the fixed grid when the water shader can't draw the clipmap
+	WaterClipmap m_waterClipmap;
+	bool m_useWaterClipmap = false;
 	Mesh m_mirrorMesh;
 	Mesh m_quadMesh;
 	Mesh m_postMesh;
 	Mesh m_DOFOutFocusMesh;
-	aie::OBJMesh m_bunnyMesh;
-	aie::OBJMesh m_buddhaMesh;
-	aie::OBJMesh m_dragonMesh;
-	aie::OBJMesh m_spearMesh;
+	//shared through the asset registry
+	std::shared_ptr<aie::OBJMesh> m_bunnyMesh;
+	std::shared_ptr<aie::OBJMesh> m_buddhaMesh;
+	std::shared_ptr<aie::OBJMesh> m_dragonMesh;
+	std::shared_ptr<aie::OBJMesh> m_spearMesh;
 
 	Mesh m_tileMesh;
-	aie::Texture m_tileTexture;
+	std::shared_ptr<aie::Texture> m_tileTexture;
 
 	Camera* m_camera;
 
@@ -75,4 +83,12 @@ protected:
 
 	Instance* m_postProcessingInstance = nullptr;
 	Instance* m_waterInstance = nullptr;
+
+	//meshes and textures finish loading in the background after startup
+	aie::AssetLoader* m_assetLoader = nullptr;
+	bool m_firstFrameDrawn = false;
+	bool m_fullyLoaded = false;
+
+	//state changes sent and filtered out by the state cache over the last frame
+	aie::GLState::Counters m_glStateCounters;
 };
\ No newline at end of file
@@ -0,0 +1,235 @@
+#include "AssetLoader.h"
+#include "AssetRegistry.h"
+#include "Texture.h"
+#include "Parallel.h"
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <stb_image.h>
+
+namespace aie {
+
+AssetLoader::AssetLoader(unsigned int workerCount /* = 0 */)
+	: m_pending(0), m_quit(false) {
+
+	if (workerCount == 0)
+		workerCount = getThreadCount() > 1 ? getThreadCount() - 1 : 1;
+
+	m_workers.reserve(workerCount);
+	for (unsigned int i = 0; i < workerCount; ++i)
+		m_workers.emplace_back(&AssetLoader::workerLoop, this);
+}
+
+AssetLoader::~AssetLoader() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+		m_work.clear();
+	}
+	m_workReady.notify_all();
+
+	for (auto& worker : m_workers)
+		worker.join();
+}
+
+void AssetLoader::addTask(std::function<void()> work, std::function<void()> upload /* = nullptr */) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_work.push_back({ std::move(work), std::move(upload) });
+		++m_pending;
+	}
+	m_workReady.notify_one();
+}
+
+std::shared_ptr<OBJMesh> AssetLoader::loadMesh(const char* filename, const OBJMesh::ImportSettings& settings,
+											   bool loadTextures /* = true */, bool flipTextureV /* = false */,
+											   std::function<void()> onLoaded /* = nullptr */) {
+
+	bool created = false;
+	std::shared_ptr<OBJMesh> mesh = AssetRegistry::findOrCreateMesh(filename, settings, loadTextures, flipTextureV, created);
+	if (created == false) {
+		runWhenLoaded(mesh, onLoaded);
+		return mesh;
+	}
+
+	// the tasks hold the mesh so it survives until they've run, even if every other user lets go
+	std::string file = filename;
+	auto prepared = std::make_shared<bool>(false);
+	AssetRegistry::beginLoad(mesh);
+
+	addTask([mesh, file, loadTextures, flipTextureV, prepared]() {
+		*prepared = mesh->prepare(file.c_str(), loadTextures, flipTextureV);
+	},
+	[mesh, file, prepared, onLoaded]() {
+		std::vector<std::function<void()>> waiting = AssetRegistry::endLoad(mesh);
+		if (*prepared == false || mesh->upload() == false) {
+			printf("Failed to load mesh %s\n", file.c_str());
+			return;
+		}
+		if (onLoaded)
+			onLoaded();
+		for (auto& callback : waiting)
+			callback();
+	});
+
+	return mesh;
+}
+
+std::shared_ptr<Texture> AssetLoader::loadTexture(const char* filename, std::function<void()> onLoaded /* = nullptr */) {
+
+	struct Image {
+		unsigned char*	pixels = nullptr;
+		int				width = 0, height = 0, components = 0;
+		~Image() { if (pixels) stbi_image_free(pixels); }
+	};
+
+	bool created = false;
+	std::shared_ptr<Texture> texture = AssetRegistry::findOrCreateTexture(filename, created);
+	if (created == false) {
+		runWhenLoaded(texture, onLoaded);
+		return texture;
+	}
+
+	unsigned char placeholder[] = { 128, 128, 128, 255 };
+	texture->create(1, 1, Texture::RGBA, placeholder);
+
+	std::string file = filename;
+	auto image = std::make_shared<Image>();
+	AssetRegistry::beginLoad(texture);
+
+	addTask([file, image]() {
+		image->pixels = stbi_load(file.c_str(), &image->width, &image->height, &image->components, 0);
+	},
+	[texture, file, image, onLoaded]() {
+		std::vector<std::function<void()>> waiting = AssetRegistry::endLoad(texture);
+		if (image->pixels == nullptr) {
+			printf("Failed to load texture %s\n", file.c_str());
+			return;
+		}
+		static const Texture::Format formats[] = { Texture::RED, Texture::RED, Texture::RG, Texture::RGB, Texture::RGBA };
+		texture->create((unsigned int)image->width, (unsigned int)image->height, formats[image->components], image->pixels);
+		if (onLoaded)
+			onLoaded();
+		for (auto& callback : waiting)
+			callback();
+	});
+
+	return texture;
+}
+
+std::shared_ptr<CompressedTexture> AssetLoader::loadCompressedTexture(const char* filename,
+																	 CompressedTexture::Usage usage /* = CompressedTexture::Usage::COLOUR */,
+																	 TextureCompressor::Quality quality /* = TextureCompressor::Quality::FAST */,
+																	 std::function<void()> onLoaded /* = nullptr */) {
+
+	bool created = false;
+	std::shared_ptr<CompressedTexture> texture = AssetRegistry::findOrCreateCompressedTexture(filename, usage, quality, created);
+	if (created == false) {
+		runWhenLoaded(texture, onLoaded);
+		return texture;
+	}
+
+	unsigned char placeholder[] = { 128, 128, 128, 255 };
+	texture->create(1, 1, Texture::RGBA, placeholder);
+
+	std::string file = filename;
+	auto prepared = std::make_shared<bool>(false);
+	AssetRegistry::beginLoad(texture);
+
+	addTask([texture, file, usage, quality, prepared]() {
+		*prepared = texture->prepare(file.c_str(), usage, quality);
+	},
+	[texture, file, prepared, onLoaded]() {
+		std::vector<std::function<void()>> waiting = AssetRegistry::endLoad(texture);
+		if (*prepared == false || texture->upload() == false) {
+			printf("Failed to load texture %s\n", file.c_str());
+			return;
+		}
+		if (onLoaded)
+			onLoaded();
+		for (auto& callback : waiting)
+			callback();
+	});
+
+	return texture;
+}
+
+// a load still in flight keeps onLoaded to run after its upload. an asset that has already loaded runs it
+// on the next pump rather than now, so the caller has the pointer the load returns before it runs
+void AssetLoader::runWhenLoaded(const std::shared_ptr<void>& asset, std::function<void()> onLoaded) {
+	if (onLoaded == nullptr)
+		return;
+	if (AssetRegistry::waitForLoad(asset, onLoaded) == false)
+		addTask([]() {}, onLoaded);
+}
+
+unsigned int AssetLoader::pumpUploads(float budgetMilliseconds) {
+
+	auto startTime = std::chrono::high_resolution_clock::now();
+	unsigned int count = 0;
+
+	for (;;) {
+		std::function<void()> upload;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_uploads.empty())
+				break;
+			upload = std::move(m_uploads.front());
+			m_uploads.pop_front();
+		}
+
+		// run outside the lock so workers can keep finishing while we upload
+		if (upload)
+			upload();
+		++count;
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			--m_pending;
+		}
+
+		std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+		if (elapsed.count() >= budgetMilliseconds)
+			break;
+	}
+
+	return count;
+}
+
+bool AssetLoader::isIdle() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_pending == 0;
+}
+
+unsigned int AssetLoader::getPendingCount() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_pending;
+}
+
+void AssetLoader::workerLoop() {
+	// the workers already cover the hardware threads, so the parsing, tangent and compression
+	// loops their tasks call run serially instead of each starting threads of their own
+	isSerialThread() = true;
+
+	for (;;) {
+		Task task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_workReady.wait(lock, [this]() { return m_quit || m_work.empty() == false; });
+			if (m_quit)
+				return;
+			task = std::move(m_work.front());
+			m_work.pop_front();
+		}
+
+		task.work();
+
+		// tasks without an upload still pass through the queue so the pending count
+		// only ever drops on the main thread
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_uploads.push_back(std::move(task.upload));
+	}
+}
+
+} // namespace aie
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "OBJMesh.h"
+
+namespace aie {
+
+// runs the cpu side of asset loading (file io, parsing, image decoding) on worker threads
+// and queues the gl side so the owning thread can upload a little at a time between frames.
+// the gl context is only current on the main thread, so uploads never run on a worker
+class AssetLoader {
+public:
+
+	// 0 uses one worker per hardware thread, less one for the main thread
+	AssetLoader(unsigned int workerCount = 0);
+	// waits for running work, anything not started yet or not uploaded is dropped
+	~AssetLoader();
+
+	// work runs on a worker, then upload (if any) runs on the thread calling pumpUploads
+	void addTask(std::function<void()> work, std::function<void()> upload = nullptr);
+
+	// finds the mesh in the AssetRegistry, queueing a load the first time it is requested: prepared on
+	// a worker, then uploaded. onLoaded runs on the main thread after that upload, also for a mesh that
+	// was already registered and is still loading. one already uploaded runs it on the next pumpUploads.
+	// a load that fails runs none of its callbacks
+	std::shared_ptr<OBJMesh> loadMesh(const char* filename, const OBJMesh::ImportSettings& settings,
+									  bool loadTextures = true, bool flipTextureV = false,
+									  std::function<void()> onLoaded = nullptr);
+
+	// finds the texture in the AssetRegistry, queueing a decode the first time it is requested.
+	// a new texture shows a 1x1 grey placeholder until then, so this must be called on the GL thread
+	std::shared_ptr<Texture> loadTexture(const char* filename, std::function<void()> onLoaded = nullptr);
+
+	// as loadTexture, but block compressed with mips through a ktx cache beside the image
+	std::shared_ptr<CompressedTexture> loadCompressedTexture(const char* filename,
+															 CompressedTexture::Usage usage = CompressedTexture::Usage::COLOUR,
+															 TextureCompressor::Quality quality = TextureCompressor::Quality::FAST,
+															 std::function<void()> onLoaded = nullptr);
+
+	// runs finished uploads until the budget is spent, always running at least one.
+	// returns the number of uploads run
+	unsigned int pumpUploads(float budgetMilliseconds);
+
+	// true once every task added has been worked and uploaded
+	bool isIdle() const;
+	unsigned int getPendingCount() const;
+
+private:
+
+	struct Task {
+		std::function<void()>	work;
+		std::function<void()>	upload;
+	};
+
+	void workerLoop();
+	// runs onLoaded for an asset someone else created, after its upload while that is still to come
+	void runWhenLoaded(const std::shared_ptr<void>& asset, std::function<void()> onLoaded);
+
+	mutable std::mutex					m_mutex;
+	std::condition_variable				m_workReady;
+	std::deque<Task>					m_work;
+	std::deque<std::function<void()>>	m_uploads;
+	std::vector<std::thread>			m_workers;
+	unsigned int						m_pending;	// added and not yet uploaded
+	bool								m_quit;
+};
+
+} // namespace aie
@@ -0,0 +1,198 @@
+#include "AssetRegistry.h"
+#include "Texture.h"
+#include <cctype>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace aie {
+
+static std::mutex s_mutex;
+static std::unordered_map<std::string, std::weak_ptr<Texture>> s_textures;
+static std::unordered_map<std::string, std::weak_ptr<OBJMesh>> s_meshes;
+
+// assets being loaded and the callbacks waiting on them. the asset is held weakly so an entry left by
+// a load that was dropped, with the asset freed, isn't mistaken for a new asset at the same address
+struct PendingLoad {
+	std::weak_ptr<void>					asset;
+	std::vector<std::function<void()>>	callbacks;
+};
+static std::unordered_map<const void*, PendingLoad> s_loading;
+
+// drops entries whose resource has gone so the maps only grow with live assets
+template <typename T>
+static unsigned int pruneExpired(std::unordered_map<std::string, std::weak_ptr<T>>& map) {
+	for (auto i = map.begin(); i != map.end();) {
+		if (i->second.expired())
+			i = map.erase(i);
+		else
+			++i;
+	}
+	return (unsigned int)map.size();
+}
+
+std::string AssetRegistry::getCanonicalPath(const char* filename) {
+
+	std::string path = filename;
+	for (auto& c : path) {
+		if (c == '\\')
+			c = '/';
+#ifdef _WIN32
+		c = (char)tolower((unsigned char)c);
+#endif
+	}
+
+	bool absolute = path.empty() == false && path[0] == '/';
+
+	// split on slashes, resolving "." and ".." where there is a part to go back over
+	std::vector<std::string> parts;
+	size_t start = 0;
+	while (start <= path.size()) {
+		size_t end = path.find('/', start);
+		if (end == std::string::npos)
+			end = path.size();
+
+		std::string part = path.substr(start, end - start);
+		if (part == "..") {
+			if (parts.empty() == false && parts.back() != "..")
+				parts.pop_back();
+			else if (absolute == false)
+				parts.push_back(part);
+		}
+		else if (part.empty() == false && part != ".") {
+			parts.push_back(part);
+		}
+
+		start = end + 1;
+	}
+
+	std::string result = absolute ? "/" : "";
+	for (size_t i = 0; i < parts.size(); ++i) {
+		if (i > 0)
+			result += '/';
+		result += parts[i];
+	}
+	return result;
+}
+
+std::shared_ptr<Texture> AssetRegistry::findOrCreateTexture(const char* filename, bool& created) {
+
+	created = false;
+	if (filename == nullptr || filename[0] == 0)
+		return nullptr;
+
+	std::string key = getCanonicalPath(filename);
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	std::shared_ptr<Texture> texture = s_textures[key].lock();
+	if (texture == nullptr) {
+		texture = std::make_shared<Texture>();
+		s_textures[key] = texture;
+		created = true;
+	}
+	return texture;
+}
+
+std::shared_ptr<Texture> AssetRegistry::loadTexture(const char* filename) {
+
+	bool created = false;
+	std::shared_ptr<Texture> texture = findOrCreateTexture(filename, created);
+	if (created && texture->load(filename) == false) {
+		printf("Failed to load texture %s\n", filename);
+		return nullptr;
+	}
+	return texture;
+}
+
+std::shared_ptr<CompressedTexture> AssetRegistry::findOrCreateCompressedTexture(const char* filename, CompressedTexture::Usage usage,
+																				TextureCompressor::Quality quality, bool& created) {
+
+	created = false;
+	if (filename == nullptr || filename[0] == 0)
+		return nullptr;
+
+	// the suffix keeps these apart from plain textures of the same file, so the cast back is safe
+	std::string key = getCanonicalPath(filename) + "|bc" + std::to_string((int)usage) + std::to_string((int)quality);
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	std::shared_ptr<CompressedTexture> texture = std::static_pointer_cast<CompressedTexture>(s_textures[key].lock());
+	if (texture == nullptr) {
+		texture = std::make_shared<CompressedTexture>();
+		s_textures[key] = texture;
+		created = true;
+	}
+	return texture;
+}
+
+std::shared_ptr<OBJMesh> AssetRegistry::findOrCreateMesh(const char* filename, const OBJMesh::ImportSettings& settings,
+														 bool loadTextures, bool flipTextureV, bool& created) {
+
+	created = false;
+	std::string key = getCanonicalPath(filename) + '|' + std::to_string(OBJMesh::getOptionsHash(flipTextureV, settings)) +
+					  (loadTextures ? "|textured" : "");
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	std::shared_ptr<OBJMesh> mesh = s_meshes[key].lock();
+	if (mesh == nullptr) {
+		mesh = std::make_shared<OBJMesh>();
+		mesh->setImportSettings(settings);
+		s_meshes[key] = mesh;
+		created = true;
+	}
+	return mesh;
+}
+
+std::shared_ptr<OBJMesh> AssetRegistry::loadMesh(const char* filename, const OBJMesh::ImportSettings& settings,
+												 bool loadTextures /* = true */, bool flipTextureV /* = false */) {
+
+	bool created = false;
+	std::shared_ptr<OBJMesh> mesh = findOrCreateMesh(filename, settings, loadTextures, flipTextureV, created);
+	if (created && mesh->load(filename, loadTextures, flipTextureV) == false)
+		return nullptr;
+	return mesh;
+}
+
+void AssetRegistry::beginLoad(const std::shared_ptr<void>& asset) {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	PendingLoad& pending = s_loading[asset.get()];
+	pending.asset = asset;
+	pending.callbacks.clear();
+}
+
+bool AssetRegistry::waitForLoad(const std::shared_ptr<void>& asset, std::function<void()> callback) {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	auto i = s_loading.find(asset.get());
+	if (i == s_loading.end())
+		return false;
+	if (i->second.asset.lock() != asset) {
+		s_loading.erase(i);
+		return false;
+	}
+	if (callback)
+		i->second.callbacks.push_back(std::move(callback));
+	return true;
+}
+
+std::vector<std::function<void()>> AssetRegistry::endLoad(const std::shared_ptr<void>& asset) {
+	std::vector<std::function<void()>> callbacks;
+	std::lock_guard<std::mutex> lock(s_mutex);
+	auto i = s_loading.find(asset.get());
+	if (i != s_loading.end()) {
+		callbacks.swap(i->second.callbacks);
+		s_loading.erase(i);
+	}
+	return callbacks;
+}
+
+unsigned int AssetRegistry::getTextureCount() {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	return pruneExpired(s_textures);
+}
+
+unsigned int AssetRegistry::getMeshCount() {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	return pruneExpired(s_meshes);
+}
+
+} // namespace aie
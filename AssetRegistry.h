@@ -0,0 +1,58 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "OBJMesh.h"
+#include "CompressedTexture.h"
+
+namespace aie {
+
+class Texture;
+
+// process wide cache of loaded meshes and textures, keyed by canonical path and load options.
+// entries are held weakly, so a resource is freed (on whichever thread drops the last reference)
+// as soon as nothing uses it, and the next request loads it again.
+// all functions are thread safe so mesh preparation on worker threads can share textures
+class AssetRegistry {
+public:
+
+	// lexically normalised path with forward slashes and no "." or ".." parts, lower case on windows
+	static std::string getCanonicalPath(const char* filename);
+
+	// returns the texture for a file, creating an empty one on first use and setting created.
+	// whoever created it fills it in, until then every user sees a texture with a 0 handle.
+	// empty filenames return nullptr
+	static std::shared_ptr<Texture> findOrCreateTexture(const char* filename, bool& created);
+
+	// synchronous load on the GL thread, returns nullptr if the file can't be loaded
+	static std::shared_ptr<Texture> loadTexture(const char* filename);
+
+	// as findOrCreateTexture, keyed on the usage and quality as well since they pick the block format
+	static std::shared_ptr<CompressedTexture> findOrCreateCompressedTexture(const char* filename, CompressedTexture::Usage usage,
+																			TextureCompressor::Quality quality, bool& created);
+
+	// returns the mesh for a file and load options, creating an unloaded one with the import
+	// settings applied on first use and setting created. whoever created it must load it
+	static std::shared_ptr<OBJMesh> findOrCreateMesh(const char* filename, const OBJMesh::ImportSettings& settings,
+													 bool loadTextures, bool flipTextureV, bool& created);
+
+	// synchronous load on the GL thread, returns nullptr if the file can't be loaded
+	static std::shared_ptr<OBJMesh> loadMesh(const char* filename, const OBJMesh::ImportSettings& settings,
+											 bool loadTextures = true, bool flipTextureV = false);
+
+	// whoever creates an asset calls beginLoad before queueing its load, and endLoad once it has been
+	// uploaded or has failed, which hands back the callbacks left by waitForLoad in the meantime.
+	// waitForLoad keeps the callback and returns true while the asset is loading, or returns false
+	// once it has loaded, for the caller to run the callback itself
+	static void beginLoad(const std::shared_ptr<void>& asset);
+	static bool waitForLoad(const std::shared_ptr<void>& asset, std::function<void()> callback);
+	static std::vector<std::function<void()>> endLoad(const std::shared_ptr<void>& asset);
+
+	// live entries, for reporting
+	static unsigned int getTextureCount();
+	static unsigned int getMeshCount();
+};
+
+} // namespace aie
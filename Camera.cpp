@@ -3,20 +3,47 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 
-//returns the forward matrix of the camera
-glm::mat4 Camera::getViewMatrix()
+//returns the forward matrix of the camera, rebuilt only after the camera has moved or turned
+const glm::mat4& Camera::getViewMatrix()
 {
-	float thetaR = glm::radians(m_theta);
-	float phiR = glm::radians(m_phi);
-	glm::vec3 forward(cos(phiR) * cos(thetaR), sin(phiR), cos(phiR) * sin(thetaR));
-	return glm::lookAt(m_position, m_position + forward, glm::vec3(0, 1, 0));
+	if (m_viewDirty)
+	{
+		float thetaR = glm::radians(m_theta);
+		float phiR = glm::radians(m_phi);
+		glm::vec3 forward(cos(phiR) * cos(thetaR), sin(phiR), cos(phiR) * sin(thetaR));
+		m_viewMatrix = glm::lookAt(m_position, m_position + forward, glm::vec3(0, 1, 0));
+		m_viewDirty = false;
+		m_projectionViewDirty = true;
+	}
+	return m_viewMatrix;
 }
 
 
-//returns the perspective matrix of the camera
-glm::mat4 Camera::getProjectionMatrix(float w, float h)
+//returns the perspective matrix of the camera, rebuilt only when the size changes
+const glm::mat4& Camera::getProjectionMatrix(float w, float h)
 {
-	return glm::perspective(glm::pi<float>() * 0.25f, w / h, 0.1f, 1000.f);
+	if (m_projectionSize.x != w || m_projectionSize.y != h)
+	{
+		m_projectionMatrix = glm::perspective(glm::pi<float>() * 0.25f, w / h, m_nearPlane, m_farPlane);
+		m_projectionSize = glm::vec2(w, h);
+		m_projectionViewDirty = true;
+	}
+	return m_projectionMatrix;
+}
+
+
+//returns the projection times the view, rebuilt only when either of them is
+const glm::mat4& Camera::getProjectionViewMatrix(float w, float h)
+{
+	//both refresh first, as either can mark the product dirty
+	getProjectionMatrix(w, h);
+	getViewMatrix();
+	if (m_projectionViewDirty)
+	{
+		m_projectionViewMatrix = m_projectionMatrix * m_viewMatrix;
+		m_projectionViewDirty = false;
+	}
+	return m_projectionViewMatrix;
 }
 
 
@@ -34,6 +61,11 @@ void Camera::update(float deltaTime)
 
 	float movementSpeed = m_movementSpeed;
 
+	//the view is only rebuilt if something below changes it
+	glm::vec3 lastPosition = m_position;
+	float lastTheta = m_theta;
+	float lastPhi = m_phi;
+
 	//hold shift to increase camera speed
 	if (input->isKeyDown(aie::INPUT_KEY_LEFT_SHIFT))
 		movementSpeed *= 5.0f;
@@ -66,12 +98,16 @@ void Camera::update(float deltaTime)
 	// store this frames values for next frame 
 	m_lastMouseX = mx;
 	m_lastMouseY = my;
+
+	if (m_position != lastPosition || m_theta != lastTheta || m_phi != lastPhi)
+		m_viewDirty = true;
 }
 
 
 void Camera::setTheta(float theta)
 {
 	m_theta = glm::clamp(theta, -m_maxCameraAngle, m_maxCameraAngle);
+	m_viewDirty = true;
 }
 
 
@@ -79,4 +115,5 @@ void Camera::setTheta(float theta)
 void Camera::setPhi(float phi)
 {
 	m_phi = glm::clamp(phi, -m_maxCameraAngle, m_maxCameraAngle);
+	m_viewDirty = true;
 }
@@ -7,10 +7,12 @@ public:
 	Camera(glm::vec3 position, float theta, float phi) : m_position(position), m_theta(theta), m_phi(phi) {};
 	~Camera() {};
 
-	//returns the forward matrix of the camera
-	glm::mat4 getViewMatrix();
-	//returns the perspective matrix of the camera
-	glm::mat4 getProjectionMatrix(float w, float h);
+	//returns the forward matrix of the camera, rebuilt only after the camera has moved or turned
+	const glm::mat4& getViewMatrix();
+	//returns the perspective matrix of the camera, rebuilt only when the size changes
+	const glm::mat4& getProjectionMatrix(float w, float h);
+	//returns the projection times the view, rebuilt only when either of them is
+	const glm::mat4& getProjectionViewMatrix(float w, float h);
 	//returns the cameras position
 	glm::vec3 getPosition() { return m_position; };
 
@@ -19,23 +21,36 @@ public:
 
 	float getTheta() { return m_theta; }
 	float getPhi() { return m_phi; }
+	//distance to the far clipping plane of the projection
+	float getFarPlane() const { return m_farPlane; }
 
 	void setTheta(float theta);
 	void setPhi(float phi);
 
-	void setPosition(glm::vec3 position) { m_position = position; }
+	void setPosition(glm::vec3 position) { m_position = position; m_viewDirty = true; }
 
 private:
 	float m_theta;
 	float m_phi;
 	glm::vec3 m_position;
 
+	//cached matrices, the view is dirty after any change to the position or angles
+	glm::mat4 m_viewMatrix;
+	glm::mat4 m_projectionMatrix;
+	glm::mat4 m_projectionViewMatrix;
+	glm::vec2 m_projectionSize = glm::vec2(0);
+	bool m_viewDirty = true;
+	bool m_projectionViewDirty = true;
+
 	float m_lastMouseX = 0.0f;
 	float m_lastMouseY = 0.0f;
 
 	int m_invertMouseX = -1;
 	int m_invertMouseY = -1;
 
+	const float m_nearPlane = 0.1f;
+	const float m_farPlane = 1000.0f;
+
 	const float m_maxCameraAngle = 70.0f;
 	const float m_turnSpeed = 0.1f;
 	const float m_movementSpeed = 1.0f;
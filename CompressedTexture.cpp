@@ -0,0 +1,355 @@
+#include "CompressedTexture.h"
+#include "MeshCache.h"
+#include "gl_core_4_4.h"
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <stb_image.h>
+
+// s3tc is an extension rather than core, but every desktop driver exposes it
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT		0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT	0x83F3
+#endif
+
+namespace aie {
+
+// KTX 1.1 layout, so the cache can be inspected with standard tools:
+//	KTXHeader
+//	key value data, holding SOURCE_KEY and a SourceRecord
+//	per mip, largest first: unsigned int imageSize, then the blocks
+struct KTXHeader {
+	unsigned char	identifier[12];
+	unsigned int	endianness;
+	unsigned int	glType;
+	unsigned int	glTypeSize;
+	unsigned int	glFormat;
+	unsigned int	glInternalFormat;
+	unsigned int	glBaseInternalFormat;
+	unsigned int	pixelWidth;
+	unsigned int	pixelHeight;
+	unsigned int	pixelDepth;
+	unsigned int	numberOfArrayElements;
+	unsigned int	numberOfFaces;
+	unsigned int	numberOfMipmapLevels;
+	unsigned int	bytesOfKeyValueData;
+};
+
+// identifies the source image and the options the blocks were built with
+struct SourceRecord {
+	unsigned long long	size;
+	unsigned long long	modifiedTime;
+	unsigned int		options;
+	unsigned int		version;
+};
+
+static const unsigned char KTX_IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+static const unsigned int KTX_ENDIANNESS = 0x04030201;
+static const char SOURCE_KEY[] = "aie.source";
+
+static unsigned int alignKTX(unsigned int size) {
+	return (size + 3) & ~3u;
+}
+
+// every format the cache can hold, with its GL enums
+static bool getFormatInfo(unsigned int internalFormat, TextureCompressor::Format& format, unsigned int& baseFormat) {
+	switch (internalFormat) {
+	case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:	format = TextureCompressor::Format::BC1; baseFormat = GL_RGB;	return true;
+	case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:	format = TextureCompressor::Format::BC3; baseFormat = GL_RGBA;	return true;
+	case GL_COMPRESSED_RED_RGTC1:			format = TextureCompressor::Format::BC4; baseFormat = GL_RED;	return true;
+	case GL_COMPRESSED_RG_RGTC2:			format = TextureCompressor::Format::BC5; baseFormat = GL_RG;	return true;
+	case GL_COMPRESSED_RGBA_BPTC_UNORM:		format = TextureCompressor::Format::BC7; baseFormat = GL_RGBA;	return true;
+	default: return false;
+	}
+}
+
+static unsigned int getInternalFormat(TextureCompressor::Format format) {
+	switch (format) {
+	case TextureCompressor::Format::BC1:	return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	case TextureCompressor::Format::BC3:	return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	case TextureCompressor::Format::BC4:	return GL_COMPRESSED_RED_RGTC1;
+	case TextureCompressor::Format::BC5:	return GL_COMPRESSED_RG_RGTC2;
+	default:								return GL_COMPRESSED_RGBA_BPTC_UNORM;
+	}
+}
+
+std::string CompressedTexture::getCacheFilename(const char* filename, Usage usage, TextureCompressor::Quality quality) {
+	return std::string(filename) + ".bc" + std::to_string((int)usage) + std::to_string((int)quality) + ".ktx";
+}
+
+bool CompressedTexture::load(const char* filename, Usage usage /* = Usage::COLOUR */,
+							 TextureCompressor::Quality quality /* = TextureCompressor::Quality::FAST */) {
+	return prepare(filename, usage, quality) && upload();
+}
+
+bool CompressedTexture::prepare(const char* filename, Usage usage /* = Usage::COLOUR */,
+								TextureCompressor::Quality quality /* = TextureCompressor::Quality::FAST */) {
+
+	m_cache.close();
+	m_encoded.clear();
+	m_mips.clear();
+
+	unsigned int options = (unsigned int)usage | ((unsigned int)quality << 8);
+
+	MeshCache::SourceStamp stamp;
+	if (MeshCache::getSourceStamp(filename, options, stamp) == false) {
+		printf("Texture file %s not found!\n", filename);
+		return false;
+	}
+
+	m_pendingFilename = filename;
+	std::string cacheFile = getCacheFilename(filename, usage, quality);
+
+	if (loadCache(cacheFile.c_str(), options, stamp.size, stamp.modifiedTime))
+		return true;
+
+	if (encode(filename, usage, quality) == false)
+		return false;
+
+	// a failed write only costs the next load an encode
+	if (writeCache(cacheFile.c_str(), options, stamp.size, stamp.modifiedTime) == false)
+		printf("Failed to write texture cache %s\n", cacheFile.c_str());
+
+	return true;
+}
+
+bool CompressedTexture::upload() {
+
+	if (m_mips.empty()) {
+		printf("Texture must be prepared before upload!\n");
+		return false;
+	}
+
+	// replaces a placeholder or an earlier image
+	if (m_glHandle != 0)
+		glDeleteTextures(1, &m_glHandle);
+
+	glGenTextures(1, &m_glHandle);
+	glBindTexture(GL_TEXTURE_2D, m_glHandle);
+
+	m_compressedSize = 0;
+	for (unsigned int level = 0; level < m_mips.size(); ++level) {
+		const Mip& mip = m_mips[level];
+		glCompressedTexImage2D(GL_TEXTURE_2D, level, m_internalFormat, mip.width, mip.height, 0, mip.size, mip.data);
+		m_compressedSize += mip.size;
+	}
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (int)m_mips.size() - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	m_filename = m_pendingFilename;
+	m_width = m_mips[0].width;
+	m_height = m_mips[0].height;
+	m_format = m_baseFormat == GL_RGBA ? RGBA : (m_baseFormat == GL_RGB ? RGB : (m_baseFormat == GL_RG ? RG : RED));
+	m_mipCount = (unsigned int)m_mips.size();
+
+	m_mips.clear();
+	m_encoded.clear();
+	m_encoded.shrink_to_fit();
+	m_cache.close();
+
+	return true;
+}
+
+bool CompressedTexture::loadCache(const char* cacheFile, unsigned int options,
+								  unsigned long long sourceSize, unsigned long long sourceTime) {
+
+	if (m_cache.open(cacheFile) == false)
+		return false;
+
+	const unsigned char* data = m_cache.getData();
+	size_t size = m_cache.getSize();
+	const KTXHeader* header = (const KTXHeader*)data;
+
+	TextureCompressor::Format format;
+	if (size < sizeof(KTXHeader) ||
+		memcmp(header->identifier, KTX_IDENTIFIER, sizeof(KTX_IDENTIFIER)) != 0 ||
+		header->endianness != KTX_ENDIANNESS ||
+		header->glType != 0 || header->glFormat != 0 ||
+		header->pixelWidth == 0 || header->pixelHeight == 0 || header->pixelDepth != 0 ||
+		header->numberOfArrayElements != 0 || header->numberOfFaces != 1 ||
+		header->numberOfMipmapLevels == 0 || header->numberOfMipmapLevels > 32 ||
+		getFormatInfo(header->glInternalFormat, format, m_baseFormat) == false ||
+		sizeof(KTXHeader) + (size_t)header->bytesOfKeyValueData > size) {
+		m_cache.close();
+		return false;
+	}
+
+	// find our source record amongst the key value pairs
+	bool current = false;
+	size_t offset = sizeof(KTXHeader);
+	size_t keyValueEnd = offset + header->bytesOfKeyValueData;
+	while (offset + 4 <= keyValueEnd) {
+		unsigned int pairSize;
+		memcpy(&pairSize, data + offset, 4);
+		offset += 4;
+		if (offset + pairSize > keyValueEnd)
+			break;
+
+		if (pairSize == sizeof(SOURCE_KEY) + sizeof(SourceRecord) &&
+			memcmp(data + offset, SOURCE_KEY, sizeof(SOURCE_KEY)) == 0) {
+			SourceRecord record;
+			memcpy(&record, data + offset + sizeof(SOURCE_KEY), sizeof(record));
+			current = record.size == sourceSize && record.modifiedTime == sourceTime &&
+					  record.options == options && record.version == VERSION;
+		}
+		offset += alignKTX(pairSize);
+	}
+
+	if (current == false) {
+		m_cache.close();
+		return false;
+	}
+
+	// every mip must be the size its dimensions imply and lie inside the file
+	offset = keyValueEnd;
+	unsigned int width = header->pixelWidth, height = header->pixelHeight;
+	for (unsigned int level = 0; level < header->numberOfMipmapLevels; ++level) {
+		unsigned int imageSize = 0;
+		if (offset + 4 <= size)
+			memcpy(&imageSize, data + offset, 4);
+		offset += 4;
+
+		if (offset + imageSize > size ||
+			imageSize != TextureCompressor::getCompressedSize(format, width, height)) {
+			m_mips.clear();
+			m_cache.close();
+			return false;
+		}
+
+		m_mips.push_back({ data + offset, imageSize, width, height });
+		offset += alignKTX(imageSize);
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+
+	m_internalFormat = header->glInternalFormat;
+	return true;
+}
+
+bool CompressedTexture::encode(const char* filename, Usage usage, TextureCompressor::Quality quality) {
+
+	int width = 0, height = 0, components = 0;
+	unsigned char* pixels = stbi_load(filename, &width, &height, &components, STBI_rgb_alpha);
+	if (pixels == nullptr) {
+		printf("Failed to load texture %s\n", filename);
+		return false;
+	}
+
+	bool hasAlpha = false;
+	for (size_t i = 3; i < (size_t)width * height * 4 && hasAlpha == false; i += 4)
+		hasAlpha = pixels[i] != 255;
+
+	bool high = quality == TextureCompressor::Quality::HIGH;
+	TextureCompressor::Format format;
+	if (usage == Usage::NORMAL_XY)
+		format = TextureCompressor::Format::BC5;
+	else if (high)
+		format = TextureCompressor::Format::BC7;
+	else
+		format = hasAlpha && usage == Usage::COLOUR ? TextureCompressor::Format::BC3 : TextureCompressor::Format::BC1;
+
+	m_internalFormat = getInternalFormat(format);
+	getFormatInfo(m_internalFormat, format, m_baseFormat);
+
+	// work out every mip's place first so the encoded blocks are never reallocated
+	unsigned int w = (unsigned int)width, h = (unsigned int)height;
+	size_t total = 0;
+	for (;;) {
+		Mip mip = { nullptr, (unsigned int)TextureCompressor::getCompressedSize(format, w, h), w, h };
+		m_mips.push_back(mip);
+		total += mip.size;
+		if (w == 1 && h == 1)
+			break;
+		w = w > 1 ? w / 2 : 1;
+		h = h > 1 ? h / 2 : 1;
+	}
+	m_encoded.resize(total);
+
+	std::vector<unsigned char> level(pixels, pixels + (size_t)width * height * 4);
+	std::vector<unsigned char> next;
+	stbi_image_free(pixels);
+
+	bool normals = usage != Usage::COLOUR;
+	size_t offset = 0;
+	for (size_t i = 0; i < m_mips.size(); ++i) {
+		Mip& mip = m_mips[i];
+		TextureCompressor::compress(level.data(), mip.width, mip.height, format, quality, m_encoded.data() + offset);
+		mip.data = m_encoded.data() + offset;
+		offset += mip.size;
+
+		if (i + 1 < m_mips.size()) {
+			next.resize((size_t)m_mips[i + 1].width * m_mips[i + 1].height * 4);
+			TextureCompressor::downsample(level.data(), mip.width, mip.height, normals, next.data());
+			level.swap(next);
+		}
+	}
+
+	return true;
+}
+
+bool CompressedTexture::writeCache(const char* cacheFile, unsigned int options,
+								   unsigned long long sourceSize, unsigned long long sourceTime) const {
+
+	unsigned int pairSize = sizeof(SOURCE_KEY) + sizeof(SourceRecord);
+
+	KTXHeader header = {};
+	memcpy(header.identifier, KTX_IDENTIFIER, sizeof(KTX_IDENTIFIER));
+	header.endianness = KTX_ENDIANNESS;
+	header.glTypeSize = 1;
+	header.glInternalFormat = m_internalFormat;
+	header.glBaseInternalFormat = m_baseFormat;
+	header.pixelWidth = m_mips[0].width;
+	header.pixelHeight = m_mips[0].height;
+	header.numberOfFaces = 1;
+	header.numberOfMipmapLevels = (unsigned int)m_mips.size();
+	header.bytesOfKeyValueData = 4 + alignKTX(pairSize);
+
+	SourceRecord record = { sourceSize, sourceTime, options, VERSION };
+
+	// per thread, in case the same image is prepared for two usages at once
+	std::string tempFile = std::string(cacheFile) + "." +
+						   std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+
+	FILE* file = nullptr;
+#ifdef _WIN32
+	fopen_s(&file, tempFile.c_str(), "wb");
+#else
+	file = fopen(tempFile.c_str(), "wb");
+#endif
+	if (file == nullptr)
+		return false;
+
+	static const unsigned char zeros[4] = {};
+
+	bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+	success &= fwrite(&pairSize, 4, 1, file) == 1;
+	success &= fwrite(SOURCE_KEY, sizeof(SOURCE_KEY), 1, file) == 1;
+	success &= fwrite(&record, sizeof(record), 1, file) == 1;
+	success &= fwrite(zeros, 1, alignKTX(pairSize) - pairSize, file) == alignKTX(pairSize) - pairSize;
+
+	for (auto& mip : m_mips) {
+		success &= fwrite(&mip.size, 4, 1, file) == 1;
+		success &= fwrite(mip.data, 1, mip.size, file) == mip.size;
+		success &= fwrite(zeros, 1, alignKTX(mip.size) - mip.size, file) == alignKTX(mip.size) - mip.size;
+	}
+
+	success &= fclose(file) == 0;
+
+	if (success == false) {
+		remove(tempFile.c_str());
+		return false;
+	}
+
+	// replace any stale cache with the new one
+	remove(cacheFile);
+	return rename(tempFile.c_str(), cacheFile) == 0;
+}
+
+} // namespace aie
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Texture.h"
+#include "MappedFile.h"
+#include "TextureCompressor.h"
+
+namespace aie {
+
+// a texture stored block compressed with a full mip chain.
+// the first load decodes the image, builds and encodes the mips and writes them to a KTX file
+// next to the source, later loads map that file and hand the blocks straight to GL
+class CompressedTexture : public Texture {
+public:
+
+	// bump whenever the encoders or mip generation change
+	static const unsigned int VERSION = 1;
+
+	// picks the block format along with the quality setting
+	enum class Usage {
+		COLOUR,		// BC1, or BC3 when any texel has alpha. BC7 for both at high quality
+		NORMAL,		// as colour but with renormalised mips, for shaders that sample xyz
+		NORMAL_XY,	// BC5 with renormalised mips, for shaders that rebuild z
+	};
+
+	CompressedTexture() {}
+	virtual ~CompressedTexture() {}
+
+	// the ktx cache beside the image, one per usage and quality as they pick the block format and encoder
+	static std::string getCacheFilename(const char* filename, Usage usage, TextureCompressor::Quality quality);
+
+	// same as prepare then upload
+	bool load(const char* filename, Usage usage = Usage::COLOUR,
+			  TextureCompressor::Quality quality = TextureCompressor::Quality::FAST);
+
+	// reads the cache or encodes the image without touching GL, so it can run on a worker thread
+	bool prepare(const char* filename, Usage usage = Usage::COLOUR,
+				 TextureCompressor::Quality quality = TextureCompressor::Quality::FAST);
+	// replaces any existing contents, must run on the GL thread
+	bool upload();
+
+	unsigned int getMipCount() const { return m_mipCount; }
+	// video memory used by every mip
+	size_t getCompressedSize() const { return m_compressedSize; }
+
+private:
+
+	struct Mip {
+		const unsigned char*	data;
+		unsigned int			size;
+		unsigned int			width, height;
+	};
+
+	bool loadCache(const char* cacheFile, unsigned int options, unsigned long long sourceSize, unsigned long long sourceTime);
+	bool encode(const char* filename, Usage usage, TextureCompressor::Quality quality);
+	bool writeCache(const char* cacheFile, unsigned int options, unsigned long long sourceSize, unsigned long long sourceTime) const;
+
+	// pending mips point in to the mapped cache or the encoded blocks until upload
+	MappedFile					m_cache;
+	std::vector<unsigned char>	m_encoded;
+	std::vector<Mip>			m_mips;
+	unsigned int				m_internalFormat = 0;
+	unsigned int				m_baseFormat = 0;
+	std::string					m_pendingFilename;
+
+	unsigned int				m_mipCount = 0;
+	size_t						m_compressedSize = 0;
+};
+
+} // namespace aie
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+namespace aie {
+
+// the six planes of a projection's clip volume, in whatever space the matrix maps from
+struct Frustum {
+
+	// normalised, xyz points in to the frustum. left, right, bottom, top, near, far
+	glm::vec4 planes[6];
+
+	// pulls the planes from the rows of a projection * view (* model) matrix (Gribb and Hartmann)
+	static Frustum fromMatrix(const glm::mat4& matrix) {
+		glm::vec4 rows[4];
+		for (int r = 0; r < 4; ++r)
+			rows[r] = glm::vec4(matrix[0][r], matrix[1][r], matrix[2][r], matrix[3][r]);
+
+		Frustum frustum;
+		for (int p = 0; p < 6; ++p) {
+			glm::vec4 plane = p % 2 == 0 ? rows[3] + rows[p / 2] : rows[3] - rows[p / 2];
+			float length = glm::length(glm::vec3(plane));
+			frustum.planes[p] = length > 0 ? plane / length : glm::vec4(0, 0, 0, 1);
+		}
+		return frustum;
+	}
+
+	bool intersectsSphere(const glm::vec3& centre, float radius) const {
+		for (int p = 0; p < 6; ++p) {
+			if (glm::dot(glm::vec3(planes[p]), centre) + planes[p].w < -radius)
+				return false;
+		}
+		return true;
+	}
+
+	// false when the box is wholly outside one plane, so boxes near the corners may still pass
+	bool intersectsBox(const glm::vec3& centre, const glm::vec3& extent) const {
+		for (int p = 0; p < 6; ++p) {
+			glm::vec3 normal = glm::vec3(planes[p]);
+			if (glm::dot(normal, centre) + planes[p].w < -glm::dot(glm::abs(normal), extent))
+				return false;
+		}
+		return true;
+	}
+};
+
+} // namespace aie
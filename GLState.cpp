@@ -0,0 +1,146 @@
+#include "GLState.h"
+#include "gl_core_4_4.h"
+#include <cassert>
+
+namespace aie {
+
+unsigned int GLState::s_program = GLState::UNKNOWN;
+unsigned int GLState::s_vertexArray = GLState::UNKNOWN;
+unsigned int GLState::s_framebuffer = GLState::UNKNOWN;
+unsigned int GLState::s_textures[GLState::MAX_TEXTURE_UNITS] = {
+	UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN,
+	UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN,
+};
+int GLState::s_viewport[4] = { -1, -1, -1, -1 };
+unsigned int GLState::s_cullEnabled = GLState::UNKNOWN;
+unsigned int GLState::s_cullFace = GLState::UNKNOWN;
+unsigned int GLState::s_polygonMode = GLState::UNKNOWN;
+GLState::Counters GLState::s_counters;
+
+void GLState::useProgram(unsigned int program) {
+	if (s_program == program) {
+		s_counters.skipped++;
+		return;
+	}
+	s_program = program;
+	glUseProgram(program);
+	s_counters.issued++;
+}
+
+void GLState::bindVertexArray(unsigned int vertexArray) {
+	if (s_vertexArray == vertexArray) {
+		s_counters.skipped++;
+		return;
+	}
+	s_vertexArray = vertexArray;
+	glBindVertexArray(vertexArray);
+	s_counters.issued++;
+}
+
+void GLState::bindFramebuffer(unsigned int framebuffer) {
+	if (s_framebuffer == framebuffer) {
+		s_counters.skipped++;
+		return;
+	}
+	s_framebuffer = framebuffer;
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	s_counters.issued++;
+}
+
+void GLState::bindTextures(unsigned int first, unsigned int count, const unsigned int* textures) {
+	assert(first + count <= MAX_TEXTURE_UNITS);
+
+	// the narrowest span holding every unit that changes
+	unsigned int begin = 0, end = count;
+	while (begin < end && s_textures[first + begin] == textures[begin])
+		begin++;
+	while (end > begin && s_textures[first + end - 1] == textures[end - 1])
+		end--;
+
+	s_counters.skipped += count - (end - begin);
+	if (begin == end)
+		return;
+
+	for (unsigned int i = begin; i < end; ++i)
+		s_textures[first + i] = textures[i];
+	glBindTextures(first + begin, end - begin, textures + begin);
+	s_counters.issued++;
+}
+
+void GLState::setViewport(int x, int y, int width, int height) {
+	if (s_viewport[0] == x && s_viewport[1] == y && s_viewport[2] == width && s_viewport[3] == height) {
+		s_counters.skipped++;
+		return;
+	}
+	s_viewport[0] = x;
+	s_viewport[1] = y;
+	s_viewport[2] = width;
+	s_viewport[3] = height;
+	glViewport(x, y, width, height);
+	s_counters.issued++;
+}
+
+void GLState::setCullEnabled(bool enabled) {
+	if (s_cullEnabled == (enabled ? 1u : 0u)) {
+		s_counters.skipped++;
+		return;
+	}
+	s_cullEnabled = enabled ? 1 : 0;
+	if (enabled)
+		glEnable(GL_CULL_FACE);
+	else
+		glDisable(GL_CULL_FACE);
+	s_counters.issued++;
+}
+
+void GLState::setCullFace(unsigned int face) {
+	if (s_cullFace == face) {
+		s_counters.skipped++;
+		return;
+	}
+	s_cullFace = face;
+	glCullFace(face);
+	s_counters.issued++;
+}
+
+void GLState::setPolygonMode(unsigned int mode) {
+	if (s_polygonMode == mode) {
+		s_counters.skipped++;
+		return;
+	}
+	s_polygonMode = mode;
+	glPolygonMode(GL_FRONT_AND_BACK, mode);
+	s_counters.issued++;
+}
+
+bool GLState::isCullEnabled() {
+	if (s_cullEnabled == UNKNOWN) {
+		s_cullEnabled = glIsEnabled(GL_CULL_FACE) ? 1 : 0;
+		s_counters.issued++;
+	}
+	return s_cullEnabled != 0;
+}
+
+unsigned int GLState::getCullFace() {
+	if (s_cullFace == UNKNOWN) {
+		GLint face = GL_BACK;
+		glGetIntegerv(GL_CULL_FACE_MODE, &face);
+		s_cullFace = (unsigned int)face;
+		s_counters.issued++;
+	}
+	return s_cullFace;
+}
+
+void GLState::invalidate() {
+	s_program = UNKNOWN;
+	s_vertexArray = UNKNOWN;
+	s_framebuffer = UNKNOWN;
+	for (auto& texture : s_textures)
+		texture = UNKNOWN;
+	s_viewport[0] = s_viewport[1] = s_viewport[2] = s_viewport[3] = -1;
+	s_cullEnabled = UNKNOWN;
+	s_cullFace = UNKNOWN;
+	s_polygonMode = UNKNOWN;
+}
+
+} // namespace aie
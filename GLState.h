@@ -0,0 +1,56 @@
+#pragma once
+
+namespace aie {
+
+// a shadow of the GL state the renderer changes most, so binds that wouldn't change anything never
+// reach the driver. textures go through glBindTextures, a whole run of units in one call.
+// anything bound around the cache, like the bootstrap's gizmos and ui or a texture upload, leaves
+// the shadow stale, so it is forgotten with invalidate() before each pass and read back as needed
+class GLState {
+public:
+
+	static const unsigned int MAX_TEXTURE_UNITS = 16;
+
+	// driver calls made, and binds dropped as they matched the shadow
+	struct Counters {
+		unsigned int	issued = 0;
+		unsigned int	skipped = 0;
+	};
+
+	static void useProgram(unsigned int program);
+	static void bindVertexArray(unsigned int vertexArray);
+	static void bindFramebuffer(unsigned int framebuffer);
+	// binds textures to units first to first + count - 1, only the span that differs is sent
+	static void bindTextures(unsigned int first, unsigned int count, const unsigned int* textures);
+	static void bindTexture(unsigned int unit, unsigned int texture) { bindTextures(unit, 1, &texture); }
+	static void setViewport(int x, int y, int width, int height);
+	static void setCullEnabled(bool enabled);
+	static void setCullFace(unsigned int face);
+	static void setPolygonMode(unsigned int mode);
+
+	// read from GL once after an invalidate, then from the shadow
+	static bool isCullEnabled();
+	static unsigned int getCullFace();
+
+	// marks everything unknown, so the next bind of each is sent
+	static void invalidate();
+
+	static const Counters& getCounters() { return s_counters; }
+	static void resetCounters() { s_counters = Counters(); }
+
+private:
+
+	static const unsigned int UNKNOWN = ~0u;
+
+	static unsigned int	s_program;
+	static unsigned int	s_vertexArray;
+	static unsigned int	s_framebuffer;
+	static unsigned int	s_textures[MAX_TEXTURE_UNITS];
+	static int			s_viewport[4];
+	static unsigned int	s_cullEnabled;
+	static unsigned int	s_cullFace;
+	static unsigned int	s_polygonMode;
+	static Counters		s_counters;
+};
+
+} // namespace aie
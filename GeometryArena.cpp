@@ -0,0 +1,190 @@
+#include "GeometryArena.h"
+#include "GLState.h"
+#include "gl_core_4_4.h"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+namespace aie {
+
+// first size of each buffer, they double from there whenever an allocation doesn't fit
+static const unsigned int INITIAL_BYTES = 4 * 1024 * 1024;
+
+std::vector<std::unique_ptr<GeometryArena>> GeometryArena::s_arenas;
+
+GeometryArena* GeometryArena::getArena(unsigned int stride, const Attribute* attributes, unsigned int attributeCount) {
+	for (auto& arena : s_arenas) {
+		if (arena->m_stride == stride && arena->m_attributes.size() == attributeCount &&
+			memcmp(arena->m_attributes.data(), attributes, attributeCount * sizeof(Attribute)) == 0)
+			return arena.get();
+	}
+
+	s_arenas.push_back(std::unique_ptr<GeometryArena>(new GeometryArena(stride, attributes, attributeCount)));
+	return s_arenas.back().get();
+}
+
+void GeometryArena::releaseAll() {
+	for (auto& arena : s_arenas)
+		arena->release();
+}
+
+GeometryArena::GeometryArena(unsigned int stride, const Attribute* attributes, unsigned int attributeCount)
+	: m_stride(stride), m_attributes(attributes, attributes + attributeCount) {
+
+	glGenVertexArrays(1, &m_vao);
+	GLState::bindVertexArray(m_vao);
+	formatVertexArray();
+	GLState::bindVertexArray(0);
+}
+
+void GeometryArena::formatVertexArray() const {
+	// vertex data comes from binding 0, which growBuffer points at whichever buffer is current
+	formatAttributes(m_attributes.data(), (unsigned int)m_attributes.size(), 0);
+
+	// the instance matrix is only enabled while drawing indirectly
+	for (unsigned int c = 0; c < 4; ++c) {
+		glVertexAttribFormat(INSTANCE_MATRIX_LOCATION + c, 4, GL_FLOAT, GL_FALSE, c * sizeof(float) * 4);
+		glVertexAttribBinding(INSTANCE_MATRIX_LOCATION + c, INSTANCE_BINDING);
+	}
+	glVertexBindingDivisor(INSTANCE_BINDING, 1);
+}
+
+void GeometryArena::formatAttributes(const Attribute* attributes, unsigned int attributeCount, unsigned int binding) {
+	for (unsigned int i = 0; i < attributeCount; ++i) {
+		const Attribute& a = attributes[i];
+		glEnableVertexAttribArray(a.location);
+		glVertexAttribFormat(a.location, a.size, a.type, a.normalised ? GL_TRUE : GL_FALSE, a.offset);
+		glVertexAttribBinding(a.location, binding);
+	}
+}
+
+GeometryArena::Allocation GeometryArena::allocate(const void* vertices, unsigned int vertexCount,
+												  const void* indices, unsigned int indexCount, unsigned int indexSize) {
+	Allocation allocation = {};
+	allocation.vertexCount = vertexCount;
+	allocation.indexBytes = (indexCount * indexSize + 3) & ~3u;
+
+	if (allocateRange(m_freeVertices, vertexCount, allocation.baseVertex) == false) {
+		unsigned int oldCapacity = m_vertexCapacity;
+		unsigned int newCapacity = std::max(std::max(oldCapacity * 2, INITIAL_BYTES / m_stride), oldCapacity + vertexCount);
+		growBuffer(m_vbo, oldCapacity * m_stride, newCapacity * m_stride);
+		m_vertexCapacity = newCapacity;
+
+		freeRange(m_freeVertices, oldCapacity, newCapacity - oldCapacity);
+		allocateRange(m_freeVertices, vertexCount, allocation.baseVertex);
+
+		GLState::bindVertexArray(m_vao);
+		glBindVertexBuffer(0, m_vbo, 0, m_stride);
+		GLState::bindVertexArray(0);
+	}
+
+	if (allocation.indexBytes != 0 &&
+		allocateRange(m_freeIndexBytes, allocation.indexBytes, allocation.indexOffset) == false) {
+		unsigned int oldCapacity = m_indexCapacity;
+		unsigned int newCapacity = std::max(std::max(oldCapacity * 2, INITIAL_BYTES), oldCapacity + allocation.indexBytes);
+		growBuffer(m_ibo, oldCapacity, newCapacity);
+		m_indexCapacity = newCapacity;
+
+		freeRange(m_freeIndexBytes, oldCapacity, newCapacity - oldCapacity);
+		allocateRange(m_freeIndexBytes, allocation.indexBytes, allocation.indexOffset);
+
+		GLState::bindVertexArray(m_vao);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
+		GLState::bindVertexArray(0);
+	}
+
+	// the copy targets leave whatever vertex array and element buffer are bound alone
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_vbo);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)allocation.baseVertex * m_stride, (GLsizeiptr)vertexCount * m_stride, vertices);
+	if (indexCount != 0) {
+		glBindBuffer(GL_COPY_WRITE_BUFFER, m_ibo);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, allocation.indexOffset, (GLsizeiptr)indexCount * indexSize, indices);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	m_usedBytes += (size_t)vertexCount * m_stride + allocation.indexBytes;
+	return allocation;
+}
+
+void GeometryArena::free(const Allocation& allocation) {
+	if (allocation.vertexCount != 0)
+		freeRange(m_freeVertices, allocation.baseVertex, allocation.vertexCount);
+	if (allocation.indexBytes != 0)
+		freeRange(m_freeIndexBytes, allocation.indexOffset, allocation.indexBytes);
+	m_usedBytes -= (size_t)allocation.vertexCount * m_stride + allocation.indexBytes;
+}
+
+void GeometryArena::bind() const {
+	GLState::bindVertexArray(m_vao);
+}
+
+void GeometryArena::bindBuffers() const {
+	glBindVertexBuffer(0, m_vbo, 0, m_stride);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
+}
+
+bool GeometryArena::allocateRange(std::map<unsigned int, unsigned int>& freeRanges, unsigned int size, unsigned int& offset) {
+	for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it) {
+		if (it->second < size)
+			continue;
+
+		offset = it->first;
+		unsigned int remaining = it->second - size;
+		freeRanges.erase(it);
+		if (remaining != 0)
+			freeRanges[offset + size] = remaining;
+		return true;
+	}
+	return false;
+}
+
+void GeometryArena::freeRange(std::map<unsigned int, unsigned int>& freeRanges, unsigned int offset, unsigned int size) {
+	if (size == 0)
+		return;
+
+	auto next = freeRanges.lower_bound(offset);
+
+	// join the range before when it ends here
+	if (next != freeRanges.begin()) {
+		auto previous = std::prev(next);
+		if (previous->first + previous->second == offset) {
+			offset = previous->first;
+			size += previous->second;
+			freeRanges.erase(previous);
+		}
+	}
+
+	// and the range after when this ends where it starts
+	if (next != freeRanges.end() && offset + size == next->first) {
+		size += next->second;
+		freeRanges.erase(next);
+	}
+
+	freeRanges[offset] = size;
+}
+
+void GeometryArena::growBuffer(unsigned int& buffer, unsigned int oldBytes, unsigned int newBytes) {
+	unsigned int grown = 0;
+	glGenBuffers(1, &grown);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+	glBufferData(GL_COPY_WRITE_BUFFER, newBytes, nullptr, GL_STATIC_DRAW);
+
+	if (buffer != 0) {
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldBytes);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glDeleteBuffers(1, &buffer);
+	}
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	buffer = grown;
+}
+
+void GeometryArena::release() {
+	glDeleteVertexArrays(1, &m_vao);
+	glDeleteBuffers(1, &m_vbo);
+	glDeleteBuffers(1, &m_ibo);
+	m_vao = m_vbo = m_ibo = 0;
+}
+
+} // namespace aie
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace aie {
+
+// one vertex buffer, index buffer and vertex array shared by every mesh with the same vertex layout.
+// meshes copy their data in to ranges of the buffers and draw with a base vertex and an index offset,
+// so switching between them never rebinds a vertex array and a whole pass can be drawn indirectly.
+// the layout is set once with vertex attribute binding, so buffers can grow without touching it
+class GeometryArena {
+public:
+
+	struct Attribute {
+		unsigned int	location;
+		int				size;
+		unsigned int	type;
+		bool			normalised;
+		unsigned int	offset;
+	};
+
+	// the per draw model matrix used by indirect submission, one column per location from here.
+	// it is read from vertex binding 1 with a divisor of 1, so each draw's baseInstance picks its matrix
+	static const unsigned int INSTANCE_MATRIX_LOCATION = 4;
+	static const unsigned int INSTANCE_BINDING = 1;
+
+	struct Allocation {
+		unsigned int	baseVertex;
+		unsigned int	vertexCount;
+		unsigned int	indexOffset;	// bytes in to the index buffer, aligned to 4
+		unsigned int	indexBytes;
+	};
+
+	~GeometryArena() {}
+
+	// the arena for a vertex layout, created on first use. GL thread only
+	static GeometryArena* getArena(unsigned int stride, const Attribute* attributes, unsigned int attributeCount);
+	// deletes every arena's GL objects, for shutdown while the context is alive.
+	// allocations can still be freed afterwards but nothing can be drawn
+	static void releaseAll();
+
+	// enables and formats the attributes on the bound vertex array, all read from one vertex binding.
+	// for vertex arrays kept outside any arena with the same layouts
+	static void formatAttributes(const Attribute* attributes, unsigned int attributeCount, unsigned int binding);
+
+	// copies vertices and, when indexCount isn't 0, 2 or 4 byte indices in to the arena, growing it as needed
+	Allocation allocate(const void* vertices, unsigned int vertexCount,
+						const void* indices, unsigned int indexCount, unsigned int indexSize);
+	void free(const Allocation& allocation);
+
+	void bind() const;
+	// formats the bound vertex array like the arena's own, instance matrix included, for draws that add
+	// attributes of their own without changing the layout every other mesh in the arena draws with
+	void formatVertexArray() const;
+	// points the bound vertex array at the arena's buffers, which change whenever the arena grows
+	void bindBuffers() const;
+	unsigned int getVertexArray() const { return m_vao; }
+	unsigned int getStride() const { return m_stride; }
+
+	// bytes in use and allocated, vertices and indices together
+	size_t getUsedBytes() const { return m_usedBytes; }
+	size_t getCapacityBytes() const { return (size_t)m_vertexCapacity * m_stride + m_indexCapacity; }
+
+private:
+
+	GeometryArena(unsigned int stride, const Attribute* attributes, unsigned int attributeCount);
+
+	// first fit in a map of free offset to size, merging neighbours when a range comes back
+	static bool allocateRange(std::map<unsigned int, unsigned int>& freeRanges, unsigned int size, unsigned int& offset);
+	static void freeRange(std::map<unsigned int, unsigned int>& freeRanges, unsigned int offset, unsigned int size);
+
+	// moves the contents to a buffer of the new size, capacities are in bytes
+	void growBuffer(unsigned int& buffer, unsigned int oldBytes, unsigned int newBytes);
+	void release();
+
+	unsigned int				m_stride;
+	std::vector<Attribute>		m_attributes;
+
+	unsigned int				m_vao = 0;
+	unsigned int				m_vbo = 0;
+	unsigned int				m_ibo = 0;
+	unsigned int				m_vertexCapacity = 0;	// in vertices
+	unsigned int				m_indexCapacity = 0;	// in bytes
+	size_t						m_usedBytes = 0;
+
+	std::map<unsigned int, unsigned int>	m_freeVertices;
+	std::map<unsigned int, unsigned int>	m_freeIndexBytes;
+
+	static std::vector<std::unique_ptr<GeometryArena>>	s_arenas;
+};
+
+} // namespace aie
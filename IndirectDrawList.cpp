@@ -0,0 +1,100 @@
+#include "IndirectDrawList.h"
+#include "GeometryArena.h"
+#include "GLState.h"
+#include "gl_core_4_4.h"
+#include <algorithm>
+
+namespace aie {
+
+IndirectDrawList::~IndirectDrawList() {
+	glDeleteBuffers(1, &m_commandBuffer);
+	glDeleteBuffers(1, &m_transformBuffer);
+}
+
+bool IndirectDrawList::isSupported(unsigned int program) {
+	return glGetAttribLocation(program, "InstanceModelMatrix") == (int)GeometryArena::INSTANCE_MATRIX_LOCATION;
+}
+
+void IndirectDrawList::setCurrentTransform(const glm::mat4& transform) {
+	for (unsigned int c = 0; c < 4; ++c)
+		glVertexAttrib4fv(GeometryArena::INSTANCE_MATRIX_LOCATION + c, &transform[c][0]);
+}
+
+void IndirectDrawList::clear() {
+	m_draws.clear();
+	m_transforms.clear();
+}
+
+unsigned int IndirectDrawList::addTransform(const glm::mat4& transform) {
+	m_transforms.push_back(transform);
+	return (unsigned int)m_transforms.size() - 1;
+}
+
+void IndirectDrawList::add(GeometryArena* arena, unsigned int indexType, unsigned int indexCount, unsigned int firstIndex,
+						   int baseVertex, unsigned int transform) {
+	if (indexCount == 0)
+		return;
+
+	Draw draw = { arena, indexType, { indexCount, 1, firstIndex, baseVertex, transform } };
+	m_draws.push_back(draw);
+}
+
+void IndirectDrawList::submit() {
+
+	m_submitCount = 0;
+	if (m_draws.empty())
+		return;
+
+	// one multi-draw per run of matching arena and index type, in the order they were added otherwise
+	std::stable_sort(m_draws.begin(), m_draws.end(), [](const Draw& a, const Draw& b) {
+		return a.arena != b.arena ? a.arena < b.arena : a.indexType < b.indexType;
+	});
+
+	m_commands.resize(m_draws.size());
+	for (size_t i = 0; i < m_draws.size(); ++i)
+		m_commands[i] = m_draws[i].command;
+
+	// orphaned every frame so the driver never waits on the last frame's draws
+	if (m_commandBuffer == 0) {
+		glGenBuffers(1, &m_commandBuffer);
+		glGenBuffers(1, &m_transformBuffer);
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_commandBuffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, m_commands.size() * sizeof(Command), m_commands.data(), GL_STREAM_DRAW);
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_transformBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, m_transforms.size() * sizeof(glm::mat4), m_transforms.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	size_t first = 0;
+	while (first < m_draws.size()) {
+		size_t last = first + 1;
+		while (last < m_draws.size() && m_draws[last].arena == m_draws[first].arena &&
+			   m_draws[last].indexType == m_draws[first].indexType)
+			++last;
+
+		GeometryArena* arena = m_draws[first].arena;
+		arena->bind();
+		glBindVertexBuffer(GeometryArena::INSTANCE_BINDING, m_transformBuffer, 0, sizeof(glm::mat4));
+		for (unsigned int c = 0; c < 4; ++c)
+			glEnableVertexAttribArray(GeometryArena::INSTANCE_MATRIX_LOCATION + c);
+
+		glMultiDrawElementsIndirect(GL_TRIANGLES, m_draws[first].indexType, (const void*)(first * sizeof(Command)),
+									(GLsizei)(last - first), 0);
+		++m_submitCount;
+
+		// ordinary draws with this arena have no matrix array to read
+		if (last == m_draws.size() || m_draws[last].arena != arena) {
+			for (unsigned int c = 0; c < 4; ++c)
+				glDisableVertexAttribArray(GeometryArena::INSTANCE_MATRIX_LOCATION + c);
+		}
+
+		first = last;
+	}
+
+	GLState::bindVertexArray(0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+} // namespace aie
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <glm/mat4x4.hpp>
+#include <vector>
+
+namespace aie {
+
+class GeometryArena;
+
+// the draws of a pass, rebuilt every frame and submitted with one glMultiDrawElementsIndirect per
+// arena and index type. each draw's model matrix reaches the vertex shader through the instanced
+// attribute at GeometryArena::INSTANCE_MATRIX_LOCATION, picked by the draw's baseInstance, so
+// shaders drawn this way declare layout(location = 4) in mat4 InstanceModelMatrix
+class IndirectDrawList {
+public:
+
+	// same layout as GL's DrawElementsIndirectCommand
+	struct Command {
+		unsigned int	count;
+		unsigned int	instanceCount;
+		unsigned int	firstIndex;
+		int				baseVertex;
+		unsigned int	baseInstance;
+	};
+
+	IndirectDrawList() {}
+	~IndirectDrawList();
+
+	// true when the program reads InstanceModelMatrix from the instance matrix location
+	static bool isSupported(unsigned int program);
+	// sets the instance matrix for ordinary draws with a supported program, as the attribute is
+	// disabled outside submit and reads this value instead
+	static void setCurrentTransform(const glm::mat4& transform);
+
+	void clear();
+
+	// returns the index to add draws with
+	unsigned int addTransform(const glm::mat4& transform);
+	// indexCount indices from firstIndex, counted in indices from the start of the arena's index buffer
+	void add(GeometryArena* arena, unsigned int indexType, unsigned int indexCount, unsigned int firstIndex,
+			 int baseVertex, unsigned int transform);
+
+	// uploads the matrices and commands and draws them, with the program already bound
+	void submit();
+
+	unsigned int getDrawCount() const { return (unsigned int)m_draws.size(); }
+	// multi-draw calls made by the last submit
+	unsigned int getSubmitCount() const { return m_submitCount; }
+
+private:
+
+	struct Draw {
+		GeometryArena*	arena;
+		unsigned int	indexType;
+		Command			command;
+	};
+
+	std::vector<Draw>		m_draws;
+	std::vector<glm::mat4>	m_transforms;
+	std::vector<Command>	m_commands;
+
+	unsigned int			m_commandBuffer = 0;
+	unsigned int			m_transformBuffer = 0;
+	unsigned int			m_submitCount = 0;
+};
+
+} // namespace aie
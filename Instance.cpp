@@ -4,8 +4,94 @@
 #include "Mesh.h"
 #include "Application3D.h"
 #include "Scene.h"
+#include "OBJMesh.h"
+#include "InstanceCuller.h"
+#include "GLState.h"
 #include <glm/gtc/matrix_transform.hpp>
 #include "gl_core_4_4.h"
+#include <cmath>
+
+//instances allocated together in each block of the pool
+static const unsigned int POOL_BLOCK_INSTANCES = 256;
+
+//screen space error in pixels a level of detail may have at zero bias
+static const float LOD_PIXEL_ERROR = 1.0f;
+//a coarser level has to be this fraction under the limit before switching to it
+static const float LOD_HYSTERESIS = 0.25f;
+
+//uniforms instances bind, hashed at compile time and looked up in each program's table
+static constexpr aie::UniformID PROJECTION_VIEW_MODEL("ProjectionViewModel");
+static constexpr aie::UniformID MODEL_MATRIX("ModelMatrix");
+static constexpr aie::UniformID AMBIENT_COLOUR("AmbientColour");
+static constexpr aie::UniformID LIGHT_COLOUR("LightColour");
+static constexpr aie::UniformID LIGHT_DIRECTION("LightDirection");
+static constexpr aie::UniformID LIGHT_MATRIX("LightMatrix");
+static constexpr aie::UniformID OFFSET_LIGHT_MATRIX("offsetLightMatrix");
+static constexpr aie::UniformID CAMERA_POSITION("cameraPosition");
+static constexpr aie::UniformID NUM_LIGHTS("numLights");
+static constexpr aie::UniformID POINT_LIGHT_POSITION("PointLightPosition");
+static constexpr aie::UniformID POINT_LIGHT_COLOUR("PointLightColour");
+static constexpr aie::UniformID SHADOW_MAP("shadowMap");
+static constexpr aie::UniformID SHADOW_BIAS_MIN("shadowBiasMin");
+static constexpr aie::UniformID SHADOW_BIAS_MAX("shadowBiasMax");
+static constexpr aie::UniformID TIME("time");
+static constexpr aie::UniformID DIMENSIONS("dimensions");
+static constexpr aie::UniformID KA("Ka");
+static constexpr aie::UniformID KD("Kd");
+static constexpr aie::UniformID KS("Ks");
+static constexpr aie::UniformID SPECULAR_POWER("specularPower");
+static constexpr aie::UniformID DIFFUSE_TEXTURE("diffuseTexture");
+static constexpr aie::UniformID DIFFUSE_TEXTURE1("diffuseTexture1");
+static constexpr aie::UniformID DIFFUSE_TEXTURE2("diffuseTexture2");
+static constexpr aie::UniformID COLOUR_TARGET("colourTarget");
+static constexpr aie::UniformID FRAME_CONSTANTS("FrameConstants");
+static constexpr aie::UniformID PASS_CONSTANTS("PassConstants");
+
+
+//binds the value if the shader uses the uniform, returning whether it does
+template <typename T>
+static bool bindIfUsed(aie::ShaderProgram* shader, aie::UniformID id, const T& value)
+{
+    int location = shader->getUniform(id);
+    if (location < 0)
+        return false;
+    shader->bindUniform(location, value);
+    return true;
+}
+
+
+//binds the array if the shader uses the uniform
+template <typename T>
+static void bindIfUsed(aie::ShaderProgram* shader, aie::UniformID id, int count, const T* values)
+{
+    int location = shader->getUniform(id);
+    if (location >= 0)
+        shader->bindUniform(location, count, values);
+}
+
+
+//binds the scene's frame constants one uniform at a time, for shaders without the FrameConstants block
+static void bindFrameUniforms(aie::ShaderProgram* shader, Scene* scene)
+{
+    //bind lighting
+    bindIfUsed(shader, AMBIENT_COLOUR, scene->getAmbientLight());
+    bindIfUsed(shader, LIGHT_COLOUR, scene->getLight().colour);
+    bindIfUsed(shader, LIGHT_DIRECTION, scene->getLight().direction);
+    bindIfUsed(shader, LIGHT_MATRIX, scene->getLightMatrix());
+    bindIfUsed(shader, OFFSET_LIGHT_MATRIX, scene->getOffsetLightMatrix());
+
+    //bind point lights
+    int numLights = scene->getNumLights();
+    bindIfUsed(shader, NUM_LIGHTS, numLights);
+    bindIfUsed(shader, POINT_LIGHT_POSITION, numLights, scene->getPointlightPositions());
+    bindIfUsed(shader, POINT_LIGHT_COLOUR, numLights, scene->getPointlightColours());
+
+    bindIfUsed(shader, SHADOW_BIAS_MIN, scene->getShadowBias().x);
+    bindIfUsed(shader, SHADOW_BIAS_MAX, scene->getShadowBias().y);
+
+    //bind time
+    bindIfUsed(shader, TIME, scene->getTime());
+}
 
 Instance::Instance(glm::mat4 transform, aie::OBJMesh* OBJmesh, aie::ShaderProgram* shader, aie::Texture* texture, aie::RenderTarget* renderTarget1, aie::RenderTarget* renderTarget2)
 {
@@ -55,6 +141,35 @@ Instance::Instance(glm::vec3 position, glm::vec3 eulerAngles, glm::vec3 scale, M
 }
 
 
+//object space bounds of the mesh drawn, zero while an OBJMesh is still loading
+const glm::vec3& Instance::getBoundsMin() const
+{
+    static const glm::vec3 none(0);
+    if (m_OBJmesh != nullptr)
+        return m_OBJmesh->getBoundsMin();
+    return m_mesh != nullptr ? m_mesh->getBoundsMin() : none;
+}
+
+
+const glm::vec3& Instance::getBoundsMax() const
+{
+    static const glm::vec3 none(0);
+    if (m_OBJmesh != nullptr)
+        return m_OBJmesh->getBoundsMax();
+    return m_mesh != nullptr ? m_mesh->getBoundsMax() : none;
+}
+
+
+//false while an OBJMesh is still loading, and for Meshes placing their own vertices
+bool Instance::hasBounds() const
+{
+    //Meshes that can't be drawn indirectly aren't culled on the GPU either
+    if (m_mesh != nullptr && m_mesh->canDrawIndirect() == false)
+        return false;
+    return getBoundsMin() != getBoundsMax();
+}
+
+
 //creates a mat4 transform from given values
 glm::mat4 Instance::makeTransform(glm::vec3 position, glm::vec3 eulerAngles, glm::vec3 scale)
 {
@@ -66,8 +181,110 @@ glm::mat4 Instance::makeTransform(glm::vec3 position, glm::vec3 eulerAngles, glm
 }
 
 
+//picks a level of detail for the scene's current pass from the projected size of each level's error
+unsigned int Instance::selectLod(Scene* scene)
+{
+    if (m_OBJmesh == nullptr || m_OBJmesh->getLodCount() <= 1)
+        return 0;
+
+    Camera* camera = scene->getCamera();
+    glm::vec2 windowSize = scene->getWindowSize();
+
+    //the largest scale in the transform, so errors are never underestimated
+    float scale = glm::max(glm::length(glm::vec3(m_transform[0])),
+        glm::max(glm::length(glm::vec3(m_transform[1])), glm::length(glm::vec3(m_transform[2]))));
+
+    //distance to the nearest point of the bounding sphere
+    glm::vec3 localCentre = (m_OBJmesh->getBoundsMin() + m_OBJmesh->getBoundsMax()) * 0.5f;
+    glm::vec3 centre = glm::vec3(m_transform * glm::vec4(localCentre, 1));
+    float radius = glm::length(m_OBJmesh->getBoundsMax() - m_OBJmesh->getBoundsMin()) * 0.5f * scale;
+    float distance = glm::length(centre - camera->getPosition()) - radius;
+
+    unsigned int& current = m_lod[scene->getCurrentPass()];
+    if (distance <= 0)
+    {
+        current = 0;
+        return 0;
+    }
+
+    //pixels covered by one world unit at that distance
+    float pixelScale = scene->getProjectionMatrix()[1][1] * windowSize.y * 0.5f / distance;
+    float threshold = getLodThreshold(scene->getLodBias());
+
+    //take the coarsest level whose error stays under the threshold, needing some margin to go coarser than last time
+    unsigned int lod = 0;
+    for (unsigned int l = 1; l < m_OBJmesh->getLodCount(); l++)
+    {
+        float pixelError = m_OBJmesh->getLodError(l) * scale * pixelScale;
+        float limit = l > current ? threshold * (1.0f - LOD_HYSTERESIS) : threshold;
+        if (pixelError > limit)
+            break;
+        lod = l;
+    }
+
+    current = lod;
+    return lod;
+}
+
+
+//projected error in pixels a level of detail may have at a lod bias
+float Instance::getLodThreshold(float lodBias)
+{
+    return LOD_PIXEL_ERROR * std::exp2(lodBias);
+}
+
+
+//draws the OBJMesh at the selected lod, culling its meshlets against the camera outside the shadow pass
+void Instance::drawOBJMesh(Scene* scene)
+{
+    unsigned int lod = selectLod(scene);
+
+    //the shadow pass draws from the light with front faces culled, so the camera can't cull it
+    if (scene->getCurrentPass() == SHADOW_PASS)
+    {
+        m_OBJmesh->draw(false, lod);
+        return;
+    }
+
+    Camera* camera = scene->getCamera();
+    glm::mat4 pvm = scene->getProjectionView() * m_transform;
+    glm::vec3 viewPosition = glm::vec3(glm::inverse(m_transform) * glm::vec4(camera->getPosition(), 1));
+
+    //back facing clusters can only be skipped while gl skips back faces and the transform keeps the winding
+    bool cullBackfaces = aie::GLState::isCullEnabled() && aie::GLState::getCullFace() == GL_BACK && glm::determinant(m_transform) > 0;
+
+    aie::OBJMesh::ClusterCulling culling = aie::OBJMesh::makeClusterCulling(pvm, viewPosition, cullBackfaces);
+    m_OBJmesh->draw(false, lod, &culling);
+}
+
+
+//adds the instance with every level of detail to a culler, fails when it can only be drawn directly
+bool Instance::addCullDraws(aie::InstanceCuller& culler)
+{
+    if (m_OBJmesh != nullptr)
+    {
+        float lodErrors[aie::InstanceCuller::MAX_LODS];
+        unsigned int lodCount = glm::min(m_OBJmesh->getLodCount(), aie::InstanceCuller::MAX_LODS);
+        for (unsigned int l = 0; l < lodCount; l++)
+            lodErrors[l] = m_OBJmesh->getLodError(l);
+
+        unsigned int index = culler.addInstance(m_transform, m_OBJmesh->getBoundsMin(), m_OBJmesh->getBoundsMax(), lodCount, lodErrors);
+        m_OBJmesh->addCullDraws(culler, index);
+        return true;
+    }
+    if (m_mesh != nullptr)
+    {
+        if (m_mesh->canDrawIndirect() == false)
+            return false;
+        float lodError = 0;
+        m_mesh->addCullDraws(culler, culler.addInstance(m_transform, m_mesh->getBoundsMin(), m_mesh->getBoundsMax(), 1, &lodError));
+    }
+    return true;
+}
+
+
 //draws the instanced object with the given shader and scene lighting
-void Instance::draw(Scene* scene, aie::ShaderProgram* tempShader)
+void Instance::draw(Scene* scene, aie::ShaderProgram* tempShader, unsigned int bindFlags)
 {
     //if a shader was passed through, use it to render, if not use the stored shader
     aie::ShaderProgram* shader;
@@ -77,106 +294,119 @@ void Instance::draw(Scene* scene, aie::ShaderProgram* tempShader)
         shader = m_shader;
     
     // set the shader pipeline 
-    shader->bind();
+    if (bindFlags & BIND_PROGRAM)
+        shader->bind();
+    bindUniforms(scene, shader, bindFlags);
 
-    // bind transform and other uniforms 
-    if (glGetUniformLocation(shader->getHandle(), "ProjectionViewModel") >= 0)
+    // draw mesh 
+    if (m_OBJmesh != nullptr)
+    {
+        drawOBJMesh(scene);
+    }
+    else if (m_mesh != nullptr)
     {
-        auto pvm = scene->getCamera()->getProjectionMatrix(scene->getWindowSize().x, scene->getWindowSize().y) * scene->getCamera()->getViewMatrix() * m_transform;
-        shader->bindUniform("ProjectionViewModel", pvm);
+        m_mesh->draw();
     }
+}
 
-    //bind lighting and camera
-    if (glGetUniformLocation(shader->getHandle(), "ModelMatrix") >= 0)
-        shader->bindUniform("ModelMatrix", m_transform);
-    if (glGetUniformLocation(shader->getHandle(), "AmbientColour") >= 0)
-        shader->bindUniform("AmbientColour", scene->getAmbientLight());
-    if (glGetUniformLocation(shader->getHandle(), "LightColour") >= 0)
-        shader->bindUniform("LightColour", scene->getLight().colour);
-    if (glGetUniformLocation(shader->getHandle(), "LightDirection") >= 0)
-        shader->bindUniform("LightDirection", scene->getLight().direction);
-    if (glGetUniformLocation(shader->getHandle(), "LightMatrix") >= 0)
-        shader->bindUniform("LightMatrix", scene->getLightMatrix());
-    if (glGetUniformLocation(shader->getHandle(), "offsetLightMatrix") >= 0)
-        shader->bindUniform("offsetLightMatrix", scene->getOffsetLightMatrix());
-    if (glGetUniformLocation(shader->getHandle(), "cameraPosition") >= 0)
-        shader->bindUniform("cameraPosition", scene->getCamera()->getPosition());
 
-    //bind point lights
-    int numLights = scene->getNumLights();
-    if (glGetUniformLocation(shader->getHandle(), "numLights") >= 0)
-        shader->bindUniform("numLights", numLights);
-    if (glGetUniformLocation(shader->getHandle(), "PointLightPosition") >= 0)
-        shader->bindUniform("PointLightPosition", numLights, scene->getPointlightPositions());
-    if (glGetUniformLocation(shader->getHandle(), "PointLightColour") >= 0)
-        shader->bindUniform("PointLightColour", numLights, scene->getPointlightColours());
-
-    //bind shadow map
-    if (glGetUniformLocation(shader->getHandle(), "shadowMap") >= 0)
+//binds the transform, and the scene and material uniforms the shader uses with the textures
+void Instance::bindUniforms(Scene* scene, aie::ShaderProgram* shader, unsigned int bindFlags)
+{
+    // bind transform and other uniforms 
+    if (shader->getUniform(PROJECTION_VIEW_MODEL) >= 0)
+        bindIfUsed(shader, PROJECTION_VIEW_MODEL, scene->getProjectionView() * m_transform);
+
+    bindIfUsed(shader, MODEL_MATRIX, m_transform);
+
+    //uniform values stay with the program, so a program bound for the pass already has these
+    if (bindFlags & (BIND_PROGRAM | BIND_SCENE))
     {
-        scene->getShadowTarget()->bindDepthTarget(7);
-        shader->bindUniform("shadowMap", 7);
+        //shaders reading the scene's uniform blocks already have the lighting and camera
+        if (shader->getUniformBlock(PASS_CONSTANTS) < 0)
+            bindIfUsed(shader, CAMERA_POSITION, scene->getCamera()->getPosition());
+        if (shader->getUniformBlock(FRAME_CONSTANTS) < 0)
+            bindFrameUniforms(shader, scene);
+
+        //bind shadow map
+        if (bindIfUsed(shader, SHADOW_MAP, 7))
+            scene->getShadowTarget()->bindDepthTarget(7);
     }
-    if (glGetUniformLocation(shader->getHandle(), "shadowBiasMin") >= 0)
-        shader->bindUniform("shadowBiasMin", scene->getShadowBias().x);
-    if (glGetUniformLocation(shader->getHandle(), "shadowBiasMax") >= 0)
-        shader->bindUniform("shadowBiasMax", scene->getShadowBias().y);
 
-    //bind time
-    if (glGetUniformLocation(shader->getHandle(), "time") >= 0)
-        shader->bindUniform("time", scene->getTime());
+    if ((bindFlags & (BIND_PROGRAM | BIND_MATERIAL)) == 0)
+        return;
 
     //bind dimensions
-    if (glGetUniformLocation(shader->getHandle(), "dimensions") >= 0)
-        shader->bindUniform("dimensions", m_dimensions);
+    bindIfUsed(shader, DIMENSIONS, m_dimensions);
 
     //if K values are set, bind K values separately
     if (m_materialManualLoad)
     {
-        if (glGetUniformLocation(shader->getHandle(), "Ka") >= 0)
-            shader->bindUniform("Ka", m_ambient); 
-        if (glGetUniformLocation(shader->getHandle(), "Kd") >= 0)
-            shader->bindUniform("Kd", m_diffuse); 
-        if (glGetUniformLocation(shader->getHandle(), "Ks") >= 0)
-            shader->bindUniform("Ks", m_specular); 
-        if (glGetUniformLocation(shader->getHandle(), "specularPower") >= 0)
-            shader->bindUniform("specularPower", m_specularPower);
+        bindIfUsed(shader, KA, m_ambient); 
+        bindIfUsed(shader, KD, m_diffuse); 
+        bindIfUsed(shader, KS, m_specular); 
+        bindIfUsed(shader, SPECULAR_POWER, m_specularPower);
     }
 
     //if textured, bind texture
     if (m_texture != nullptr)
     {
-        if (glGetUniformLocation(shader->getHandle(), "diffuseTexture") >= 0)
-        {
-            shader->bindUniform("diffuseTexture", 1);
-            m_texture->bind(1);
-        }
+        if (bindIfUsed(shader, DIFFUSE_TEXTURE, 1))
+            aie::GLState::bindTexture(1, m_texture->getHandle());
     }
     //if using render target as texture, bind it
     else if (m_renderTarget1 != nullptr)
     {
-        if (glGetUniformLocation(shader->getHandle(), "diffuseTexture1") >= 0)
-            shader->bindUniform("diffuseTexture1", 1);
-        if (glGetUniformLocation(shader->getHandle(), "diffuseTexture2") >= 0)
-            shader->bindUniform("diffuseTexture2", 2);
-        if (glGetUniformLocation(shader->getHandle(), "colourTarget") >= 0)
-            shader->bindUniform("colourTarget", 1);
-
-        m_renderTarget1->getTarget(0).bind(1);
+        bindIfUsed(shader, DIFFUSE_TEXTURE1, 1);
+        bindIfUsed(shader, DIFFUSE_TEXTURE2, 2);
+        bindIfUsed(shader, COLOUR_TARGET, 1);
 
         if (m_renderTarget2 != nullptr)
-            m_renderTarget2->getTarget(0).bind(2);
+        {
+            unsigned int targets[2] = { m_renderTarget1->getTarget(0).getHandle(), m_renderTarget2->getTarget(0).getHandle() };
+            aie::GLState::bindTextures(1, 2, targets);
+        }
+        else
+            aie::GLState::bindTexture(1, m_renderTarget1->getTarget(0).getHandle());
     }
+}
 
-    // draw mesh 
-    if (m_OBJmesh != nullptr)
-    {
-        m_OBJmesh->draw();
-    }
-    else if (m_mesh != nullptr)
-    {
-        m_mesh->draw();
-    }
+
+//draws the object and count instances after it in the scene's batch with one instanced draw
+void Instance::drawInstanced(Scene* scene, aie::ShaderProgram* tempShader, unsigned int transformBuffer, unsigned int firstTransform, unsigned int count,
+    unsigned int bindFlags)
+{
+    aie::ShaderProgram* shader = tempShader != nullptr ? tempShader : m_shader;
+
+    //every uniform is shared by the batch, only the transforms differ
+    if (bindFlags & BIND_PROGRAM)
+        shader->bind();
+    bindUniforms(scene, shader, bindFlags);
+    m_mesh->drawInstanced(transformBuffer, firstTransform, count);
+}
+
+
+//true when both would bind the same uniforms and draw the same Mesh
+bool Instance::canBatchWith(const Instance& other) const
+{
+    if (m_mesh == nullptr || m_mesh != other.m_mesh || m_mesh->canDrawIndirect() == false)
+        return false;
+
+    return m_shader == other.m_shader && m_translucent == other.m_translucent && hasSameMaterial(other);
+}
+
+
+//true when the textures and material uniforms the instance binds are the same as the other's
+bool Instance::hasSameMaterial(const Instance& other) const
+{
+    if (m_texture != other.m_texture ||
+        m_renderTarget1 != other.m_renderTarget1 || m_renderTarget2 != other.m_renderTarget2 ||
+        m_dimensions != other.m_dimensions || m_materialManualLoad != other.m_materialManualLoad)
+        return false;
+
+    return m_materialManualLoad == false ||
+        (m_ambient == other.m_ambient && m_diffuse == other.m_diffuse &&
+         m_specular == other.m_specular && m_specularPower == other.m_specularPower);
 }
 
 
@@ -190,19 +420,15 @@ void Instance::drawRaw(Scene* scene, aie::ShaderProgram* tempShader)
     else
         shader = m_shader;
     
-    if (glGetUniformLocation(shader->getHandle(), "ProjectionViewModel") >= 0)
-    {
-        auto pvm = scene->getCamera()->getProjectionMatrix(scene->getWindowSize().x, scene->getWindowSize().y) * scene->getCamera()->getViewMatrix() * m_transform;
-        shader->bindUniform("ProjectionViewModel", pvm);
-    }
+    if (shader->getUniform(PROJECTION_VIEW_MODEL) >= 0)
+        bindIfUsed(shader, PROJECTION_VIEW_MODEL, scene->getProjectionView() * m_transform);
 
-    if (glGetUniformLocation(shader->getHandle(), "ModelMatrix") >= 0)
-        shader->bindUniform("ModelMatrix", m_transform);
+    bindIfUsed(shader, MODEL_MATRIX, m_transform);
     
     // draw mesh 
     if (m_OBJmesh != nullptr)
     {
-        m_OBJmesh->draw();
+        drawOBJMesh(scene);
     }
     else if (m_mesh != nullptr)
     {
@@ -220,6 +446,7 @@ void Instance::addMaterial(glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specu
     m_diffuse = diffuse;
     m_specular = specular;
     m_specularPower = specularPower;
+    markSceneDirty();
 }
 
 
@@ -227,4 +454,58 @@ void Instance::addMaterial(glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specu
 void Instance::setDimensions(int dimensions)
 {
     m_dimensions = dimensions;
+    markSceneDirty();
+}
+
+
+//has the owning scene rebuild its batches and material ids, when there is one
+void Instance::markSceneDirty()
+{
+    if (m_scene != nullptr)
+        m_scene->markInstancesDirty();
+}
+
+
+//free slots of the pool, each holding the next free slot. blocks are never returned to the heap,
+//a scene that once held many instances keeps their slots for the ones it adds later
+static void* s_freeInstance = nullptr;
+
+
+//instances come from a pool of fixed size slots
+void* Instance::operator new(size_t size)
+{
+    //classes deriving from Instance don't fit the slots
+    if (size != sizeof(Instance))
+        return ::operator new(size);
+
+    if (s_freeInstance == nullptr)
+    {
+        //thread the new block's slots on to the free list
+        char* block = (char*)::operator new(sizeof(Instance) * POOL_BLOCK_INSTANCES);
+        for (unsigned int i = 0; i < POOL_BLOCK_INSTANCES; i++)
+        {
+            void* slot = block + sizeof(Instance) * i;
+            *(void**)slot = s_freeInstance;
+            s_freeInstance = slot;
+        }
+    }
+
+    void* memory = s_freeInstance;
+    s_freeInstance = *(void**)memory;
+    return memory;
+}
+
+
+void Instance::operator delete(void* memory, size_t size)
+{
+    if (memory == nullptr)
+        return;
+    if (size != sizeof(Instance))
+    {
+        ::operator delete(memory);
+        return;
+    }
+
+    *(void**)memory = s_freeInstance;
+    s_freeInstance = memory;
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include <glm/glm.hpp>
+#include "Scene.h"
 
 namespace aie
 {
@@ -7,6 +8,7 @@ namespace aie
 	class ShaderProgram;
 	class Texture;
 	class RenderTarget;
+	class InstanceCuller;
 }
 class Scene;
 class Mesh;
@@ -16,6 +18,16 @@ struct Light;
 class Instance
 {
 public:
+	//state a draw binds, those left out are assumed to be bound already by the draw before it.
+	//scene uniforms belong to the program, material ones to the textures and material uniforms
+	enum BindFlags
+	{
+		BIND_PROGRAM = 1,
+		BIND_SCENE = 2,
+		BIND_MATERIAL = 4,
+		BIND_ALL = BIND_PROGRAM | BIND_SCENE | BIND_MATERIAL,
+	};
+
 	//constructors for OBJMeshes
 	Instance(glm::mat4 transform, aie::OBJMesh* OBJmesh, aie::ShaderProgram* shader, aie::Texture* texture = nullptr, aie::RenderTarget* renderTarget1 = nullptr, aie::RenderTarget* renderTarget2 = nullptr);
 	Instance(glm::vec3 position, glm::vec3 eulerAngles, glm::vec3 scale, aie::OBJMesh* OBJmesh, aie::ShaderProgram* shader, aie::Texture* texture = nullptr, aie::RenderTarget* renderTarget1 = nullptr, aie::RenderTarget* renderTarget2 = nullptr);
@@ -24,26 +36,80 @@ public:
 	Instance(glm::vec3 position, glm::vec3 eulerAngles, glm::vec3 scale, Mesh* mesh, aie::ShaderProgram* shader, aie::Texture* texture = nullptr, aie::RenderTarget* renderTarget1 = nullptr, aie::RenderTarget* renderTarget2 = nullptr);
 
 	//draws the instanced object with the given shader and lighting
-	void draw(Scene* scene, aie::ShaderProgram* tempShader = nullptr);
+	void draw(Scene* scene, aie::ShaderProgram* tempShader = nullptr, unsigned int bindFlags = BIND_ALL);
+	//draws the object and count instances after it in the scene's batch, which share everything
+	//but their transforms, with one instanced draw. the shader reads each model matrix from the
+	//instance matrix attribute
+	void drawInstanced(Scene* scene, aie::ShaderProgram* tempShader, unsigned int transformBuffer, unsigned int firstTransform, unsigned int count,
+		unsigned int bindFlags = BIND_ALL);
+	//true when every uniform the instance binds is the same as the other's and they draw the same Mesh,
+	//so both can be drawn by one instanced draw
+	bool canBatchWith(const Instance& other) const;
+	//true when the textures and material uniforms the instance binds are the same as the other's
+	bool hasSameMaterial(const Instance& other) const;
 	//draws the instanced object without binding only the pvm
 	void drawRaw(Scene* scene, aie::ShaderProgram* tempShader = nullptr);
+	//picks a level of detail for the scene's current pass from the projected size of each level's error
+	unsigned int selectLod(Scene* scene);
+	//projected error in pixels a level of detail may have at a lod bias
+	static float getLodThreshold(float lodBias);
+	//draws the OBJMesh at the selected lod, culling its meshlets against the camera outside the shadow pass
+	void drawOBJMesh(Scene* scene);
+	//adds the instance with every level of detail to a culler, fails when it can only be drawn directly
+	bool addCullDraws(aie::InstanceCuller& culler);
 	//creates a mat4 transform from given values
 	glm::mat4 makeTransform(glm::vec3 position, glm::vec3 eulerAngles, glm::vec3 scale);
 
+	const glm::mat4& getTransform() const { return m_transform; }
+	//moves an instance that isn't in a scene, those that are move through Scene::setInstanceTransform
+	void setTransform(const glm::mat4& transform) { m_transform = transform; }
+	//object space bounds of the mesh drawn, zero while an OBJMesh is still loading
+	const glm::vec3& getBoundsMin() const;
+	const glm::vec3& getBoundsMax() const;
+	//false while an OBJMesh is still loading, and for Meshes placing their own vertices like the water
+	//clipmap, whose bounds don't cover what they draw
+	bool hasBounds() const;
+	aie::ShaderProgram* getShader() const { return m_shader; }
+	//the mesh drawn, whichever kind it is, as an identity for sorting
+	const void* getMeshKey() const { return m_OBJmesh != nullptr ? (const void*)m_OBJmesh : (const void*)m_mesh; }
+	bool isOBJMesh() const { return m_OBJmesh != nullptr; }
+
+	//the setters below change how the instance batches, so an instance already in a scene has the
+	//scene regroup its batches the next time they are drawn
+
+	//translucent instances are drawn after the opaque ones in a pass, back to front
+	void setTranslucent(bool translucent) { m_translucent = translucent; markSceneDirty(); }
+	bool isTranslucent() const { return m_translucent; }
+
 	//swaps the attached shader
-	void swapShader(aie::ShaderProgram* newShader) { m_shader = newShader; }
+	void swapShader(aie::ShaderProgram* newShader) { m_shader = newShader; markSceneDirty(); }
 
 	//adds material lighting data
 	void addMaterial(glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, float specularPower);
 	//adds parameters for shaders to use
 	void setDimensions(int dimensions);
 
+	//instances come from a pool of fixed size slots, so scenes of many instances
+	//don't make as many heap allocations
+	static void* operator new(size_t size);
+	static void operator delete(void* memory, size_t size);
+
 	glm::vec3 m_ambient = glm::vec3(0);
 	glm::vec3 m_diffuse = glm::vec3(0);
 	glm::vec3 m_specular = glm::vec3(0);
 	float m_specularPower = 0.0f;
 
 protected:
+	//binds the transform, and the scene and material uniforms the shader uses with the textures
+	//when the flags ask for them
+	void bindUniforms(Scene* scene, aie::ShaderProgram* shader, unsigned int bindFlags);
+	//has the owning scene rebuild its batches and material ids, when there is one
+	void markSceneDirty();
+
+	//set by Scene::AddInstance, the scene deleting the instance when it's removed
+	friend class Scene;
+	Scene* m_scene = nullptr;
+
 	glm::mat4 m_transform;
 	Mesh* m_mesh;
 	aie::OBJMesh* m_OBJmesh;
@@ -54,7 +120,11 @@ protected:
 
 	
 	bool m_materialManualLoad = false;
+	bool m_translucent = false;
 
 	int m_dimensions = 1;
+
+	//last level of detail picked in each pass, for hysteresis
+	unsigned int m_lod[MAX_PASSES] = {};
 };
 
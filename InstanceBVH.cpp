@@ -0,0 +1,394 @@
+#include "InstanceBVH.h"
+#include "Frustum.h"
+#include <algorithm>
+#include <cfloat>
+
+//changes that always pass before a rebuild, so small trees aren't rebuilt after every change
+static const unsigned int MIN_CHANGES_BEFORE_REBUILD = 16;
+
+//half the surface area of a box, which the chance of a query reaching it grows with
+static float getArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+	glm::vec3 size = boundsMax - boundsMin;
+	return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+
+void InstanceBVH::insert(InstanceHandle handle, const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+	if (handle.index >= m_slotLeaves.size())
+		m_slotLeaves.resize(handle.index + 1, (int)NO_NODE);
+
+	int leaf = allocateNode();
+	Node& node = m_nodes[leaf];
+	node.boundsMin = boundsMin;
+	node.boundsMax = boundsMax;
+	node.children[0] = NO_NODE;
+	node.children[1] = NO_NODE;
+	node.handle = handle;
+
+	m_slotLeaves[handle.index] = leaf;
+	m_leafCount++;
+	m_changesSinceBuild++;
+	insertLeaf(leaf);
+}
+
+
+//does nothing for instances not in the tree
+void InstanceBVH::remove(InstanceHandle handle)
+{
+	if (contains(handle) == false)
+		return;
+
+	int leaf = m_slotLeaves[handle.index];
+	m_slotLeaves[handle.index] = NO_NODE;
+	removeLeaf(leaf);
+	freeNode(leaf);
+	m_leafCount--;
+	m_changesSinceBuild++;
+}
+
+
+//replaces an instance's bounds, refitting every box above it
+void InstanceBVH::update(InstanceHandle handle, const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+	if (contains(handle) == false)
+		return;
+
+	int leaf = m_slotLeaves[handle.index];
+	m_nodes[leaf].boundsMin = boundsMin;
+	m_nodes[leaf].boundsMax = boundsMax;
+	refit(m_nodes[leaf].parent);
+	m_changesSinceBuild++;
+}
+
+
+bool InstanceBVH::contains(InstanceHandle handle) const
+{
+	return handle.index < m_slotLeaves.size() && m_slotLeaves[handle.index] != NO_NODE &&
+		m_nodes[m_slotLeaves[handle.index]].handle == handle;
+}
+
+
+//rebuilds the tree top down once enough changes have been made
+void InstanceBVH::rebuildIfWorn()
+{
+	if (m_changesSinceBuild >= MIN_CHANGES_BEFORE_REBUILD && m_changesSinceBuild > m_leafCount / 4)
+		rebuild();
+}
+
+
+void InstanceBVH::rebuild()
+{
+	m_changesSinceBuild = 0;
+
+	//keep the leaves and start the nodes over with them at the front
+	std::vector<Node> nodes;
+	nodes.reserve(m_leafCount * 2);
+	for (unsigned int slot = 0; slot < m_slotLeaves.size(); slot++)
+	{
+		if (m_slotLeaves[slot] == NO_NODE)
+			continue;
+		nodes.push_back(m_nodes[m_slotLeaves[slot]]);
+		m_slotLeaves[slot] = (int)nodes.size() - 1;
+	}
+	m_nodes.swap(nodes);
+	m_freeNode = NO_NODE;
+	m_root = NO_NODE;
+	if (m_nodes.empty())
+		return;
+
+	std::vector<int> leaves(m_nodes.size());
+	for (unsigned int i = 0; i < leaves.size(); i++)
+		leaves[i] = (int)i;
+	m_root = build(leaves, 0, (unsigned int)leaves.size());
+	m_nodes[m_root].parent = NO_NODE;
+}
+
+
+//appends the instances whose bounds may intersect the frustum, subtrees wholly inside it added without further tests
+void InstanceBVH::queryFrustum(const aie::Frustum& frustum, std::vector<InstanceHandle>& results) const
+{
+	if (m_root == NO_NODE)
+		return;
+
+	m_stack.clear();
+	m_stack.push_back(m_root << 1);
+	while (m_stack.empty() == false)
+	{
+		int entry = m_stack.back();
+		m_stack.pop_back();
+		const Node& node = m_nodes[entry >> 1];
+		bool inside = (entry & 1) != 0;
+
+		if (inside == false)
+		{
+			//outside when the centre is further behind a plane than the extent reaches,
+			//inside when it is further in front of every plane
+			glm::vec3 centre = (node.boundsMin + node.boundsMax) * 0.5f;
+			glm::vec3 extent = (node.boundsMax - node.boundsMin) * 0.5f;
+			bool outside = false;
+			inside = true;
+			for (int p = 0; p < 6 && outside == false; p++)
+			{
+				glm::vec3 normal = glm::vec3(frustum.planes[p]);
+				float distance = glm::dot(normal, centre) + frustum.planes[p].w;
+				float radius = glm::dot(glm::abs(normal), extent);
+				outside = distance < -radius;
+				inside = inside && distance >= radius;
+			}
+			if (outside)
+				continue;
+		}
+
+		if (node.isLeaf())
+			results.push_back(node.handle);
+		else
+		{
+			m_stack.push_back(node.children[0] << 1 | (inside ? 1 : 0));
+			m_stack.push_back(node.children[1] << 1 | (inside ? 1 : 0));
+		}
+	}
+}
+
+
+//appends the instances whose bounds intersect the sphere
+void InstanceBVH::querySphere(const glm::vec3& centre, float radius, std::vector<InstanceHandle>& results) const
+{
+	if (m_root == NO_NODE)
+		return;
+
+	m_stack.clear();
+	m_stack.push_back(m_root);
+	while (m_stack.empty() == false)
+	{
+		const Node& node = m_nodes[m_stack.back()];
+		m_stack.pop_back();
+
+		//distance from the centre to the nearest point of the box
+		glm::vec3 offset = glm::clamp(centre, node.boundsMin, node.boundsMax) - centre;
+		if (glm::dot(offset, offset) > radius * radius)
+			continue;
+
+		if (node.isLeaf())
+			results.push_back(node.handle);
+		else
+		{
+			m_stack.push_back(node.children[0]);
+			m_stack.push_back(node.children[1]);
+		}
+	}
+}
+
+
+//appends the instances whose bounds the ray hits within maxDistance, nearest first
+void InstanceBVH::queryRay(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, std::vector<RayHit>& results) const
+{
+	if (m_root == NO_NODE)
+		return;
+
+	//axes the ray runs parallel to divide to infinity, so only boxes the origin lies within pass them
+	glm::vec3 inverseDirection = 1.0f / direction;
+	size_t firstResult = results.size();
+
+	m_stack.clear();
+	m_stack.push_back(m_root);
+	while (m_stack.empty() == false)
+	{
+		const Node& node = m_nodes[m_stack.back()];
+		m_stack.pop_back();
+
+		//the distances the ray enters and leaves the slab of each axis
+		glm::vec3 t0 = (node.boundsMin - origin) * inverseDirection;
+		glm::vec3 t1 = (node.boundsMax - origin) * inverseDirection;
+		glm::vec3 slabEnter = glm::min(t0, t1);
+		glm::vec3 slabExit = glm::max(t0, t1);
+		float enter = glm::max(glm::max(slabEnter.x, slabEnter.y), glm::max(slabEnter.z, 0.0f));
+		float exit = glm::min(glm::min(slabExit.x, slabExit.y), glm::min(slabExit.z, maxDistance));
+		if (enter > exit)
+			continue;
+
+		if (node.isLeaf())
+			results.push_back({ node.handle, enter });
+		else
+		{
+			m_stack.push_back(node.children[0]);
+			m_stack.push_back(node.children[1]);
+		}
+	}
+
+	std::sort(results.begin() + firstResult, results.end(), [](const RayHit& a, const RayHit& b)
+	{
+		return a.distance < b.distance;
+	});
+}
+
+
+int InstanceBVH::allocateNode()
+{
+	if (m_freeNode == NO_NODE)
+	{
+		m_nodes.push_back(Node());
+		return (int)m_nodes.size() - 1;
+	}
+
+	int node = m_freeNode;
+	m_freeNode = m_nodes[node].parent;
+	return node;
+}
+
+
+void InstanceBVH::freeNode(int node)
+{
+	m_nodes[node].parent = m_freeNode;
+	m_nodes[node].handle = InstanceHandle();
+	m_freeNode = node;
+}
+
+
+//places a detached leaf beside the node whose box grows least, starting from the root
+void InstanceBVH::insertLeaf(int leaf)
+{
+	if (m_root == NO_NODE)
+	{
+		m_root = leaf;
+		m_nodes[leaf].parent = NO_NODE;
+		return;
+	}
+
+	glm::vec3 leafMin = m_nodes[leaf].boundsMin;
+	glm::vec3 leafMax = m_nodes[leaf].boundsMax;
+
+	//every box on the way down grows to hold the leaf, so going deeper costs that growth on top of
+	//the new parent's area. stop when pairing with the current node is cheaper than either child
+	int sibling = m_root;
+	while (m_nodes[sibling].isLeaf() == false)
+	{
+		const Node& node = m_nodes[sibling];
+		float area = getArea(node.boundsMin, node.boundsMax);
+		float combinedArea = getArea(glm::min(node.boundsMin, leafMin), glm::max(node.boundsMax, leafMax));
+		float cost = 2.0f * combinedArea;
+		float inheritedCost = 2.0f * (combinedArea - area);
+
+		float childCosts[2];
+		for (int c = 0; c < 2; c++)
+		{
+			const Node& child = m_nodes[node.children[c]];
+			float childArea = getArea(glm::min(child.boundsMin, leafMin), glm::max(child.boundsMax, leafMax));
+			if (child.isLeaf() == false)
+				childArea -= getArea(child.boundsMin, child.boundsMax);
+			childCosts[c] = childArea + inheritedCost;
+		}
+
+		if (cost < childCosts[0] && cost < childCosts[1])
+			break;
+		sibling = node.children[childCosts[0] < childCosts[1] ? 0 : 1];
+	}
+
+	//a new parent takes the sibling's place, holding it and the leaf
+	int oldParent = m_nodes[sibling].parent;
+	int parent = allocateNode();
+	Node& node = m_nodes[parent];
+	node.parent = oldParent;
+	node.boundsMin = glm::min(m_nodes[sibling].boundsMin, leafMin);
+	node.boundsMax = glm::max(m_nodes[sibling].boundsMax, leafMax);
+	node.children[0] = sibling;
+	node.children[1] = leaf;
+	node.handle = InstanceHandle();
+	m_nodes[sibling].parent = parent;
+	m_nodes[leaf].parent = parent;
+
+	if (oldParent == NO_NODE)
+		m_root = parent;
+	else
+	{
+		Node& grandparent = m_nodes[oldParent];
+		grandparent.children[grandparent.children[0] == sibling ? 0 : 1] = parent;
+		refit(oldParent);
+	}
+}
+
+
+//detaches a leaf, its sibling taking its parent's place
+void InstanceBVH::removeLeaf(int leaf)
+{
+	if (leaf == m_root)
+	{
+		m_root = NO_NODE;
+		return;
+	}
+
+	int parent = m_nodes[leaf].parent;
+	int grandparent = m_nodes[parent].parent;
+	int sibling = m_nodes[parent].children[m_nodes[parent].children[0] == leaf ? 1 : 0];
+	freeNode(parent);
+
+	m_nodes[sibling].parent = grandparent;
+	if (grandparent == NO_NODE)
+		m_root = sibling;
+	else
+	{
+		Node& node = m_nodes[grandparent];
+		node.children[node.children[0] == parent ? 0 : 1] = sibling;
+		refit(grandparent);
+	}
+}
+
+
+//recomputes the boxes from a node up to the root, stopping once a box doesn't change
+void InstanceBVH::refit(int node)
+{
+	while (node != NO_NODE)
+	{
+		Node& current = m_nodes[node];
+		const Node& left = m_nodes[current.children[0]];
+		const Node& right = m_nodes[current.children[1]];
+		glm::vec3 boundsMin = glm::min(left.boundsMin, right.boundsMin);
+		glm::vec3 boundsMax = glm::max(left.boundsMax, right.boundsMax);
+		if (boundsMin == current.boundsMin && boundsMax == current.boundsMax)
+			return;
+
+		current.boundsMin = boundsMin;
+		current.boundsMax = boundsMax;
+		node = current.parent;
+	}
+}
+
+
+//builds a subtree over leaves[first, last), splitting at the median along the widest axis of their centres
+int InstanceBVH::build(std::vector<int>& leaves, unsigned int first, unsigned int last)
+{
+	if (last - first == 1)
+		return leaves[first];
+
+	glm::vec3 centreMin = glm::vec3(FLT_MAX);
+	glm::vec3 centreMax = glm::vec3(-FLT_MAX);
+	for (unsigned int i = first; i < last; i++)
+	{
+		glm::vec3 centre = m_nodes[leaves[i]].boundsMin + m_nodes[leaves[i]].boundsMax;
+		centreMin = glm::min(centreMin, centre);
+		centreMax = glm::max(centreMax, centre);
+	}
+
+	glm::vec3 size = centreMax - centreMin;
+	int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+	unsigned int middle = (first + last) / 2;
+	std::nth_element(leaves.begin() + first, leaves.begin() + middle, leaves.begin() + last, [this, axis](int a, int b)
+	{
+		return m_nodes[a].boundsMin[axis] + m_nodes[a].boundsMax[axis] < m_nodes[b].boundsMin[axis] + m_nodes[b].boundsMax[axis];
+	});
+
+	int left = build(leaves, first, middle);
+	int right = build(leaves, middle, last);
+
+	int parent = allocateNode();
+	Node& node = m_nodes[parent];
+	node.boundsMin = glm::min(m_nodes[left].boundsMin, m_nodes[right].boundsMin);
+	node.boundsMax = glm::max(m_nodes[left].boundsMax, m_nodes[right].boundsMax);
+	node.children[0] = left;
+	node.children[1] = right;
+	node.handle = InstanceHandle();
+	m_nodes[left].parent = parent;
+	m_nodes[right].parent = parent;
+	return parent;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "InstanceStore.h"
+
+namespace aie
+{
+	struct Frustum;
+}
+
+//a bounding volume hierarchy over instances' world bounds, with one instance in each leaf. instances
+//are inserted next to the leaf that grows the tree least and moving one refits the boxes above it,
+//so changes cost the depth of the tree. the tree wears down as instances move away from where they
+//were inserted, so it is rebuilt once a quarter as many changes as it has leaves have been made
+class InstanceBVH
+{
+public:
+
+	void insert(InstanceHandle handle, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+	//does nothing for instances not in the tree
+	void remove(InstanceHandle handle);
+	//replaces an instance's bounds, refitting every box above it
+	void update(InstanceHandle handle, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+	bool contains(InstanceHandle handle) const;
+
+	//rebuilds the tree top down once enough changes have been made, called before queries
+	void rebuildIfWorn();
+	void rebuild();
+
+	//appends the instances whose bounds may intersect the frustum, subtrees wholly inside it added without further tests
+	void queryFrustum(const aie::Frustum& frustum, std::vector<InstanceHandle>& results) const;
+	//appends the instances whose bounds intersect the sphere
+	void querySphere(const glm::vec3& centre, float radius, std::vector<InstanceHandle>& results) const;
+	//appends the instances whose bounds the ray hits within maxDistance, with the distance it enters each,
+	//nearest first. direction needn't be normalised, distances are in multiples of it
+	struct RayHit
+	{
+		InstanceHandle handle;
+		float distance;
+	};
+	void queryRay(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, std::vector<RayHit>& results) const;
+
+	unsigned int getLeafCount() const { return m_leafCount; }
+
+private:
+
+	static const int NO_NODE = -1;
+
+	//leaves have no children and hold their instance's handle. free nodes keep the next free node in parent
+	struct Node
+	{
+		glm::vec3 boundsMin;
+		int parent;
+		glm::vec3 boundsMax;
+		int children[2];
+		InstanceHandle handle;
+
+		bool isLeaf() const { return children[0] == NO_NODE; }
+	};
+
+	int allocateNode();
+	void freeNode(int node);
+	//places a detached leaf beside the node whose box grows least, starting from the root
+	void insertLeaf(int leaf);
+	//detaches a leaf, its sibling taking its parent's place
+	void removeLeaf(int leaf);
+	//recomputes the boxes from a node up to the root, stopping once a box doesn't change
+	void refit(int node);
+	//builds a subtree over leaves[first, last), splitting at the median along the widest axis of their centres
+	int build(std::vector<int>& leaves, unsigned int first, unsigned int last);
+
+	std::vector<Node> m_nodes;
+	int m_root = NO_NODE;
+	int m_freeNode = NO_NODE;
+	//the leaf of each store slot, NO_NODE for those not in the tree
+	std::vector<int> m_slotLeaves;
+	unsigned int m_leafCount = 0;
+	unsigned int m_changesSinceBuild = 0;
+	//traversal stack, kept so queries don't allocate. frustum queries put each node's index in the upper
+	//bits with whether it is known to be inside in the lowest
+	mutable std::vector<int> m_stack;
+};
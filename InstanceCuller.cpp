@@ -0,0 +1,366 @@
+#include "InstanceCuller.h"
+#include "GeometryArena.h"
+#include "GLState.h"
+#include "Shader.h"
+#include "gl_core_4_4.h"
+#include <algorithm>
+#include <cfloat>
+#include <cstdio>
+
+namespace aie {
+
+// threads per work group of the culling shader
+static const unsigned int CULL_GROUP_SIZE = 64;
+
+// the GPU half of cullDraw, any change to one must be made to the other
+static const char* CULL_SHADER_SOURCE = R"(
+#version 430
+layout(local_size_x = 64) in;
+
+struct Instance {
+	mat4 transform;
+	vec4 sphere;
+	vec4 lodErrors;
+};
+
+struct Draw {
+	uint instance;
+	uint group;
+	int baseVertex;
+	uint lodCount;
+	uvec4 indexCounts;
+	uvec4 firstIndices;
+};
+
+struct Command {
+	uint count;
+	uint instanceCount;
+	uint firstIndex;
+	int baseVertex;
+	uint baseInstance;
+};
+
+layout(std430, binding = 0) readonly buffer Instances { Instance instances[]; };
+layout(std430, binding = 1) readonly buffer Draws { Draw draws[]; };
+layout(std430, binding = 2) readonly buffer Groups { uint groupFirst[]; };
+layout(std430, binding = 3) buffer Counts { uint groupCounts[]; };
+layout(std430, binding = 4) writeonly buffer Commands { Command commands[]; };
+
+uniform vec4 planes[6];
+uniform vec3 lodPosition;
+uniform float lodPixelScale;
+uniform float lodThreshold;
+uniform int drawCount;
+
+void main() {
+	uint d = gl_GlobalInvocationID.x;
+	if (d >= uint(drawCount))
+		return;
+
+	Draw draw = draws[d];
+	Instance instance = instances[draw.instance];
+
+	vec3 centre = vec3(instance.transform * vec4(instance.sphere.xyz, 1));
+	float scale = max(length(instance.transform[0].xyz), max(length(instance.transform[1].xyz), length(instance.transform[2].xyz)));
+	float radius = instance.sphere.w * scale;
+
+	for (int p = 0; p < 6; ++p) {
+		if (dot(planes[p].xyz, centre) + planes[p].w < -radius)
+			return;
+	}
+
+	uint lod = 0u;
+	float sphereDistance = length(centre - lodPosition) - radius;
+	if (sphereDistance > 0.0) {
+		float pixelScale = lodPixelScale / sphereDistance;
+		for (uint l = 1u; l < 4u; ++l) {
+			if (instance.lodErrors[l] * scale * pixelScale > lodThreshold)
+				break;
+			lod = l;
+		}
+	}
+	lod = min(lod, draw.lodCount - 1u);
+
+	if (draw.indexCounts[lod] == 0u)
+		return;
+
+	uint slot = groupFirst[draw.group] + atomicAdd(groupCounts[draw.group], 1u);
+	commands[slot] = Command(draw.indexCounts[lod], 1u, draw.firstIndices[lod], draw.baseVertex, draw.instance);
+}
+)";
+
+std::unique_ptr<ShaderProgram> InstanceCuller::s_program;
+bool InstanceCuller::s_programBuilt = false;
+
+InstanceCuller::~InstanceCuller() {
+	glDeleteBuffers(1, &m_instanceBuffer);
+	glDeleteBuffers(1, &m_drawBuffer);
+	glDeleteBuffers(1, &m_groupBuffer);
+	glDeleteBuffers(1, &m_countBuffer);
+	glDeleteBuffers(1, &m_commandBuffer);
+}
+
+bool InstanceCuller::isComputeSupported() {
+	if (s_programBuilt == false) {
+		s_programBuilt = true;
+
+		std::unique_ptr<ShaderProgram> program(new ShaderProgram());
+		if (program->createShader(eShaderStage::COMPUTE, CULL_SHADER_SOURCE) == false ||
+			program->link() == false) {
+			printf("Instance Culling Shader Error: %s\n", program->getLastError());
+			printf("Instances will be culled on the CPU\n");
+			return false;
+		}
+		s_program = std::move(program);
+	}
+	return s_program != nullptr;
+}
+
+void InstanceCuller::releaseProgram() {
+	s_program.reset();
+}
+
+void InstanceCuller::clear() {
+	m_instances.clear();
+	m_draws.clear();
+	m_drawArenas.clear();
+	m_dirty = true;
+}
+
+unsigned int InstanceCuller::addInstance(const glm::mat4& transform, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+										 unsigned int lodCount, const float* lodErrors) {
+	Instance instance;
+	instance.transform = transform;
+	instance.sphere = glm::vec4((boundsMin + boundsMax) * 0.5f, glm::length(boundsMax - boundsMin) * 0.5f);
+	for (unsigned int l = 0; l < MAX_LODS; ++l)
+		instance.lodErrors[l] = l < lodCount ? lodErrors[l] : FLT_MAX;
+
+	m_instances.push_back(instance);
+	m_dirty = true;
+	return (unsigned int)m_instances.size() - 1;
+}
+
+void InstanceCuller::updateInstance(unsigned int instance, const glm::mat4& transform,
+									const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	Instance& entry = m_instances[instance];
+	entry.transform = transform;
+	entry.sphere = glm::vec4((boundsMin + boundsMax) * 0.5f, glm::length(boundsMax - boundsMin) * 0.5f);
+
+	// before the first build everything is uploaded together
+	if (m_dirty)
+		return;
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_instanceBuffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)instance * sizeof(Instance), sizeof(Instance), &entry);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void InstanceCuller::addDraw(unsigned int instance, GeometryArena* arena, unsigned int indexType, int baseVertex,
+							 unsigned int lodCount, const unsigned int* indexCounts, const unsigned int* firstIndices) {
+	Draw draw;
+	draw.instance = instance;
+	draw.group = 0;
+	draw.baseVertex = baseVertex;
+	draw.lodCount = std::min(std::max(lodCount, 1u), MAX_LODS);
+	for (unsigned int l = 0; l < MAX_LODS; ++l) {
+		draw.indexCounts[l] = indexCounts[std::min(l, draw.lodCount - 1)];
+		draw.firstIndices[l] = firstIndices[std::min(l, draw.lodCount - 1)];
+	}
+
+	m_draws.push_back(draw);
+	m_drawArenas.push_back(std::make_pair(arena, indexType));
+	m_dirty = true;
+}
+
+bool InstanceCuller::cullDraw(const Instance& instance, const Draw& draw, const View& view, Command& command) {
+
+	glm::vec3 centre = glm::vec3(instance.transform * glm::vec4(glm::vec3(instance.sphere), 1));
+	float scale = std::max(glm::length(glm::vec3(instance.transform[0])),
+						   std::max(glm::length(glm::vec3(instance.transform[1])), glm::length(glm::vec3(instance.transform[2]))));
+	float radius = instance.sphere.w * scale;
+
+	if (view.frustum.intersectsSphere(centre, radius) == false)
+		return false;
+
+	unsigned int lod = 0;
+	float distance = glm::length(centre - view.lodPosition) - radius;
+	if (distance > 0) {
+		float pixelScale = view.lodPixelScale / distance;
+		for (unsigned int l = 1; l < MAX_LODS; ++l) {
+			if (instance.lodErrors[l] * scale * pixelScale > view.lodThreshold)
+				break;
+			lod = l;
+		}
+	}
+	lod = std::min(lod, draw.lodCount - 1);
+
+	if (draw.indexCounts[lod] == 0)
+		return false;
+
+	command.count = draw.indexCounts[lod];
+	command.instanceCount = 1;
+	command.firstIndex = draw.firstIndices[lod];
+	command.baseVertex = draw.baseVertex;
+	command.baseInstance = draw.instance;
+	return true;
+}
+
+void InstanceCuller::build() {
+	m_dirty = false;
+
+	// one group per arena and index type, in the same order IndirectDrawList submits them
+	m_groups.clear();
+	for (auto& key : m_drawArenas) {
+		bool found = false;
+		for (auto& g : m_groups)
+			found = found || (g.arena == key.first && g.indexType == key.second);
+		if (found == false)
+			m_groups.push_back({ key.first, key.second, 0, 0 });
+	}
+	std::sort(m_groups.begin(), m_groups.end(), [](const Group& a, const Group& b) {
+		return a.arena != b.arena ? a.arena < b.arena : a.indexType < b.indexType;
+	});
+
+	for (size_t d = 0; d < m_draws.size(); ++d) {
+		unsigned int g = 0;
+		while (m_groups[g].arena != m_drawArenas[d].first || m_groups[g].indexType != m_drawArenas[d].second)
+			++g;
+		m_draws[d].group = g;
+		m_groups[g].commandCount++;
+	}
+
+	m_groupFirst.resize(m_groups.size());
+	unsigned int first = 0;
+	for (size_t g = 0; g < m_groups.size(); ++g) {
+		m_groups[g].firstCommand = first;
+		m_groupFirst[g] = first;
+		first += m_groups[g].commandCount;
+	}
+
+	if (m_instanceBuffer == 0) {
+		glGenBuffers(1, &m_instanceBuffer);
+		glGenBuffers(1, &m_drawBuffer);
+		glGenBuffers(1, &m_groupBuffer);
+		glGenBuffers(1, &m_countBuffer);
+		glGenBuffers(1, &m_commandBuffer);
+	}
+
+	// the instance buffer is also the instance matrix's vertex buffer
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_instanceBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, m_instances.size() * sizeof(Instance), m_instances.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_drawBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, m_draws.size() * sizeof(Draw), m_draws.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_groupBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, m_groupFirst.size() * sizeof(unsigned int), m_groupFirst.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_countBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, m_groups.size() * sizeof(unsigned int), nullptr, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_commandBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, m_draws.size() * sizeof(Command), nullptr, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void InstanceCuller::draw(const View& view) {
+	if (m_dirty)
+		build();
+	if (m_draws.empty())
+		return;
+
+	if (isUsingCompute())
+		cullOnGPU(view);
+	else
+		cullOnCPU(view);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_commandBuffer);
+	for (size_t g = 0; g < m_groups.size(); ++g) {
+		const Group& group = m_groups[g];
+		group.arena->bind();
+		glBindVertexBuffer(GeometryArena::INSTANCE_BINDING, m_instanceBuffer, 0, sizeof(Instance));
+		for (unsigned int c = 0; c < 4; ++c)
+			glEnableVertexAttribArray(GeometryArena::INSTANCE_MATRIX_LOCATION + c);
+
+		glMultiDrawElementsIndirect(GL_TRIANGLES, group.indexType, (const void*)(group.firstCommand * sizeof(Command)),
+									(GLsizei)group.commandCount, 0);
+
+		// ordinary draws with this arena have no matrix array to read
+		if (g + 1 == m_groups.size() || m_groups[g + 1].arena != group.arena) {
+			for (unsigned int c = 0; c < 4; ++c)
+				glDisableVertexAttribArray(GeometryArena::INSTANCE_MATRIX_LOCATION + c);
+		}
+	}
+
+	GLState::bindVertexArray(0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void InstanceCuller::cullOnGPU(const View& view) {
+	m_lastOnGPU = true;
+
+	// empty commands and counts, the commands the shader doesn't write stay as no-op draws
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_countBuffer);
+	glClearBufferData(GL_COPY_WRITE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_commandBuffer);
+	glClearBufferData(GL_COPY_WRITE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_instanceBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_drawBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_groupBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, m_countBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, m_commandBuffer);
+
+	// the caller's program is put back for the draws
+	ShaderProgram* drawProgram = ShaderProgram::getCurrent();
+
+	s_program->bind();
+	s_program->bindUniform("planes", 6, view.frustum.planes);
+	s_program->bindUniform("lodPosition", view.lodPosition);
+	s_program->bindUniform("lodPixelScale", view.lodPixelScale);
+	s_program->bindUniform("lodThreshold", view.lodThreshold);
+	s_program->bindUniform("drawCount", (int)m_draws.size());
+	glDispatchCompute(((unsigned int)m_draws.size() + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+	// the commands are read by the draws, and cleared or read back after
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+	if (drawProgram != nullptr)
+		drawProgram->bind();
+
+	for (unsigned int b = 0; b < 5; ++b)
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, b, 0);
+}
+
+void InstanceCuller::cullOnCPU(const View& view) {
+	m_lastOnGPU = false;
+
+	Command empty = {};
+	m_commands.assign(m_draws.size(), empty);
+	m_groupCounts.assign(m_groups.size(), 0);
+
+	m_visibleCount = 0;
+	Command command;
+	for (auto& draw : m_draws) {
+		if (cullDraw(m_instances[draw.instance], draw, view, command) == false)
+			continue;
+
+		m_commands[m_groupFirst[draw.group] + m_groupCounts[draw.group]++] = command;
+		++m_visibleCount;
+	}
+
+	// orphaned so the driver never waits on the last pass's draws
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_commandBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, m_commands.size() * sizeof(Command), m_commands.data(), GL_DYNAMIC_COPY);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void InstanceCuller::getCommands(std::vector<Command>& commands) const {
+	if (m_lastOnGPU == false) {
+		commands = m_commands;
+		return;
+	}
+
+	commands.resize(m_draws.size());
+	glBindBuffer(GL_COPY_READ_BUFFER, m_commandBuffer);
+	glGetBufferSubData(GL_COPY_READ_BUFFER, 0, commands.size() * sizeof(Command), commands.data());
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+}
+
+} // namespace aie
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "IndirectDrawList.h"
+#include "Frustum.h"
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace aie {
+
+class GeometryArena;
+class ShaderProgram;
+
+// draws a fixed set of instances indirectly, culled and given a level of detail on the GPU.
+// the instances' transforms, bounding spheres and per lod draws are uploaded once to storage
+// buffers. each pass a compute shader tests every draw's sphere against the frustum, picks its
+// lod from the camera, and appends the visible ones to the front of their arena's range of the
+// command buffer, which was cleared to empty commands. each range is then drawn with one
+// glMultiDrawElementsIndirect, so the CPU cost of a pass doesn't grow with the instance count.
+// without an indirect count (GL 4.6) the empty tail of each range is drawn too, as no-ops.
+// a command's baseInstance is its instance, which picks the instance matrix attribute straight
+// from the instance buffer, so shaders are the same as for IndirectDrawList.
+// the CPU fallback runs the same tests in the same order of operations, giving the same commands
+// except that the GPU appends each range in whatever order its threads finish
+class InstanceCuller {
+public:
+
+	typedef IndirectDrawList::Command Command;
+
+	static const unsigned int MAX_LODS = 4;
+
+	// what a pass is culled against and how it picks detail
+	struct View {
+		Frustum		frustum;		// world space
+		glm::vec3	lodPosition;	// distances for lod selection are measured from here
+		float		lodPixelScale;	// pixels covered by one world unit at a distance of one
+		float		lodThreshold;	// largest projected error in pixels a level may have
+	};
+
+	// std430 layouts read by the compute shader
+	struct Instance {
+		glm::mat4	transform;
+		glm::vec4	sphere;				// object space centre and radius
+		float		lodErrors[MAX_LODS];	// past the instance's lod count these never pass
+	};
+
+	struct Draw {
+		unsigned int	instance;
+		unsigned int	group;
+		int				baseVertex;
+		unsigned int	lodCount;
+		unsigned int	indexCounts[MAX_LODS];
+		unsigned int	firstIndices[MAX_LODS];
+	};
+
+	InstanceCuller() {}
+	~InstanceCuller();
+
+	// builds the compute program the first time, false when it won't compile and only the CPU can cull
+	static bool isComputeSupported();
+	// deletes the compute program, for shutdown while the context is alive
+	static void releaseProgram();
+
+	// removes every instance and draw, the buffers are rebuilt on the next draw
+	void clear();
+
+	// lodErrors holds lodCount object space errors, returns the index to add the instance's draws with
+	unsigned int addInstance(const glm::mat4& transform, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+							 unsigned int lodCount, const float* lodErrors);
+	// moves an instance already added, its draws and lods staying as they are. an instance buffer
+	// already built has just that instance rewritten
+	void updateInstance(unsigned int instance, const glm::mat4& transform, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+	// one draw of an instance, lodCount ranges of indices counted from the start of the arena's index buffer
+	void addDraw(unsigned int instance, GeometryArena* arena, unsigned int indexType, int baseVertex,
+				 unsigned int lodCount, const unsigned int* indexCounts, const unsigned int* firstIndices);
+
+	// culls with the compute shader when it's supported and enabled, on the CPU otherwise
+	void setUseCompute(bool useCompute) { m_useCompute = useCompute; }
+	bool isUsingCompute() const { return m_useCompute && isComputeSupported(); }
+
+	// culls and draws every instance, with the program already bound
+	void draw(const View& view);
+
+	// the commands of the last draw in submission order, read back when culled on the GPU.
+	// sorting each range makes the two paths comparable
+	void getCommands(std::vector<Command>& commands) const;
+
+	unsigned int getInstanceCount() const { return (unsigned int)m_instances.size(); }
+	unsigned int getDrawCount() const { return (unsigned int)m_draws.size(); }
+	// visible draws in the last CPU cull, the GPU's count stays on the GPU
+	unsigned int getVisibleCount() const { return m_visibleCount; }
+	// multi-draw calls made by the last draw
+	unsigned int getSubmitCount() const { return (unsigned int)m_groups.size(); }
+
+	// the per draw test shared by both paths, false when culled. otherwise writes the draw's command
+	// for the lod picked by the same rule as Instance::selectLod, without its hysteresis
+	static bool cullDraw(const Instance& instance, const Draw& draw, const View& view, Command& command);
+
+private:
+
+	// the draws sharing an arena and index type, drawn from one range of the command buffer
+	struct Group {
+		GeometryArena*	arena;
+		unsigned int	indexType;
+		unsigned int	firstCommand;
+		unsigned int	commandCount;
+	};
+
+	// sorts the draws in to groups and uploads everything that stays the same between passes
+	void build();
+	void cullOnGPU(const View& view);
+	void cullOnCPU(const View& view);
+
+	static std::unique_ptr<ShaderProgram>	s_program;
+	static bool								s_programBuilt;
+
+	std::vector<Instance>	m_instances;
+	std::vector<Draw>		m_draws;
+	std::vector<std::pair<GeometryArena*, unsigned int>>	m_drawArenas;	// arena and index type of each draw
+	std::vector<Group>		m_groups;
+	std::vector<Command>	m_commands;
+	std::vector<unsigned int>	m_groupFirst;
+	std::vector<unsigned int>	m_groupCounts;
+
+	bool					m_useCompute = true;
+	bool					m_dirty = false;
+	bool					m_lastOnGPU = false;
+	unsigned int			m_visibleCount = 0;
+
+	unsigned int			m_instanceBuffer = 0;
+	unsigned int			m_drawBuffer = 0;
+	unsigned int			m_groupBuffer = 0;
+	unsigned int			m_countBuffer = 0;
+	unsigned int			m_commandBuffer = 0;
+};
+
+} // namespace aie
@@ -0,0 +1,213 @@
+#include "InstanceStore.h"
+#include "Instance.h"
+#include <cassert>
+
+//far beyond any scene, yet small enough that multiplying it by a plane normal stays finite
+const float InstanceStore::UNBOUNDED_EXTENT = 1e30f;
+
+
+//the layers and ids are read by passes, the local bounds are transformed in to world bounds.
+//empty bounds, with min equal to max, leave the instance unbounded
+InstanceHandle InstanceStore::add(Instance* instance, unsigned int layers, unsigned int meshId, unsigned int materialId,
+	const glm::vec3& localMin, const glm::vec3& localMax)
+{
+	//reuse a free slot when there is one, its generation already moved on when it was freed
+	unsigned int slot = m_freeSlot;
+	if (slot != NO_SLOT)
+		m_freeSlot = m_slots[slot].index;
+	else
+	{
+		slot = (unsigned int)m_slots.size();
+		m_slots.push_back({ 0, 0 });
+	}
+
+	unsigned int index = (unsigned int)m_instances.size();
+	m_slots[slot].index = index;
+
+	m_instances.push_back(instance);
+	m_entrySlots.push_back(slot);
+	m_transforms.push_back(instance->getTransform());
+	for (int axis = 0; axis < 3; axis++)
+	{
+		m_boundsCentre[axis].push_back(0);
+		m_boundsExtent[axis].push_back(0);
+	}
+	m_localMin.push_back(localMin);
+	m_localMax.push_back(localMax);
+	m_layers.push_back(layers);
+	m_meshIds.push_back(meshId);
+	m_materialIds.push_back(materialId);
+	updateBounds(index);
+
+	InstanceHandle handle;
+	handle.index = slot;
+	handle.generation = m_slots[slot].generation;
+	return handle;
+}
+
+
+//returns the instance for the caller to delete, nullptr if the handle is stale
+Instance* InstanceStore::remove(InstanceHandle handle)
+{
+	if (isAlive(handle) == false)
+		return nullptr;
+
+	unsigned int index = m_slots[handle.index].index;
+	unsigned int last = getCount() - 1;
+	Instance* instance = m_instances[index];
+
+	//the last entry fills the gap
+	if (index != last)
+	{
+		m_instances[index] = m_instances[last];
+		m_entrySlots[index] = m_entrySlots[last];
+		m_transforms[index] = m_transforms[last];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			m_boundsCentre[axis][index] = m_boundsCentre[axis][last];
+			m_boundsExtent[axis][index] = m_boundsExtent[axis][last];
+		}
+		m_localMin[index] = m_localMin[last];
+		m_localMax[index] = m_localMax[last];
+		m_layers[index] = m_layers[last];
+		m_meshIds[index] = m_meshIds[last];
+		m_materialIds[index] = m_materialIds[last];
+		m_slots[m_entrySlots[index]].index = index;
+	}
+
+	m_instances.pop_back();
+	m_entrySlots.pop_back();
+	m_transforms.pop_back();
+	for (int axis = 0; axis < 3; axis++)
+	{
+		m_boundsCentre[axis].pop_back();
+		m_boundsExtent[axis].pop_back();
+	}
+	m_localMin.pop_back();
+	m_localMax.pop_back();
+	m_layers.pop_back();
+	m_meshIds.pop_back();
+	m_materialIds.pop_back();
+
+	//the new generation makes every outstanding handle to the slot stale
+	m_slots[handle.index].generation++;
+	m_slots[handle.index].index = m_freeSlot;
+	m_freeSlot = handle.index;
+
+	return instance;
+}
+
+
+bool InstanceStore::isAlive(InstanceHandle handle) const
+{
+	if (handle.index >= m_slots.size() || m_slots[handle.index].generation != handle.generation)
+		return false;
+
+	//free slots keep their generation until reused, so check the slot is still pointed back at
+	unsigned int index = m_slots[handle.index].index;
+	return index < m_entrySlots.size() && m_entrySlots[index] == handle.index;
+}
+
+
+//nullptr if the handle is stale
+Instance* InstanceStore::get(InstanceHandle handle) const
+{
+	return isAlive(handle) ? m_instances[m_slots[handle.index].index] : nullptr;
+}
+
+
+InstanceHandle InstanceStore::getHandle(unsigned int index) const
+{
+	assert(index < getCount());
+
+	InstanceHandle handle;
+	handle.index = m_entrySlots[index];
+	handle.generation = m_slots[handle.index].generation;
+	return handle;
+}
+
+
+//moves the instance, updating its world bounds
+void InstanceStore::setTransform(InstanceHandle handle, const glm::mat4& transform)
+{
+	assert(isAlive(handle));
+
+	unsigned int index = m_slots[handle.index].index;
+	m_transforms[index] = transform;
+	updateBounds(index);
+}
+
+
+//replaces the object space bounds, for meshes that finished loading after the instance was added
+void InstanceStore::setLocalBounds(unsigned int index, const glm::vec3& localMin, const glm::vec3& localMax)
+{
+	m_localMin[index] = localMin;
+	m_localMax[index] = localMax;
+	updateBounds(index);
+}
+
+
+glm::vec3 InstanceStore::getBoundsMin(unsigned int index) const
+{
+	return glm::vec3(m_boundsCentre[0][index] - m_boundsExtent[0][index], m_boundsCentre[1][index] - m_boundsExtent[1][index],
+		m_boundsCentre[2][index] - m_boundsExtent[2][index]);
+}
+
+
+glm::vec3 InstanceStore::getBoundsMax(unsigned int index) const
+{
+	return glm::vec3(m_boundsCentre[0][index] + m_boundsExtent[0][index], m_boundsCentre[1][index] + m_boundsExtent[1][index],
+		m_boundsCentre[2][index] + m_boundsExtent[2][index]);
+}
+
+
+//writes an entry's world bounds from its transform and local bounds
+void InstanceStore::updateBounds(unsigned int index)
+{
+	glm::vec3 centre, extent;
+	if (isBounded(index))
+		transformBounds(m_transforms[index], m_localMin[index], m_localMax[index], centre, extent);
+	else
+	{
+		centre = glm::vec3(m_transforms[index][3]);
+		extent = glm::vec3(UNBOUNDED_EXTENT);
+	}
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		m_boundsCentre[axis][index] = centre[axis];
+		m_boundsExtent[axis][index] = extent[axis];
+	}
+}
+
+
+void InstanceStore::reserve(unsigned int count)
+{
+	m_slots.reserve(count);
+	m_instances.reserve(count);
+	m_entrySlots.reserve(count);
+	m_transforms.reserve(count);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		m_boundsCentre[axis].reserve(count);
+		m_boundsExtent[axis].reserve(count);
+	}
+	m_localMin.reserve(count);
+	m_localMax.reserve(count);
+	m_layers.reserve(count);
+	m_meshIds.reserve(count);
+	m_materialIds.reserve(count);
+}
+
+
+//the world centre and half extent of local bounds under a transform
+void InstanceStore::transformBounds(const glm::mat4& transform, const glm::vec3& localMin, const glm::vec3& localMax,
+	glm::vec3& centre, glm::vec3& extent)
+{
+	//the centre moves with the transform, the extent grows by the absolute value of each axis
+	glm::vec3 localExtent = (localMax - localMin) * 0.5f;
+	centre = glm::vec3(transform * glm::vec4((localMin + localMax) * 0.5f, 1));
+	extent = glm::abs(glm::vec3(transform[0])) * localExtent.x +
+		glm::abs(glm::vec3(transform[1])) * localExtent.y +
+		glm::abs(glm::vec3(transform[2])) * localExtent.z;
+}
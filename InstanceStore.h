@@ -0,0 +1,99 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+class Instance;
+
+//refers to an instance in a store until it is removed. the slot may be reused afterwards, but with
+//a new generation, so a stale handle is never mistaken for the instance that took its place
+struct InstanceHandle
+{
+	unsigned int index = ~0u;
+	unsigned int generation = 0;
+
+	bool operator==(const InstanceHandle& other) const { return index == other.index && generation == other.generation; }
+	bool operator!=(const InstanceHandle& other) const { return !(*this == other); }
+};
+
+//the scene's instances with the data every pass reads kept in parallel arrays, packed so the first
+//getCount() entries of each are live. adding appends, removing moves the last entry in to the gap,
+//so both are constant time and a pass walks the arrays from start to end
+class InstanceStore
+{
+public:
+
+	//the layers and ids are read by passes, the local bounds are transformed in to world bounds.
+	//empty bounds, with min equal to max, leave the instance unbounded
+	InstanceHandle add(Instance* instance, unsigned int layers, unsigned int meshId, unsigned int materialId,
+		const glm::vec3& localMin, const glm::vec3& localMax);
+	//returns the instance for the caller to delete, nullptr if the handle is stale
+	Instance* remove(InstanceHandle handle);
+
+	bool isAlive(InstanceHandle handle) const;
+	//nullptr if the handle is stale
+	Instance* get(InstanceHandle handle) const;
+	//position of a live instance in the arrays, which changes as others are removed
+	unsigned int getIndex(InstanceHandle handle) const { return m_slots[handle.index].index; }
+	InstanceHandle getHandle(unsigned int index) const;
+
+	//moves the instance, updating its world bounds
+	void setTransform(InstanceHandle handle, const glm::mat4& transform);
+	//replaces the object space bounds, for meshes that finished loading after the instance was added.
+	//empty bounds, with min equal to max, leave the instance unbounded
+	void setLocalBounds(unsigned int index, const glm::vec3& localMin, const glm::vec3& localMax);
+
+	void setMaterialId(unsigned int index, unsigned int materialId) { m_materialIds[index] = materialId; }
+
+	unsigned int getCount() const { return (unsigned int)m_instances.size(); }
+	void reserve(unsigned int count);
+
+	Instance* const* getInstances() const { return m_instances.data(); }
+	const glm::mat4* getTransforms() const { return m_transforms.data(); }
+	//world bounds as centres and half extents, one array per axis so four can be loaded at once.
+	//unbounded instances have an extent of UNBOUNDED_EXTENT, so no plane ever excludes them
+	const float* getBoundsCentre(int axis) const { return m_boundsCentre[axis].data(); }
+	const float* getBoundsExtent(int axis) const { return m_boundsExtent[axis].data(); }
+	glm::vec3 getBoundsMin(unsigned int index) const;
+	glm::vec3 getBoundsMax(unsigned int index) const;
+	bool isBounded(unsigned int index) const { return m_localMin[index] != m_localMax[index]; }
+	const glm::vec3* getLocalBoundsMin() const { return m_localMin.data(); }
+	const glm::vec3* getLocalBoundsMax() const { return m_localMax.data(); }
+	const unsigned int* getLayers() const { return m_layers.data(); }
+	const unsigned int* getMeshIds() const { return m_meshIds.data(); }
+	const unsigned int* getMaterialIds() const { return m_materialIds.data(); }
+
+	static const float UNBOUNDED_EXTENT;
+
+	//the world centre and half extent of local bounds under a transform
+	static void transformBounds(const glm::mat4& transform, const glm::vec3& localMin, const glm::vec3& localMax,
+		glm::vec3& centre, glm::vec3& extent);
+
+private:
+
+	//a live slot holds the instance's index in the arrays, a free one the next free slot
+	struct Slot
+	{
+		unsigned int index;
+		unsigned int generation;
+	};
+
+	static const unsigned int NO_SLOT = ~0u;
+
+	std::vector<Slot> m_slots;
+	unsigned int m_freeSlot = NO_SLOT;
+
+	//writes an entry's world bounds from its transform and local bounds
+	void updateBounds(unsigned int index);
+
+	//parallel arrays, with the slot of each entry so moves can update it
+	std::vector<Instance*> m_instances;
+	std::vector<unsigned int> m_entrySlots;
+	std::vector<glm::mat4> m_transforms;
+	std::vector<float> m_boundsCentre[3];
+	std::vector<float> m_boundsExtent[3];
+	std::vector<glm::vec3> m_localMin;
+	std::vector<glm::vec3> m_localMax;
+	std::vector<unsigned int> m_layers;
+	std::vector<unsigned int> m_meshIds;
+	std::vector<unsigned int> m_materialIds;
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+
+namespace aie {
+
+// read-only memory mapping of an entire file
+class MappedFile {
+public:
+
+	MappedFile() : m_data(nullptr), m_size(0) {}
+	~MappedFile() { close(); }
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// maps the whole file, fails on missing or empty files
+	bool open(const char* filename);
+	void close();
+
+	bool isOpen() const { return m_data != nullptr; }
+
+	const unsigned char* getData() const { return m_data; }
+	size_t getSize() const { return m_size; }
+
+private:
+
+	const unsigned char*	m_data;
+	size_t					m_size;
+};
+
+} // namespace aie
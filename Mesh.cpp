@@ -1,140 +1,173 @@
 #include "Mesh.h"
+#include <cstddef>
+#include <cstdio>
 #include <vector>
 #include <gl_core_4_4.h>
+#include "MeshOptimiser.h"
+#include "VertexPacking.h"
+#include "Parallel.h"
+#include "IndirectDrawList.h"
+#include "InstanceCuller.h"
+#include "GLState.h"
+
+//regions of a dynamic mesh's buffer, so the CPU writes one while the GPU may still read the other two
+static const unsigned int DYNAMIC_REGIONS = 3;
+
+//the Vertex layout, shared by its arena and by dynamic meshes
+static const aie::GeometryArena::Attribute VERTEX_ATTRIBUTES[] = {
+	{ 0, 4, GL_FLOAT, false, offsetof(Mesh::Vertex, position) },
+	{ 1, 4, GL_FLOAT, true, offsetof(Mesh::Vertex, normal) },
+	{ 2, 2, GL_FLOAT, false, offsetof(Mesh::Vertex, texCoord) },
+};
+
+//arenas for each vertex layout, at the same attribute locations so shaders take any of them
+static aie::GeometryArena* getVertexArena()
+{
+	return aie::GeometryArena::getArena(sizeof(Mesh::Vertex), VERTEX_ATTRIBUTES, 3);
+}
+
+static aie::GeometryArena* getPackedVertexArena()
+{
+	static const aie::GeometryArena::Attribute attributes[] = {
+		{ 0, 4, GL_HALF_FLOAT, false, offsetof(Mesh::PackedVertex, position) },
+		{ 1, 4, GL_INT_2_10_10_10_REV, true, offsetof(Mesh::PackedVertex, normal) },
+		{ 2, 2, GL_HALF_FLOAT, false, offsetof(Mesh::PackedVertex, texCoord) },
+	};
+	return aie::GeometryArena::getArena(sizeof(Mesh::PackedVertex), attributes, 3);
+}
+
+//positions and texcoords only, the normal comes from the attribute's current value
+static aie::GeometryArena* getGridVertexArena()
+{
+	static const aie::GeometryArena::Attribute attributes[] = {
+		{ 0, 3, GL_FLOAT, false, offsetof(Mesh::GridVertex, position) },
+		{ 2, 2, GL_FLOAT, false, offsetof(Mesh::GridVertex, texCoord) },
+	};
+	return aie::GeometryArena::getArena(sizeof(Mesh::GridVertex), attributes, 2);
+}
+
+static aie::GeometryArena* getScreenVertexArena()
+{
+	static const aie::GeometryArena::Attribute attributes[] = {
+		{ 0, 2, GL_FLOAT, false, 0 },
+	};
+	return aie::GeometryArena::getArena(sizeof(float) * 2, attributes, 1);
+}
+
 
-//uses openGL delete calls to clear the mesh data
+//returns the mesh's range of its arena, or deletes its dynamic buffer
 Mesh::~Mesh() 
 {
-	glDeleteVertexArrays(1, &vao);
-	glDeleteBuffers(1, &vbo);
-	glDeleteBuffers(1, &ibo);
+	if (arena != nullptr)
+		arena->free(allocation);
+
+	if (dynamic != nullptr)
+	{
+		for (unsigned int r = 0; r < DYNAMIC_REGIONS; r++)
+			glDeleteSync((GLsync)dynamic->fences[r]);
+		glDeleteVertexArrays(1, &dynamic->vao);
+		glDeleteBuffers(1, &dynamic->buffer);
+		delete dynamic;
+	}
 }
 
 
 //create a quad mesh in the middle of world space
-void Mesh::initialiseQuad(const unsigned int width, const unsigned int height) 
+void Mesh::initialiseQuad(const unsigned int width, const unsigned int height, bool dropNormals /* = false */)
 {
 	// check that the mesh is not initialized already 
-	assert(vao == 0);
-
-	// generate buffers 
-	glGenBuffers(1, &vbo);
-	glGenVertexArrays(1, &vao);
+	assert(arena == nullptr);
 
-	// bind vertex array aka a mesh wrapper 
-	glBindVertexArray(vao);
+	//one vertex per grid corner, shared by the up to six triangles around it
+	unsigned int columns = width + 1;
+	unsigned int vertexCount = columns * (height + 1);
+	unsigned int indexCount = 6 * width * height;
 
-	// bind vertex buffer 
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	std::vector<Vertex> vertices(dropNormals ? 0 : vertexCount);
+	std::vector<GridVertex> gridVertices(dropNormals ? vertexCount : 0);
+	std::vector<unsigned short> shortIndices(vertexCount < 65536 ? indexCount : 0);
+	std::vector<unsigned int> indices(vertexCount < 65536 ? 0 : indexCount);
 
-	//create a vector of vertices based on given height and width
-	
-	std::vector<Vertex> vertices(6 * width * height);
+	float xOffset = width / 2.0f;
+	float yOffset = height / 2.0f;
 
-	float xOffset = (width - 1.0f) / 2.0f;
-	float yOffset = (height - 1.0f) / 2.0f;
-
-	//assign position, normal and texture coordinates of all vertices
-	for (int i = 0; i < height; i++)
+	//each row of corners and the row of quads above it are independent of every other row
+	parallelFor(height + 1, [&](unsigned int i)
 	{
-		for (int j = 0; j < width; j++)
+		for (unsigned int j = 0; j < columns; j++)
 		{
-			//find centerpoint of this sub-quad in world space
-			glm::vec4 worldQuadCenter = { j - xOffset, 0, i - yOffset, 1 };
-
-			//set corner offsets
-			glm::vec4 worldTopLeft      = glm::vec4(-0.5f, 0,  0.5f, 0);
-			glm::vec4 worldTopRight     = glm::vec4( 0.5f, 0,  0.5f, 0);
-			glm::vec4 worldBottomLeft   = glm::vec4(-0.5f, 0, -0.5f, 0);
-			glm::vec4 worldBottomRight  = glm::vec4( 0.5f, 0, -0.5f, 0);
-			
-			//if odd indexed quad, split triangles top-right to bottom-left
-			if ((i + j) % 2 == 1)
-			{
-				vertices[6 * (i * width + j) + 0].position = worldQuadCenter + worldTopLeft;
-				vertices[6 * (i * width + j) + 1].position = worldQuadCenter + worldTopRight;
-				vertices[6 * (i * width + j) + 2].position = worldQuadCenter + worldBottomLeft;
+			//texture space runs against the z axis, so the top of each quad is at the lower v
+			glm::vec4 position = { j - xOffset, 0, i - yOffset, 1 };
+			glm::vec2 texCoord = { (float)j / (float)width, (float)(height - i) / (float)height };
 
-				vertices[6 * (i * width + j) + 3].position = worldQuadCenter + worldBottomLeft;
-				vertices[6 * (i * width + j) + 4].position = worldQuadCenter + worldTopRight;
-				vertices[6 * (i * width + j) + 5].position = worldQuadCenter + worldBottomRight;
+			if (dropNormals)
+			{
+				gridVertices[i * columns + j].position = glm::vec3(position);
+				gridVertices[i * columns + j].texCoord = texCoord;
 			}
-			//if even indexed quad, split triangles top-left to bottom-right
 			else
 			{
-				vertices[6 * (i * width + j) + 0].position = worldQuadCenter + worldTopLeft;
-				vertices[6 * (i * width + j) + 1].position = worldQuadCenter + worldTopRight;
-				vertices[6 * (i * width + j) + 2].position = worldQuadCenter + worldBottomRight;
-
-				vertices[6 * (i * width + j) + 3].position = worldQuadCenter + worldBottomRight;
-				vertices[6 * (i * width + j) + 4].position = worldQuadCenter + worldBottomLeft;
-				vertices[6 * (i * width + j) + 5].position = worldQuadCenter + worldTopLeft;
+				vertices[i * columns + j].position = position;
+				vertices[i * columns + j].normal = { 0, 1, 0, 0 };
+				vertices[i * columns + j].texCoord = texCoord;
 			}
+		}
 
-			//add up-facing normals for the vertices
-			vertices[6 * (i * width + j) + 0].normal = { 0, 1, 0, 0 };
-			vertices[6 * (i * width + j) + 1].normal = { 0, 1, 0, 0 };
-			vertices[6 * (i * width + j) + 2].normal = { 0, 1, 0, 0 };
-			vertices[6 * (i * width + j) + 3].normal = { 0, 1, 0, 0 };
-			vertices[6 * (i * width + j) + 4].normal = { 0, 1, 0, 0 };
-			vertices[6 * (i * width + j) + 5].normal = { 0, 1, 0, 0 };
+		if (i == height)
+			return;
 
-			//find top-left point of this quad in texture space
-			glm::vec2 textureQuadCenter = { (float)j / (float)width, (float)i / (float)height };
+		for (unsigned int j = 0; j < width; j++)
+		{
+			unsigned int bottomLeft = i * columns + j;
+			unsigned int bottomRight = bottomLeft + 1;
+			unsigned int topLeft = bottomLeft + columns;
+			unsigned int topRight = topLeft + 1;
 
-			//set corner offsets
-			glm::vec2 textureTopLeft     = glm::vec2(0.0f / width, 0.0f / height);
-			glm::vec2 textureTopRight    = glm::vec2(1.0f / width, 0.0f / height);
-			glm::vec2 textureBottomLeft  = glm::vec2(0.0f / width, 1.0f / height);
-			glm::vec2 textureBottomRight = glm::vec2(1.0f / width, 1.0f / height);
+			unsigned int quad[6];
 
 			//if odd indexed quad, split triangles top-right to bottom-left
-			if (i + j % 2 == 1)
+			if ((i + j) % 2 == 1)
 			{
-				vertices[6 * (i * width + j) + 0].texCoord = textureQuadCenter + textureTopLeft;
-				vertices[6 * (i * width + j) + 1].texCoord = textureQuadCenter + textureTopRight;
-				vertices[6 * (i * width + j) + 2].texCoord = textureQuadCenter + textureBottomLeft;
-
-				vertices[6 * (i * width + j) + 3].texCoord = textureQuadCenter + textureBottomLeft;
-				vertices[6 * (i * width + j) + 4].texCoord = textureQuadCenter + textureTopRight;
-				vertices[6 * (i * width + j) + 5].texCoord = textureQuadCenter + textureBottomRight;
+				quad[0] = topLeft;    quad[1] = topRight; quad[2] = bottomLeft;
+				quad[3] = bottomLeft; quad[4] = topRight; quad[5] = bottomRight;
 			}
 			//if even indexed quad, split triangles top-left to bottom-right
 			else
 			{
-				vertices[6 * (i * width + j) + 0].texCoord = textureQuadCenter + textureTopLeft;
-				vertices[6 * (i * width + j) + 1].texCoord = textureQuadCenter + textureTopRight;
-				vertices[6 * (i * width + j) + 2].texCoord = textureQuadCenter + textureBottomRight;
+				quad[0] = topLeft;     quad[1] = topRight;   quad[2] = bottomRight;
+				quad[3] = bottomRight; quad[4] = bottomLeft; quad[5] = topLeft;
+			}
 
-				vertices[6 * (i * width + j) + 3].texCoord = textureQuadCenter + textureBottomRight;
-				vertices[6 * (i * width + j) + 4].texCoord = textureQuadCenter + textureBottomLeft;
-				vertices[6 * (i * width + j) + 5].texCoord = textureQuadCenter + textureTopLeft;
+			unsigned int first = 6 * (i * width + j);
+			for (unsigned int k = 0; k < 6; k++)
+			{
+				if (shortIndices.empty())
+					indices[first + k] = quad[k];
+				else
+					shortIndices[first + k] = (unsigned short)quad[k];
 			}
 		}
-	}
-
-	// fill vertex buffer 
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex),
-		vertices.data(), GL_STATIC_DRAW);
+	});
 
-	// enable first element as position 
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE,
-		sizeof(Vertex), 0);
+	// copy in to the arena 
+	const void* indexData = shortIndices.empty() ? (const void*)indices.data() : (const void*)shortIndices.data();
+	unsigned int indexSize = shortIndices.empty() ? sizeof(unsigned int) : sizeof(unsigned short);
+	indexType = shortIndices.empty() ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
 
-	// enable second element as normal 
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 4, GL_FLOAT, GL_TRUE,
-		sizeof(Vertex), (void*)16);
-
-	// enable third element as texture 
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE,
-		sizeof(Vertex), (void*)32);
+	if (dropNormals)
+	{
+		arena = getGridVertexArena();
+		allocation = arena->allocate(gridVertices.data(), vertexCount, indexData, indexCount, indexSize);
+	}
+	else
+	{
+		arena = getVertexArena();
+		allocation = arena->allocate(vertices.data(), vertexCount, indexData, indexCount, indexSize);
+	}
 
-	// unbind buffers 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	constantNormal = dropNormals;
+	boundsMin = glm::vec3(-xOffset, 0, -yOffset);
+	boundsMax = glm::vec3(xOffset, 0, yOffset);
 
 	// quad has 2 triangles 
 	triCount = 2 * height * width;
@@ -143,17 +176,7 @@ void Mesh::initialiseQuad(const unsigned int width, const unsigned int height)
 
 //create a full-screen quad mesh
 void Mesh::initialiseFullscreenQuad() {
-	assert(vao == 0);
-
-	// generate buffers 
-	glGenBuffers(1, &vbo);
-	glGenVertexArrays(1, &vao);
-
-	// bind vertex array aka a mesh wrapper 
-	glBindVertexArray(vao);
-
-	// bind vertex buffer 
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	assert(arena == nullptr);
 
 	// define vertices 
 	float vertices[] = {
@@ -165,17 +188,9 @@ void Mesh::initialiseFullscreenQuad() {
 	 1, 1 // right top 
 	};
 
-	// fill vertex buffer 
-	glBufferData(GL_ARRAY_BUFFER, 12 * sizeof(float), vertices,
-		GL_STATIC_DRAW);
-
-	// enable first element as position 
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 8, 0);
-
-	// unbind buffers 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	// copy in to the arena 
+	arena = getScreenVertexArena();
+	allocation = arena->allocate(vertices, 6, nullptr, 0, 0);
 
 	// quad has 2 triangles 
 	triCount = 2;
@@ -183,68 +198,257 @@ void Mesh::initialiseFullscreenQuad() {
 
 
 //set the vertex data of the quad using the given vertices, optional use of indices instead
-void Mesh::initialise(unsigned int vertexCount,	const Vertex* vertices,	unsigned int indexCount /* = 0 */, unsigned int* indices /* = nullptr*/) 
+void Mesh::initialise(unsigned int vertexCount,	const Vertex* vertices,	unsigned int indexCount /* = 0 */, unsigned int* indices /* = nullptr*/,
+	bool packVertices /* = false */) 
 {
-	assert(vao == 0);
+	assert(arena == nullptr);
 
-	// generate buffers 
-	glGenBuffers(1, &vbo);
-	glGenVertexArrays(1, &vao);
+	//indexed meshes are reordered for the post-transform cache and vertex fetch before upload
+	std::vector<Vertex> optimisedVertices;
+	std::vector<unsigned int> optimisedIndices;
+	if (indexCount != 0)
+	{
+		optimisedVertices.assign(vertices, vertices + vertexCount);
+		optimisedIndices.assign(indices, indices + indexCount);
 
-	// bind vertex array aka a mesh wrapper 
-	glBindVertexArray(vao);
+		aie::MeshOptimiser::optimiseVertexCache(optimisedIndices.data(), indexCount, vertexCount);
+		aie::MeshOptimiser::optimiseOverdraw(optimisedIndices.data(), indexCount, (const float*)optimisedVertices.data(),
+			vertexCount, sizeof(Vertex) / sizeof(float), 1.05f);
+		vertexCount = aie::MeshOptimiser::optimiseVertexFetch(optimisedVertices, optimisedIndices);
 
-	// bind vertex buffer 
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		vertices = optimisedVertices.data();
+		indices = optimisedIndices.data();
+	}
 
-	// fill vertex buffer 
-	glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof(Vertex),
-		vertices, GL_STATIC_DRAW);
+	//16 bit indices whenever every index fits 
+	std::vector<unsigned short> shortIndices;
+	const void* indexData = indices;
+	unsigned int indexSize = sizeof(unsigned int);
+	indexType = 0;
+	if (indexCount != 0)
+	{
+		if (vertexCount < 65536)
+		{
+			shortIndices.assign(indices, indices + indexCount);
+			indexData = shortIndices.data();
+			indexSize = sizeof(unsigned short);
+			indexType = GL_UNSIGNED_SHORT;
+		}
+		else
+		{
+			indexType = GL_UNSIGNED_INT;
+		}
+	}
 
-	// enable first element as position 
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE,
-		sizeof(Vertex), 0);
+	if (packVertices)
+	{
+		std::vector<PackedVertex> packed(vertexCount);
+		for (unsigned int i = 0; i < vertexCount; ++i)
+		{
+			packed[i].position[0] = aie::packHalf(vertices[i].position.x);
+			packed[i].position[1] = aie::packHalf(vertices[i].position.y);
+			packed[i].position[2] = aie::packHalf(vertices[i].position.z);
+			packed[i].position[3] = aie::packHalf(1.0f);
+			packed[i].normal = aie::packSnorm1010102(glm::vec4(glm::vec3(vertices[i].normal), 0));
+			packed[i].texCoord[0] = aie::packHalf(vertices[i].texCoord.x);
+			packed[i].texCoord[1] = aie::packHalf(vertices[i].texCoord.y);
+		}
 
-	// enable second element as normal 
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 4, GL_FLOAT, GL_TRUE,
-		sizeof(Vertex), (void*)16);
+		//the vertex fetch expands them back to floats
+		arena = getPackedVertexArena();
+		allocation = arena->allocate(packed.data(), vertexCount, indexData, indexCount, indexSize);
+	}
+	else
+	{
+		arena = getVertexArena();
+		allocation = arena->allocate(vertices, vertexCount, indexData, indexCount, indexSize);
+	}
 
-	// bind indices if there are any 
-	if (indexCount != 0) 
+	if (indexCount != 0)
+		triCount = indexCount / 3;
+	else
+		triCount = vertexCount / 3;
+
+	boundsMin = boundsMax = vertexCount != 0 ? glm::vec3(vertices[0].position) : glm::vec3(0);
+	for (unsigned int i = 1; i < vertexCount; ++i)
 	{
-		glGenBuffers(1, &ibo);
+		boundsMin = glm::min(boundsMin, glm::vec3(vertices[i].position));
+		boundsMax = glm::max(boundsMax, glm::vec3(vertices[i].position));
+	}
+}
 
-		// bind vertex buffer 
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
 
-		// fill vertex buffer 
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-			indexCount * sizeof(unsigned int), indices, GL_STATIC_DRAW);
+void Mesh::draw() 
+{
+	if (dynamic != nullptr)
+	{
+		drawDynamic();
+		return;
+	}
 
-		triCount = indexCount / 3;
+	arena->bind();
+
+	//meshes without a normal stream are all facing up
+	if (constantNormal)
+		glVertexAttrib4f(1, 0, 1, 0, 0);
+
+	// using indices or just vertices? 
+	if (indexType != 0)
+		glDrawElementsBaseVertex(GL_TRIANGLES, 3 * triCount,
+			indexType, (void*)(size_t)allocation.indexOffset, allocation.baseVertex);
+	else
+		glDrawArrays(GL_TRIANGLES, allocation.baseVertex, 3 * triCount);
+}
+
+
+//draws count copies of the mesh in one call, each reading its model matrix from the buffer
+void Mesh::drawInstanced(unsigned int transformBuffer, unsigned int firstTransform, unsigned int count)
+{
+	assert(canDrawIndirect());
+
+	arena->bind();
+
+	//meshes without a normal stream are all facing up
+	if (constantNormal)
+		glVertexAttrib4f(1, 0, 1, 0, 0);
+
+	glBindVertexBuffer(aie::GeometryArena::INSTANCE_BINDING, transformBuffer, 0, sizeof(glm::mat4));
+	for (unsigned int c = 0; c < 4; c++)
+		glEnableVertexAttribArray(aie::GeometryArena::INSTANCE_MATRIX_LOCATION + c);
+
+	//the base instance offsets the matrices read, the divisor steps through them
+	glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, 3 * triCount, indexType,
+		(void*)(size_t)allocation.indexOffset, count, allocation.baseVertex, firstTransform);
+
+	for (unsigned int c = 0; c < 4; c++)
+		glDisableVertexAttribArray(aie::GeometryArena::INSTANCE_MATRIX_LOCATION + c);
+}
+
+
+//create a mesh whose vertices, and indices when maxIndices isn't 0, are rewritten between frames
+bool Mesh::initialiseDynamic(unsigned int maxVertices, unsigned int maxIndices /* = 0 */)
+{
+	assert(arena == nullptr && dynamic == nullptr);
+
+	dynamic = new DynamicRing();
+	dynamic->maxVertices = maxVertices;
+	dynamic->maxIndices = maxIndices;
+	//regions start on a whole vertex so each one's vertices are reached with a base vertex
+	unsigned int bytes = maxVertices * sizeof(Vertex) + maxIndices * sizeof(unsigned int);
+	dynamic->regionBytes = (bytes + sizeof(Vertex) - 1) / sizeof(Vertex) * sizeof(Vertex);
+	indexType = 0;
+
+	//mapped once for the life of the mesh. coherent writes reach the GPU without flushing,
+	//and the fences stop the CPU from writing a region the GPU hasn't finished with
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	GLsizeiptr bufferBytes = (GLsizeiptr)dynamic->regionBytes * DYNAMIC_REGIONS;
+
+	glGenBuffers(1, &dynamic->buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, dynamic->buffer);
+	glBufferStorage(GL_COPY_WRITE_BUFFER, bufferBytes, nullptr, flags);
+	dynamic->data = (char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, bufferBytes, flags);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	//out of memory, or a driver without persistent mapping
+	if (dynamic->data == nullptr)
+	{
+		printf("Failed to map a %u byte dynamic mesh buffer\n", (unsigned int)bufferBytes);
+		glDeleteBuffers(1, &dynamic->buffer);
+		delete dynamic;
+		dynamic = nullptr;
+		return false;
 	}
-	else 
+
+	//every region's vertices are reached through the base vertex, so the bindings never change
+	glGenVertexArrays(1, &dynamic->vao);
+	aie::GLState::bindVertexArray(dynamic->vao);
+	aie::GeometryArena::formatAttributes(VERTEX_ATTRIBUTES, 3, 0);
+	glBindVertexBuffer(0, dynamic->buffer, 0, sizeof(Vertex));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, dynamic->buffer);
+	aie::GLState::bindVertexArray(0);
+
+	triCount = 0;
+	return true;
+}
+
+
+//the next region to write, waiting only while the GPU still reads it from three updates ago.
+//indices is set to the region's indices when the mesh has them
+Mesh::Vertex* Mesh::beginUpdate(unsigned int** indices /* = nullptr */)
+{
+	assert(dynamic != nullptr);
+
+	//everything drawn from the current region has been submitted by now
+	glDeleteSync((GLsync)dynamic->fences[dynamic->region]);
+	dynamic->fences[dynamic->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	dynamic->writeRegion = (dynamic->region + 1) % DYNAMIC_REGIONS;
+	GLsync fence = (GLsync)dynamic->fences[dynamic->writeRegion];
+	if (fence != nullptr)
 	{
-		triCount = vertexCount / 3;
+		GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (result == GL_TIMEOUT_EXPIRED)
+		{
+			dynamic->stallCount++;
+			while (result == GL_TIMEOUT_EXPIRED)
+				result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		}
+		glDeleteSync(fence);
+		dynamic->fences[dynamic->writeRegion] = nullptr;
 	}
 
-	// unbind buffers 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	char* region = dynamic->data + (size_t)dynamic->writeRegion * dynamic->regionBytes;
+	if (indices != nullptr)
+		*indices = dynamic->maxIndices != 0 ? (unsigned int*)(region + dynamic->maxVertices * sizeof(Vertex)) : nullptr;
+	return (Vertex*)region;
 }
 
 
-void Mesh::draw() 
+//draws from the written region from now on. indexCount 0 draws the vertices as a triangle list
+void Mesh::endUpdate(unsigned int vertexCount, unsigned int indexCount /* = 0 */)
 {
-	glBindVertexArray(vao);
+	assert(dynamic != nullptr && vertexCount <= dynamic->maxVertices && indexCount <= dynamic->maxIndices);
 
-	// using indices or just vertices? 
-	if (ibo != 0)
-		glDrawElements(GL_TRIANGLES, 3 * triCount,
-			GL_UNSIGNED_INT, 0);
+	dynamic->region = dynamic->writeRegion;
+	indexType = indexCount != 0 ? GL_UNSIGNED_INT : 0;
+	triCount = indexCount != 0 ? indexCount / 3 : vertexCount / 3;
+}
+
+
+void Mesh::drawDynamic()
+{
+	if (triCount == 0)
+		return;
+
+	aie::GLState::bindVertexArray(dynamic->vao);
+
+	size_t regionOffset = (size_t)dynamic->region * dynamic->regionBytes;
+	unsigned int baseVertex = (unsigned int)(regionOffset / sizeof(Vertex));
+	if (indexType != 0)
+		glDrawElementsBaseVertex(GL_TRIANGLES, 3 * triCount, GL_UNSIGNED_INT,
+			(void*)(regionOffset + dynamic->maxVertices * sizeof(Vertex)), baseVertex);
 	else
-		glDrawArrays(GL_TRIANGLES, 0, 3 * triCount);
-}
\ No newline at end of file
+		glDrawArrays(GL_TRIANGLES, baseVertex, 3 * triCount);
+}
+
+
+//adds the mesh to a pass drawn with the list's transform
+void Mesh::addIndirect(aie::IndirectDrawList& list, unsigned int transform)
+{
+	assert(isIndexed());
+
+	unsigned int indexSize = indexType == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned int);
+	list.add(arena, indexType, 3 * triCount, allocation.indexOffset / indexSize, allocation.baseVertex, transform);
+}
+
+
+//adds the mesh as the only draw of a culler's instance
+void Mesh::addCullDraws(aie::InstanceCuller& culler, unsigned int instance)
+{
+	assert(isIndexed());
+
+	unsigned int indexSize = indexType == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned int);
+	unsigned int indexCount = 3 * triCount;
+	unsigned int firstIndex = allocation.indexOffset / indexSize;
+	culler.addDraw(instance, arena, indexType, allocation.baseVertex, 1, &indexCount, &firstIndex);
+}
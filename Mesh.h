@@ -1,12 +1,19 @@
 #pragma once
 #include <glm/glm.hpp>
+#include "GeometryArena.h"
+
+namespace aie
+{
+	class IndirectDrawList;
+	class InstanceCuller;
+}
 
 class Mesh
 {
 public:
 
-	Mesh() : triCount(0), vao(0), vbo(0), ibo(0) {}
-	virtual ~Mesh(); //uses openGL delete calls to clear the mesh data
+	Mesh() : triCount(0), arena(nullptr), allocation(), indexType(0) {}
+	virtual ~Mesh(); //returns the mesh's range of its arena, or deletes its dynamic buffer
 
 	struct Vertex {
 		glm::vec4 position;
@@ -14,19 +21,89 @@ public:
 		glm::vec2 texCoord;
 	};
 
-	//create a quad mesh in the middle of world space
-	void initialiseQuad(const unsigned int width, const unsigned int height);
+	//16 byte vertex, half float position and texcoord and a 10:10:10:2 snorm normal
+	struct PackedVertex {
+		unsigned short position[4];
+		unsigned int normal;
+		unsigned short texCoord[2];
+	};
+
+	//vertex of a quad mesh without its normal stream
+	struct GridVertex {
+		glm::vec3 position;
+		glm::vec2 texCoord;
+	};
+
+	//create an indexed quad mesh in the middle of world space, one vertex per grid corner.
+	//dropNormals leaves out the normal stream, as every normal is up, and draws supply it instead
+	void initialiseQuad(const unsigned int width, const unsigned int height, bool dropNormals = false);
 	//create a full-screen quad mesh
 	void initialiseFullscreenQuad();
 
-	//set the vertex data of the quad using the given vertices, optional use of indices instead
-	void initialise(unsigned int vertexCount, const Vertex* vertices, unsigned int indexCount = 0, unsigned int* indices = nullptr);
+	//set the vertex data of the quad using the given vertices, optional use of indices instead.
+	//indices are stored as 16 bit when they fit and packVertices uploads PackedVertex instead of Vertex
+	void initialise(unsigned int vertexCount, const Vertex* vertices, unsigned int indexCount = 0, unsigned int* indices = nullptr,
+		bool packVertices = false);
+
+	//create a mesh whose vertices, and indices when maxIndices isn't 0, are rewritten between frames.
+	//its buffer stays mapped and holds three regions, so writing one never waits on draws from the others.
+	//returns false, leaving the mesh empty, when the buffer can't be mapped
+	bool initialiseDynamic(unsigned int maxVertices, unsigned int maxIndices = 0);
+	//the next region to write, waiting only while the GPU still reads it from three updates ago.
+	//indices is set to the region's indices when the mesh has them
+	Vertex* beginUpdate(unsigned int** indices = nullptr);
+	//draws from the written region from now on. indexCount 0 draws the vertices as a triangle list
+	void endUpdate(unsigned int vertexCount, unsigned int indexCount = 0);
+	bool isDynamic() const { return dynamic != nullptr; }
+	//times beginUpdate had to wait for the GPU, which means more regions are needed
+	unsigned int getStallCount() const { return dynamic != nullptr ? dynamic->stallCount : 0; }
 
 	virtual void draw();
+	//draws count copies of the mesh in one call, each reading its model matrix at
+	//GeometryArena::INSTANCE_MATRIX_LOCATION from a buffer of mat4s starting at firstTransform.
+	//only meshes that canDrawIndirect can be drawn this way
+	void drawInstanced(unsigned int transformBuffer, unsigned int firstTransform, unsigned int count);
+	bool isIndexed() const { return indexType != 0; }
+	//only indexed meshes that draw their whole index range can be drawn indirectly,
+	//and a dynamic mesh's range moves every update
+	virtual bool canDrawIndirect() const { return isIndexed() && dynamic == nullptr; }
+	//adds the mesh to a pass drawn with the list's transform
+	void addIndirect(aie::IndirectDrawList& list, unsigned int transform);
+	//adds the mesh as the only draw of a culler's instance
+	void addCullDraws(aie::InstanceCuller& culler, unsigned int instance);
+
+	//object space bounds of the vertices, zero for the fullscreen quad
+	const glm::vec3& getBoundsMin() const { return boundsMin; }
+	const glm::vec3& getBoundsMax() const { return boundsMax; }
 
 protected:
 
+	//a persistently mapped buffer split into regions, each holding vertices then 32 bit indices
+	struct DynamicRing {
+		unsigned int vao = 0;
+		unsigned int buffer = 0;
+		char* data = nullptr;
+		unsigned int maxVertices = 0;
+		unsigned int maxIndices = 0;
+		unsigned int regionBytes = 0;
+		//the region drawn from and the one handed out by beginUpdate
+		unsigned int region = 0;
+		unsigned int writeRegion = 0;
+		//GLsync of the draws from each region, so gl headers stay out of here
+		void* fences[3] = { nullptr, nullptr, nullptr };
+		unsigned int stallCount = 0;
+	};
+
+	void drawDynamic();
+
 	unsigned int triCount;
-	unsigned int vao, vbo, ibo;
+	//vertices and indices live in the arena shared by every mesh with the same vertex layout
+	aie::GeometryArena* arena;
+	aie::GeometryArena::Allocation allocation;
+	unsigned int indexType;
+	bool constantNormal = false;
+	glm::vec3 boundsMin = glm::vec3(0);
+	glm::vec3 boundsMax = glm::vec3(0);
+	DynamicRing* dynamic = nullptr;
 };
 
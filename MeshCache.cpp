@@ -0,0 +1,280 @@
+#include "MeshCache.h"
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <sys/stat.h>
+
+namespace aie {
+
+// file layout:
+//	FileHeader
+//	MaterialRecord[materialCount]
+//	ChunkRecord[chunkCount]
+//	string table (null terminated strings)
+//	per chunk vertex, index and meshlet blocks, each aligned to BLOCK_ALIGNMENT
+struct FileHeader {
+	char				magic[4];
+	unsigned int		version;
+	unsigned int		vertexSize;
+	unsigned int		options;
+	unsigned long long	sourceSize;
+	unsigned long long	sourceTime;
+	unsigned int		materialCount;
+	unsigned int		chunkCount;
+	unsigned int		stringTableSize;
+	unsigned int		padding;
+};
+
+static const char MAGIC[4] = { 'O', 'B', 'J', 'C' };
+static const unsigned long long BLOCK_ALIGNMENT = 16;
+
+static unsigned long long alignBlock(unsigned long long offset) {
+	return (offset + BLOCK_ALIGNMENT - 1) & ~(BLOCK_ALIGNMENT - 1);
+}
+
+std::string MeshCache::getCacheFilename(const char* filename, unsigned int options) {
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%08x.meshcache", options);
+	return std::string(filename) + suffix;
+}
+
+bool MeshCache::getSourceStamp(const char* filename, unsigned int options, SourceStamp& stamp) {
+#ifdef _WIN32
+	struct _stat64 info;
+	if (_stat64(filename, &info) != 0)
+		return false;
+#else
+	struct stat info;
+	if (stat(filename, &info) != 0)
+		return false;
+#endif
+
+	stamp.size = (unsigned long long)info.st_size;
+	stamp.modifiedTime = (unsigned long long)info.st_mtime;
+	stamp.options = options;
+	return true;
+}
+
+bool MeshCache::open(const char* cacheFile, const SourceStamp& stamp, unsigned int vertexSize) {
+	close();
+
+	if (m_file.open(cacheFile) == false)
+		return false;
+
+	const unsigned char* data = m_file.getData();
+	unsigned long long size = m_file.getSize();
+
+	// reject stale caches and ones written by a different version
+	const FileHeader* header = (const FileHeader*)data;
+	if (size < sizeof(FileHeader) ||
+		memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+		header->version != VERSION ||
+		header->vertexSize != vertexSize ||
+		header->options != stamp.options ||
+		header->sourceSize != stamp.size ||
+		header->sourceTime != stamp.modifiedTime) {
+		close();
+		return false;
+	}
+
+	// make sure every table and block lies inside the file before trusting it
+	unsigned long long offset = sizeof(FileHeader);
+	unsigned long long materialOffset = offset;
+	offset += (unsigned long long)header->materialCount * sizeof(MaterialRecord);
+	unsigned long long chunkOffset = offset;
+	offset += (unsigned long long)header->chunkCount * sizeof(ChunkRecord);
+	unsigned long long stringOffset = offset;
+	offset += header->stringTableSize;
+
+	if (offset > size ||
+		header->stringTableSize == 0 ||
+		data[stringOffset + header->stringTableSize - 1] != 0) {
+		close();
+		return false;
+	}
+
+	const MaterialRecord* materials = (const MaterialRecord*)(data + materialOffset);
+	for (unsigned int i = 0; i < header->materialCount; ++i) {
+		for (auto name : materials[i].textureNames) {
+			if (name >= header->stringTableSize) {
+				close();
+				return false;
+			}
+		}
+	}
+
+	const ChunkRecord* chunks = (const ChunkRecord*)(data + chunkOffset);
+	for (unsigned int i = 0; i < header->chunkCount; ++i) {
+		const ChunkRecord& c = chunks[i];
+		unsigned long long lodIndexTotal = 0;
+		unsigned long long lodMeshletTotal = 0;
+		for (unsigned int l = 0; l < c.lodCount && l < MAX_LODS; ++l) {
+			lodIndexTotal += c.lodIndexCounts[l];
+			lodMeshletTotal += c.lodMeshletCounts[l];
+		}
+
+		if (c.materialID >= (int)header->materialCount ||
+			(c.indexSize != 2 && c.indexSize != 4) ||
+			c.lodCount == 0 || c.lodCount > MAX_LODS || lodIndexTotal != c.indexCount ||
+			(c.meshletCount != 0 && lodMeshletTotal != c.meshletCount) ||
+			c.vertexOffset + (unsigned long long)c.vertexCount * vertexSize > size ||
+			c.indexOffset + (unsigned long long)c.indexCount * c.indexSize > size ||
+			c.meshletOffset + (unsigned long long)c.meshletCount * sizeof(MeshletRecord) > size) {
+			close();
+			return false;
+		}
+
+		// every meshlet has to stay inside its own lod's index list
+		const MeshletRecord* meshlets = (const MeshletRecord*)(data + c.meshletOffset);
+		unsigned long long lodFirstIndex = 0;
+		unsigned int meshlet = 0;
+		for (unsigned int l = 0; l < c.lodCount && c.meshletCount != 0; ++l) {
+			unsigned long long lodEnd = lodFirstIndex + c.lodIndexCounts[l];
+			for (unsigned int m = 0; m < c.lodMeshletCounts[l]; ++m, ++meshlet) {
+				const MeshletRecord& r = meshlets[meshlet];
+				if (r.firstIndex < lodFirstIndex || (unsigned long long)r.firstIndex + r.indexCount > lodEnd) {
+					close();
+					return false;
+				}
+			}
+			lodFirstIndex = lodEnd;
+		}
+	}
+
+	m_materials = materials;
+	m_chunks = chunks;
+	m_strings = (const char*)(data + stringOffset);
+	m_materialCount = header->materialCount;
+	m_chunkCount = header->chunkCount;
+	return true;
+}
+
+void MeshCache::close() {
+	m_file.close();
+	m_materials = nullptr;
+	m_chunks = nullptr;
+	m_strings = nullptr;
+	m_materialCount = 0;
+	m_chunkCount = 0;
+}
+
+unsigned int MeshCacheWriter::addString(const std::string& value) {
+	if (value.empty())
+		return 0;
+
+	unsigned int offset = (unsigned int)m_strings.size();
+	m_strings.insert(m_strings.end(), value.begin(), value.end());
+	m_strings.push_back(0);
+	return offset;
+}
+
+void MeshCacheWriter::addChunk(int materialID, const float boundsMin[3], const float boundsMax[3],
+							   const void* vertices, unsigned int vertexCount,
+							   const void* indices, unsigned int indexCount, unsigned int indexSize,
+							   unsigned int lodCount, const unsigned int* lodIndexCounts, const float* lodErrors,
+							   const MeshCache::MeshletRecord* meshlets, unsigned int meshletCount, const unsigned int* lodMeshletCounts) {
+	MeshCache::ChunkRecord chunk = {};
+	chunk.materialID = materialID;
+	chunk.vertexCount = vertexCount;
+	chunk.indexCount = indexCount;
+	chunk.indexSize = indexSize;
+	chunk.lodCount = lodCount;
+	memcpy(chunk.lodIndexCounts, lodIndexCounts, lodCount * sizeof(unsigned int));
+	memcpy(chunk.lodErrors, lodErrors, lodCount * sizeof(float));
+	chunk.meshletCount = meshletCount;
+	if (meshletCount != 0)
+		memcpy(chunk.lodMeshletCounts, lodMeshletCounts, lodCount * sizeof(unsigned int));
+	memcpy(chunk.boundsMin, boundsMin, sizeof(chunk.boundsMin));
+	memcpy(chunk.boundsMax, boundsMax, sizeof(chunk.boundsMax));
+	m_chunks.push_back(chunk);
+
+	ChunkSource source = { vertices, indices, meshlets };
+	m_chunkSources.push_back(source);
+}
+
+bool MeshCacheWriter::write(const char* cacheFile, const MeshCache::SourceStamp& stamp, unsigned int vertexSize) const {
+
+	FileHeader header = {};
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = MeshCache::VERSION;
+	header.vertexSize = vertexSize;
+	header.options = stamp.options;
+	header.sourceSize = stamp.size;
+	header.sourceTime = stamp.modifiedTime;
+	header.materialCount = (unsigned int)m_materials.size();
+	header.chunkCount = (unsigned int)m_chunks.size();
+	header.stringTableSize = (unsigned int)m_strings.size();
+
+	// lay out the data blocks after the tables
+	std::vector<MeshCache::ChunkRecord> chunks = m_chunks;
+	unsigned long long offset = sizeof(FileHeader) +
+		m_materials.size() * sizeof(MeshCache::MaterialRecord) +
+		chunks.size() * sizeof(MeshCache::ChunkRecord) +
+		m_strings.size();
+
+	for (auto& c : chunks) {
+		c.vertexOffset = offset = alignBlock(offset);
+		offset += (unsigned long long)c.vertexCount * vertexSize;
+		c.indexOffset = offset = alignBlock(offset);
+		offset += (unsigned long long)c.indexCount * c.indexSize;
+		c.meshletOffset = offset = alignBlock(offset);
+		offset += (unsigned long long)c.meshletCount * sizeof(MeshCache::MeshletRecord);
+	}
+
+	// per thread, as meshes sharing a source but not load options can be prepared at the same time
+	std::string tempFile = std::string(cacheFile) + "." +
+						   std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+
+	FILE* file = nullptr;
+#ifdef _WIN32
+	fopen_s(&file, tempFile.c_str(), "wb");
+#else
+	file = fopen(tempFile.c_str(), "wb");
+#endif
+	if (file == nullptr)
+		return false;
+
+	bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+	if (m_materials.empty() == false)
+		success &= fwrite(m_materials.data(), sizeof(MeshCache::MaterialRecord), m_materials.size(), file) == m_materials.size();
+	if (chunks.empty() == false)
+		success &= fwrite(chunks.data(), sizeof(MeshCache::ChunkRecord), chunks.size(), file) == chunks.size();
+	success &= fwrite(m_strings.data(), 1, m_strings.size(), file) == m_strings.size();
+
+	static const char zeros[BLOCK_ALIGNMENT] = {};
+	offset = sizeof(FileHeader) +
+		m_materials.size() * sizeof(MeshCache::MaterialRecord) +
+		chunks.size() * sizeof(MeshCache::ChunkRecord) +
+		m_strings.size();
+
+	for (size_t i = 0; i < chunks.size() && success; ++i) {
+		const MeshCache::ChunkRecord& c = chunks[i];
+
+		success &= fwrite(zeros, 1, (size_t)(c.vertexOffset - offset), file) == c.vertexOffset - offset;
+		success &= fwrite(m_chunkSources[i].vertices, vertexSize, c.vertexCount, file) == c.vertexCount;
+		offset = c.vertexOffset + (unsigned long long)c.vertexCount * vertexSize;
+
+		success &= fwrite(zeros, 1, (size_t)(c.indexOffset - offset), file) == c.indexOffset - offset;
+		success &= fwrite(m_chunkSources[i].indices, c.indexSize, c.indexCount, file) == c.indexCount;
+		offset = c.indexOffset + (unsigned long long)c.indexCount * c.indexSize;
+
+		success &= fwrite(zeros, 1, (size_t)(c.meshletOffset - offset), file) == c.meshletOffset - offset;
+		if (c.meshletCount != 0)
+			success &= fwrite(m_chunkSources[i].meshlets, sizeof(MeshCache::MeshletRecord), c.meshletCount, file) == c.meshletCount;
+		offset = c.meshletOffset + (unsigned long long)c.meshletCount * sizeof(MeshCache::MeshletRecord);
+	}
+
+	success &= fclose(file) == 0;
+
+	if (success == false) {
+		remove(tempFile.c_str());
+		return false;
+	}
+
+	// replace any stale cache with the new one
+	remove(cacheFile);
+	return rename(tempFile.c_str(), cacheFile) == 0;
+}
+
+} // namespace aie
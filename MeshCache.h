@@ -0,0 +1,130 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "MappedFile.h"
+#include "MeshOptimiser.h"
+
+namespace aie {
+
+// versioned binary cache of a fully processed OBJMesh, written next to the source obj.
+// the cache is memory mapped and its vertex and index blocks are handed straight to GL,
+// so nothing is parsed or rebuilt when the source file has not changed
+class MeshCache {
+public:
+
+	// bump whenever the file layout, or the processing that produces the cached data, changes
+	static const unsigned int VERSION = 6;
+
+	// levels of detail a chunk can store, level 0 is the full mesh
+	static const unsigned int MAX_LODS = 4;
+
+	// culling cluster, firstIndex counts from the start of the chunk's index block
+	typedef MeshOptimiser::Meshlet MeshletRecord;
+
+	// identifies the source file and the load options a cache was built with
+	struct SourceStamp {
+		unsigned long long	size;
+		unsigned long long	modifiedTime;
+		unsigned int		options;
+	};
+
+	struct MaterialRecord {
+		float			ambient[3];
+		float			diffuse[3];
+		float			specular[3];
+		float			emissive[3];
+		float			specularPower;
+		float			opacity;
+		unsigned int	textureNames[7];	// offsets in to the string table, same order as the material slots
+	};
+
+	struct ChunkRecord {
+		int					materialID;
+		unsigned int		vertexCount;
+		unsigned int		indexCount;
+		float				boundsMin[3];
+		float				boundsMax[3];
+		unsigned int		indexSize;		// 2 or 4 bytes
+		unsigned int		lodCount;
+		unsigned int		lodIndexCounts[MAX_LODS];	// lod index lists follow each other, summing to indexCount
+		float				lodErrors[MAX_LODS];		// object space error of each lod
+		unsigned int		meshletCount;
+		unsigned int		lodMeshletCounts[MAX_LODS];	// each lod's meshlets follow the last's, 0 when not built
+		unsigned long long	vertexOffset;	// offsets from the start of the file
+		unsigned long long	indexOffset;
+		unsigned long long	meshletOffset;
+	};
+
+	MeshCache() : m_materials(nullptr), m_chunks(nullptr), m_strings(nullptr),
+		m_materialCount(0), m_chunkCount(0) {}
+	~MeshCache() {}
+
+	// returns the cache filename used for a source file loaded with the given options hash,
+	// so loads of one file with different options each keep their own cache
+	static std::string getCacheFilename(const char* filename, unsigned int options);
+
+	// fills in the size and modified time of the source file, fails if it doesn't exist
+	static bool getSourceStamp(const char* filename, unsigned int options, SourceStamp& stamp);
+
+	// maps a cache file, fails if it is missing, stale, from another version or corrupt
+	bool open(const char* cacheFile, const SourceStamp& stamp, unsigned int vertexSize);
+	void close();
+
+	unsigned int getMaterialCount() const { return m_materialCount; }
+	const MaterialRecord& getMaterial(unsigned int index) const { return m_materials[index]; }
+
+	unsigned int getChunkCount() const { return m_chunkCount; }
+	const ChunkRecord& getChunk(unsigned int index) const { return m_chunks[index]; }
+
+	const char* getString(unsigned int offset) const { return m_strings + offset; }
+	const void* getVertices(const ChunkRecord& chunk) const { return m_file.getData() + chunk.vertexOffset; }
+	const void* getIndices(const ChunkRecord& chunk) const { return m_file.getData() + chunk.indexOffset; }
+	const MeshletRecord* getMeshlets(const ChunkRecord& chunk) const { return (const MeshletRecord*)(m_file.getData() + chunk.meshletOffset); }
+
+private:
+
+	MappedFile				m_file;
+	const MaterialRecord*	m_materials;
+	const ChunkRecord*		m_chunks;
+	const char*				m_strings;
+	unsigned int			m_materialCount;
+	unsigned int			m_chunkCount;
+};
+
+// gathers processed mesh data and writes it out as a MeshCache file.
+// chunk data is referenced, not copied, so it must outlive the call to write
+class MeshCacheWriter {
+public:
+
+	MeshCacheWriter() { m_strings.push_back(0); }
+	~MeshCacheWriter() {}
+
+	// returns the string table offset for the string, empty strings share offset 0
+	unsigned int addString(const std::string& value);
+
+	void addMaterial(const MeshCache::MaterialRecord& material) { m_materials.push_back(material); }
+	void addChunk(int materialID, const float boundsMin[3], const float boundsMax[3],
+				  const void* vertices, unsigned int vertexCount,
+				  const void* indices, unsigned int indexCount, unsigned int indexSize,
+				  unsigned int lodCount, const unsigned int* lodIndexCounts, const float* lodErrors,
+				  const MeshCache::MeshletRecord* meshlets, unsigned int meshletCount, const unsigned int* lodMeshletCounts);
+
+	// writes via a temporary file so that a partially written cache is never picked up
+	bool write(const char* cacheFile, const MeshCache::SourceStamp& stamp, unsigned int vertexSize) const;
+
+private:
+
+	struct ChunkSource {
+		const void*						vertices;
+		const void*						indices;
+		const MeshCache::MeshletRecord*	meshlets;
+	};
+
+	std::vector<char>						m_strings;
+	std::vector<MeshCache::MaterialRecord>	m_materials;
+	std::vector<MeshCache::ChunkRecord>		m_chunks;
+	std::vector<ChunkSource>				m_chunkSources;
+};
+
+} // namespace aie
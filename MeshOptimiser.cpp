@@ -0,0 +1,812 @@
+#include "MeshOptimiser.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace aie {
+
+static unsigned int hashKey(const int* key, unsigned int count) {
+	unsigned int h = 2166136261u;
+	for (unsigned int i = 0; i < count; ++i) {
+		h ^= (unsigned int)key[i];
+		h *= 16777619u;
+	}
+	return h ^ (h >> 15);
+}
+
+unsigned int MeshOptimiser::weldVertices(float* vertices, unsigned int vertexCount, unsigned int vertexFloats, unsigned int keyFloats,
+										 unsigned int* indices, unsigned int indexCount, float epsilon) {
+
+	if (vertexCount == 0)
+		return 0;
+
+	// build an integer key per vertex, either the snapped grid cell or the exact bits
+	std::vector<int> keys((size_t)vertexCount * keyFloats);
+	float inverseEpsilon = epsilon > 0 ? 1.0f / epsilon : 0;
+
+	for (unsigned int v = 0; v < vertexCount; ++v) {
+		const float* vertex = vertices + (size_t)v * vertexFloats;
+		int* key = &keys[(size_t)v * keyFloats];
+
+		for (unsigned int i = 0; i < keyFloats; ++i) {
+			if (epsilon > 0)
+				key[i] = (int)std::floor(vertex[i] * inverseEpsilon + 0.5f);
+			else {
+				// treat -0 and 0 as the same value
+				float value = vertex[i] == 0 ? 0.0f : vertex[i];
+				memcpy(&key[i], &value, sizeof(int));
+			}
+		}
+	}
+
+	// open addressing table of unique vertices, sized to stay under half full
+	size_t capacity = 64;
+	while (capacity < (size_t)vertexCount * 2)
+		capacity *= 2;
+
+	const unsigned int EMPTY = ~0u;
+	std::vector<unsigned int> table(capacity, EMPTY);
+	std::vector<unsigned int> remap(vertexCount);
+
+	unsigned int uniqueCount = 0;
+	size_t mask = capacity - 1;
+	size_t keyBytes = keyFloats * sizeof(int);
+
+	for (unsigned int v = 0; v < vertexCount; ++v) {
+		const int* key = &keys[(size_t)v * keyFloats];
+
+		size_t slot = hashKey(key, keyFloats) & mask;
+		while (table[slot] != EMPTY &&
+			   memcmp(&keys[(size_t)table[slot] * keyFloats], key, keyBytes) != 0)
+			slot = (slot + 1) & mask;
+
+		if (table[slot] == EMPTY) {
+			// first occurrence, move it down to its compacted position
+			table[slot] = v;
+			remap[v] = uniqueCount;
+			if (uniqueCount != v)
+				memcpy(vertices + (size_t)uniqueCount * vertexFloats,
+					   vertices + (size_t)v * vertexFloats, vertexFloats * sizeof(float));
+			++uniqueCount;
+		}
+		else
+			remap[v] = remap[table[slot]];
+	}
+
+	for (unsigned int i = 0; i < indexCount; ++i)
+		indices[i] = remap[indices[i]];
+
+	return uniqueCount;
+}
+
+// fifo cache of vertex timestamps, a vertex is cached if it went in within the last cacheSize misses
+struct FifoCache {
+	std::vector<unsigned int> timestamps;
+	unsigned int time;
+	unsigned int size;
+
+	FifoCache(unsigned int vertexCount, unsigned int cacheSize)
+		: timestamps(vertexCount, 0), time(cacheSize + 1), size(cacheSize) {}
+
+	void reset() { time += size + 1; }
+
+	// returns 1 on a miss
+	unsigned int access(unsigned int v) {
+		if (time - timestamps[v] > size) {
+			timestamps[v] = time++;
+			return 1;
+		}
+		return 0;
+	}
+};
+
+MeshOptimiser::CacheStatistics MeshOptimiser::analyseVertexCache(const unsigned int* indices, unsigned int indexCount, unsigned int vertexCount,
+																 unsigned int cacheSize) {
+
+	CacheStatistics result = { 0, 0 };
+	if (indexCount < 3 || vertexCount == 0)
+		return result;
+
+	FifoCache cache(vertexCount, cacheSize);
+	std::vector<char> referenced(vertexCount, 0);
+
+	unsigned int misses = 0, uniqueCount = 0;
+	for (unsigned int i = 0; i < indexCount; ++i) {
+		misses += cache.access(indices[i]);
+		if (referenced[indices[i]] == 0) {
+			referenced[indices[i]] = 1;
+			++uniqueCount;
+		}
+	}
+
+	result.acmr = (float)misses / (float)(indexCount / 3);
+	result.atvr = (float)misses / (float)uniqueCount;
+	return result;
+}
+
+void MeshOptimiser::optimiseVertexCache(unsigned int* indices, unsigned int indexCount, unsigned int vertexCount,
+										unsigned int cacheSize) {
+
+	unsigned int triangleCount = indexCount / 3;
+	if (triangleCount == 0 || vertexCount == 0)
+		return;
+
+	// vertex to triangle adjacency, also used as the live triangle count per vertex
+	std::vector<unsigned int> liveCount(vertexCount, 0);
+	for (unsigned int i = 0; i < triangleCount * 3; ++i)
+		liveCount[indices[i]]++;
+
+	std::vector<unsigned int> adjacencyOffset(vertexCount + 1, 0);
+	for (unsigned int v = 0; v < vertexCount; ++v)
+		adjacencyOffset[v + 1] = adjacencyOffset[v] + liveCount[v];
+
+	std::vector<unsigned int> adjacency(triangleCount * 3);
+	{
+		std::vector<unsigned int> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+		for (unsigned int i = 0; i < triangleCount * 3; ++i)
+			adjacency[fill[indices[i]]++] = i / 3;
+	}
+
+	std::vector<unsigned int> source(indices, indices + triangleCount * 3);
+	std::vector<char> emitted(triangleCount, 0);
+	std::vector<unsigned int> timestamps(vertexCount, 0);
+	std::vector<unsigned int> deadEnd;
+	std::vector<unsigned int> candidates;
+	deadEnd.reserve(triangleCount * 3);
+
+	unsigned int time = cacheSize + 1;
+	unsigned int cursor = 0;
+	unsigned int output = 0;
+	int fanning = 0;
+
+	while (fanning >= 0) {
+
+		// emit every remaining triangle around the fanning vertex
+		candidates.clear();
+		for (unsigned int a = adjacencyOffset[fanning]; a < adjacencyOffset[fanning + 1]; ++a) {
+			unsigned int triangle = adjacency[a];
+			if (emitted[triangle])
+				continue;
+
+			for (unsigned int k = 0; k < 3; ++k) {
+				unsigned int v = source[triangle * 3 + k];
+				indices[output++] = v;
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				liveCount[v]--;
+				if (time - timestamps[v] > cacheSize)
+					timestamps[v] = time++;
+			}
+			emitted[triangle] = 1;
+		}
+
+		// pick the candidate that will still be in the cache once its remaining triangles are
+		// emitted, preferring the oldest, otherwise fall back to the dead end stack
+		int next = -1;
+		int best = -1;
+		for (unsigned int v : candidates) {
+			if (liveCount[v] == 0)
+				continue;
+			int priority = 0;
+			if (time - timestamps[v] + 2 * liveCount[v] <= cacheSize)
+				priority = (int)(time - timestamps[v]);
+			if (priority > best) {
+				best = priority;
+				next = (int)v;
+			}
+		}
+
+		if (next == -1) {
+			while (deadEnd.empty() == false) {
+				unsigned int v = deadEnd.back();
+				deadEnd.pop_back();
+				if (liveCount[v] > 0) {
+					next = (int)v;
+					break;
+				}
+			}
+		}
+
+		if (next == -1) {
+			while (cursor < vertexCount && liveCount[cursor] == 0)
+				++cursor;
+			if (cursor < vertexCount)
+				next = (int)cursor;
+		}
+
+		fanning = next;
+	}
+}
+
+void MeshOptimiser::optimiseOverdraw(unsigned int* indices, unsigned int indexCount,
+									 const float* vertices, unsigned int vertexCount, unsigned int vertexFloats,
+									 float threshold, unsigned int cacheSize) {
+
+	unsigned int triangleCount = indexCount / 3;
+	if (triangleCount == 0 || vertexCount == 0)
+		return;
+
+	// hard boundaries, where a triangle misses on all three vertices the cache has gone cold
+	// and the triangles either side can be moved independently for free
+	std::vector<unsigned int> clusters;
+	FifoCache cache(vertexCount, cacheSize);
+	for (unsigned int t = 0; t < triangleCount; ++t) {
+		unsigned int misses = cache.access(indices[t * 3 + 0]) +
+							  cache.access(indices[t * 3 + 1]) +
+							  cache.access(indices[t * 3 + 2]);
+		if (misses == 3)
+			clusters.push_back(t);
+	}
+	if (clusters.empty() || clusters[0] != 0)
+		clusters.insert(clusters.begin(), 0);
+	clusters.push_back(triangleCount);
+
+	// soft boundaries, split a hard cluster as soon as the running acmr is within threshold of the cluster's own
+	std::vector<unsigned int> split;
+	for (size_t c = 0; c + 1 < clusters.size(); ++c) {
+		unsigned int start = clusters[c], end = clusters[c + 1];
+
+		cache.reset();
+		unsigned int clusterMisses = 0;
+		for (unsigned int t = start; t < end; ++t)
+			for (unsigned int k = 0; k < 3; ++k)
+				clusterMisses += cache.access(indices[t * 3 + k]);
+		float clusterThreshold = threshold * (float)clusterMisses / (float)(end - start);
+
+		split.push_back(start);
+		cache.reset();
+		unsigned int misses = 0, runStart = start;
+		for (unsigned int t = start; t < end; ++t) {
+			for (unsigned int k = 0; k < 3; ++k)
+				misses += cache.access(indices[t * 3 + k]);
+
+			if (t + 1 < end && (float)misses / (float)(t + 1 - runStart) <= clusterThreshold) {
+				split.push_back(t + 1);
+				cache.reset();
+				misses = 0;
+				runStart = t + 1;
+			}
+		}
+	}
+	split.push_back(triangleCount);
+	unsigned int clusterCount = (unsigned int)split.size() - 1;
+
+	// area weighted centroid and normal of each cluster and of the whole mesh
+	std::vector<float> clusterData(clusterCount * 7, 0.0f);
+	float meshCentroid[3] = { 0, 0, 0 };
+	float meshArea = 0;
+
+	for (unsigned int c = 0; c < clusterCount; ++c) {
+		float* data = &clusterData[c * 7];
+		for (unsigned int t = split[c]; t < split[c + 1]; ++t) {
+			const float* p0 = vertices + (size_t)indices[t * 3 + 0] * vertexFloats;
+			const float* p1 = vertices + (size_t)indices[t * 3 + 1] * vertexFloats;
+			const float* p2 = vertices + (size_t)indices[t * 3 + 2] * vertexFloats;
+
+			float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+			float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+			float n[3] = { e1[1] * e2[2] - e1[2] * e2[1],
+						   e1[2] * e2[0] - e1[0] * e2[2],
+						   e1[0] * e2[1] - e1[1] * e2[0] };
+			float area = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+			for (unsigned int k = 0; k < 3; ++k) {
+				float centre = (p0[k] + p1[k] + p2[k]) / 3.0f;
+				data[k] += centre * area;
+				data[3 + k] += n[k];
+			}
+			data[6] += area;
+		}
+
+		for (unsigned int k = 0; k < 3; ++k)
+			meshCentroid[k] += data[k];
+		meshArea += data[6];
+	}
+
+	if (meshArea > 0)
+		for (unsigned int k = 0; k < 3; ++k)
+			meshCentroid[k] /= meshArea;
+
+	// clusters facing away from the centre are likely to occlude the rest, so draw them first
+	std::vector<float> sortKeys(clusterCount);
+	for (unsigned int c = 0; c < clusterCount; ++c) {
+		const float* data = &clusterData[c * 7];
+		float area = data[6] > 0 ? data[6] : 1.0f;
+		float length = std::sqrt(data[3] * data[3] + data[4] * data[4] + data[5] * data[5]);
+		float inverseLength = length > 0 ? 1.0f / length : 0.0f;
+
+		float key = 0;
+		for (unsigned int k = 0; k < 3; ++k)
+			key += (data[k] / area - meshCentroid[k]) * data[3 + k] * inverseLength;
+		sortKeys[c] = key;
+	}
+
+	std::vector<unsigned int> order(clusterCount);
+	for (unsigned int c = 0; c < clusterCount; ++c)
+		order[c] = c;
+	std::stable_sort(order.begin(), order.end(), [&sortKeys](unsigned int a, unsigned int b) {
+		return sortKeys[a] > sortKeys[b];
+	});
+
+	std::vector<unsigned int> source(indices, indices + triangleCount * 3);
+	unsigned int output = 0;
+	for (unsigned int c : order) {
+		unsigned int begin = split[c] * 3;
+		unsigned int end = split[c + 1] * 3;
+		memcpy(indices + output, source.data() + begin, (end - begin) * sizeof(unsigned int));
+		output += end - begin;
+	}
+}
+
+// symmetric 4x4 quadric stored as its 10 unique terms, accumulated area weighted
+struct Quadric {
+	double a00, a11, a22, a01, a02, a12;
+	double b0, b1, b2;
+	double c;
+	double weight;
+};
+
+static void addPlaneQuadric(Quadric& q, const float* p0, const float* p1, const float* p2) {
+	double e1[3] = { (double)p1[0] - p0[0], (double)p1[1] - p0[1], (double)p1[2] - p0[2] };
+	double e2[3] = { (double)p2[0] - p0[0], (double)p2[1] - p0[1], (double)p2[2] - p0[2] };
+	double n[3] = { e1[1] * e2[2] - e1[2] * e2[1],
+					e1[2] * e2[0] - e1[0] * e2[2],
+					e1[0] * e2[1] - e1[1] * e2[0] };
+
+	double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+	if (length == 0)
+		return;
+
+	double area = length * 0.5;
+	n[0] /= length;
+	n[1] /= length;
+	n[2] /= length;
+	double d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+
+	q.a00 += area * n[0] * n[0];
+	q.a11 += area * n[1] * n[1];
+	q.a22 += area * n[2] * n[2];
+	q.a01 += area * n[0] * n[1];
+	q.a02 += area * n[0] * n[2];
+	q.a12 += area * n[1] * n[2];
+	q.b0 += area * n[0] * d;
+	q.b1 += area * n[1] * d;
+	q.b2 += area * n[2] * d;
+	q.c += area * d * d;
+	q.weight += area;
+}
+
+static void addQuadric(Quadric& q, const Quadric& other) {
+	q.a00 += other.a00;
+	q.a11 += other.a11;
+	q.a22 += other.a22;
+	q.a01 += other.a01;
+	q.a02 += other.a02;
+	q.a12 += other.a12;
+	q.b0 += other.b0;
+	q.b1 += other.b1;
+	q.b2 += other.b2;
+	q.c += other.c;
+	q.weight += other.weight;
+}
+
+// area weighted mean squared distance from p to the quadric's planes
+static float evaluateQuadric(const Quadric& q, const float* p) {
+	double x = p[0], y = p[1], z = p[2];
+	double r = q.a00 * x * x + q.a11 * y * y + q.a22 * z * z +
+			   2 * (q.a01 * x * y + q.a02 * x * z + q.a12 * y * z) +
+			   2 * (q.b0 * x + q.b1 * y + q.b2 * z) + q.c;
+	if (r <= 0 || q.weight <= 0)
+		return 0;
+	return (float)(r / q.weight);
+}
+
+// open addressing set of directed edges
+class EdgeSet {
+public:
+
+	explicit EdgeSet(size_t count) {
+		size_t capacity = 64;
+		while (capacity < count * 2)
+			capacity *= 2;
+		m_keys.assign(capacity, (unsigned long long)EMPTY);
+		m_mask = capacity - 1;
+	}
+
+	void insert(unsigned int a, unsigned int b) {
+		unsigned long long key = makeKey(a, b);
+		size_t slot = hash(key) & m_mask;
+		while (m_keys[slot] != EMPTY && m_keys[slot] != key)
+			slot = (slot + 1) & m_mask;
+		m_keys[slot] = key;
+	}
+
+	bool contains(unsigned int a, unsigned int b) const {
+		unsigned long long key = makeKey(a, b);
+		size_t slot = hash(key) & m_mask;
+		while (m_keys[slot] != EMPTY) {
+			if (m_keys[slot] == key)
+				return true;
+			slot = (slot + 1) & m_mask;
+		}
+		return false;
+	}
+
+private:
+
+	static const unsigned long long EMPTY = ~0ull;
+
+	static unsigned long long makeKey(unsigned int a, unsigned int b) { return ((unsigned long long)a << 32) | b; }
+	static size_t hash(unsigned long long key) {
+		key ^= key >> 29;
+		key *= 0xbf58476d1ce4e5b9ull;
+		return (size_t)(key ^ (key >> 32));
+	}
+
+	std::vector<unsigned long long>	m_keys;
+	size_t							m_mask;
+};
+
+// true if moving from onto to would turn any of from's triangles over or collapse one to a sliver
+static bool collapseFlipsTriangle(unsigned int from, unsigned int to,
+								  const unsigned int* indices, const unsigned int* adjacency, unsigned int adjacencyCount,
+								  const unsigned int* remap, const float* vertices, unsigned int vertexFloats) {
+
+	const float* target = vertices + (size_t)to * vertexFloats;
+
+	for (unsigned int a = 0; a < adjacencyCount; ++a) {
+		const unsigned int* triangle = indices + adjacency[a] * 3;
+		unsigned int v[3] = { remap[triangle[0]], remap[triangle[1]], remap[triangle[2]] };
+
+		// triangles along the collapsed edge disappear, and ones already collapsed this pass don't matter
+		if (v[0] == to || v[1] == to || v[2] == to ||
+			v[0] == v[1] || v[1] == v[2] || v[0] == v[2])
+			continue;
+
+		const float* p[3];
+		const float* q[3];
+		for (unsigned int k = 0; k < 3; ++k) {
+			p[k] = vertices + (size_t)v[k] * vertexFloats;
+			q[k] = v[k] == from ? target : p[k];
+		}
+
+		float e1[3], e2[3], f1[3], f2[3];
+		for (unsigned int k = 0; k < 3; ++k) {
+			e1[k] = p[1][k] - p[0][k];
+			e2[k] = p[2][k] - p[0][k];
+			f1[k] = q[1][k] - q[0][k];
+			f2[k] = q[2][k] - q[0][k];
+		}
+
+		float n0[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+		float n1[3] = { f1[1] * f2[2] - f1[2] * f2[1], f1[2] * f2[0] - f1[0] * f2[2], f1[0] * f2[1] - f1[1] * f2[0] };
+
+		// also reject collapses that squash a triangle to a sliver, which would otherwise slip past on rounding
+		float d = n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2];
+		if (d <= 0.01f * (n0[0] * n0[0] + n0[1] * n0[1] + n0[2] * n0[2]))
+			return true;
+	}
+
+	return false;
+}
+
+unsigned int MeshOptimiser::simplify(unsigned int* destination, const unsigned int* indices, unsigned int indexCount,
+									 const float* vertices, unsigned int vertexCount, unsigned int vertexFloats,
+									 unsigned int targetIndexCount, float targetError, float* resultError) {
+
+	indexCount -= indexCount % 3;
+	memcpy(destination, indices, indexCount * sizeof(unsigned int));
+	if (resultError != nullptr)
+		*resultError = 0;
+
+	if (indexCount <= targetIndexCount || vertexCount == 0)
+		return indexCount;
+
+	// map every vertex to the first vertex sharing its position
+	std::vector<unsigned int> positionRemap(vertexCount);
+	std::vector<unsigned int> wedgeCount(vertexCount, 0);
+	{
+		size_t capacity = 64;
+		while (capacity < (size_t)vertexCount * 2)
+			capacity *= 2;
+		const unsigned int EMPTY = ~0u;
+		std::vector<unsigned int> table(capacity, EMPTY);
+		size_t mask = capacity - 1;
+
+		for (unsigned int v = 0; v < vertexCount; ++v) {
+			int key[3];
+			for (unsigned int k = 0; k < 3; ++k) {
+				float value = vertices[(size_t)v * vertexFloats + k];
+				value = value == 0 ? 0.0f : value;
+				memcpy(&key[k], &value, sizeof(int));
+			}
+
+			size_t slot = hashKey(key, 3) & mask;
+			while (table[slot] != EMPTY &&
+				   memcmp(vertices + (size_t)table[slot] * vertexFloats, vertices + (size_t)v * vertexFloats, 3 * sizeof(float)) != 0)
+				slot = (slot + 1) & mask;
+
+			if (table[slot] == EMPTY)
+				table[slot] = v;
+			positionRemap[v] = table[slot];
+			wedgeCount[table[slot]]++;
+		}
+	}
+
+	// lock seams, and borders found as directed edges without a matching opposite edge
+	std::vector<char> locked(vertexCount, 0);
+	{
+		EdgeSet edges(indexCount);
+		for (unsigned int i = 0; i < indexCount; i += 3)
+			for (unsigned int k = 0; k < 3; ++k)
+				edges.insert(positionRemap[indices[i + k]], positionRemap[indices[i + (k + 1) % 3]]);
+
+		for (unsigned int i = 0; i < indexCount; i += 3) {
+			for (unsigned int k = 0; k < 3; ++k) {
+				unsigned int a = positionRemap[indices[i + k]];
+				unsigned int b = positionRemap[indices[i + (k + 1) % 3]];
+				if (edges.contains(b, a) == false)
+					locked[a] = locked[b] = 1;
+			}
+		}
+
+		for (unsigned int v = 0; v < vertexCount; ++v)
+			if (wedgeCount[positionRemap[v]] > 1 || locked[positionRemap[v]])
+				locked[v] = 1;
+	}
+
+	std::vector<Quadric> quadrics(vertexCount);
+	memset(quadrics.data(), 0, quadrics.size() * sizeof(Quadric));
+	for (unsigned int i = 0; i < indexCount; i += 3) {
+		const float* p0 = vertices + (size_t)indices[i + 0] * vertexFloats;
+		const float* p1 = vertices + (size_t)indices[i + 1] * vertexFloats;
+		const float* p2 = vertices + (size_t)indices[i + 2] * vertexFloats;
+
+		Quadric q = {};
+		addPlaneQuadric(q, p0, p1, p2);
+		for (unsigned int k = 0; k < 3; ++k)
+			addQuadric(quadrics[indices[i + k]], q);
+	}
+
+	struct Collapse {
+		unsigned int	from, to;
+		float			cost;
+	};
+
+	std::vector<unsigned int> remap(vertexCount);
+	for (unsigned int v = 0; v < vertexCount; ++v)
+		remap[v] = v;
+
+	std::vector<unsigned int> adjacencyOffset(vertexCount + 1);
+	std::vector<unsigned int> adjacency;
+	std::vector<Collapse> collapses;
+	std::vector<char> touched(vertexCount);
+
+	float maxErrorSquared = targetError * targetError;
+	float errorSquared = 0;
+
+	unsigned int resultCount = indexCount;
+	while (resultCount > targetIndexCount) {
+		unsigned int triangleCount = resultCount / 3;
+
+		// vertex to triangle adjacency for the flip checks
+		std::fill(adjacencyOffset.begin(), adjacencyOffset.end(), 0);
+		for (unsigned int i = 0; i < resultCount; ++i)
+			adjacencyOffset[destination[i] + 1]++;
+		for (unsigned int v = 0; v < vertexCount; ++v)
+			adjacencyOffset[v + 1] += adjacencyOffset[v];
+		adjacency.resize(resultCount);
+		{
+			std::vector<unsigned int> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+			for (unsigned int i = 0; i < resultCount; ++i)
+				adjacency[fill[destination[i]]++] = i / 3;
+		}
+
+		// every directed edge is a candidate, an interior edge's opposite direction comes from its other triangle
+		collapses.clear();
+		for (unsigned int i = 0; i < resultCount; i += 3) {
+			for (unsigned int k = 0; k < 3; ++k) {
+				unsigned int from = destination[i + k];
+				unsigned int to = destination[i + (k + 1) % 3];
+				if (locked[from])
+					continue;
+
+				Collapse collapse = { from, to, evaluateQuadric(quadrics[from], vertices + (size_t)to * vertexFloats) };
+				if (collapse.cost <= maxErrorSquared)
+					collapses.push_back(collapse);
+			}
+		}
+
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) {
+			return a.cost < b.cost;
+		});
+
+		// each collapse removes about two triangles, endpoints only move once per pass
+		unsigned int targetTriangles = targetIndexCount / 3;
+		unsigned int collapseGoal = (triangleCount - targetTriangles) / 2 + 1;
+		unsigned int collapseCount = 0;
+		std::fill(touched.begin(), touched.end(), 0);
+
+		for (auto& collapse : collapses) {
+			if (collapseCount >= collapseGoal)
+				break;
+			if (touched[collapse.from] || touched[collapse.to])
+				continue;
+
+			unsigned int begin = adjacencyOffset[collapse.from];
+			if (collapseFlipsTriangle(collapse.from, collapse.to, destination, &adjacency[begin],
+									  adjacencyOffset[collapse.from + 1] - begin, remap.data(), vertices, vertexFloats))
+				continue;
+
+			remap[collapse.from] = collapse.to;
+			addQuadric(quadrics[collapse.to], quadrics[collapse.from]);
+			touched[collapse.from] = touched[collapse.to] = 1;
+			errorSquared = std::max(errorSquared, collapse.cost);
+			++collapseCount;
+		}
+
+		if (collapseCount == 0)
+			break;
+
+		// apply the collapses and drop the triangles that became degenerate
+		unsigned int write = 0;
+		for (unsigned int i = 0; i < resultCount; i += 3) {
+			unsigned int a = remap[destination[i + 0]];
+			unsigned int b = remap[destination[i + 1]];
+			unsigned int c = remap[destination[i + 2]];
+			if (a != b && b != c && a != c) {
+				destination[write + 0] = a;
+				destination[write + 1] = b;
+				destination[write + 2] = c;
+				write += 3;
+			}
+		}
+		resultCount = write;
+	}
+
+	if (resultError != nullptr)
+		*resultError = std::sqrt(errorSquared);
+
+	return resultCount;
+}
+
+unsigned int MeshOptimiser::optimiseVertexFetch(void* vertices, unsigned int vertexCount, unsigned int vertexSize,
+												unsigned int* indices, unsigned int indexCount) {
+
+	const unsigned int UNUSED = ~0u;
+	std::vector<unsigned int> remap(vertexCount, UNUSED);
+
+	unsigned int nextVertex = 0;
+	for (unsigned int i = 0; i < indexCount; ++i) {
+		unsigned int& target = remap[indices[i]];
+		if (target == UNUSED)
+			target = nextVertex++;
+		indices[i] = target;
+	}
+
+	std::vector<char> source((char*)vertices, (char*)vertices + (size_t)vertexCount * vertexSize);
+	for (unsigned int v = 0; v < vertexCount; ++v)
+		if (remap[v] != UNUSED)
+			memcpy((char*)vertices + (size_t)remap[v] * vertexSize, source.data() + (size_t)v * vertexSize, vertexSize);
+
+	return nextVertex;
+}
+
+// unit face normal, false for degenerate triangles
+static bool getFaceNormal(const float* p0, const float* p1, const float* p2, float* normal) {
+	float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+	float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+	normal[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	normal[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	normal[2] = e1[0] * e2[1] - e1[1] * e2[0];
+
+	float length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+	if (length == 0)
+		return false;
+	for (unsigned int k = 0; k < 3; ++k)
+		normal[k] /= length;
+	return true;
+}
+
+static void finishMeshlet(MeshOptimiser::Meshlet& meshlet, const unsigned int* indices,
+						  const float* vertices, unsigned int vertexFloats) {
+	const unsigned int* begin = indices + meshlet.firstIndex;
+	const unsigned int* end = begin + meshlet.indexCount;
+
+	// sphere around the bounding box, close enough to the minimal sphere for culling
+	float boundsMin[3], boundsMax[3];
+	for (unsigned int k = 0; k < 3; ++k)
+		boundsMin[k] = boundsMax[k] = vertices[(size_t)begin[0] * vertexFloats + k];
+	for (const unsigned int* i = begin; i < end; ++i) {
+		const float* p = vertices + (size_t)*i * vertexFloats;
+		for (unsigned int k = 0; k < 3; ++k) {
+			boundsMin[k] = std::min(boundsMin[k], p[k]);
+			boundsMax[k] = std::max(boundsMax[k], p[k]);
+		}
+	}
+
+	float radiusSquared = 0;
+	for (unsigned int k = 0; k < 3; ++k)
+		meshlet.centre[k] = (boundsMin[k] + boundsMax[k]) * 0.5f;
+	for (const unsigned int* i = begin; i < end; ++i) {
+		const float* p = vertices + (size_t)*i * vertexFloats;
+		float d[3] = { p[0] - meshlet.centre[0], p[1] - meshlet.centre[1], p[2] - meshlet.centre[2] };
+		radiusSquared = std::max(radiusSquared, d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+	}
+	meshlet.radius = std::sqrt(radiusSquared);
+
+	// the cone axis is the average normal, its cutoff the widest normal from it
+	float axis[3] = { 0, 0, 0 };
+	float normal[3];
+	for (const unsigned int* i = begin; i < end; i += 3) {
+		if (getFaceNormal(vertices + (size_t)i[0] * vertexFloats, vertices + (size_t)i[1] * vertexFloats,
+						  vertices + (size_t)i[2] * vertexFloats, normal))
+			for (unsigned int k = 0; k < 3; ++k)
+				axis[k] += normal[k];
+	}
+
+	float length = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+	meshlet.coneCutoff = -1;
+	if (length < 1e-6f) {
+		meshlet.coneAxis[0] = meshlet.coneAxis[1] = meshlet.coneAxis[2] = 0;
+		return;
+	}
+
+	float cutoff = 1;
+	for (unsigned int k = 0; k < 3; ++k)
+		meshlet.coneAxis[k] = axis[k] / length;
+	for (const unsigned int* i = begin; i < end; i += 3) {
+		if (getFaceNormal(vertices + (size_t)i[0] * vertexFloats, vertices + (size_t)i[1] * vertexFloats,
+						  vertices + (size_t)i[2] * vertexFloats, normal))
+			cutoff = std::min(cutoff, normal[0] * meshlet.coneAxis[0] + normal[1] * meshlet.coneAxis[1] + normal[2] * meshlet.coneAxis[2]);
+	}
+	meshlet.coneCutoff = cutoff;
+}
+
+unsigned int MeshOptimiser::buildMeshlets(const unsigned int* indices, unsigned int indexCount,
+										  const float* vertices, unsigned int vertexCount, unsigned int vertexFloats,
+										  unsigned int maxTriangles, std::vector<Meshlet>& meshlets) {
+
+	// cosine of the most a new triangle may turn from the meshlet's running normal, about 30 degrees, once it is half full
+	const float SPLIT_COSINE = 0.85f;
+
+	unsigned int triangleCount = indexCount / 3;
+	if (triangleCount == 0 || maxTriangles == 0 || vertexCount == 0)
+		return 0;
+
+	size_t firstMeshlet = meshlets.size();
+	Meshlet meshlet = {};
+	float axis[3] = { 0, 0, 0 };
+
+	for (unsigned int t = 0; t < triangleCount; ++t) {
+		const unsigned int* triangle = indices + t * 3;
+		float normal[3] = { 0, 0, 0 };
+		bool valid = getFaceNormal(vertices + (size_t)triangle[0] * vertexFloats, vertices + (size_t)triangle[1] * vertexFloats,
+								   vertices + (size_t)triangle[2] * vertexFloats, normal);
+
+		unsigned int count = meshlet.indexCount / 3;
+		if (count > 0) {
+			float length = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+			float turn = length > 0 ? (normal[0] * axis[0] + normal[1] * axis[1] + normal[2] * axis[2]) / length : 1.0f;
+
+			if (count >= maxTriangles || (valid && count * 2 >= maxTriangles && turn < SPLIT_COSINE)) {
+				finishMeshlet(meshlet, indices, vertices, vertexFloats);
+				meshlets.push_back(meshlet);
+				meshlet = {};
+				meshlet.firstIndex = t * 3;
+				axis[0] = axis[1] = axis[2] = 0;
+			}
+		}
+
+		meshlet.indexCount += 3;
+		for (unsigned int k = 0; k < 3; ++k)
+			axis[k] += normal[k];
+	}
+
+	finishMeshlet(meshlet, indices, vertices, vertexFloats);
+	meshlets.push_back(meshlet);
+
+	return (unsigned int)(meshlets.size() - firstMeshlet);
+}
+
+} // namespace aie
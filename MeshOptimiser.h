@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vector>
+
+namespace aie {
+
+// load time processing for indexed triangle meshes.
+// vertices are treated as rows of floats so the same code works for every vertex layout
+class MeshOptimiser {
+public:
+
+	// post-transform cache size the reordering and statistics assume
+	static const unsigned int CACHE_SIZE = 16;
+
+	// average cache miss ratio, misses per triangle (0.5 is ideal, 3 is worst)
+	// and average transform to vertex ratio, misses per referenced vertex (1 is ideal)
+	struct CacheStatistics {
+		float acmr;
+		float atvr;
+	};
+
+	// a run of consecutive triangles that is culled as one, with a bounding sphere around its
+	// vertices and a cone holding every triangle normal (cutoff is the cosine of the cone's half
+	// angle, 0 or less when the normals spread too far for the cone to ever cull)
+	struct Meshlet {
+		unsigned int	firstIndex;
+		unsigned int	indexCount;
+		float			centre[3];
+		float			radius;
+		float			coneAxis[3];
+		float			coneCutoff;
+	};
+
+	// merges vertices whose first keyFloats floats match and remaps the indices.
+	// epsilon 0 welds exact matches only, otherwise values are snapped to an epsilon grid first.
+	// vertices are compacted in place, keeping the first of each duplicate, and the new count is returned
+	static unsigned int weldVertices(float* vertices, unsigned int vertexCount, unsigned int vertexFloats, unsigned int keyFloats,
+									 unsigned int* indices, unsigned int indexCount, float epsilon);
+
+	template <typename Vertex>
+	static unsigned int weldVertices(std::vector<Vertex>& vertices, std::vector<unsigned int>& indices, unsigned int keyFloats, float epsilon) {
+		unsigned int count = weldVertices((float*)vertices.data(), (unsigned int)vertices.size(), sizeof(Vertex) / sizeof(float), keyFloats,
+										  indices.data(), (unsigned int)indices.size(), epsilon);
+		vertices.resize(count);
+		return count;
+	}
+
+	// simulates a fifo post-transform cache over the triangle list
+	static CacheStatistics analyseVertexCache(const unsigned int* indices, unsigned int indexCount, unsigned int vertexCount,
+											  unsigned int cacheSize = CACHE_SIZE);
+
+	// reorders triangles for the post-transform cache using Tipsify (Sander, Nehab and Barczak 2007)
+	static void optimiseVertexCache(unsigned int* indices, unsigned int indexCount, unsigned int vertexCount,
+									unsigned int cacheSize = CACHE_SIZE);
+
+	// reorders clusters of an already cache optimised triangle list so outward facing clusters draw first.
+	// clusters are split wherever the cache would not suffer by more than threshold (e.g. 1.05 for 5%).
+	// positions are read as the first three floats of each vertex
+	static void optimiseOverdraw(unsigned int* indices, unsigned int indexCount,
+								 const float* vertices, unsigned int vertexCount, unsigned int vertexFloats,
+								 float threshold, unsigned int cacheSize = CACHE_SIZE);
+
+	// quadric error edge collapse (Garland and Heckbert 1997) that writes a reduced index list
+	// over the same vertices, so every level of detail shares one vertex buffer.
+	// vertices on a seam (a position shared by several vertices) or an open border never move,
+	// collapses that would flip a triangle are rejected, and simplification stops at the target
+	// index count or when the next collapse would move the surface further than targetError.
+	// returns the new index count and the largest error introduced, in position units
+	static unsigned int simplify(unsigned int* destination, const unsigned int* indices, unsigned int indexCount,
+								 const float* vertices, unsigned int vertexCount, unsigned int vertexFloats,
+								 unsigned int targetIndexCount, float targetError, float* resultError = nullptr);
+
+	// reorders vertices in to first use order and drops unreferenced ones, returns the new vertex count
+	static unsigned int optimiseVertexFetch(void* vertices, unsigned int vertexCount, unsigned int vertexSize,
+											unsigned int* indices, unsigned int indexCount);
+
+	// splits a triangle list in to meshlets of up to maxTriangles without reordering it, closing a
+	// meshlet early once it is half full and the next triangle turns away from the ones before.
+	// meshlets are appended with firstIndex relative to indices, the number added is returned.
+	// positions are read as the first three floats of each vertex
+	static unsigned int buildMeshlets(const unsigned int* indices, unsigned int indexCount,
+									  const float* vertices, unsigned int vertexCount, unsigned int vertexFloats,
+									  unsigned int maxTriangles, std::vector<Meshlet>& meshlets);
+
+	template <typename Vertex>
+	static unsigned int optimiseVertexFetch(std::vector<Vertex>& vertices, std::vector<unsigned int>& indices) {
+		unsigned int count = optimiseVertexFetch(vertices.data(), (unsigned int)vertices.size(), sizeof(Vertex),
+												 indices.data(), (unsigned int)indices.size());
+		vertices.resize(count);
+		return count;
+	}
+};
+
+} // namespace aie
@@ -1,43 +1,218 @@
 #include "OBJMesh.h"
 #include "gl_core_4_4.h"
 #include <glm/geometric.hpp>
-
-#define TINYOBJLOADER_IMPLEMENTATION
-#include "tiny_obj_loader.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include "OBJParser.h"
+#include "MeshOptimiser.h"
+#include "VertexPacking.h"
+#include "Parallel.h"
+#include "AssetRegistry.h"
+#include "IndirectDrawList.h"
+#include "InstanceCuller.h"
+#include "Frustum.h"
+#include "Shader.h"
+#include "GLState.h"
+#include <stb_image.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define OBJMESH_SSE2
+#include <xmmintrin.h>
+#endif
 
 namespace aie {
 
-OBJMesh::~OBJMesh() {
-	for (auto& c : m_meshChunks) {
-		glDeleteVertexArrays(1, &c.vao);
-		glDeleteBuffers(1, &c.vbo);
-		glDeleteBuffers(1, &c.ibo);
+// folds every load option that changes the processed data in to the cache key
+unsigned int OBJMesh::getOptionsHash(bool flipTextureV, const ImportSettings& settings) {
+	unsigned int values[12] = { flipTextureV ? 1u : 0u, settings.weldVertices ? 1u : 0u, 0,
+								settings.optimiseVertexOrder ? 1u : 0u, 0, settings.packVertices ? 1u : 0u,
+								settings.lodCount, 0, 0, settings.compressTextures ? 1u : 0u,
+								(unsigned int)settings.textureQuality, settings.meshletTriangles };
+	memcpy(&values[2], &settings.weldEpsilon, sizeof(float));
+	memcpy(&values[4], &settings.overdrawThreshold, sizeof(float));
+	memcpy(&values[7], &settings.lodReduction, sizeof(float));
+	memcpy(&values[8], &settings.lodTargetError, sizeof(float));
+
+	unsigned int hash = 2166136261u;
+	for (auto value : values) {
+		hash ^= value;
+		hash *= 16777619u;
 	}
+	return hash;
+}
+
+OBJMesh::~OBJMesh() {
+	for (auto& c : m_meshChunks)
+		c.arena->free(c.allocation);
+	releasePending();
 }
 
 bool OBJMesh::load(const char* filename, bool loadTextures /* = true */, bool flipTextureV /* = false */) {
+	return prepare(filename, loadTextures, flipTextureV) && upload();
+}
 
-	if (m_meshChunks.empty() == false) {
+bool OBJMesh::prepare(const char* filename, bool loadTextures /* = true */, bool flipTextureV /* = false */) {
+
+	if (m_prepared) {
 		printf("Mesh already initialised, can't re-initialise!\n");
 		return false;
 	}
 
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
-	std::string error = "";
+	auto startTime = std::chrono::high_resolution_clock::now();
 
 	std::string file = filename;
 	std::string folder = file.substr(0, file.find_last_of('/') + 1);
 
-	bool success = tinyobj::LoadObj(shapes, materials, error,
-									filename, folder.c_str());
+	// the cache is only valid for the same source file and load options
+	MeshCache::SourceStamp stamp;
+	if (MeshCache::getSourceStamp(filename, getOptionsHash(flipTextureV, m_importSettings), stamp) == false) {
+		printf("Mesh file %s not found!\n", filename);
+		return false;
+	}
+
+	std::string cacheFile = MeshCache::getCacheFilename(filename, stamp.options);
 
-	if (success == false) {
-		printf("%s\n", error.c_str());
+	bool fromCache = loadCache(cacheFile.c_str(), stamp, folder, loadTextures);
+	if (fromCache == false &&
+		loadOBJ(filename, folder, loadTextures, flipTextureV, cacheFile.c_str(), stamp) == false) {
+		releasePending();
 		return false;
 	}
 
 	m_filename = filename;
+	m_prepared = true;
+
+	std::chrono::duration<float, std::milli> loadTime = std::chrono::high_resolution_clock::now() - startTime;
+	printf("Prepared %s in %.1fms (%s)\n", filename, loadTime.count(), fromCache ? "mesh cache" : "obj");
+
+	return true;
+}
+
+bool OBJMesh::upload() {
+
+	if (m_prepared == false || m_meshChunks.empty() == false) {
+		printf("Mesh must be prepared, and not yet uploaded, before upload!\n");
+		return false;
+	}
+
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	for (auto& t : m_pendingTextures) {
+		static const Texture::Format formats[] = { Texture::RED, Texture::RED, Texture::RG, Texture::RGB, Texture::RGBA };
+		if (t.compressed)
+			t.compressed->upload();
+		else
+			t.texture->create((unsigned int)t.width, (unsigned int)t.height, formats[t.components], t.pixels);
+	}
+
+	m_meshChunks.resize(m_pendingChunks.size());
+	for (size_t i = 0; i < m_pendingChunks.size(); ++i) {
+		const PendingChunk& p = m_pendingChunks[i];
+		const MeshCache::ChunkRecord& c = p.record;
+		MeshChunk& chunk = m_meshChunks[i];
+
+		createChunk(chunk, p.vertices, c.vertexCount, p.indices, c.indexCount, c.indexSize,
+					c.lodCount, c.lodIndexCounts, c.lodErrors, p.meshlets, c.meshletCount, c.lodMeshletCounts);
+
+		chunk.materialID = c.materialID;
+		chunk.boundsMin = glm::vec3(c.boundsMin[0], c.boundsMin[1], c.boundsMin[2]);
+		chunk.boundsMax = glm::vec3(c.boundsMax[0], c.boundsMax[1], c.boundsMax[2]);
+	}
+
+	// combine chunk bounds and lods here, on the GL thread, with the rest of the state draw reads
+	if (m_meshChunks.empty() == false) {
+		m_boundsMin = m_meshChunks[0].boundsMin;
+		m_boundsMax = m_meshChunks[0].boundsMax;
+		for (auto& c : m_meshChunks) {
+			m_boundsMin = glm::min(m_boundsMin, c.boundsMin);
+			m_boundsMax = glm::max(m_boundsMax, c.boundsMax);
+		}
+	}
+
+	// a chunk with fewer lods keeps drawing its coarsest, so that error carries on to the higher levels
+	m_lodCount = 1;
+	for (auto& c : m_meshChunks)
+		m_lodCount = std::max(m_lodCount, c.lodCount);
+	for (unsigned int l = 0; l < m_lodCount; ++l) {
+		m_lodErrors[l] = 0;
+		for (auto& c : m_meshChunks)
+			m_lodErrors[l] = std::max(m_lodErrors[l], c.lodError[std::min(l, c.lodCount - 1)]);
+	}
+
+	releasePending();
+
+	std::chrono::duration<float, std::milli> uploadTime = std::chrono::high_resolution_clock::now() - startTime;
+	printf("Uploaded %s in %.1fms\n", m_filename.c_str(), uploadTime.count());
+
+	return true;
+}
+
+void OBJMesh::releasePending() {
+	for (auto& t : m_pendingTextures) {
+		if (t.pixels)
+			stbi_image_free(t.pixels);
+	}
+	m_pendingTextures.clear();
+	m_pendingChunks.clear();
+	m_pendingCache.close();
+}
+
+bool OBJMesh::loadCache(const char* cacheFile, const MeshCache::SourceStamp& stamp, const std::string& folder, bool loadTextures) {
+
+	MeshCache& cache = m_pendingCache;
+	if (cache.open(cacheFile, stamp, getVertexSize()) == false)
+		return false;
+	// copy materials
+	m_materials.resize(cache.getMaterialCount());
+	for (unsigned int i = 0; i < cache.getMaterialCount(); ++i) {
+		const MeshCache::MaterialRecord& m = cache.getMaterial(i);
+
+		m_materials[i].ambient = glm::vec3(m.ambient[0], m.ambient[1], m.ambient[2]);
+		m_materials[i].diffuse = glm::vec3(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
+		m_materials[i].specular = glm::vec3(m.specular[0], m.specular[1], m.specular[2]);
+		m_materials[i].emissive = glm::vec3(m.emissive[0], m.emissive[1], m.emissive[2]);
+		m_materials[i].specularPower = m.specularPower;
+		m_materials[i].opacity = m.opacity;
+
+		if (loadTextures) {
+			std::string names[7];
+			for (int t = 0; t < 7; ++t)
+				names[t] = cache.getString(m.textureNames[t]);
+			decodeMaterialTextures(m_materials[i], folder, names);
+		}
+	}
+
+	// chunks are uploaded directly from the mapped file, which stays open until then
+	m_pendingChunks.resize(cache.getChunkCount());
+	for (unsigned int i = 0; i < cache.getChunkCount(); ++i) {
+		const MeshCache::ChunkRecord& c = cache.getChunk(i);
+		PendingChunk& chunk = m_pendingChunks[i];
+
+		chunk.record = c;
+		chunk.vertices = cache.getVertices(c);
+		chunk.indices = cache.getIndices(c);
+		chunk.meshlets = cache.getMeshlets(c);
+	}
+
+	return true;
+}
+
+bool OBJMesh::loadOBJ(const char* filename, const std::string& folder, bool loadTextures, bool flipTextureV,
+					  const char* cacheFile, const MeshCache::SourceStamp& stamp) {
+
+	OBJParser parser;
+	if (parser.parse(filename, flipTextureV) == false) {
+		printf("%s\n", parser.getLastError().c_str());
+		return false;
+	}
+
+	std::vector<OBJParser::Material>& materials = parser.getMaterials();
+	std::vector<OBJParser::Shape>& shapes = parser.getShapes();
+
+	MeshCacheWriter cache;
 
 	// copy materials
 	m_materials.resize(materials.size());
@@ -47,131 +222,346 @@ bool OBJMesh::load(const char* filename, bool loadTextures /* = true */, bool fl
 		m_materials[index].ambient = glm::vec3(m.ambient[0], m.ambient[1], m.ambient[2]);
 		m_materials[index].diffuse = glm::vec3(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
 		m_materials[index].specular = glm::vec3(m.specular[0], m.specular[1], m.specular[2]);
-		m_materials[index].emissive = glm::vec3(m.emission[0], m.emission[1], m.emission[2]);
-		m_materials[index].specularPower = m.shininess;
-		m_materials[index].opacity = m.dissolve;
-
-		// textures
-		m_materials[index].alphaTexture.load((folder + m.alpha_texname).c_str());
-		m_materials[index].ambientTexture.load((folder + m.ambient_texname).c_str());
-		m_materials[index].diffuseTexture.load((folder + m.diffuse_texname).c_str());
-		m_materials[index].specularTexture.load((folder + m.specular_texname).c_str());
-		m_materials[index].specularHighlightTexture.load((folder + m.specular_highlight_texname).c_str());
-		m_materials[index].normalTexture.load((folder + m.bump_texname).c_str());
-		m_materials[index].displacementTexture.load((folder + m.displacement_texname).c_str());
+		m_materials[index].emissive = glm::vec3(m.emissive[0], m.emissive[1], m.emissive[2]);
+		m_materials[index].specularPower = m.specularPower;
+		m_materials[index].opacity = m.opacity;
+
+		// textures, in bound slot order
+		if (loadTextures)
+			decodeMaterialTextures(m_materials[index], folder, m.textureNames);
+
+		MeshCache::MaterialRecord record = {};
+		memcpy(record.ambient, m.ambient, sizeof(record.ambient));
+		memcpy(record.diffuse, m.diffuse, sizeof(record.diffuse));
+		memcpy(record.specular, m.specular, sizeof(record.specular));
+		memcpy(record.emissive, m.emissive, sizeof(record.emissive));
+		record.specularPower = m.specularPower;
+		record.opacity = m.opacity;
+		for (int t = 0; t < 7; ++t)
+			record.textureNames[t] = cache.addString(m.textureNames[t]);
+		cache.addMaterial(record);
 
 		++index;
 	}
 
-	// copy shapes
-	m_meshChunks.reserve(shapes.size());
-	for (auto& s : shapes) {
-
-		MeshChunk chunk;
+	// the parser has already built the final vertices, so they're processed in place and then
+	// moved in to the pending chunk, which keeps them alive for the cache write and the upload
+	m_pendingChunks.resize(shapes.size());
+	for (size_t c = 0; c < shapes.size(); ++c) {
+
+		OBJParser::Shape& s = shapes[c];
+		PendingChunk& chunk = m_pendingChunks[c];
+
+		std::vector<Vertex>& vertices = s.vertices;
+
+		// merge duplicates on position, normal and texcoord, tangents are rebuilt below
+		if (m_importSettings.weldVertices) {
+			unsigned int keyFloats = (sizeof(glm::vec4) * 2 + sizeof(glm::vec2)) / sizeof(float);
+#ifdef OBJMESH_VERBOSE
+			unsigned int before = (unsigned int)vertices.size();
+#endif
+			MeshOptimiser::weldVertices(vertices, s.indices, keyFloats, m_importSettings.weldEpsilon);
+#ifdef OBJMESH_VERBOSE
+			printf("%s chunk %u: welded %u vertices to %u\n", filename, (unsigned int)c, before, (unsigned int)vertices.size());
+#endif
+		}
 
-		// generate buffers
-		glGenBuffers(1, &chunk.vbo);
-		glGenBuffers(1, &chunk.ibo);
-		glGenVertexArrays(1, &chunk.vao);
+		// cache friendly triangle order, then outward facing clusters first, then vertices in first use order
+		if (m_importSettings.optimiseVertexOrder) {
+			unsigned int vertexCount = (unsigned int)vertices.size();
+			unsigned int indexCount = (unsigned int)s.indices.size();
+#ifdef OBJMESH_VERBOSE
+			MeshOptimiser::CacheStatistics before = MeshOptimiser::analyseVertexCache(s.indices.data(), indexCount, vertexCount);
+#endif
+
+			MeshOptimiser::optimiseVertexCache(s.indices.data(), indexCount, vertexCount);
+			if (m_importSettings.overdrawThreshold > 0)
+				MeshOptimiser::optimiseOverdraw(s.indices.data(), indexCount, (const float*)vertices.data(), vertexCount,
+												sizeof(Vertex) / sizeof(float), m_importSettings.overdrawThreshold);
+			MeshOptimiser::optimiseVertexFetch(vertices, s.indices);
+
+#ifdef OBJMESH_VERBOSE
+			// analysing costs as much as optimising, so only for tuning the import
+			MeshOptimiser::CacheStatistics after = MeshOptimiser::analyseVertexCache(s.indices.data(), indexCount, (unsigned int)vertices.size());
+			printf("%s chunk %u: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", filename, (unsigned int)c,
+				   before.acmr, after.acmr, before.atvr, after.atvr);
+#endif
+		}
 
-		// bind vertex array aka a mesh wrapper
-		glBindVertexArray(chunk.vao);
+		glm::vec3 boundsMin = vertices.empty() ? glm::vec3(0) : glm::vec3(vertices[0].position);
+		glm::vec3 boundsMax = boundsMin;
+		for (auto& v : vertices) {
+			boundsMin = glm::min(boundsMin, glm::vec3(v.position));
+			boundsMax = glm::max(boundsMax, glm::vec3(v.position));
+		}
 
-		// set the index buffer data
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, chunk.ibo);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-					 s.mesh.indices.size() * sizeof(unsigned int),
-					 s.mesh.indices.data(), GL_STATIC_DRAW);
+#ifdef OBJMESH_BENCHMARK_TANGENTS
+		// the mesh cache skips this, delete it to benchmark again
+		if (s.hasNormals)
+			benchmarkTangents(filename, (unsigned int)c, vertices, s.indices, s.hasTexcoords);
+#endif
 
-		// store index count for rendering
-		chunk.indexCount = (unsigned int)s.mesh.indices.size();
+		// calculate for normal mapping
+		if (s.hasNormals && s.hasTexcoords)
+			calculateTangents(vertices, s.indices);
+
+		unsigned int vertexCount = (unsigned int)vertices.size();
+
+		// coarser index lists over the same vertices are appended after the full one
+		unsigned int lodCount = 1;
+		unsigned int lodIndexCounts[MeshCache::MAX_LODS] = { (unsigned int)s.indices.size() };
+		float lodErrors[MeshCache::MAX_LODS] = {};
+		unsigned int lodLevels = m_importSettings.lodCount < MeshCache::MAX_LODS ? m_importSettings.lodCount : MeshCache::MAX_LODS;
+
+		if (lodLevels > 1 && lodIndexCounts[0] != 0) {
+			float targetError = m_importSettings.lodTargetError * glm::length(boundsMax - boundsMin);
+			std::vector<unsigned int> lodIndices(lodIndexCounts[0]);
+
+			for (; lodCount < lodLevels; ++lodCount) {
+				// always simplify the full mesh so each lod's error is measured against the original surface
+				unsigned int target = (unsigned int)(lodIndexCounts[lodCount - 1] * m_importSettings.lodReduction) / 3 * 3;
+				unsigned int count = MeshOptimiser::simplify(lodIndices.data(), s.indices.data(), lodIndexCounts[0],
+															 (const float*)vertices.data(), vertexCount, sizeof(Vertex) / sizeof(float),
+															 target, targetError, &lodErrors[lodCount]);
+
+				// stop once the error limit keeps the next level from getting meaningfully smaller
+				if (count == 0 || count > lodIndexCounts[lodCount - 1] * 3 / 4)
+					break;
+
+				MeshOptimiser::optimiseVertexCache(lodIndices.data(), count, vertexCount);
+				s.indices.insert(s.indices.end(), lodIndices.begin(), lodIndices.begin() + count);
+				lodIndexCounts[lodCount] = count;
+
+#ifdef OBJMESH_VERBOSE
+				printf("%s chunk %u: lod %u has %u triangles, error %g\n", filename, (unsigned int)c,
+					   lodCount, count / 3, lodErrors[lodCount]);
+#endif
+			}
+		}
 
-		// create vertex data
-		std::vector<Vertex> vertices;
-		vertices.resize(s.mesh.positions.size() / 3);
-		size_t vertCount = vertices.size();
+		// culling clusters over each lod in turn, which the lod lists' triangle order already keeps local
+		unsigned int meshletCount = 0;
+		unsigned int lodMeshletCounts[MeshCache::MAX_LODS] = {};
+		if (m_importSettings.meshletTriangles > 0) {
+			unsigned int firstIndex = 0;
+			for (unsigned int l = 0; l < lodCount; ++l) {
+				size_t firstMeshlet = chunk.meshletStorage.size();
+				lodMeshletCounts[l] = MeshOptimiser::buildMeshlets(s.indices.data() + firstIndex, lodIndexCounts[l],
+																   (const float*)vertices.data(), vertexCount, sizeof(Vertex) / sizeof(float),
+																   m_importSettings.meshletTriangles, chunk.meshletStorage);
+				for (size_t m = firstMeshlet; m < chunk.meshletStorage.size(); ++m)
+					chunk.meshletStorage[m].firstIndex += firstIndex;
+				firstIndex += lodIndexCounts[l];
+			}
+			meshletCount = (unsigned int)chunk.meshletStorage.size();
+#ifdef OBJMESH_VERBOSE
+			printf("%s chunk %u: %u meshlets\n", filename, (unsigned int)c, meshletCount);
+#endif
+		}
+		chunk.meshlets = chunk.meshletStorage.data();
 
-		bool hasPosition = s.mesh.positions.empty() == false;
-		bool hasNormal = s.mesh.normals.empty() == false;
-		bool hasTexture = s.mesh.texcoords.empty() == false;
+		unsigned int indexCount = (unsigned int)s.indices.size();
+		unsigned int indexSize = sizeof(unsigned int);
 
-		for (size_t i = 0; i < vertCount; ++i) {
-			if (hasPosition)
-				vertices[i].position = glm::vec4(s.mesh.positions[i * 3 + 0], s.mesh.positions[i * 3 + 1], s.mesh.positions[i * 3 + 2], 1);
-			if (hasNormal)
-				vertices[i].normal = glm::vec4(s.mesh.normals[i * 3 + 0], s.mesh.normals[i * 3 + 1], s.mesh.normals[i * 3 + 2], 0);
+		if (m_importSettings.packVertices) {
+			chunk.packedVertexStorage.resize(vertexCount);
+			for (unsigned int i = 0; i < vertexCount; ++i)
+				packVertex(vertices[i], chunk.packedVertexStorage[i]);
+			chunk.vertices = chunk.packedVertexStorage.data();
+		}
+		else {
+			chunk.vertexStorage = std::move(vertices);
+			chunk.vertices = chunk.vertexStorage.data();
+		}
 
-			// flip the T / V (might not always be needed, depends on how mesh was made)
-			if (hasTexture)
-				vertices[i].texcoord = glm::vec2(s.mesh.texcoords[i * 2 + 0], flipTextureV ? 1.0f - s.mesh.texcoords[i * 2 + 1] : s.mesh.texcoords[i * 2 + 1]);
+		// halve the index data whenever every index fits in 16 bits
+		if (vertexCount < 65536) {
+			chunk.shortIndexStorage.assign(s.indices.begin(), s.indices.end());
+			chunk.indices = chunk.shortIndexStorage.data();
+			indexSize = sizeof(unsigned short);
+		}
+		else {
+			chunk.indexStorage = std::move(s.indices);
+			chunk.indices = chunk.indexStorage.data();
 		}
 
-		// calculate for normal mapping
-		if (hasNormal && hasTexture)
-			calculateTangents(vertices, s.mesh.indices);
+		MeshCache::ChunkRecord& record = chunk.record;
+		record = {};
+		record.materialID = s.materialID;
+		record.vertexCount = vertexCount;
+		record.indexCount = indexCount;
+		memcpy(record.boundsMin, &boundsMin[0], sizeof(record.boundsMin));
+		memcpy(record.boundsMax, &boundsMax[0], sizeof(record.boundsMax));
+		record.indexSize = indexSize;
+		record.lodCount = lodCount;
+		memcpy(record.lodIndexCounts, lodIndexCounts, sizeof(record.lodIndexCounts));
+		memcpy(record.lodErrors, lodErrors, sizeof(record.lodErrors));
+		record.meshletCount = meshletCount;
+		memcpy(record.lodMeshletCounts, lodMeshletCounts, sizeof(record.lodMeshletCounts));
+
+		cache.addChunk(record.materialID, record.boundsMin, record.boundsMax,
+					   chunk.vertices, vertexCount, chunk.indices, indexCount, indexSize,
+					   lodCount, lodIndexCounts, lodErrors, chunk.meshlets, meshletCount, lodMeshletCounts);
+	}
 
-		// bind vertex buffer
-		glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+	// a failed write only costs the next load a re-parse
+	if (cache.write(cacheFile, stamp, getVertexSize()) == false)
+		printf("Failed to write mesh cache %s\n", cacheFile);
 
-		// fill vertex buffer
-		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+	return true;
+}
 
-		// enable first element as positions
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
+void OBJMesh::decodeMaterialTextures(Material& material, const std::string& folder, const std::string names[7]) {
+	std::shared_ptr<Texture>* slots[7] = { &material.diffuseTexture, &material.alphaTexture, &material.ambientTexture,
+										   &material.specularTexture, &material.specularHighlightTexture,
+										   &material.normalTexture, &material.displacementTexture };
+	for (int t = 0; t < 7; ++t) {
+		if (names[t].empty() == false)
+			*slots[t] = decodeTexture(folder + names[t], t == 5 ? CompressedTexture::Usage::NORMAL : CompressedTexture::Usage::COLOUR);
+	}
+}
+
+std::shared_ptr<Texture> OBJMesh::decodeTexture(const std::string& filename, CompressedTexture::Usage usage) {
+
+	// a texture some other material or mesh created is filled in by whoever created it
+	bool created = false;
+
+	if (m_importSettings.compressTextures) {
+		std::shared_ptr<CompressedTexture> texture = AssetRegistry::findOrCreateCompressedTexture(filename.c_str(), usage,
+																								  m_importSettings.textureQuality, created);
+		if (created && texture->prepare(filename.c_str(), usage, m_importSettings.textureQuality)) {
+			PendingTexture pending = { texture, texture, nullptr, 0, 0, 0 };
+			m_pendingTextures.push_back(pending);
+		}
+		return texture;
+	}
 
-		// enable normals
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(1, 4, GL_FLOAT, GL_TRUE, sizeof(Vertex), (void*)(sizeof(glm::vec4) * 1));
+	std::shared_ptr<Texture> texture = AssetRegistry::findOrCreateTexture(filename.c_str(), created);
+	if (created == false)
+		return texture;
 
-		// enable texture coords
-		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(sizeof(glm::vec4) * 2));
+	PendingTexture pending = { texture, nullptr, nullptr, 0, 0, 0 };
+	pending.pixels = stbi_load(filename.c_str(), &pending.width, &pending.height, &pending.components, 0);
+	if (pending.pixels == nullptr) {
+		printf("Failed to load texture %s\n", filename.c_str());
+		return texture;
+	}
+	m_pendingTextures.push_back(pending);
+	return texture;
+}
 
-		// enable tangents
-		glEnableVertexAttribArray(3);
-		glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(sizeof(glm::vec4) * 2 + sizeof(glm::vec2)));
+void OBJMesh::packVertex(const Vertex& vertex, PackedVertex& packed) {
+	packed.position[0] = packHalf(vertex.position.x);
+	packed.position[1] = packHalf(vertex.position.y);
+	packed.position[2] = packHalf(vertex.position.z);
+	packed.position[3] = packHalf(1.0f);
 
-		// bind 0 for safety
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glm::vec3 normal(vertex.normal);
+	float length = glm::length(normal);
+	if (length > 0)
+		normal /= length;
+	packed.normal = packSnorm1010102(glm::vec4(normal, 0));
 
-		// set chunk material
-		chunk.materialID = s.mesh.material_ids.empty() ? -1 : s.mesh.material_ids[0];
+	packed.tangent = packSnorm1010102(glm::vec4(glm::vec3(vertex.tangent), vertex.tangent.w < 0 ? -1.0f : 1.0f));
+
+	packed.texcoord[0] = packHalf(vertex.texcoord.x);
+	packed.texcoord[1] = packHalf(vertex.texcoord.y);
+}
 
-		m_meshChunks.push_back(chunk);
+void OBJMesh::createChunk(MeshChunk& chunk, const void* vertices, unsigned int vertexCount,
+						  const void* indices, unsigned int indexCount, unsigned int indexSize,
+						  unsigned int lodCount, const unsigned int* lodIndexCounts, const float* lodErrors,
+						  const MeshCache::MeshletRecord* meshlets, unsigned int meshletCount, const unsigned int* lodMeshletCounts) {
+
+	// vertex layouts, at the same locations so shaders take either
+	static const GeometryArena::Attribute vertexAttributes[] = {
+		{ 0, 4, GL_FLOAT, false, offsetof(Vertex, position) },
+		{ 1, 4, GL_FLOAT, true, offsetof(Vertex, normal) },
+		{ 2, 2, GL_FLOAT, false, offsetof(Vertex, texcoord) },
+		{ 3, 4, GL_FLOAT, false, offsetof(Vertex, tangent) },
+	};
+	// expanded back to floats by the vertex fetch
+	static const GeometryArena::Attribute packedVertexAttributes[] = {
+		{ 0, 4, GL_HALF_FLOAT, false, offsetof(PackedVertex, position) },
+		{ 1, 4, GL_INT_2_10_10_10_REV, true, offsetof(PackedVertex, normal) },
+		{ 2, 2, GL_HALF_FLOAT, false, offsetof(PackedVertex, texcoord) },
+		{ 3, 4, GL_INT_2_10_10_10_REV, true, offsetof(PackedVertex, tangent) },
+	};
+
+	if (m_importSettings.packVertices)
+		chunk.arena = GeometryArena::getArena(sizeof(PackedVertex), packedVertexAttributes, 4);
+	else
+		chunk.arena = GeometryArena::getArena(sizeof(Vertex), vertexAttributes, 4);
+
+	chunk.allocation = chunk.arena->allocate(vertices, vertexCount, indices, indexCount, indexSize);
+
+	// store index count and type for rendering
+	chunk.indexCount = indexCount;
+	chunk.indexType = indexSize == sizeof(unsigned short) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
+	// lod index lists are stored one after another, counted from the start of the arena's indices
+	chunk.lodCount = lodCount;
+	unsigned int firstIndex = chunk.allocation.indexOffset / indexSize;
+	for (unsigned int l = 0; l < lodCount; ++l) {
+		chunk.lodFirstIndex[l] = firstIndex;
+		chunk.lodIndexCount[l] = lodIndexCounts[l];
+		chunk.lodError[l] = lodErrors[l];
+		firstIndex += lodIndexCounts[l];
 	}
-	
-	// load obj
-	return true;
+
+	// meshlets are copied out as the mapped cache is closed after upload
+	chunk.meshlets.assign(meshlets, meshlets + meshletCount);
+	unsigned int firstMeshlet = 0;
+	for (unsigned int l = 0; l < lodCount; ++l) {
+		chunk.lodFirstMeshlet[l] = firstMeshlet;
+		chunk.lodMeshletCount[l] = meshletCount != 0 ? lodMeshletCounts[l] : 0;
+		firstMeshlet += chunk.lodMeshletCount[l];
+	}
+}
+
+// material uniforms, hashed at compile time and looked up in the bound program's table
+static constexpr UniformID KA_UNIFORM("Ka");
+static constexpr UniformID KD_UNIFORM("Kd");
+static constexpr UniformID KS_UNIFORM("Ks");
+static constexpr UniformID KE_UNIFORM("Ke");
+static constexpr UniformID OPACITY_UNIFORM("opacity");
+static constexpr UniformID SPECULAR_POWER_UNIFORM("specularPower");
+static constexpr UniformID ALPHA_TEXTURE_UNIFORM("alphaTexture");
+static constexpr UniformID AMBIENT_TEXTURE_UNIFORM("ambientTexture");
+static constexpr UniformID DIFFUSE_TEXTURE_UNIFORM("diffuseTexture");
+static constexpr UniformID SPECULAR_TEXTURE_UNIFORM("specularTexture");
+static constexpr UniformID SPECULAR_HIGHLIGHT_TEXTURE_UNIFORM("specularHighlightTexture");
+static constexpr UniformID NORMAL_TEXTURE_UNIFORM("normalTexture");
+static constexpr UniformID DISPLACEMENT_TEXTURE_UNIFORM("displacementTexture");
+
+static unsigned int getHandle(const std::shared_ptr<Texture>& texture) {
+	return texture ? texture->getHandle() : 0;
 }
 
-void OBJMesh::draw(bool usePatches /* = false */) {
+void OBJMesh::draw(bool usePatches /* = false */, unsigned int lod /* = 0 */, const ClusterCulling* culling /* = nullptr */) {
 
-	int program = -1;
-	glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+	ShaderProgram* program = ShaderProgram::getCurrent();
 
-	if (program == -1) {
+	if (program == nullptr) {
 		printf("No shader bound!\n");
 		return;
 	}
 
-	// pull uniforms from the shader
-	int kaUniform = glGetUniformLocation(program, "Ka");
-	int kdUniform = glGetUniformLocation(program, "Kd");
-	int ksUniform = glGetUniformLocation(program, "Ks");
-	int keUniform = glGetUniformLocation(program, "Ke");
-	int opacityUniform = glGetUniformLocation(program, "opacity");
-	int specPowUniform = glGetUniformLocation(program, "specularPower");
-
-	int alphaTexUniform = glGetUniformLocation(program, "alphaTexture");
-	int ambientTexUniform = glGetUniformLocation(program, "ambientTexture");
-	int diffuseTexUniform = glGetUniformLocation(program, "diffuseTexture");
-	int specTexUniform = glGetUniformLocation(program, "specularTexture");
-	int specHighlightTexUniform = glGetUniformLocation(program, "specularHighlightTexture");
-	int normalTexUniform = glGetUniformLocation(program, "normalTexture");
-	int dispTexUniform = glGetUniformLocation(program, "displacementTexture");
+	// pull uniforms from the shader's table
+	int kaUniform = program->getUniform(KA_UNIFORM);
+	int kdUniform = program->getUniform(KD_UNIFORM);
+	int ksUniform = program->getUniform(KS_UNIFORM);
+	int keUniform = program->getUniform(KE_UNIFORM);
+	int opacityUniform = program->getUniform(OPACITY_UNIFORM);
+	int specPowUniform = program->getUniform(SPECULAR_POWER_UNIFORM);
+
+	int alphaTexUniform = program->getUniform(ALPHA_TEXTURE_UNIFORM);
+	int ambientTexUniform = program->getUniform(AMBIENT_TEXTURE_UNIFORM);
+	int diffuseTexUniform = program->getUniform(DIFFUSE_TEXTURE_UNIFORM);
+	int specTexUniform = program->getUniform(SPECULAR_TEXTURE_UNIFORM);
+	int specHighlightTexUniform = program->getUniform(SPECULAR_HIGHLIGHT_TEXTURE_UNIFORM);
+	int normalTexUniform = program->getUniform(NORMAL_TEXTURE_UNIFORM);
+	int dispTexUniform = program->getUniform(DISPLACEMENT_TEXTURE_UNIFORM);
 
 	// set texture slots (these don't change per material)
 	if (diffuseTexUniform >= 0)
@@ -190,6 +580,7 @@ void OBJMesh::draw(bool usePatches /* = false */) {
 		glUniform1i(dispTexUniform, 6);
 
 	int currentMaterial = -1;
+	GeometryArena* currentArena = nullptr;
 
 	// draw the mesh chunks
 	for (auto& c : m_meshChunks) {
@@ -210,59 +601,145 @@ void OBJMesh::draw(bool usePatches /* = false */) {
 			if (specPowUniform >= 0)
 				glUniform1f(specPowUniform, m_materials[currentMaterial].specularPower);
 
-			glActiveTexture(GL_TEXTURE0);
-			if (m_materials[currentMaterial].diffuseTexture.getHandle() > 0)
-				glBindTexture(GL_TEXTURE_2D, m_materials[currentMaterial].diffuseTexture.getHandle());
-			else if (diffuseTexUniform >= 0)
-				glBindTexture(GL_TEXTURE_2D, 0);
-
-			glActiveTexture(GL_TEXTURE1);
-			if (m_materials[currentMaterial].alphaTexture.getHandle() > 0)
-				glBindTexture(GL_TEXTURE_2D, m_materials[currentMaterial].alphaTexture.getHandle());
-			else if (alphaTexUniform >= 0)
-				glBindTexture(GL_TEXTURE_2D, 0);
-
-			glActiveTexture(GL_TEXTURE2);
-			if (m_materials[currentMaterial].ambientTexture.getHandle() > 0)
-				glBindTexture(GL_TEXTURE_2D, m_materials[currentMaterial].ambientTexture.getHandle());
-			else if (ambientTexUniform >= 0)
-				glBindTexture(GL_TEXTURE_2D, 0);
-
-			glActiveTexture(GL_TEXTURE3);
-			if (m_materials[currentMaterial].specularTexture.getHandle() > 0)
-				glBindTexture(GL_TEXTURE_2D, m_materials[currentMaterial].specularTexture.getHandle());
-			else if (specTexUniform >= 0)
-				glBindTexture(GL_TEXTURE_2D, 0);
-
-			glActiveTexture(GL_TEXTURE4);
-			if (m_materials[currentMaterial].specularHighlightTexture.getHandle() > 0)
-				glBindTexture(GL_TEXTURE_2D, m_materials[currentMaterial].specularHighlightTexture.getHandle());
-			else if (specHighlightTexUniform >= 0)
-				glBindTexture(GL_TEXTURE_2D, 0);
-
-			glActiveTexture(GL_TEXTURE5);
-			if (m_materials[currentMaterial].normalTexture.getHandle() > 0)
-				glBindTexture(GL_TEXTURE_2D, m_materials[currentMaterial].normalTexture.getHandle());
-			else if (normalTexUniform >= 0)
-				glBindTexture(GL_TEXTURE_2D, 0);
-
-			glActiveTexture(GL_TEXTURE6);
-			if (m_materials[currentMaterial].displacementTexture.getHandle() > 0)
-				glBindTexture(GL_TEXTURE_2D, m_materials[currentMaterial].displacementTexture.getHandle());
-			else if (dispTexUniform >= 0)
-				glBindTexture(GL_TEXTURE_2D, 0);
+			// units 0 to 6 in one call, leaving out those already bound. units without a texture
+			// are cleared, samplers the shader doesn't use never read them
+			const Material& material = m_materials[currentMaterial];
+			unsigned int textures[7] = {
+				getHandle(material.diffuseTexture),
+				getHandle(material.alphaTexture),
+				getHandle(material.ambientTexture),
+				getHandle(material.specularTexture),
+				getHandle(material.specularHighlightTexture),
+				getHandle(material.normalTexture),
+				getHandle(material.displacementTexture),
+			};
+			GLState::bindTextures(0, 7, textures);
 		}
 
 		// bind and draw geometry
-		glBindVertexArray(c.vao);
+		unsigned int level = std::min(lod, c.lodCount - 1);
+		size_t indexSize = c.indexType == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned int);
+		void* offset = (void*)(c.lodFirstIndex[level] * indexSize);
+
+		if (culling != nullptr && usePatches == false && c.lodMeshletCount[level] != 0) {
+			cullMeshlets(c, level, *culling);
+			if (m_drawCounts.empty())
+				continue;
+
+			if (currentArena != c.arena) {
+				currentArena = c.arena;
+				currentArena->bind();
+			}
+			if (m_drawCounts.size() == 1)
+				glDrawElementsBaseVertex(GL_TRIANGLES, m_drawCounts[0], c.indexType, m_drawOffsets[0], m_drawBaseVertices[0]);
+			else
+				glMultiDrawElementsBaseVertex(GL_TRIANGLES, m_drawCounts.data(), c.indexType, m_drawOffsets.data(),
+											  (int)m_drawCounts.size(), m_drawBaseVertices.data());
+			continue;
+		}
+
+		// chunks sharing an arena draw without rebinding
+		if (currentArena != c.arena) {
+			currentArena = c.arena;
+			currentArena->bind();
+		}
 		if (usePatches)
-			glDrawElements(GL_PATCHES, c.indexCount, GL_UNSIGNED_INT, 0);
+			glDrawElementsBaseVertex(GL_PATCHES, c.lodIndexCount[level], c.indexType, offset, c.allocation.baseVertex);
 		else
-			glDrawElements(GL_TRIANGLES, c.indexCount, GL_UNSIGNED_INT, 0);
+			glDrawElementsBaseVertex(GL_TRIANGLES, c.lodIndexCount[level], c.indexType, offset, c.allocation.baseVertex);
 	}
 }
 
-void OBJMesh::calculateTangents(std::vector<Vertex>& vertices, const std::vector<unsigned int>& indices) {
+void OBJMesh::addIndirect(IndirectDrawList& list, unsigned int lod, unsigned int transform) const {
+	for (auto& c : m_meshChunks) {
+		unsigned int level = std::min(lod, c.lodCount - 1);
+		list.add(c.arena, c.indexType, c.lodIndexCount[level], c.lodFirstIndex[level], c.allocation.baseVertex, transform);
+	}
+}
+
+void OBJMesh::addCullDraws(InstanceCuller& culler, unsigned int instance) const {
+	for (auto& c : m_meshChunks)
+		culler.addDraw(instance, c.arena, c.indexType, c.allocation.baseVertex, c.lodCount, c.lodIndexCount, c.lodFirstIndex);
+}
+
+OBJMesh::ClusterCulling OBJMesh::makeClusterCulling(const glm::mat4& projectionViewModel, const glm::vec3& objectViewPosition,
+													bool cullBackfaces) {
+	ClusterCulling culling;
+
+	Frustum frustum = Frustum::fromMatrix(projectionViewModel);
+	for (int p = 0; p < 6; ++p)
+		culling.planes[p] = frustum.planes[p];
+
+	culling.viewPosition = objectViewPosition;
+	culling.cullBackfaces = cullBackfaces;
+	return culling;
+}
+
+void OBJMesh::cullMeshlets(const MeshChunk& chunk, unsigned int lod, const ClusterCulling& culling) {
+
+	m_drawCounts.clear();
+	m_drawOffsets.clear();
+	m_drawBaseVertices.clear();
+
+	// meshlets count from the chunk's first index, the draws from the arena's
+	size_t indexSize = chunk.indexType == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned int);
+	size_t chunkOffset = chunk.allocation.indexOffset;
+	unsigned int rangeStart = 0, rangeEnd = 0;
+
+	const MeshCache::MeshletRecord* meshlets = chunk.meshlets.data() + chunk.lodFirstMeshlet[lod];
+	for (unsigned int m = 0; m < chunk.lodMeshletCount[lod]; ++m) {
+		const MeshCache::MeshletRecord& meshlet = meshlets[m];
+		glm::vec3 centre(meshlet.centre[0], meshlet.centre[1], meshlet.centre[2]);
+
+		bool visible = true;
+		for (int p = 0; p < 6 && visible; ++p)
+			visible = glm::dot(glm::vec3(culling.planes[p]), centre) + culling.planes[p].w >= -meshlet.radius;
+
+		// every triangle is back facing when each direction from the eye in to the sphere is
+		// within 90 degrees of each normal in the cone, so the two cones' half angles and the
+		// angle between their axes must sum to less than 90 degrees
+		if (visible && culling.cullBackfaces && meshlet.coneCutoff > 0) {
+			glm::vec3 toCentre = centre - culling.viewPosition;
+			float distanceSquared = glm::dot(toCentre, toCentre);
+			float radiusSquared = meshlet.radius * meshlet.radius;
+
+			if (distanceSquared > radiusSquared) {
+				glm::vec3 axis(meshlet.coneAxis[0], meshlet.coneAxis[1], meshlet.coneAxis[2]);
+				float tangent = std::sqrt(distanceSquared - radiusSquared);
+				float coneSine = std::sqrt(std::max(0.0f, 1.0f - meshlet.coneCutoff * meshlet.coneCutoff));
+
+				visible = meshlet.coneCutoff * tangent <= coneSine * meshlet.radius ||
+						  glm::dot(axis, toCentre) <= coneSine * tangent + meshlet.coneCutoff * meshlet.radius;
+			}
+		}
+
+		if (visible == false)
+			continue;
+
+		// meshlets are consecutive in the index list, so neighbours draw as one range
+		if (rangeEnd == meshlet.firstIndex && rangeEnd != rangeStart) {
+			rangeEnd += meshlet.indexCount;
+			continue;
+		}
+		if (rangeEnd != rangeStart) {
+			m_drawCounts.push_back((int)(rangeEnd - rangeStart));
+			m_drawOffsets.push_back((const void*)(chunkOffset + rangeStart * indexSize));
+			m_drawBaseVertices.push_back((int)chunk.allocation.baseVertex);
+		}
+		rangeStart = meshlet.firstIndex;
+		rangeEnd = meshlet.firstIndex + meshlet.indexCount;
+	}
+
+	if (rangeEnd != rangeStart) {
+		m_drawCounts.push_back((int)(rangeEnd - rangeStart));
+		m_drawOffsets.push_back((const void*)(chunkOffset + rangeStart * indexSize));
+		m_drawBaseVertices.push_back((int)chunk.allocation.baseVertex);
+	}
+}
+
+#ifdef OBJMESH_BENCHMARK_TANGENTS
+// the original single threaded routine, kept to benchmark and verify calculateTangents against
+static void calculateTangentsReference(std::vector<OBJMesh::Vertex>& vertices, const std::vector<unsigned int>& indices) {
 	unsigned int vertexCount = (unsigned int)vertices.size();
 	glm::vec4* tan1 = new glm::vec4[vertexCount * 2];
 	glm::vec4* tan2 = tan1 + vertexCount;
@@ -318,12 +795,236 @@ void OBJMesh::calculateTangents(std::vector<Vertex>& vertices, const std::vector
 
 		// Calculate handedness (direction of bitangent)
 		vertices[a].tangent.w = (glm::dot(glm::cross(glm::vec3(n), glm::vec3(t)), glm::vec3(tan2[a])) < 0.0F) ? 1.0F : -1.0F;
-
-		// calculate bitangent (ignoring for our Vertex, here just for reference)
-		//vertices[a].bitangent = glm::vec4(glm::cross(glm::vec3(vertices[a].normal), glm::vec3(vertices[a].tangent)) * vertices[a].tangent.w, 0);
-		//vertices[a].tangent.w = 0;
 	}
 
 	delete[] tan1;
 }
-}
\ No newline at end of file
+#endif
+
+// triangles or vertices handed to each job in the parallel tangent passes
+static const unsigned int TANGENT_BLOCK_SIZE = 1024;
+
+// gram-schmidt orthogonalises a block of vertices against their summed triangle directions,
+// four vertices at a time with sse. sums points at the tan1 xyz then tan2 xyz rows for the block
+static void orthogonaliseTangents(OBJMesh::Vertex* vertices, const float* const sums[6], unsigned int count) {
+	unsigned int a = 0;
+
+#ifdef OBJMESH_SSE2
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 minusOne = _mm_set1_ps(-1.0f);
+
+	for (; a + 4 <= count; a += 4) {
+		__m128 nx = _mm_loadu_ps(&vertices[a + 0].normal.x);
+		__m128 ny = _mm_loadu_ps(&vertices[a + 1].normal.x);
+		__m128 nz = _mm_loadu_ps(&vertices[a + 2].normal.x);
+		__m128 nw = _mm_loadu_ps(&vertices[a + 3].normal.x);
+		_MM_TRANSPOSE4_PS(nx, ny, nz, nw);
+
+		__m128 tx = _mm_loadu_ps(&sums[0][a]);
+		__m128 ty = _mm_loadu_ps(&sums[1][a]);
+		__m128 tz = _mm_loadu_ps(&sums[2][a]);
+		__m128 bx = _mm_loadu_ps(&sums[3][a]);
+		__m128 by = _mm_loadu_ps(&sums[4][a]);
+		__m128 bz = _mm_loadu_ps(&sums[5][a]);
+
+		// same operation order as the glm calls in the reference, and a true divide and square root,
+		// so every lane is bit identical to it
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, tx), _mm_mul_ps(ny, ty)), _mm_mul_ps(nz, tz));
+		__m128 vx = _mm_sub_ps(tx, _mm_mul_ps(nx, d));
+		__m128 vy = _mm_sub_ps(ty, _mm_mul_ps(ny, d));
+		__m128 vz = _mm_sub_ps(tz, _mm_mul_ps(nz, d));
+
+		__m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+		__m128 inverseLength = _mm_div_ps(one, _mm_sqrt_ps(lengthSquared));
+		vx = _mm_mul_ps(vx, inverseLength);
+		vy = _mm_mul_ps(vy, inverseLength);
+		vz = _mm_mul_ps(vz, inverseLength);
+
+		// handedness from cross(n, t) . tan2
+		__m128 cx = _mm_sub_ps(_mm_mul_ps(ny, tz), _mm_mul_ps(ty, nz));
+		__m128 cy = _mm_sub_ps(_mm_mul_ps(nz, tx), _mm_mul_ps(tz, nx));
+		__m128 cz = _mm_sub_ps(_mm_mul_ps(nx, ty), _mm_mul_ps(tx, ny));
+		__m128 h = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, bx), _mm_mul_ps(cy, by)), _mm_mul_ps(cz, bz));
+		__m128 negative = _mm_cmplt_ps(h, _mm_setzero_ps());
+		__m128 vw = _mm_or_ps(_mm_and_ps(negative, one), _mm_andnot_ps(negative, minusOne));
+
+		_MM_TRANSPOSE4_PS(vx, vy, vz, vw);
+		_mm_storeu_ps(&vertices[a + 0].tangent.x, vx);
+		_mm_storeu_ps(&vertices[a + 1].tangent.x, vy);
+		_mm_storeu_ps(&vertices[a + 2].tangent.x, vz);
+		_mm_storeu_ps(&vertices[a + 3].tangent.x, vw);
+	}
+#endif
+
+	for (; a < count; ++a) {
+		glm::vec3 n = glm::vec3(vertices[a].normal);
+		glm::vec3 t(sums[0][a], sums[1][a], sums[2][a]);
+		glm::vec3 b(sums[3][a], sums[4][a], sums[5][a]);
+
+		vertices[a].tangent = glm::vec4(glm::normalize(t - n * glm::dot(n, t)), 0);
+		vertices[a].tangent.w = (glm::dot(glm::cross(n, t), b) < 0.0F) ? 1.0F : -1.0F;
+	}
+}
+
+// a triangle's texture space directions, using exactly the reference arithmetic
+static void calculateTriangleDirections(const std::vector<OBJMesh::Vertex>& vertices, const unsigned int* triangle,
+										glm::vec3& sdir, glm::vec3& tdir) {
+	const OBJMesh::Vertex& a = vertices[triangle[0]];
+	const OBJMesh::Vertex& b = vertices[triangle[1]];
+	const OBJMesh::Vertex& c = vertices[triangle[2]];
+
+	float x1 = b.position.x - a.position.x;
+	float x2 = c.position.x - a.position.x;
+	float y1 = b.position.y - a.position.y;
+	float y2 = c.position.y - a.position.y;
+	float z1 = b.position.z - a.position.z;
+	float z2 = c.position.z - a.position.z;
+
+	float s1 = b.texcoord.x - a.texcoord.x;
+	float s2 = c.texcoord.x - a.texcoord.x;
+	float t1 = b.texcoord.y - a.texcoord.y;
+	float t2 = c.texcoord.y - a.texcoord.y;
+
+	float r = 1.0F / (s1 * t2 - s2 * t1);
+	sdir = glm::vec3((t2 * x1 - t1 * x2) * r, (t2 * y1 - t1 * y2) * r, (t2 * z1 - t1 * z2) * r);
+	tdir = glm::vec3((s1 * x2 - s2 * x1) * r, (s1 * y2 - s2 * y1) * r, (s1 * z2 - s2 * z1) * r);
+}
+
+void OBJMesh::calculateTangents(std::vector<Vertex>& vertices, const std::vector<unsigned int>& indices) {
+	unsigned int vertexCount = (unsigned int)vertices.size();
+	unsigned int triangleCount = (unsigned int)indices.size() / 3;
+	if (vertexCount == 0)
+		return;
+
+	unsigned int triangleBlocks = (triangleCount + TANGENT_BLOCK_SIZE - 1) / TANGENT_BLOCK_SIZE;
+	unsigned int vertexBlocks = (vertexCount + TANGENT_BLOCK_SIZE - 1) / TANGENT_BLOCK_SIZE;
+
+	// with a single thread, scatter straight in to per vertex sums like the reference does
+	if (getThreadCount() == 1 || triangleBlocks == 1) {
+		std::vector<float> sums((size_t)vertexCount * 6, 0.0f);
+		float* rows[6];
+		for (int row = 0; row < 6; ++row)
+			rows[row] = sums.data() + (size_t)vertexCount * row;
+
+		for (unsigned int triangle = 0; triangle < triangleCount; ++triangle) {
+			glm::vec3 sdir, tdir;
+			calculateTriangleDirections(vertices, indices.data() + triangle * 3, sdir, tdir);
+			for (unsigned int k = 0; k < 3; ++k) {
+				unsigned int v = indices[triangle * 3 + k];
+				rows[0][v] += sdir.x;
+				rows[1][v] += sdir.y;
+				rows[2][v] += sdir.z;
+				rows[3][v] += tdir.x;
+				rows[4][v] += tdir.y;
+				rows[5][v] += tdir.z;
+			}
+		}
+
+		for (unsigned int block = 0; block < vertexBlocks; ++block) {
+			unsigned int begin = block * TANGENT_BLOCK_SIZE;
+			const float* blockRows[6];
+			for (int row = 0; row < 6; ++row)
+				blockRows[row] = rows[row] + begin;
+			orthogonaliseTangents(vertices.data() + begin, blockRows, std::min(vertexCount - begin, TANGENT_BLOCK_SIZE));
+		}
+		return;
+	}
+
+	// per triangle directions
+	std::vector<glm::vec3> directions((size_t)triangleCount * 2);
+
+	parallelFor(triangleBlocks, [&](unsigned int block) {
+		unsigned int end = std::min(triangleCount, (block + 1) * TANGENT_BLOCK_SIZE);
+		for (unsigned int triangle = block * TANGENT_BLOCK_SIZE; triangle < end; ++triangle)
+			calculateTriangleDirections(vertices, indices.data() + triangle * 3,
+										directions[triangle * 2 + 0], directions[triangle * 2 + 1]);
+	});
+
+	// vertex to triangle table built in triangle order, so each vertex gathers its
+	// directions in the same order the reference scattered them and the sums match exactly
+	std::vector<unsigned int> cornerOffsets(vertexCount + 1, 0);
+	for (unsigned int i = 0; i < triangleCount * 3; ++i)
+		cornerOffsets[indices[i] + 1]++;
+	for (unsigned int v = 0; v < vertexCount; ++v)
+		cornerOffsets[v + 1] += cornerOffsets[v];
+
+	std::vector<unsigned int> cornerTriangles(triangleCount * 3);
+	{
+		std::vector<unsigned int> fill(cornerOffsets.begin(), cornerOffsets.end() - 1);
+		for (unsigned int i = 0; i < triangleCount * 3; ++i)
+			cornerTriangles[fill[indices[i]]++] = i / 3;
+	}
+
+	// gather and orthogonalise in blocks of vertices, each block owned by one job
+	parallelFor(vertexBlocks, [&](unsigned int block) {
+		unsigned int begin = block * TANGENT_BLOCK_SIZE;
+		unsigned int count = std::min(vertexCount - begin, TANGENT_BLOCK_SIZE);
+
+		float sums[6][TANGENT_BLOCK_SIZE];
+		for (unsigned int v = 0; v < count; ++v) {
+			glm::vec3 tan1(0), tan2(0);
+			for (unsigned int c = cornerOffsets[begin + v]; c < cornerOffsets[begin + v + 1]; ++c) {
+				tan1 += directions[cornerTriangles[c] * 2 + 0];
+				tan2 += directions[cornerTriangles[c] * 2 + 1];
+			}
+			sums[0][v] = tan1.x;
+			sums[1][v] = tan1.y;
+			sums[2][v] = tan1.z;
+			sums[3][v] = tan2.x;
+			sums[4][v] = tan2.y;
+			sums[5][v] = tan2.z;
+		}
+
+		const float* rows[6] = { sums[0], sums[1], sums[2], sums[3], sums[4], sums[5] };
+		orthogonaliseTangents(vertices.data() + begin, rows, count);
+	});
+}
+
+#ifdef OBJMESH_BENCHMARK_TANGENTS
+void OBJMesh::benchmarkTangents(const char* filename, unsigned int chunk, const std::vector<Vertex>& vertices,
+								const std::vector<unsigned int>& indices, bool hasTexcoords) {
+	std::vector<Vertex> reference = vertices;
+
+	// meshes without texture coordinates, like the stanford scans, get planar ones so the maths is representative
+	if (hasTexcoords == false)
+		for (auto& v : reference)
+			v.texcoord = glm::vec2(v.position.x, v.position.z);
+
+	std::vector<Vertex> parallel = reference;
+	float referenceTime = 0, parallelTime = 0;
+
+	// best of a few runs of each
+	for (int run = 0; run < 5; ++run) {
+		std::vector<Vertex> copy = reference;
+		auto start = std::chrono::high_resolution_clock::now();
+		calculateTangentsReference(copy, indices);
+		std::chrono::duration<float, std::milli> time = std::chrono::high_resolution_clock::now() - start;
+		referenceTime = run == 0 ? time.count() : std::min(referenceTime, time.count());
+		if (run == 0)
+			reference = copy;
+
+		copy = parallel;
+		start = std::chrono::high_resolution_clock::now();
+		calculateTangents(copy, indices);
+		time = std::chrono::high_resolution_clock::now() - start;
+		parallelTime = run == 0 ? time.count() : std::min(parallelTime, time.count());
+		if (run == 4)
+			parallel = copy;
+	}
+
+	unsigned int mismatches = 0;
+	float maxDifference = 0;
+	for (size_t v = 0; v < reference.size(); ++v) {
+		if (memcmp(&reference[v].tangent, &parallel[v].tangent, sizeof(glm::vec4)) != 0) {
+			++mismatches;
+			for (int k = 0; k < 4; ++k)
+				maxDifference = std::max(maxDifference, std::abs(reference[v].tangent[k] - parallel[v].tangent[k]));
+		}
+	}
+
+	printf("%s chunk %u tangents: reference %.2fms, parallel %.2fms on %u threads, %u of %u vertices differ (max %g)\n",
+		   filename, chunk, referenceTime, parallelTime, getThreadCount(), mismatches, (unsigned int)reference.size(), maxDifference);
+}
+#endif
+
+}
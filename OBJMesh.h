@@ -3,12 +3,20 @@
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
+#include <glm/mat4x4.hpp>
+#include <memory>
 #include <string>
 #include <vector>
 #include "Texture.h"
+#include "MeshCache.h"
+#include "CompressedTexture.h"
+#include "GeometryArena.h"
 
 namespace aie {
 
+class IndirectDrawList;
+class InstanceCuller;
+
 // a simple triangle mesh wrapper
 class OBJMesh {
 public:
@@ -23,6 +31,15 @@ public:
 		glm::vec4 tangent;	// added to attrib location 3
 	};
 
+	// 20 byte vertex used when ImportSettings::packVertices is set, bound to the same attrib
+	// locations and expanded by the vertex fetch so shaders are unchanged
+	struct PackedVertex {
+		unsigned short	position[4];	// half floats, w is 1
+		unsigned int	normal;			// 10:10:10:2 snorm, w is 0
+		unsigned int	tangent;		// 10:10:10:2 snorm, w holds the bitangent sign
+		unsigned short	texcoord[2];	// half floats
+	};
+
 	// a basic material
 	class Material {
 	public:
@@ -38,44 +55,178 @@ public:
 		float specularPower;
 		float opacity;
 
-		Texture diffuseTexture;				// bound slot 0
-		Texture alphaTexture;				// bound slot 1
-		Texture ambientTexture;				// bound slot 2
-		Texture specularTexture;			// bound slot 3
-		Texture specularHighlightTexture;	// bound slot 4
-		Texture normalTexture;				// bound slot 5
-		Texture displacementTexture;		// bound slot 6
+		// shared through the AssetRegistry, null when the material names no texture for the slot
+		std::shared_ptr<Texture> diffuseTexture;			// bound slot 0
+		std::shared_ptr<Texture> alphaTexture;				// bound slot 1
+		std::shared_ptr<Texture> ambientTexture;			// bound slot 2
+		std::shared_ptr<Texture> specularTexture;			// bound slot 3
+		std::shared_ptr<Texture> specularHighlightTexture;	// bound slot 4
+		std::shared_ptr<Texture> normalTexture;				// bound slot 5
+		std::shared_ptr<Texture> displacementTexture;		// bound slot 6
+	};
+
+	// load time processing, changing any of these rebuilds the mesh cache
+	struct ImportSettings {
+		bool	weldVertices = true;	// merge vertices with matching position, normal and texcoord
+		float	weldEpsilon = 0.0f;		// 0 merges exact matches only
+		bool	optimiseVertexOrder = true;	// reorder triangles and vertices for the post-transform cache and fetch
+		float	overdrawThreshold = 1.05f;	// acmr a chunk may lose to overdraw ordering, 0 disables it
+		bool	packVertices = false;		// upload PackedVertex instead of Vertex
+		unsigned int	lodCount = 1;		// levels of detail to generate, up to MeshCache::MAX_LODS
+		float	lodReduction = 0.25f;		// triangle count of each lod relative to the one before
+		float	lodTargetError = 0.02f;		// largest simplification error, relative to the chunk's bounds diagonal
+		bool	compressTextures = true;	// block compress material textures with mips, cached as ktx beside each image
+		TextureCompressor::Quality	textureQuality = TextureCompressor::Quality::FAST;
+		unsigned int	meshletTriangles = 128;	// triangles per culling cluster, 0 always draws whole chunks
+	};
+
+	// frustum planes and view position in the mesh's object space, for culling meshlets
+	struct ClusterCulling {
+		glm::vec4	planes[6];		// normalised, xyz points in to the frustum
+		glm::vec3	viewPosition;
+		bool		cullBackfaces;	// only while back faces are culled and the transform keeps the winding
 	};
 
 	OBJMesh() {}
 	~OBJMesh();
 
-	// will fail if a mesh has already been loaded in to this instance
+	// hash of every load option that changes the processed mesh, used to key caches
+	static unsigned int getOptionsHash(bool flipTextureV, const ImportSettings& settings);
+
+	// must be set before load
+	void setImportSettings(const ImportSettings& settings) { m_importSettings = settings; }
+	const ImportSettings& getImportSettings() const { return m_importSettings; }
+
+	// will fail if a mesh has already been loaded in to this instance, same as prepare then upload
 	bool load(const char* filename, bool loadTextures = true, bool flipTextureV = false);
 
-	// allow option to draw as patches for tessellation
-	void draw(bool usePatches = false);
+	// parses the obj, or maps its cache, and decodes its textures without touching GL,
+	// so it can run on a worker thread. nothing is drawn until upload is called
+	bool prepare(const char* filename, bool loadTextures = true, bool flipTextureV = false);
+	// creates the buffers and textures for a prepared mesh, must run on the GL thread
+	bool upload();
+	bool isUploaded() const { return m_meshChunks.empty() == false; }
+
+	// extracts the object space frustum from a projection * view * model matrix
+	static ClusterCulling makeClusterCulling(const glm::mat4& projectionViewModel, const glm::vec3& objectViewPosition,
+											 bool cullBackfaces);
+
+	// allow option to draw as patches for tessellation, chunks with fewer lods draw their coarsest.
+	// with culling, meshlets outside the frustum or facing away are skipped and the rest drawn
+	// with one multi-draw per chunk. patches are never culled as tessellation may move them.
+	// materials go to the program last bound with ShaderProgram::bind
+	void draw(bool usePatches = false, unsigned int lod = 0, const ClusterCulling* culling = nullptr);
+	// adds every chunk at the lod to a pass drawn with the list's transform, materials are not bound
+	void addIndirect(IndirectDrawList& list, unsigned int lod, unsigned int transform) const;
+	// adds every chunk with all its lods to a culler's instance, for the GPU to pick from
+	void addCullDraws(InstanceCuller& culler, unsigned int instance) const;
+
+	// levels of detail, with the largest object space error any chunk has at each level
+	unsigned int getLodCount() const { return m_lodCount; }
+	float getLodError(unsigned int lod) const { return m_lodErrors[lod]; }
 
 	// access to the filename that was loaded
 	const std::string& getFilename() const { return m_filename; }
 
+	// object space bounds of all chunks
+	const glm::vec3& getBoundsMin() const { return m_boundsMin; }
+	const glm::vec3& getBoundsMax() const { return m_boundsMax; }
+
 	// material access
 	size_t getMaterialCount() const { return m_materials.size();  }
 	Material& getMaterial(size_t index) { return m_materials[index];  }
 
 private:
 
-	void calculateTangents(std::vector<Vertex>& vertices, const std::vector<unsigned int>& indices);
-
 	struct MeshChunk {
-		unsigned int	vao, vbo, ibo;
+		GeometryArena*	arena;			// shared by every chunk with the same vertex layout
+		GeometryArena::Allocation	allocation;
 		unsigned int	indexCount;
+		unsigned int	indexType;		// GL_UNSIGNED_SHORT when the chunk has fewer than 65536 vertices
+		unsigned int	lodCount;
+		unsigned int	lodFirstIndex[MeshCache::MAX_LODS];
+		unsigned int	lodIndexCount[MeshCache::MAX_LODS];
+		float			lodError[MeshCache::MAX_LODS];
 		int				materialID;
+		glm::vec3		boundsMin, boundsMax;
+		// empty when the chunk was imported without meshlets
+		std::vector<MeshCache::MeshletRecord>	meshlets;
+		unsigned int	lodFirstMeshlet[MeshCache::MAX_LODS];
+		unsigned int	lodMeshletCount[MeshCache::MAX_LODS];
+	};
+
+	// chunk data waiting for upload. it points in to the mapped cache, or in to the storage
+	// here when the chunk was just built from the obj
+	struct PendingChunk {
+		MeshCache::ChunkRecord		record;
+		const void*					vertices;
+		const void*					indices;
+		const MeshCache::MeshletRecord*	meshlets;
+		std::vector<Vertex>			vertexStorage;
+		std::vector<PackedVertex>	packedVertexStorage;
+		std::vector<unsigned int>	indexStorage;
+		std::vector<unsigned short>	shortIndexStorage;
+		std::vector<MeshCache::MeshletRecord>	meshletStorage;
+	};
+
+	// image waiting for upload. compressed textures hold their own blocks, otherwise the
+	// decoded pixels are freed with stbi_image_free
+	struct PendingTexture {
+		std::shared_ptr<Texture>			texture;
+		std::shared_ptr<CompressedTexture>	compressed;
+		unsigned char*						pixels;
+		int									width, height, components;
 	};
 
+	// prepares from a valid mesh cache, uploading will read straight from the mapped file
+	bool loadCache(const char* cacheFile, const MeshCache::SourceStamp& stamp, const std::string& folder, bool loadTextures);
+	// parses the obj and writes a new mesh cache for the next load
+	bool loadOBJ(const char* filename, const std::string& folder, bool loadTextures, bool flipTextureV,
+				 const char* cacheFile, const MeshCache::SourceStamp& stamp);
+
+	// unnamed textures are skipped, textures already in the registry are shared without any io
+	void decodeMaterialTextures(Material& material, const std::string& folder, const std::string names[7]);
+	std::shared_ptr<Texture> decodeTexture(const std::string& filename, CompressedTexture::Usage usage);
+	void releasePending();
+	// vertices are Vertex or PackedVertex depending on the import settings, indices are 2 or 4 bytes
+	static void packVertex(const Vertex& vertex, PackedVertex& packed);
+	void createChunk(MeshChunk& chunk, const void* vertices, unsigned int vertexCount,
+					 const void* indices, unsigned int indexCount, unsigned int indexSize,
+					 unsigned int lodCount, const unsigned int* lodIndexCounts, const float* lodErrors,
+					 const MeshCache::MeshletRecord* meshlets, unsigned int meshletCount, const unsigned int* lodMeshletCounts);
+	// fills the multi-draw lists with the visible meshlets of a chunk's lod, merging neighbours
+	void cullMeshlets(const MeshChunk& chunk, unsigned int lod, const ClusterCulling& culling);
+
+	unsigned int getVertexSize() const { return m_importSettings.packVertices ? sizeof(PackedVertex) : sizeof(Vertex); }
+
+	// multithreaded and sse, bit identical to the original scalar routine
+	void calculateTangents(std::vector<Vertex>& vertices, const std::vector<unsigned int>& indices);
+
+#ifdef OBJMESH_BENCHMARK_TANGENTS
+	// times calculateTangents against the original routine and reports any differences
+	void benchmarkTangents(const char* filename, unsigned int chunk, const std::vector<Vertex>& vertices,
+						   const std::vector<unsigned int>& indices, bool hasTexcoords);
+#endif
+
+	ImportSettings			m_importSettings;
+
 	std::string				m_filename;
 	std::vector<MeshChunk>	m_meshChunks;
 	std::vector<Material>	m_materials;
+	glm::vec3				m_boundsMin = glm::vec3(0);
+	glm::vec3				m_boundsMax = glm::vec3(0);
+	unsigned int			m_lodCount = 1;
+	float					m_lodErrors[MeshCache::MAX_LODS] = {};
+
+	// multi-draw lists reused by every draw
+	std::vector<int>			m_drawCounts;
+	std::vector<const void*>	m_drawOffsets;
+	std::vector<int>			m_drawBaseVertices;
+
+	bool						m_prepared = false;
+	MeshCache					m_pendingCache;
+	std::vector<PendingChunk>	m_pendingChunks;
+	std::vector<PendingTexture>	m_pendingTextures;
 };
 
 } // namespace aie
\ No newline at end of file
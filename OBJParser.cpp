@@ -0,0 +1,759 @@
+#include "OBJParser.h"
+#include "MappedFile.h"
+#include "Parallel.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define OBJ_PARSER_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace aie {
+
+// ranges are at least this big, so small files are not split across threads
+static const size_t MIN_RANGE_SIZE = 64 * 1024;
+
+// a face corner, as 0-based indices in to the file wide arrays, -1 when not given
+struct Corner {
+	int position;
+	int texcoord;
+	int normal;
+};
+
+// object, group and material statements, placed by the triangle they come before
+struct Event {
+	enum Type { OBJECT, MATERIAL, MATERIAL_LIBRARY };
+
+	Type			type;
+	unsigned int	triangle;
+	std::string		name;
+};
+
+// a line aligned slice of the file, parsed by one thread
+struct Range {
+	const char*			begin;
+	const char*			end;
+
+	// element counts from the counting pass
+	unsigned int		positions, texcoords, normals, triangles;
+
+	// where this range's elements start in the file wide arrays
+	unsigned int		positionOffset, texcoordOffset, normalOffset, triangleOffset;
+
+	std::vector<Event>	events;
+};
+
+enum LineType {
+	LINE_OTHER,
+	LINE_POSITION,
+	LINE_TEXCOORD,
+	LINE_NORMAL,
+	LINE_FACE,
+	LINE_OBJECT,
+	LINE_MATERIAL,
+	LINE_MATERIAL_LIBRARY,
+};
+
+static inline unsigned int countTrailingZeros(unsigned int mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+static inline unsigned int countBits(unsigned int value) {
+	value = value - ((value >> 1) & 0x55555555);
+	value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+	return (((value + (value >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+static inline bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char* skipSpace(const char* p, const char* end) {
+	while (p < end && isSpace(*p))
+		++p;
+	return p;
+}
+
+// returns the next '\n' at or after p, or end
+static const char* findLineEnd(const char* p, const char* end) {
+#ifdef OBJ_PARSER_SSE2
+	const __m128i newline = _mm_set1_epi8('\n');
+	while (end - p >= 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)p);
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+		if (mask != 0)
+			return p + countTrailingZeros(mask);
+		p += 16;
+	}
+#endif
+	while (p < end && *p != '\n')
+		++p;
+	return p;
+}
+
+// counts whitespace separated tokens, a token being a run of bytes above ' '
+static unsigned int countTokens(const char* p, const char* end) {
+	unsigned int count = 0;
+	unsigned int inToken = 0;
+#ifdef OBJ_PARSER_SSE2
+	const __m128i space = _mm_set1_epi8(' ');
+	while (end - p >= 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)p);
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpgt_epi8(bytes, space));
+
+		// a token starts wherever a token byte follows a non token byte
+		unsigned int starts = mask & ~((mask << 1) | inToken);
+		count += countBits(starts);
+		inToken = (mask >> 15) & 1;
+		p += 16;
+	}
+#endif
+	for (; p < end; ++p) {
+		unsigned int isToken = (signed char)*p > ' ' ? 1 : 0;
+		count += isToken & ~inToken;
+		inToken = isToken;
+	}
+	return count;
+}
+
+// true if the line starts with the keyword followed by whitespace, args is set to what follows
+static inline bool matchKeyword(const char* line, const char* lineEnd, const char* keyword, size_t length, const char*& args) {
+	if ((size_t)(lineEnd - line) <= length ||
+		memcmp(line, keyword, length) != 0 ||
+		isSpace(line[length]) == false)
+		return false;
+	args = line + length + 1;
+	return true;
+}
+
+static LineType classifyLine(const char* line, const char* lineEnd, const char*& args) {
+	line = skipSpace(line, lineEnd);
+
+	if (line == lineEnd)
+		return LINE_OTHER;
+
+	switch (line[0]) {
+	case 'v':
+		if (matchKeyword(line, lineEnd, "v", 1, args))		return LINE_POSITION;
+		if (matchKeyword(line, lineEnd, "vt", 2, args))		return LINE_TEXCOORD;
+		if (matchKeyword(line, lineEnd, "vn", 2, args))		return LINE_NORMAL;
+		break;
+	case 'f':
+		if (matchKeyword(line, lineEnd, "f", 1, args))		return LINE_FACE;
+		break;
+	case 'o':
+		if (matchKeyword(line, lineEnd, "o", 1, args))		return LINE_OBJECT;
+		break;
+	case 'g':
+		if (matchKeyword(line, lineEnd, "g", 1, args))		return LINE_OBJECT;
+		break;
+	case 'u':
+		if (matchKeyword(line, lineEnd, "usemtl", 6, args))	return LINE_MATERIAL;
+		break;
+	case 'm':
+		if (matchKeyword(line, lineEnd, "mtllib", 6, args))	return LINE_MATERIAL_LIBRARY;
+		break;
+	default:
+		break;
+	}
+	return LINE_OTHER;
+}
+
+// the rest of the line with surrounding whitespace removed
+static std::string readName(const char* p, const char* end) {
+	p = skipSpace(p, end);
+	while (end > p && isSpace(end[-1]))
+		--end;
+	return std::string(p, end);
+}
+
+static const char* parseFloat(const char* p, const char* end, float& value) {
+	static const double powersOf10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+
+	p = skipSpace(p, end);
+	const char* start = p;
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		++p;
+	}
+
+	// accumulate up to 19 significant digits, anything past that only moves the exponent
+	unsigned long long mantissa = 0;
+	int significant = 0;
+	int exponent = 0;
+	bool hasDigits = false;
+
+	for (; p < end && (unsigned int)(*p - '0') < 10; ++p) {
+		hasDigits = true;
+		if (significant < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			significant += mantissa != 0;
+		}
+		else
+			++exponent;
+	}
+
+	if (p < end && *p == '.') {
+		for (++p; p < end && (unsigned int)(*p - '0') < 10; ++p) {
+			hasDigits = true;
+			if (significant < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				significant += mantissa != 0;
+				--exponent;
+			}
+		}
+	}
+
+	// anything unusual (nan, inf, hex) goes through the c library
+	if (hasDigits == false) {
+		char buffer[64];
+		const char* tokenEnd = start;
+		while (tokenEnd < end && (signed char)*tokenEnd > ' ' && tokenEnd - start < 63)
+			++tokenEnd;
+		memcpy(buffer, start, tokenEnd - start);
+		buffer[tokenEnd - start] = 0;
+		value = strtof(buffer, nullptr);
+		return tokenEnd;
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char* e = p + 1;
+		bool negativeExponent = false;
+		if (e < end && (*e == '-' || *e == '+')) {
+			negativeExponent = *e == '-';
+			++e;
+		}
+		if (e < end && (unsigned int)(*e - '0') < 10) {
+			int power = 0;
+			for (; e < end && (unsigned int)(*e - '0') < 10; ++e)
+				power = power < 10000 ? power * 10 + (*e - '0') : power;
+			exponent += negativeExponent ? -power : power;
+			p = e;
+		}
+	}
+
+	double result = (double)mantissa;
+	if (exponent < 0)
+		result = -exponent <= 22 ? result / powersOf10[-exponent] : result * std::pow(10.0, exponent);
+	else if (exponent > 0)
+		result = exponent <= 22 ? result * powersOf10[exponent] : result * std::pow(10.0, exponent);
+
+	value = (float)(negative ? -result : result);
+	return p;
+}
+
+static inline const char* parseInt(const char* p, const char* end, int& value) {
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		++p;
+	}
+
+	int result = 0;
+	for (; p < end && (unsigned int)(*p - '0') < 10; ++p)
+		result = result * 10 + (*p - '0');
+
+	value = negative ? -result : result;
+	return p;
+}
+
+// obj indices are 1-based, or relative to the current end of the list when negative
+static inline int resolveIndex(int index, unsigned int count) {
+	if (index > 0)
+		return index - 1;
+	if (index < 0)
+		return (int)count + index;
+	return -1;
+}
+
+// parses one v, v/vt, v//vn or v/vt/vn token
+static const char* parseCorner(const char* p, const char* end, const unsigned int counts[3], Corner& corner) {
+	int index = 0;
+
+	corner.texcoord = -1;
+	corner.normal = -1;
+
+	p = parseInt(p, end, index);
+	corner.position = resolveIndex(index, counts[0]);
+
+	if (p < end && *p == '/') {
+		++p;
+		if (p < end && *p != '/' && (signed char)*p > ' ') {
+			p = parseInt(p, end, index);
+			corner.texcoord = resolveIndex(index, counts[1]);
+		}
+		if (p < end && *p == '/') {
+			++p;
+			p = parseInt(p, end, index);
+			corner.normal = resolveIndex(index, counts[2]);
+		}
+	}
+
+	// skip anything unexpected left in the token
+	while (p < end && (signed char)*p > ' ')
+		++p;
+	return p;
+}
+
+// first pass, counts every element so the file wide arrays can be allocated exactly
+static void countRange(Range& range) {
+	range.positions = range.texcoords = range.normals = range.triangles = 0;
+
+	const char* args = nullptr;
+	for (const char* p = range.begin; p < range.end; ) {
+		const char* lineEnd = findLineEnd(p, range.end);
+
+		switch (classifyLine(p, lineEnd, args)) {
+		case LINE_POSITION:	++range.positions;	break;
+		case LINE_TEXCOORD:	++range.texcoords;	break;
+		case LINE_NORMAL:	++range.normals;	break;
+		case LINE_FACE: {
+			unsigned int corners = countTokens(args, lineEnd);
+			if (corners >= 3)
+				range.triangles += corners - 2;
+			break;
+		}
+		case LINE_OBJECT: {
+			Event event = { Event::OBJECT, range.triangles, readName(args, lineEnd) };
+			range.events.push_back(event);
+			break;
+		}
+		case LINE_MATERIAL: {
+			Event event = { Event::MATERIAL, range.triangles, readName(args, lineEnd) };
+			range.events.push_back(event);
+			break;
+		}
+		case LINE_MATERIAL_LIBRARY: {
+			Event event = { Event::MATERIAL_LIBRARY, range.triangles, readName(args, lineEnd) };
+			range.events.push_back(event);
+			break;
+		}
+		default:
+			break;
+		}
+
+		p = lineEnd + 1;
+	}
+}
+
+// second pass, parses straight in to this range's slice of the file wide arrays
+static void parseRange(const Range& range, bool flipTextureV,
+					   float* positions, float* texcoords, float* normals, Corner* triangles) {
+
+	// running totals, used to resolve relative indices
+	unsigned int counts[3] = { range.positionOffset, range.texcoordOffset, range.normalOffset };
+
+	float* position = positions + range.positionOffset * 3;
+	float* texcoord = texcoords + range.texcoordOffset * 2;
+	float* normal = normals + range.normalOffset * 3;
+	Corner* corner = triangles + range.triangleOffset * 3;
+
+	std::vector<Corner> face;
+
+	const char* args = nullptr;
+	for (const char* p = range.begin; p < range.end; ) {
+		const char* lineEnd = findLineEnd(p, range.end);
+
+		switch (classifyLine(p, lineEnd, args)) {
+		case LINE_POSITION:
+			args = parseFloat(args, lineEnd, position[0]);
+			args = parseFloat(args, lineEnd, position[1]);
+			parseFloat(args, lineEnd, position[2]);
+			position += 3;
+			++counts[0];
+			break;
+		case LINE_TEXCOORD:
+			args = parseFloat(args, lineEnd, texcoord[0]);
+			parseFloat(args, lineEnd, texcoord[1]);
+
+			// flip the T / V (might not always be needed, depends on how mesh was made)
+			if (flipTextureV)
+				texcoord[1] = 1.0f - texcoord[1];
+			texcoord += 2;
+			++counts[1];
+			break;
+		case LINE_NORMAL:
+			args = parseFloat(args, lineEnd, normal[0]);
+			args = parseFloat(args, lineEnd, normal[1]);
+			parseFloat(args, lineEnd, normal[2]);
+			normal += 3;
+			++counts[2];
+			break;
+		case LINE_FACE: {
+			// tokens are split exactly as countTokens counted them
+			face.clear();
+			for (const char* token = skipSpace(args, lineEnd); token < lineEnd; ) {
+				if ((signed char)*token > ' ') {
+					Corner c;
+					token = parseCorner(token, lineEnd, counts, c);
+					face.push_back(c);
+				}
+				else
+					++token;
+			}
+
+			// triangulate as a fan
+			for (size_t i = 2; i < face.size(); ++i) {
+				corner[0] = face[0];
+				corner[1] = face[i - 1];
+				corner[2] = face[i];
+				corner += 3;
+			}
+			break;
+		}
+		default:
+			break;
+		}
+
+		p = lineEnd + 1;
+	}
+}
+
+// open addressing map from a corner's index triple to its vertex
+class CornerMap {
+public:
+
+	CornerMap(size_t expectedCount) : m_count(0) {
+		size_t capacity = 64;
+		while (capacity < expectedCount * 2)
+			capacity *= 2;
+		resize(capacity);
+	}
+
+	// returns the existing vertex for the corner, or adds it as newVertex
+	unsigned int findOrAdd(const Corner& corner, unsigned int newVertex, bool& added) {
+		if ((m_count + 1) * 10 > m_entries.size() * 7)
+			resize(m_entries.size() * 2);
+
+		size_t mask = m_entries.size() - 1;
+		for (size_t i = hash(corner) & mask; ; i = (i + 1) & mask) {
+			Entry& entry = m_entries[i];
+			if (entry.corner.position < 0) {
+				entry.corner = corner;
+				entry.vertex = newVertex;
+				++m_count;
+				added = true;
+				return newVertex;
+			}
+			if (entry.corner.position == corner.position &&
+				entry.corner.texcoord == corner.texcoord &&
+				entry.corner.normal == corner.normal) {
+				added = false;
+				return entry.vertex;
+			}
+		}
+	}
+
+private:
+
+	struct Entry {
+		Corner			corner;
+		unsigned int	vertex;
+	};
+
+	static size_t hash(const Corner& corner) {
+		unsigned int h = (unsigned int)corner.position * 0x9E3779B1u;
+		h ^= (unsigned int)corner.texcoord * 0x85EBCA77u + (h >> 15);
+		h ^= (unsigned int)corner.normal * 0xC2B2AE3Du + (h >> 13);
+		return h ^ (h >> 16);
+	}
+
+	void resize(size_t capacity) {
+		std::vector<Entry> old;
+		old.swap(m_entries);
+
+		Entry empty = { { -1, -1, -1 }, 0 };
+		m_entries.assign(capacity, empty);
+
+		size_t mask = capacity - 1;
+		for (auto& entry : old) {
+			if (entry.corner.position < 0)
+				continue;
+			size_t i = hash(entry.corner) & mask;
+			while (m_entries[i].corner.position >= 0)
+				i = (i + 1) & mask;
+			m_entries[i] = entry;
+		}
+	}
+
+	std::vector<Entry>	m_entries;
+	size_t				m_count;
+};
+
+bool OBJParser::parse(const char* filename, bool flipTextureV /* = false */) {
+
+	m_materials.clear();
+	m_shapes.clear();
+	m_lastError.clear();
+
+	std::string file = filename;
+	m_folder = file.substr(0, file.find_last_of('/') + 1);
+
+	MappedFile mapped;
+	if (mapped.open(filename) == false) {
+		m_lastError = "Failed to open " + file;
+		return false;
+	}
+
+	const char* data = (const char*)mapped.getData();
+	const char* dataEnd = data + mapped.getSize();
+
+	// split in to line aligned ranges, several per thread so uneven ranges balance out
+	size_t rangeCount = std::max<size_t>(1, std::min<size_t>(getThreadCount() * 4, mapped.getSize() / MIN_RANGE_SIZE));
+	std::vector<Range> ranges(rangeCount);
+
+	const char* rangeStart = data;
+	for (size_t i = 0; i < rangeCount; ++i) {
+		const char* rangeEnd = dataEnd;
+		if (i + 1 < rangeCount) {
+			rangeEnd = std::max(rangeStart, data + mapped.getSize() * (i + 1) / rangeCount);
+			rangeEnd = std::min(findLineEnd(rangeEnd, dataEnd) + 1, dataEnd);
+		}
+		ranges[i].begin = rangeStart;
+		ranges[i].end = rangeEnd;
+		rangeStart = rangeEnd;
+	}
+
+	parallelFor((unsigned int)rangeCount, [&](unsigned int i) {
+		countRange(ranges[i]);
+	});
+
+	// prefix sums give every range its place in the file wide arrays
+	unsigned int positionCount = 0, texcoordCount = 0, normalCount = 0, triangleCount = 0;
+	for (auto& range : ranges) {
+		range.positionOffset = positionCount;
+		range.texcoordOffset = texcoordCount;
+		range.normalOffset = normalCount;
+		range.triangleOffset = triangleCount;
+
+		positionCount += range.positions;
+		texcoordCount += range.texcoords;
+		normalCount += range.normals;
+		triangleCount += range.triangles;
+	}
+
+	std::vector<float> positions(positionCount * 3);
+	std::vector<float> texcoords(texcoordCount * 2);
+	std::vector<float> normals(normalCount * 3);
+	std::vector<Corner> triangles(triangleCount * 3);
+
+	parallelFor((unsigned int)rangeCount, [&](unsigned int i) {
+		parseRange(ranges[i], flipTextureV, positions.data(), texcoords.data(), normals.data(), triangles.data());
+	});
+
+	// material libraries are small, so they are read on this thread
+	for (auto& range : ranges)
+		for (auto& event : range.events)
+			if (event.type == Event::MATERIAL_LIBRARY)
+				parseMaterials(m_folder + event.name);
+
+	// walk the statements in file order, cutting a new shape at each object, group or material change
+	struct ShapeRange {
+		std::string		name;
+		int				materialID;
+		unsigned int	firstTriangle;
+		unsigned int	triangleCount;
+	};
+
+	std::vector<ShapeRange> shapeRanges;
+	ShapeRange current = { "", -1, 0, 0 };
+
+	for (auto& range : ranges) {
+		for (auto& event : range.events) {
+			if (event.type == Event::MATERIAL_LIBRARY)
+				continue;
+
+			int materialID = event.type == Event::MATERIAL ? findMaterial(event.name) : current.materialID;
+			if (event.type == Event::MATERIAL && materialID == current.materialID)
+				continue;
+
+			unsigned int triangle = range.triangleOffset + event.triangle;
+			current.triangleCount = triangle - current.firstTriangle;
+			if (current.triangleCount > 0)
+				shapeRanges.push_back(current);
+
+			if (event.type == Event::OBJECT)
+				current.name = event.name;
+			current.materialID = materialID;
+			current.firstTriangle = triangle;
+		}
+	}
+
+	current.triangleCount = triangleCount - current.firstTriangle;
+	if (current.triangleCount > 0)
+		shapeRanges.push_back(current);
+
+	// build each shape's final vertices and indices, one unique vertex per index triple
+	m_shapes.resize(shapeRanges.size());
+	std::vector<char> shapeFailed(shapeRanges.size(), 0);
+
+	parallelFor((unsigned int)shapeRanges.size(), [&](unsigned int s) {
+		const ShapeRange& range = shapeRanges[s];
+		Shape& shape = m_shapes[s];
+
+		shape.name = range.name;
+		shape.materialID = range.materialID;
+		shape.hasNormals = false;
+		shape.hasTexcoords = false;
+
+		unsigned int cornerCount = range.triangleCount * 3;
+		const Corner* corners = triangles.data() + range.firstTriangle * 3;
+
+		CornerMap map(std::min(cornerCount, positionCount));
+		shape.indices.resize(cornerCount);
+		shape.vertices.reserve(std::min(cornerCount, positionCount));
+
+		for (unsigned int i = 0; i < cornerCount; ++i) {
+			const Corner& c = corners[i];
+
+			if (c.position < 0 || c.position >= (int)positionCount ||
+				c.texcoord < -1 || c.texcoord >= (int)texcoordCount ||
+				c.normal < -1 || c.normal >= (int)normalCount) {
+				shapeFailed[s] = 1;
+				return;
+			}
+
+			bool added = false;
+			shape.indices[i] = map.findOrAdd(c, (unsigned int)shape.vertices.size(), added);
+			if (added == false)
+				continue;
+
+			OBJMesh::Vertex vertex;
+			const float* p = &positions[c.position * 3];
+			vertex.position = glm::vec4(p[0], p[1], p[2], 1);
+			vertex.normal = glm::vec4(0);
+			vertex.texcoord = glm::vec2(0);
+			vertex.tangent = glm::vec4(0);
+
+			if (c.normal >= 0) {
+				const float* n = &normals[c.normal * 3];
+				vertex.normal = glm::vec4(n[0], n[1], n[2], 0);
+				shape.hasNormals = true;
+			}
+			if (c.texcoord >= 0) {
+				const float* t = &texcoords[c.texcoord * 2];
+				vertex.texcoord = glm::vec2(t[0], t[1]);
+				shape.hasTexcoords = true;
+			}
+
+			shape.vertices.push_back(vertex);
+		}
+	});
+
+	for (size_t s = 0; s < shapeFailed.size(); ++s) {
+		if (shapeFailed[s]) {
+			m_shapes.clear();
+			m_lastError = "Invalid face index in " + file;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool OBJParser::parseMaterials(const std::string& filename) {
+
+	MappedFile mapped;
+	if (mapped.open(filename.c_str()) == false) {
+		printf("Material file %s not found!\n", filename.c_str());
+		return false;
+	}
+
+	const char* data = (const char*)mapped.getData();
+	const char* dataEnd = data + mapped.getSize();
+
+	Material* material = nullptr;
+
+	for (const char* p = data; p < dataEnd; ) {
+		const char* lineEnd = findLineEnd(p, dataEnd);
+		const char* line = skipSpace(p, lineEnd);
+		const char* args = nullptr;
+		p = lineEnd + 1;
+
+		if (matchKeyword(line, lineEnd, "newmtl", 6, args)) {
+			Material m;
+			m.name = readName(args, lineEnd);
+			for (int i = 0; i < 3; ++i)
+				m.ambient[i] = m.diffuse[i] = m.specular[i] = m.emissive[i] = 0;
+			m.specularPower = 1;
+			m.opacity = 1;
+			m_materials.push_back(m);
+			material = &m_materials.back();
+			continue;
+		}
+
+		// everything else belongs to a material
+		if (material == nullptr)
+			continue;
+
+		float* colour = nullptr;
+		if (matchKeyword(line, lineEnd, "Ka", 2, args))
+			colour = material->ambient;
+		else if (matchKeyword(line, lineEnd, "Kd", 2, args))
+			colour = material->diffuse;
+		else if (matchKeyword(line, lineEnd, "Ks", 2, args))
+			colour = material->specular;
+		else if (matchKeyword(line, lineEnd, "Ke", 2, args))
+			colour = material->emissive;
+
+		if (colour != nullptr) {
+			args = parseFloat(args, lineEnd, colour[0]);
+			args = parseFloat(args, lineEnd, colour[1]);
+			parseFloat(args, lineEnd, colour[2]);
+		}
+		else if (matchKeyword(line, lineEnd, "Ns", 2, args))
+			parseFloat(args, lineEnd, material->specularPower);
+		else if (matchKeyword(line, lineEnd, "d", 1, args))
+			parseFloat(args, lineEnd, material->opacity);
+		else if (matchKeyword(line, lineEnd, "Tr", 2, args)) {
+			float transparency = 0;
+			parseFloat(args, lineEnd, transparency);
+			material->opacity = 1.0f - transparency;
+		}
+		else if (matchKeyword(line, lineEnd, "map_Kd", 6, args))
+			material->textureNames[0] = readName(args, lineEnd);
+		else if (matchKeyword(line, lineEnd, "map_d", 5, args))
+			material->textureNames[1] = readName(args, lineEnd);
+		else if (matchKeyword(line, lineEnd, "map_Ka", 6, args))
+			material->textureNames[2] = readName(args, lineEnd);
+		else if (matchKeyword(line, lineEnd, "map_Ks", 6, args))
+			material->textureNames[3] = readName(args, lineEnd);
+		else if (matchKeyword(line, lineEnd, "map_Ns", 6, args))
+			material->textureNames[4] = readName(args, lineEnd);
+		else if (matchKeyword(line, lineEnd, "map_bump", 8, args) ||
+				 matchKeyword(line, lineEnd, "map_Bump", 8, args) ||
+				 matchKeyword(line, lineEnd, "bump", 4, args))
+			material->textureNames[5] = readName(args, lineEnd);
+		else if (matchKeyword(line, lineEnd, "disp", 4, args))
+			material->textureNames[6] = readName(args, lineEnd);
+	}
+
+	return true;
+}
+
+int OBJParser::findMaterial(const std::string& name) const {
+	for (size_t i = 0; i < m_materials.size(); ++i)
+		if (m_materials[i].name == name)
+			return (int)i;
+	return -1;
+}
+
+} // namespace aie
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "OBJMesh.h"
+
+namespace aie {
+
+// multithreaded obj / mtl parser that builds OBJMesh vertices and indices directly.
+// the mapped file is split in to line aligned ranges that are counted and then parsed
+// on all cores straight in to exactly sized arrays, so nothing is copied or grown
+class OBJParser {
+public:
+
+	// material values as read from the mtl, textures are names relative to the obj folder
+	struct Material {
+		std::string	name;
+		float		ambient[3];
+		float		diffuse[3];
+		float		specular[3];
+		float		emissive[3];
+		float		specularPower;
+		float		opacity;
+		std::string	textureNames[7];	// same order as the OBJMesh::Material bound slots
+	};
+
+	// faces are split in to shapes at every object, group and material change
+	struct Shape {
+		std::string						name;
+		int								materialID;
+		bool							hasNormals;
+		bool							hasTexcoords;
+		std::vector<OBJMesh::Vertex>	vertices;
+		std::vector<unsigned int>		indices;
+	};
+
+	OBJParser() {}
+	~OBJParser() {}
+
+	bool parse(const char* filename, bool flipTextureV = false);
+
+	const std::string& getLastError() const { return m_lastError; }
+
+	std::vector<Material>&	getMaterials() { return m_materials; }
+	std::vector<Shape>&		getShapes() { return m_shapes; }
+
+private:
+
+	bool parseMaterials(const std::string& filename);
+	int findMaterial(const std::string& name) const;
+
+	std::string				m_folder;
+	std::string				m_lastError;
+	std::vector<Material>	m_materials;
+	std::vector<Shape>		m_shapes;
+};
+
+} // namespace aie
@@ -0,0 +1,56 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+//returns the number of threads parallelFor will run on, including the calling thread
+inline unsigned int getThreadCount()
+{
+	unsigned int count = std::thread::hardware_concurrency();
+	return count == 0 ? 1 : count;
+}
+
+//true on threads that already run one of a set spread over the hardware threads, such as asset
+//loader workers, where parallelFor runs serially rather than starting threads of its own
+inline bool& isSerialThread()
+{
+	static thread_local bool serial = false;
+	return serial;
+}
+
+//calls function(index) for every index in [0, count) across all hardware threads
+//indices are handed out one at a time so uneven jobs balance out, and the calling thread joins in
+template <typename Function>
+void parallelFor(unsigned int count, const Function& function)
+{
+	unsigned int threadCount = isSerialThread() ? 1 : std::min(getThreadCount(), count);
+
+	if (threadCount <= 1)
+	{
+		for (unsigned int i = 0; i < count; i++)
+			function(i);
+		return;
+	}
+
+	std::atomic<unsigned int> next(0);
+	auto worker = [&]()
+	{
+		//nested calls stay on the threads already started
+		bool wasSerial = isSerialThread();
+		isSerialThread() = true;
+		for (unsigned int i = next++; i < count; i = next++)
+			function(i);
+		isSerialThread() = wasSerial;
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(threadCount - 1);
+	for (unsigned int i = 1; i < threadCount; i++)
+		threads.emplace_back(worker);
+
+	worker();
+
+	for (auto& thread : threads)
+		thread.join();
+}
@@ -0,0 +1,72 @@
+#include "RenderQueue.h"
+#include <glm/common.hpp>
+
+static_assert(RenderQueue::PASS_BITS + RenderQueue::TRANSLUCENT_BITS + RenderQueue::PROGRAM_BITS +
+	RenderQueue::MATERIAL_BITS + RenderQueue::MESH_BITS + RenderQueue::DEPTH_BITS == 64, "sort key fields must fill 64 bits");
+
+
+//the key without its depth
+uint64_t RenderQueue::makeKey(unsigned int pass, bool translucent, unsigned int program, unsigned int material, unsigned int mesh)
+{
+	uint64_t key = pass & ((1u << PASS_BITS) - 1);
+	key = (key << TRANSLUCENT_BITS) | (translucent ? 1 : 0);
+	key = (key << PROGRAM_BITS) | (program & ((1u << PROGRAM_BITS) - 1));
+	key = (key << MATERIAL_BITS) | (material & ((1u << MATERIAL_BITS) - 1));
+	key = (key << MESH_BITS) | (mesh & ((1u << MESH_BITS) - 1));
+	return key << DEPTH_BITS;
+}
+
+
+//the key with a depth, reversed for translucent keys
+uint64_t RenderQueue::addDepth(uint64_t key, float depth)
+{
+	const unsigned int maxDepth = (1u << DEPTH_BITS) - 1;
+	unsigned int quantised = (unsigned int)(glm::clamp(depth, 0.0f, 1.0f) * maxDepth);
+
+	bool translucent = ((key >> (DEPTH_BITS + MESH_BITS + MATERIAL_BITS + PROGRAM_BITS)) & 1) != 0;
+	if (translucent)
+		quantised = maxDepth - quantised;
+
+	return (key & ~(uint64_t)maxDepth) | quantised;
+}
+
+
+//least significant digit radix sort a byte at a time, skipping bytes every key shares
+void RenderQueue::sort()
+{
+	size_t count = m_items.size();
+	if (count < 2)
+		return;
+
+	//every byte's histogram in one read of the keys
+	size_t histograms[8][256] = {};
+	for (size_t i = 0; i < count; i++)
+	{
+		uint64_t key = m_items[i].key;
+		for (unsigned int b = 0; b < 8; b++)
+			histograms[b][(key >> (b * 8)) & 0xff]++;
+	}
+
+	m_scratch.resize(count);
+	for (unsigned int b = 0; b < 8; b++)
+	{
+		size_t* histogram = histograms[b];
+
+		//a byte every key shares doesn't change the order
+		if (histogram[(m_items[0].key >> (b * 8)) & 0xff] == count)
+			continue;
+
+		size_t offset = 0;
+		for (unsigned int d = 0; d < 256; d++)
+		{
+			size_t digitCount = histogram[d];
+			histogram[d] = offset;
+			offset += digitCount;
+		}
+
+		//stable scatter, so the lower bytes' order survives
+		for (size_t i = 0; i < count; i++)
+			m_scratch[histogram[(m_items[i].key >> (b * 8)) & 0xff]++] = m_items[i];
+		m_items.swap(m_scratch);
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+//the draw items of a pass with packed sort keys. sorting puts items sharing a program together, then
+//those sharing a material, then a mesh, with opaque items front to back followed by translucent ones
+//back to front, so submission only changes the state that differs from the item before
+class RenderQueue
+{
+public:
+
+	//bits of each field of a key, from the most significant
+	static const unsigned int PASS_BITS = 2;
+	static const unsigned int TRANSLUCENT_BITS = 1;
+	static const unsigned int PROGRAM_BITS = 10;
+	static const unsigned int MATERIAL_BITS = 16;
+	static const unsigned int MESH_BITS = 16;
+	static const unsigned int DEPTH_BITS = 19;
+
+	struct Item
+	{
+		uint64_t key;
+		unsigned int index;
+	};
+
+	//the key without its depth. ids past their field's range wrap, which only costs sorting quality
+	static uint64_t makeKey(unsigned int pass, bool translucent, unsigned int program, unsigned int material, unsigned int mesh);
+	//the key with a depth from 0 at the camera to 1 at the far end of the range, reversed for translucent keys
+	static uint64_t addDepth(uint64_t key, float depth);
+
+	void clear() { m_items.clear(); }
+	void add(uint64_t key, unsigned int index) { m_items.push_back({ key, index }); }
+	//least significant digit radix sort a byte at a time, skipping bytes every key shares
+	void sort();
+
+	const std::vector<Item>& getItems() const { return m_items; }
+
+private:
+
+	std::vector<Item> m_items;
+	std::vector<Item> m_scratch;
+};
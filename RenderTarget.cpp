@@ -1,4 +1,5 @@
 #include "RenderTarget.h"
+#include "GLState.h"
 #include "gl_core_4_4.h"
 #include <vector>
 
@@ -25,7 +26,7 @@ bool RenderTarget::initialise(unsigned int targetCount, unsigned int width, unsi
 
 	// setup and bind a framebuffer object
 	glGenFramebuffers(1, &m_fbo);
-	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+	GLState::bindFramebuffer(m_fbo);
 
     if (use_depth_texture) {
         glGenTextures(1, &m_depthTarget);
@@ -81,7 +82,7 @@ bool RenderTarget::initialise(unsigned int targetCount, unsigned int width, unsi
 	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
 
 		// cleanup
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		GLState::bindFramebuffer(0);
 		delete[] m_targets;
 		m_targets = nullptr;
         if(m_depthTarget)
@@ -97,7 +98,7 @@ bool RenderTarget::initialise(unsigned int targetCount, unsigned int width, unsi
 	}
 
 	// success
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	GLState::bindFramebuffer(0);
 	m_targetCount = targetCount;
 	m_width = width;
 	m_height = height;
@@ -115,16 +116,15 @@ RenderTarget::~RenderTarget() {
 }
 
 void RenderTarget::bind() {
-	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+	GLState::bindFramebuffer(m_fbo);
 }
 
 void RenderTarget::unbind() {
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	GLState::bindFramebuffer(0);
 }
 
 void RenderTarget::bindDepthTarget(unsigned int index) const {
-    glActiveTexture(GL_TEXTURE0 + index);
-    glBindTexture(GL_TEXTURE_2D, m_depthTarget);
+    GLState::bindTexture(index, m_depthTarget);
 }
 
 } // namespace aie
\ No newline at end of file
@@ -1,7 +1,29 @@
 #include "Scene.h"
 #include "Instance.h"
+#include "Shader.h"
+#include "IndirectDrawList.h"
+#include "InstanceCuller.h"
+#include "Camera.h"
+#include "GLState.h"
+#include "Frustum.h"
 #include "gl_core_4_4.h"
 #include <glm/gtc/matrix_transform.hpp>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define SCENE_SSE2
+#include <xmmintrin.h>
+#endif
+
+//a material id no batch has, so the next batch binds its material
+static const unsigned int NO_MATERIAL = ~0u;
+//an instance not in a pass's batch buffer or culler
+static const unsigned int NO_SLOT = ~0u;
+//below this many instances every instance's bounds are swept, four at a time, instead of walking the hierarchy
+static const unsigned int HIERARCHY_MIN_INSTANCES = 1024;
 
 Scene::Scene(Camera* camera, glm::vec2 windowSize, Light& light, glm::vec3 ambientLight)
 {
@@ -9,49 +31,135 @@ Scene::Scene(Camera* camera, glm::vec2 windowSize, Light& light, glm::vec3 ambie
 	m_windowSize = windowSize;
 	m_sunlight = light;
 	m_ambientLight = ambientLight;
+
+	//every pass builds its cullers and batches the first time it is drawn
+	for (int i = 0; i < MAX_PASSES; i++)
+	{
+		m_cullersDirty[i] = true;
+		m_batchesDirty[i] = true;
+	}
 }
 
 
 Scene::~Scene()
 {
-	for (auto it = m_instances.begin(); it != m_instances.end(); it++)
-		delete* it;
+	Instance* const* instances = m_instances.getInstances();
+	for (unsigned int i = 0; i < m_instances.getCount(); i++)
+		delete instances[i];
+	for (int i = 0; i < MAX_PASSES; i++)
+		delete m_cullers[i];
+	glDeleteBuffers(MAX_PASSES, m_batchBuffers);
+	glDeleteBuffers(1, &m_streamBuffer);
 }
 
 
-void Scene::AddInstance(Instance* instance, int ySign)
+//adds an instance to the layers that are above or below the water level, the scene then owns it
+InstanceHandle Scene::AddInstance(Instance* instance, int ySign)
 {
-	m_instances.push_back(instance);
-
+	unsigned int layers = LAYER_SCENE;
 	if (ySign == 1 || ySign == 2)
-		m_aboveWater.push_back(instance);
+		layers |= LAYER_ABOVE_WATER;
 	if (ySign == -1 || ySign == 2)
-		m_underWater.push_back(instance);
+		layers |= LAYER_UNDER_WATER;
 	if (ySign != 0)
-		m_notWater.push_back(instance);
+		layers |= LAYER_NOT_WATER;
+
+	//the instance's setters tell the scene when its batch or material changes
+	instance->m_scene = this;
+
+	//mesh ids are dense in order of first use, material ids wait for the first draw
+	auto mesh = m_meshIds.insert(std::make_pair(instance->getMeshKey(), (unsigned int)m_meshIds.size())).first;
+
+	//instances without bounds yet are added unbounded, so they're drawn until they have them
+	InstanceHandle handle;
+	if (instance->hasBounds())
+	{
+		handle = m_instances.add(instance, layers, mesh->second, 0, instance->getBoundsMin(), instance->getBoundsMax());
+		unsigned int index = m_instances.getIndex(handle);
+		m_bvh.insert(handle, m_instances.getBoundsMin(index), m_instances.getBoundsMax(index));
+	}
+	else
+	{
+		handle = m_instances.add(instance, layers, mesh->second, 0, glm::vec3(0), glm::vec3(0));
+		m_unboundedInstances.push_back(handle);
+	}
+
+	for (unsigned int bit = 0; bit < 4; bit++)
+		m_layerCounts[bit] += (layers >> bit) & 1;
+	markInstancesDirty();
+	return handle;
+}
+
+
+//removes and deletes an instance, the handle going stale
+bool Scene::RemoveInstance(InstanceHandle handle)
+{
+	if (m_instances.isAlive(handle) == false)
+		return false;
+
+	unsigned int layers = m_instances.getLayers()[m_instances.getIndex(handle)];
+	for (unsigned int bit = 0; bit < 4; bit++)
+		m_layerCounts[bit] -= (layers >> bit) & 1;
+
+	m_bvh.remove(handle);
+	delete m_instances.remove(handle);
+	markInstancesDirty();
+	return true;
+}
+
+
+//moves an instance, rewriting only its transform in the passes' batch buffers and cullers
+void Scene::setInstanceTransform(InstanceHandle handle, const glm::mat4& transform)
+{
+	Instance* instance = m_instances.get(handle);
+	if (instance == nullptr)
+		return;
+
+	instance->setTransform(transform);
+	m_instances.setTransform(handle, transform);
+	unsigned int index = m_instances.getIndex(handle);
+	m_bvh.update(handle, m_instances.getBoundsMin(index), m_instances.getBoundsMax(index));
+
+	//batches and cullers waiting to be rebuilt will take the new transform then
+	for (int i = 0; i < MAX_PASSES; i++)
+	{
+		if (m_batchesDirty[i] == false && index < m_memberSlots[i].size() && m_memberSlots[i][index] != NO_SLOT)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, m_batchBuffers[i]);
+			glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)m_memberSlots[i][index] * sizeof(glm::mat4), sizeof(glm::mat4), &transform);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+		if (m_cullersDirty[i] == false && index < m_cullerIndices[i].size() && m_cullerIndices[i][index] != NO_SLOT)
+			m_cullers[i]->updateInstance(m_cullerIndices[i][index], transform, instance->getBoundsMin(), instance->getBoundsMax());
+	}
+}
+
+
+//the passes' batches, culled draws and material ids are rebuilt the next time they are drawn
+void Scene::markInstancesDirty()
+{
+	m_materialIdsDirty = true;
+	for (int i = 0; i < MAX_PASSES; i++)
+	{
+		m_cullersDirty[i] = true;
+		m_batchesDirty[i] = true;
+	}
 }
 
 
 void Scene::draw(int ySign, aie::ShaderProgram* tempShader)
 {
-	//enable gl wire frame rendering
-	if (m_wireFrameActive)
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	m_currentPass = ySign + 1;
 
-	//get the pvm for the sunlight
-	glm::vec3 lightDirection = glm::normalize(glm::vec3(getLight().direction * -1.0f));
-	glm::mat4 lightProjection = glm::ortho<float>(-10, 10, -10, 10, -10, 10);
-	glm::mat4 lightView = glm::lookAt(lightDirection, glm::vec3(0), glm::vec3(0, 1, 0));
-	m_lightMatrix = lightProjection * lightView;
+	//gizmos and the ui bind around the state cache between passes
+	aie::GLState::invalidate();
 
-	glm::mat4 textureSpaceOffset(
-		0.5f, 0.0f, 0.0f, 0.0f,
-		0.0f, 0.5f, 0.0f, 0.0f,
-		0.0f, 0.0f, 0.5f, 0.0f,
-		0.5f, 0.5f, 0.5f, 1.0f
-	);
+	//enable gl wire frame rendering
+	if (m_wireFrameActive)
+		aie::GLState::setPolygonMode(GL_LINE);
 
-	m_offsetLightMatrix = textureSpaceOffset * m_lightMatrix;
+	updateLightMatrix();
+	updatePassMatrices();
 
 	//alway draw all lights
 	for (int i = 0; i < MAX_LIGHTS && i < m_pointLights.size(); i++)
@@ -59,86 +167,581 @@ void Scene::draw(int ySign, aie::ShaderProgram* tempShader)
 		m_pointLightPositions[i] = m_pointLights[i].direction;
 		m_pointLightColours[i] = m_pointLights[i].colour;
 	}
+
+	updateConstants(ySign);
 	
-	//draw everything
+	//draw the pass's instances, batching those that can be drawn together
+	unsigned int layer = getLayer(ySign);
+	if (layer != 0)
+		drawBatched(layer, tempShader);
+
+	//disble gl wire frame rendering before rendering the UI
+	if (m_wireFrameActive)
+		aie::GLState::setPolygonMode(GL_FILL);
+}
+
+
+void Scene::drawRaw(int ySign, aie::ShaderProgram* tempShader, bool shadowPass)
+{
+	m_currentPass = shadowPass ? SHADOW_PASS : ySign + 1;
+	aie::GLState::invalidate();
+	updateLightMatrix();
+	updatePassMatrices();
+	updateConstants(ySign);
+
+	unsigned int layer = getLayer(ySign);
+	if (layer == 0)
+		return;
+
+	//only the pvm and model matrix differ between instances here, so the model matrix can come from the draw
+	if (tempShader != nullptr && tempShader->hasInstanceMatrix())
+	{
+		m_culledCounts[m_currentPass] = 0;
+		drawCulled(layer, tempShader);
+		return;
+	}
+
+	//draw everything in the pass's layer inside the frustum, the shadow pass's being the light's
+	const glm::mat4& cullMatrix = m_currentPass == SHADOW_PASS ? m_lightMatrix : m_projectionView;
+	m_culledCounts[m_currentPass] = cullInstances(layer, cullMatrix);
+
+	//shaders reading the instance matrix take it from the attribute's current value here
+	Instance* const* instances = m_instances.getInstances();
+	for (auto it = m_visibleIndices.begin(); it != m_visibleIndices.end(); it++)
+	{
+		aie::IndirectDrawList::setCurrentTransform(instances[*it]->getTransform());
+		instances[*it]->drawRaw(this, tempShader);
+	}
+}
+
+
+//the layer drawn for a ySign, 0 for unknown values
+unsigned int Scene::getLayer(int ySign)
+{
 	if (ySign == 0)
+		return LAYER_SCENE;
+	if (ySign == 1)
+		return LAYER_ABOVE_WATER;
+	if (ySign == -1)
+		return LAYER_UNDER_WATER;
+	if (ySign == 2)
+		return LAYER_NOT_WATER;
+	return 0;
+}
+
+
+void Scene::drawCulled(unsigned int layer, aie::ShaderProgram* shader)
+{
+	aie::InstanceCuller*& culler = m_cullers[m_currentPass];
+	std::vector<Instance*>& directInstances = m_directInstances[m_currentPass];
+	if (culler == nullptr)
+		culler = new aie::InstanceCuller();
+
+	//meshes that finished loading since the last pass rebuild the cullers with their bounds and lods
+	updateUnboundedInstances();
+	if (m_cullersDirty[m_currentPass])
 	{
-		for (auto it = m_instances.begin(); it != m_instances.end(); it++)
+		m_cullersDirty[m_currentPass] = false;
+		culler->clear();
+		directInstances.clear();
+
+		//an instance adds at most one instance to the culler, which its transform is moved through
+		Instance* const* instances = m_instances.getInstances();
+		const unsigned int* layers = m_instances.getLayers();
+		std::vector<unsigned int>& cullerIndices = m_cullerIndices[m_currentPass];
+		cullerIndices.assign(m_instances.getCount(), NO_SLOT);
+		for (unsigned int i = 0; i < m_instances.getCount(); i++)
 		{
-			Instance* instance = *it;
-			instance->draw(this, tempShader);
+			if ((layers[i] & layer) == 0)
+				continue;
+
+			unsigned int cullerIndex = culler->getInstanceCount();
+			if (instances[i]->addCullDraws(*culler) == false)
+				directInstances.push_back(instances[i]);
+			else if (culler->getInstanceCount() != cullerIndex)
+				cullerIndices[i] = cullerIndex;
 		}
 	}
-	//draw everything that is above water
-	else if (ySign == 1)
+
+	//anything that can't be culled is drawn straight away, with its matrix as the attribute's current value
+	for (auto it = directInstances.begin(); it != directInstances.end(); it++)
+	{
+		aie::IndirectDrawList::setCurrentTransform((*it)->getTransform());
+		(*it)->drawRaw(this, shader);
+	}
+
+	//the shadow pass is culled against the light, lods are always picked from the camera
+	const glm::mat4& cullMatrix = m_currentPass == SHADOW_PASS ? m_lightMatrix : m_projectionView;
+
+	aie::InstanceCuller::View view;
+	view.frustum = aie::Frustum::fromMatrix(cullMatrix);
+	view.lodPosition = m_camera->getPosition();
+	view.lodPixelScale = m_projectionMatrix[1][1] * m_windowSize.y * 0.5f;
+	view.lodThreshold = Instance::getLodThreshold(getLodBias());
+	culler->draw(view);
+}
+
+
+//sorts the pass's batches in to the render queue and draws them, binding only the state that changes
+void Scene::drawBatched(unsigned int layer, aie::ShaderProgram* tempShader)
+{
+	if (m_batchesDirty[m_currentPass])
+	{
+		m_batchesDirty[m_currentPass] = false;
+		buildBatches(layer);
+	}
+
+	std::vector<Batch>& batches = m_batches[m_currentPass];
+	std::vector<unsigned int>& members = m_batchMembers[m_currentPass];
+	Instance* const* instances = m_instances.getInstances();
+	const glm::mat4* transforms = m_instances.getTransforms();
+
+	m_culledCounts[m_currentPass] = cullInstances(layer, m_projectionView);
+
+	//group the visible instances by batch, so the culled ones are never walked
+	const std::vector<unsigned int>& memberBatches = m_memberBatches[m_currentPass];
+	m_batchOffsets.assign(batches.size() + 1, 0);
+	for (auto it = m_visibleIndices.begin(); it != m_visibleIndices.end(); it++)
+		m_batchOffsets[memberBatches[*it] + 1]++;
+	for (unsigned int b = 0; b < batches.size(); b++)
+		m_batchOffsets[b + 1] += m_batchOffsets[b];
+	m_batchCursors.assign(m_batchOffsets.begin(), m_batchOffsets.end() - 1);
+	m_visibleMembers.resize(m_visibleIndices.size());
+	for (auto it = m_visibleIndices.begin(); it != m_visibleIndices.end(); it++)
+		m_visibleMembers[m_batchCursors[memberBatches[*it]]++] = *it;
+
+	//each batch draws its visible members, the transforms of partly visible instanced batches streamed together
+	m_batchDraws.clear();
+	m_visibleTransforms.clear();
+	for (unsigned int b = 0; b < batches.size(); b++)
 	{
-		for (auto it = m_aboveWater.begin(); it != m_aboveWater.end(); it++)
+		const Batch& batch = batches[b];
+
+		BatchDraw draw;
+		draw.batch = b;
+		draw.firstMember = m_batchOffsets[b];
+		draw.count = m_batchOffsets[b + 1] - m_batchOffsets[b];
+		if (draw.count == 0)
+			continue;
+
+		draw.buffer = m_batchBuffers[m_currentPass];
+		draw.firstTransform = batch.first;
+
+		aie::ShaderProgram* shader = tempShader != nullptr ? tempShader : instances[members[batch.first]]->getShader();
+		if (draw.count < batch.count && draw.count > 1 && shader->canDrawInstanced())
 		{
-			Instance* instance = *it;
-			instance->draw(this, tempShader);
+			if (m_streamBuffer == 0)
+				glGenBuffers(1, &m_streamBuffer);
+			draw.buffer = m_streamBuffer;
+			draw.firstTransform = (unsigned int)m_visibleTransforms.size();
+			for (unsigned int i = draw.firstMember; i < draw.firstMember + draw.count; i++)
+				m_visibleTransforms.push_back(transforms[m_visibleMembers[i]]);
 		}
+		m_batchDraws.push_back(draw);
 	}
-	//draw everything that is under water
-	else if (ySign == -1)
+
+	if (m_visibleTransforms.empty() == false)
 	{
-		for (auto it = m_underWater.begin(); it != m_underWater.end(); it++)
+		glBindBuffer(GL_ARRAY_BUFFER, m_streamBuffer);
+		glBufferData(GL_ARRAY_BUFFER, m_visibleTransforms.size() * sizeof(glm::mat4), m_visibleTransforms.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	//only the depth changes between frames, taken from the first instance drawn and spanning the camera's range
+	glm::vec3 cameraPosition = m_camera->getPosition();
+	float farPlane = m_camera->getFarPlane();
+	m_renderQueue.clear();
+	for (unsigned int d = 0; d < m_batchDraws.size(); d++)
+	{
+		const BatchDraw& draw = m_batchDraws[d];
+		float depth = glm::length(glm::vec3(transforms[m_visibleMembers[draw.firstMember]][3]) - cameraPosition);
+		m_renderQueue.add(RenderQueue::addDepth(batches[draw.batch].key, depth / farPlane), d);
+	}
+	m_renderQueue.sort();
+
+	aie::ShaderProgram* lastShader = nullptr;
+	unsigned int lastMaterial = NO_MATERIAL;
+	const std::vector<RenderQueue::Item>& items = m_renderQueue.getItems();
+	for (auto item = items.begin(); item != items.end(); item++)
+	{
+		const BatchDraw& draw = m_batchDraws[item->index];
+		const Batch& batch = batches[draw.batch];
+		Instance* first = instances[m_visibleMembers[draw.firstMember]];
+		aie::ShaderProgram* shader = tempShader != nullptr ? tempShader : first->getShader();
+
+		unsigned int bindFlags = 0;
+		if (shader != lastShader)
+			bindFlags = Instance::BIND_ALL;
+		else if (batch.material != lastMaterial)
+			bindFlags = Instance::BIND_MATERIAL;
+		lastShader = shader;
+		lastMaterial = batch.material;
+
+		if (draw.count > 1 && shader->canDrawInstanced())
 		{
-			Instance* instance = *it;
-			instance->draw(this, tempShader);
+			first->drawInstanced(this, tempShader, draw.buffer, draw.firstTransform, draw.count, bindFlags);
+			continue;
 		}
+
+		//everything else draws each member on its own, with its matrix as the attribute's current value
+		for (unsigned int i = draw.firstMember; i < draw.firstMember + draw.count; i++)
+		{
+			Instance* instance = instances[m_visibleMembers[i]];
+			aie::IndirectDrawList::setCurrentTransform(instance->getTransform());
+			instance->draw(this, tempShader, bindFlags);
+			bindFlags = 0;
+		}
+
+		//OBJMeshes bind their own textures over the instance's
+		if (first->isOBJMesh())
+			lastMaterial = NO_MATERIAL;
+	}
+}
+
+
+//groups the pass's instances in to batches, gives them sort keys and uploads their transforms
+void Scene::buildBatches(unsigned int layer)
+{
+	std::vector<Batch>& batches = m_batches[m_currentPass];
+	std::vector<unsigned int>& members = m_batchMembers[m_currentPass];
+	std::vector<unsigned int>& memberBatches = m_memberBatches[m_currentPass];
+	std::vector<unsigned int>& memberSlots = m_memberSlots[m_currentPass];
+
+	if (m_materialIdsDirty)
+	{
+		m_materialIdsDirty = false;
+		updateMaterialIds();
 	}
-	//draw everything that is not water
-	else if (ySign == 2)
+
+	//instances that can be batched share a shader, mesh, material and translucency,
+	//so ordering the pass's instances by those puts each batch's members next to each other
+	struct Entry
 	{
-		for (auto it = m_notWater.begin(); it != m_notWater.end(); it++)
+		aie::ShaderProgram* shader;
+		unsigned int mesh;
+		unsigned int material;
+		bool translucent;
+		unsigned int index;
+
+		bool operator<(const Entry& other) const
 		{
-			Instance* instance = *it;
-			instance->draw(this, tempShader);
+			if (shader != other.shader)
+				return std::less<aie::ShaderProgram*>()(shader, other.shader);
+			if (mesh != other.mesh)
+				return mesh < other.mesh;
+			if (material != other.material)
+				return material < other.material;
+			if (translucent != other.translucent)
+				return translucent < other.translucent;
+			return index < other.index;
 		}
+	};
+
+	Instance* const* instances = m_instances.getInstances();
+	const unsigned int* layers = m_instances.getLayers();
+	const unsigned int* meshIds = m_instances.getMeshIds();
+	const unsigned int* materialIds = m_instances.getMaterialIds();
+	const glm::mat4* instanceTransforms = m_instances.getTransforms();
+
+	std::vector<Entry> entries;
+	for (unsigned int i = 0; i < m_instances.getCount(); i++)
+	{
+		if (layers[i] & layer)
+			entries.push_back({ instances[i]->getShader(), meshIds[i], materialIds[i], instances[i]->isTranslucent(), i });
 	}
+	std::sort(entries.begin(), entries.end());
 
-	//disble gl wire frame rendering before rendering the UI
-	if (m_wireFrameActive)
-		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	//dense program ids in order of first use, for the sort keys' program field
+	std::vector<aie::ShaderProgram*> programs;
+
+	batches.clear();
+	members.clear();
+	memberBatches.resize(m_instances.getCount());
+	memberSlots.assign(m_instances.getCount(), NO_SLOT);
+	std::vector<glm::mat4> transforms;
+	transforms.reserve(entries.size());
+	for (unsigned int e = 0; e < entries.size();)
+	{
+		Instance* first = instances[entries[e].index];
+
+		//the batch runs on while the next instance draws the same way, those that can't be instanced stay alone
+		unsigned int end = e + 1;
+		while (end < entries.size() && entries[end].mesh == entries[e].mesh && entries[end].material == entries[e].material &&
+			first->canBatchWith(*instances[entries[end].index]))
+			end++;
+
+		unsigned int program = (unsigned int)(std::find(programs.begin(), programs.end(), first->getShader()) - programs.begin());
+		if (program == programs.size())
+			programs.push_back(first->getShader());
+
+		Batch batch;
+		batch.first = (unsigned int)members.size();
+		batch.count = end - e;
+		batch.key = RenderQueue::makeKey(m_currentPass, first->isTranslucent(), program, entries[e].material, entries[e].mesh);
+		batch.material = entries[e].material;
+		batches.push_back(batch);
+
+		for (; e < end; e++)
+		{
+			memberBatches[entries[e].index] = (unsigned int)batches.size() - 1;
+			memberSlots[entries[e].index] = (unsigned int)members.size();
+			members.push_back(entries[e].index);
+			transforms.push_back(instanceTransforms[entries[e].index]);
+		}
+	}
+
+	if (m_batchBuffers[m_currentPass] == 0)
+		glGenBuffers(1, &m_batchBuffers[m_currentPass]);
+	glBindBuffer(GL_ARRAY_BUFFER, m_batchBuffers[m_currentPass]);
+	//moved instances rewrite their own transform in place
+	glBufferData(GL_ARRAY_BUFFER, transforms.size() * sizeof(glm::mat4), transforms.data(), GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
 
-void Scene::drawRaw(int ySign, aie::ShaderProgram* tempShader)
+//gives instances with the same material the same id, materials being set after instances are added
+void Scene::updateMaterialIds()
 {
-	//draw everything
-	if (ySign == 0)
+	//the first instance found with each material stands for it
+	std::vector<Instance*> materials;
+	Instance* const* instances = m_instances.getInstances();
+	for (unsigned int i = 0; i < m_instances.getCount(); i++)
 	{
-		for (auto it = m_instances.begin(); it != m_instances.end(); it++)
-		{
-			Instance* instance = *it;
-			instance->drawRaw(this, tempShader);
-		}
+		unsigned int material = 0;
+		while (material < materials.size() && materials[material]->hasSameMaterial(*instances[i]) == false)
+			material++;
+		if (material == materials.size())
+			materials.push_back(instances[i]);
+		m_instances.setMaterialId(i, material);
 	}
-	//draw everything that is above water
-	else if (ySign == 1)
+}
+
+
+//lists the instances of the layer whose bounds are inside the frustum of the matrix as visible,
+//returning how many are outside. large scenes walk the hierarchy, small ones sweep every instance
+unsigned int Scene::cullInstances(unsigned int layer, const glm::mat4& cullMatrix)
+{
+	updateUnboundedInstances();
+
+	aie::Frustum frustum = aie::Frustum::fromMatrix(cullMatrix);
+	const unsigned int* layers = m_instances.getLayers();
+	m_visibleIndices.clear();
+
+	unsigned int count = m_instances.getCount();
+	if (count >= HIERARCHY_MIN_INSTANCES)
 	{
-		for (auto it = m_aboveWater.begin(); it != m_aboveWater.end(); it++)
+		unsigned int layerCount = 0;
+		for (unsigned int bit = 0; bit < 4; bit++)
+			layerCount += (layer >> bit) & 1 ? m_layerCounts[bit] : 0;
+
+		m_bvh.rebuildIfWorn();
+		m_queryResults.clear();
+		m_bvh.queryFrustum(frustum, m_queryResults);
+		//instances without bounds aren't in the hierarchy, and are always drawn
+		m_queryResults.insert(m_queryResults.end(), m_unboundedInstances.begin(), m_unboundedInstances.end());
+
+		for (auto it = m_queryResults.begin(); it != m_queryResults.end(); it++)
 		{
-			Instance* instance = *it;
-			instance->drawRaw(this, tempShader);
+			unsigned int index = m_instances.getIndex(*it);
+			if (layers[index] & layer)
+				m_visibleIndices.push_back(index);
 		}
+		return layerCount - (unsigned int)m_visibleIndices.size();
 	}
-	//draw everything that is under water
-	else if (ySign == -1)
+
+	const float* centre[3] = { m_instances.getBoundsCentre(0), m_instances.getBoundsCentre(1), m_instances.getBoundsCentre(2) };
+	const float* extent[3] = { m_instances.getBoundsExtent(0), m_instances.getBoundsExtent(1), m_instances.getBoundsExtent(2) };
+
+	unsigned int culled = 0;
+	unsigned int i = 0;
+#ifdef SCENE_SSE2
+	//four instances at a time, outside when the centre is further behind any plane than the extent reaches
+	__m128 planes[6][4];
+	__m128 absNormals[6][3];
+	for (int p = 0; p < 6; p++)
 	{
-		for (auto it = m_underWater.begin(); it != m_underWater.end(); it++)
+		for (int c = 0; c < 4; c++)
+			planes[p][c] = _mm_set1_ps(frustum.planes[p][c]);
+		for (int c = 0; c < 3; c++)
+			absNormals[p][c] = _mm_set1_ps(std::abs(frustum.planes[p][c]));
+	}
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 cx = _mm_loadu_ps(centre[0] + i);
+		__m128 cy = _mm_loadu_ps(centre[1] + i);
+		__m128 cz = _mm_loadu_ps(centre[2] + i);
+		__m128 ex = _mm_loadu_ps(extent[0] + i);
+		__m128 ey = _mm_loadu_ps(extent[1] + i);
+		__m128 ez = _mm_loadu_ps(extent[2] + i);
+
+		__m128 outside = _mm_setzero_ps();
+		for (int p = 0; p < 6; p++)
 		{
-			Instance* instance = *it;
-			instance->drawRaw(this, tempShader);
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, planes[p][0]), _mm_mul_ps(cy, planes[p][1])),
+				_mm_add_ps(_mm_mul_ps(cz, planes[p][2]), planes[p][3]));
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, absNormals[p][0]), _mm_mul_ps(ey, absNormals[p][1])),
+				_mm_mul_ps(ez, absNormals[p][2]));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+		}
+
+		int outsideMask = _mm_movemask_ps(outside);
+		for (unsigned int lane = 0; lane < 4; lane++)
+		{
+			if ((layers[i + lane] & layer) == 0)
+				continue;
+			if (outsideMask & (1 << lane))
+				culled++;
+			else
+				m_visibleIndices.push_back(i + lane);
 		}
 	}
-	//draw everything that is not water
-	else if (ySign == 2)
+#endif
+
+	for (; i < count; i++)
+	{
+		if ((layers[i] & layer) == 0)
+			continue;
+		if (frustum.intersectsBox(glm::vec3(centre[0][i], centre[1][i], centre[2][i]), glm::vec3(extent[0][i], extent[1][i], extent[2][i])))
+			m_visibleIndices.push_back(i);
+		else
+			culled++;
+	}
+
+	return culled;
+}
+
+
+//gives unbounded instances their bounds once their meshes have loaded
+void Scene::updateUnboundedInstances()
+{
+	for (unsigned int u = 0; u < m_unboundedInstances.size();)
 	{
-		for (auto it = m_notWater.begin(); it != m_notWater.end(); it++)
+		Instance* instance = m_instances.get(m_unboundedInstances[u]);
+		if (instance != nullptr && instance->hasBounds() == false)
 		{
-			Instance* instance = *it;
-			instance->drawRaw(this, tempShader);
+			u++;
+			continue;
 		}
+
+		if (instance != nullptr)
+		{
+			unsigned int index = m_instances.getIndex(m_unboundedInstances[u]);
+			m_instances.setLocalBounds(index, instance->getBoundsMin(), instance->getBoundsMax());
+			m_bvh.insert(m_unboundedInstances[u], m_instances.getBoundsMin(index), m_instances.getBoundsMax(index));
+		}
+		m_unboundedInstances[u] = m_unboundedInstances.back();
+		m_unboundedInstances.pop_back();
+
+		//the cullers took the bounds and lods the mesh had when the instance was added
+		for (int i = 0; i < MAX_PASSES; i++)
+			m_cullersDirty[i] = true;
 	}
-}
\ No newline at end of file
+}
+
+
+//appends the instances whose bounds may be inside the frustum of a projection view matrix
+void Scene::queryFrustum(const glm::mat4& matrix, std::vector<InstanceHandle>& results)
+{
+	updateUnboundedInstances();
+	m_bvh.rebuildIfWorn();
+	m_bvh.queryFrustum(aie::Frustum::fromMatrix(matrix), results);
+	results.insert(results.end(), m_unboundedInstances.begin(), m_unboundedInstances.end());
+}
+
+
+//appends the instances whose bounds may intersect a sphere
+void Scene::querySphere(const glm::vec3& centre, float radius, std::vector<InstanceHandle>& results)
+{
+	updateUnboundedInstances();
+	m_bvh.rebuildIfWorn();
+	m_bvh.querySphere(centre, radius, results);
+	results.insert(results.end(), m_unboundedInstances.begin(), m_unboundedInstances.end());
+}
+
+
+//appends the instances whose bounds a ray hits within maxDistance, nearest first
+void Scene::queryRay(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, std::vector<InstanceBVH::RayHit>& results)
+{
+	updateUnboundedInstances();
+	m_bvh.rebuildIfWorn();
+	m_bvh.queryRay(origin, direction, maxDistance, results);
+}
+
+
+//the sun's orthographic projection, which the shadow pass is drawn and culled with
+void Scene::updateLightMatrix()
+{
+	//get the pvm for the sunlight
+	glm::vec3 lightDirection = glm::normalize(glm::vec3(getLight().direction * -1.0f));
+	glm::mat4 lightProjection = glm::ortho<float>(-10, 10, -10, 10, -10, 10);
+	glm::mat4 lightView = glm::lookAt(lightDirection, glm::vec3(0), glm::vec3(0, 1, 0));
+	m_lightMatrix = lightProjection * lightView;
+
+	glm::mat4 textureSpaceOffset(
+		0.5f, 0.0f, 0.0f, 0.0f,
+		0.0f, 0.5f, 0.0f, 0.0f,
+		0.0f, 0.0f, 0.5f, 0.0f,
+		0.5f, 0.5f, 0.5f, 1.0f
+	);
+
+	m_offsetLightMatrix = textureSpaceOffset * m_lightMatrix;
+}
+
+
+//takes the camera's matrices for the pass, the camera only rebuilding them after it has moved
+void Scene::updatePassMatrices()
+{
+	m_viewMatrix = m_camera->getViewMatrix();
+	m_projectionMatrix = m_camera->getProjectionMatrix(m_windowSize.x, m_windowSize.y);
+	m_projectionView = m_camera->getProjectionViewMatrix(m_windowSize.x, m_windowSize.y);
+}
+
+
+//uploads the frame constants when they've changed and the current pass's constants,
+//the shadow pass's projection view being the light's
+void Scene::updateConstants(int ySign)
+{
+	if (m_frameBuffer.getHandle() == 0)
+	{
+		m_frameBuffer.create(sizeof(FrameConstants));
+		m_passBuffer.create(sizeof(PassConstants), MAX_PASSES);
+		memset(&m_frameConstants, 0xff, sizeof(FrameConstants));
+	}
+
+	//every member is written, and the padding cleared, so the bytes can be compared
+	FrameConstants frame;
+	memset(&frame, 0, sizeof(FrameConstants));
+	frame.lightDirection = glm::vec4(m_sunlight.direction, 0);
+	frame.lightColour = glm::vec4(m_sunlight.colour, 0);
+	frame.ambientColour = glm::vec4(m_ambientLight, 0);
+	frame.lightMatrix = m_lightMatrix;
+	frame.offsetLightMatrix = m_offsetLightMatrix;
+	int lightCount = (int)std::min<size_t>(MAX_LIGHTS, m_pointLights.size());
+	for (int i = 0; i < lightCount; i++)
+	{
+		frame.pointLightPositions[i] = glm::vec4(m_pointLights[i].direction, 1);
+		frame.pointLightColours[i] = glm::vec4(m_pointLights[i].colour, 0);
+	}
+	frame.shadowBias = getShadowBias();
+	frame.time = m_time;
+	frame.numLights = getNumLights();
+
+	//the later passes of a frame leave the frame constants as they are
+	if (memcmp(&frame, &m_frameConstants, sizeof(FrameConstants)) != 0)
+	{
+		m_frameConstants = frame;
+		m_frameBuffer.update(0, &m_frameConstants, FRAME_CONSTANTS_BINDING);
+	}
+	else
+		m_frameBuffer.bind(0, FRAME_CONSTANTS_BINDING);
+
+	PassConstants pass;
+	pass.view = m_viewMatrix;
+	pass.projection = m_projectionMatrix;
+	pass.projectionView = m_currentPass == SHADOW_PASS ? m_lightMatrix : m_projectionView;
+	pass.cameraPosition = glm::vec4(m_camera->getPosition(), 1);
+	pass.clipPlane = ySign == 1 || ySign == -1 ? glm::vec4(0, (float)ySign, 0, 0) : glm::vec4(0, 0, 0, 1);
+
+	m_passBuffer.update(m_currentPass, &pass, PASS_CONSTANTS_BINDING);
+}
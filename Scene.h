@@ -1,14 +1,26 @@
 #pragma once
 #include <glm/glm.hpp>
 #include <vector>
-#include <list>
+#include <unordered_map>
+#include "UniformBuffer.h"
+#include "RenderQueue.h"
+#include "InstanceStore.h"
+#include "InstanceBVH.h"
 
 #define MAX_LIGHTS 4
+#define MAX_PASSES 5
+//pass index of the shadow casters, drawn from the light rather than the camera. the camera passes
+//take ySign + 1, so the shadow pass comes after them and never shares their slot
+#define SHADOW_PASS 4
+//uniform buffer binding points of the scene's constants
+#define FRAME_CONSTANTS_BINDING 0
+#define PASS_CONSTANTS_BINDING 1
 
 namespace aie
 {
 	class RenderTarget;
 	class ShaderProgram;
+	class InstanceCuller;
 }
 
 class Camera;
@@ -24,16 +36,90 @@ struct Light
 	Light(glm::vec3 pos, glm::vec3 col, float intensity) : direction(pos), colour(col* intensity) {}
 };
 
+//constants shared by every instance in a frame, std140 so a shader reads them as
+//	layout(std140, binding = 0) uniform FrameConstants {
+//		vec4 LightDirection; vec4 LightColour; vec4 AmbientColour;
+//		mat4 LightMatrix; mat4 offsetLightMatrix;
+//		vec4 PointLightPosition[4]; vec4 PointLightColour[4];
+//		vec2 shadowBias; float time; int numLights;
+//	};
+//a shader reading the block isn't given these as loose uniforms
+struct FrameConstants
+{
+	glm::vec4 lightDirection;
+	glm::vec4 lightColour;
+	glm::vec4 ambientColour;
+	glm::mat4 lightMatrix;
+	glm::mat4 offsetLightMatrix;
+	glm::vec4 pointLightPositions[MAX_LIGHTS];
+	glm::vec4 pointLightColours[MAX_LIGHTS];
+	glm::vec2 shadowBias;
+	float time;
+	int numLights;
+};
+
+//constants of the pass being drawn, read as
+//	layout(std140, binding = 1) uniform PassConstants {
+//		mat4 ProjectionView; mat4 View; mat4 Projection; vec4 cameraPosition; vec4 ClipPlane;
+//	};
+//so a vertex shader only needs ModelMatrix per instance. the clip plane keeps the side of the water
+//the pass draws, dot(ClipPlane, worldPosition) >= 0, and never clips passes drawn whole
+struct PassConstants
+{
+	glm::mat4 projectionView;
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::vec4 cameraPosition;
+	glm::vec4 clipPlane;
+};
+
 class Scene
 {
 public:
 	Scene(Camera* camera, glm::vec2 windowSize, Light& light, glm::vec3	ambientLight);
 	~Scene();
 
-	//adds an instance to the instance lists that are above or below the water level
-	void AddInstance(Instance* instance, int ySign);
+	//layers of the scene's instances, each pass drawing those in one of them
+	enum Layer
+	{
+		LAYER_SCENE = 1,
+		LAYER_ABOVE_WATER = 2,
+		LAYER_UNDER_WATER = 4,
+		LAYER_NOT_WATER = 8,
+	};
+
+	//adds an instance to the layers that are above or below the water level, the scene then owns it.
+	//ySign 1 is above the water, -1 below, 2 both and -2 neither, while 0 is only drawn by the whole scene
+	InstanceHandle AddInstance(Instance* instance, int ySign);
+	//removes and deletes an instance, the handle going stale. fails for handles already stale
+	bool RemoveInstance(InstanceHandle handle);
+	//moves an instance, rewriting only its transform in the passes' batch buffers and cullers
+	void setInstanceTransform(InstanceHandle handle, const glm::mat4& transform);
+	//the passes' batches, culled draws and material ids are rebuilt the next time they are drawn,
+	//for when an instance in the scene changes its shader, material or translucency
+	void markInstancesDirty();
+	const InstanceStore& getInstances() const { return m_instances; }
+	//appends the instances whose bounds may be inside the frustum of a projection view matrix,
+	//or intersect a sphere, walking the scene's bounding volume hierarchy. instances without
+	//bounds yet can't be ruled out, so are always appended
+	void queryFrustum(const glm::mat4& matrix, std::vector<InstanceHandle>& results);
+	void querySphere(const glm::vec3& centre, float radius, std::vector<InstanceHandle>& results);
+	//appends the instances whose bounds a ray hits within maxDistance, nearest first. instances
+	//without bounds yet are left out, as there's nowhere for the ray to hit them
+	void queryRay(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, std::vector<InstanceBVH::RayHit>& results);
+	//instances sharing a Mesh, shader, textures and material are drawn together by one instanced draw
+	//when the shader reads the instance matrix attribute and has no ProjectionViewModel or ModelMatrix.
+	//instances whose bounds are outside the camera's frustum aren't drawn
 	void draw(int ySign, aie::ShaderProgram* tempShader = nullptr);
-	void drawRaw(int ySign, aie::ShaderProgram* tempShader = nullptr);
+	//shaders that read the instance matrix attribute draw the whole pass with a few indirect multi-draws,
+	//culled and given their lods on the GPU from instance data uploaded the first time the pass is drawn
+	//after an AddInstance, so meshes should be uploaded before their instances are added. other shaders
+	//draw each instance inside the frustum. shadowPass draws the ySign's instances as the shadow pass,
+	//from the light and with the shadow pass's own lods and bias
+	void drawRaw(int ySign, aie::ShaderProgram* tempShader = nullptr, bool shadowPass = false);
+	//instances outside the frustum the last time the pass was drawn, those culled on the GPU not counted
+	unsigned int getCulledCount(int ySign) { return m_culledCounts[ySign + 1]; }
+	unsigned int getShadowCulledCount() { return m_culledCounts[SHADOW_PASS]; }
 
 	Camera* getCamera() { return m_camera; }
 	glm::vec2 getWindowSize() { return m_windowSize; }
@@ -49,6 +135,10 @@ public:
 	glm::vec3* getPointlightPositions() { return &m_pointLightPositions[0]; }
 	glm::vec3* getPointlightColours() { return &m_pointLightColours[0]; }
 	std::vector<Light>& getPointLights() { return m_pointLights; }
+	//the camera's matrices for the pass being drawn, taken once as the pass starts
+	const glm::mat4& getViewMatrix() { return m_viewMatrix; }
+	const glm::mat4& getProjectionMatrix() { return m_projectionMatrix; }
+	const glm::mat4& getProjectionView() { return m_projectionView; }
 	glm::mat4 getLightMatrix() { return m_lightMatrix; }
 	glm::mat4 getOffsetLightMatrix() { return m_offsetLightMatrix; }
 	glm::vec2 getShadowBias() { return glm::vec2(m_shadowBiasMin, m_shadowBiasMax); }
@@ -58,7 +148,36 @@ public:
 	
 	void setWireFrame(bool active) { m_wireFrameActive = active; }
 
+	//lod bias for the pass drawn with the given ySign, each step of positive bias doubles the allowed error
+	void setLodBias(int ySign, float bias) { m_lodBias[ySign + 1] = bias; }
+	void setShadowLodBias(float bias) { m_lodBias[SHADOW_PASS] = bias; }
+	float getLodBias() { return m_lodBias[m_currentPass]; }
+	//index of the pass being drawn, from 0 to MAX_PASSES - 1
+	int getCurrentPass() { return m_currentPass; }
+
 protected:
+	//the layer drawn for a ySign, 0 for unknown values
+	static unsigned int getLayer(int ySign);
+	void drawCulled(unsigned int layer, aie::ShaderProgram* shader);
+	//sorts the pass's batches in to the render queue and draws them, binding only the state that changes
+	void drawBatched(unsigned int layer, aie::ShaderProgram* tempShader);
+	//groups the pass's instances in to batches, gives them sort keys and uploads their transforms
+	void buildBatches(unsigned int layer);
+	//gives instances with the same material the same id, materials being set after instances are added
+	void updateMaterialIds();
+	//lists the instances of the layer whose bounds are inside the frustum of the matrix as visible,
+	//returning how many are outside. large scenes walk the hierarchy, small ones sweep every instance
+	unsigned int cullInstances(unsigned int layer, const glm::mat4& cullMatrix);
+	//gives unbounded instances their bounds once their meshes have loaded
+	void updateUnboundedInstances();
+	//the sun's orthographic projection, which the shadow pass is drawn and culled with
+	void updateLightMatrix();
+	//takes the camera's matrices for the pass, the camera only rebuilding them after it has moved
+	void updatePassMatrices();
+	//uploads the frame constants when they've changed and the current pass's constants,
+	//the shadow pass's projection view being the light's
+	void updateConstants(int ySign);
+
 	Camera* m_camera;
 	glm::vec2 m_windowSize;
 
@@ -68,19 +187,83 @@ protected:
 
 	glm::mat4 m_lightMatrix = glm::mat4(0);
 	glm::mat4 m_offsetLightMatrix = glm::mat4(0);
+	glm::mat4 m_viewMatrix = glm::mat4(1);
+	glm::mat4 m_projectionMatrix = glm::mat4(1);
+	glm::mat4 m_projectionView = glm::mat4(1);
 
 	float m_time = 0.0f;
 	bool m_wireFrameActive = false;
 
-	std::list<Instance*> m_instances;
-	std::list<Instance*> m_aboveWater;
-	std::list<Instance*> m_underWater;
-	std::list<Instance*> m_notWater;
+	int m_currentPass = 1;
+	float m_lodBias[MAX_PASSES] = {};
+
+	//every instance, with its layers, mesh id and material id beside its transform and bounds
+	InstanceStore m_instances;
+	//ids of the meshes drawn, in order of first use
+	std::unordered_map<const void*, unsigned int> m_meshIds;
+	bool m_materialIdsDirty = true;
+	//every bounded instance, refit as they move
+	InstanceBVH m_bvh;
+	//instances added before their bounds were known, never culled until they have them
+	std::vector<InstanceHandle> m_unboundedInstances;
+	//instances in each layer, by the layer's bit
+	unsigned int m_layerCounts[4] = {};
+	//indices in the store of the instances inside the frustum of the pass being drawn
+	std::vector<unsigned int> m_visibleIndices;
+	std::vector<InstanceHandle> m_queryResults;
+	unsigned int m_culledCounts[MAX_PASSES] = {};
 
 	glm::vec3 m_pointLightPositions[MAX_LIGHTS];
 	glm::vec3 m_pointLightColours[MAX_LIGHTS];
 
 	aie::RenderTarget* m_shadowTarget = nullptr;
+	//each pass's instances as the GPU culls them, rebuilt after instances are added,
+	//with those that can't be drawn indirectly kept aside
+	aie::InstanceCuller* m_cullers[MAX_PASSES] = {};
+	bool m_cullersDirty[MAX_PASSES];
+	std::vector<Instance*> m_directInstances[MAX_PASSES];
+	//the culler's index for each instance in the store, NO_SLOT when the pass's culler doesn't have it
+	std::vector<unsigned int> m_cullerIndices[MAX_PASSES];
+	//each pass's instances in batches that share everything but their transforms, rebuilt after instances
+	//are added. a batch's members are contiguous, with their transforms at the same indices of the buffer
+	struct Batch
+	{
+		unsigned int first;
+		unsigned int count;
+		//the sort key without depth, and the material's id so submission can tell when it changes
+		uint64_t key;
+		unsigned int material;
+	};
+	std::vector<Batch> m_batches[MAX_PASSES];
+	//indices of the instances in the store, and the batch of each instance in the pass by that index
+	std::vector<unsigned int> m_batchMembers[MAX_PASSES];
+	std::vector<unsigned int> m_memberBatches[MAX_PASSES];
+	//where each instance's transform is in the batch buffer by its index in the store, NO_SLOT outside the pass
+	std::vector<unsigned int> m_memberSlots[MAX_PASSES];
+	unsigned int m_batchBuffers[MAX_PASSES] = {};
+	bool m_batchesDirty[MAX_PASSES];
+	//the visible part of each batch drawn this pass. batches with culled members draw the transforms
+	//of those left from the stream buffer, the rest from the batch buffer
+	struct BatchDraw
+	{
+		unsigned int batch;
+		unsigned int firstMember;
+		unsigned int count;
+		unsigned int buffer;
+		unsigned int firstTransform;
+	};
+	std::vector<BatchDraw> m_batchDraws;
+	//the visible instances grouped by batch, with where each batch's members start
+	std::vector<unsigned int> m_visibleMembers;
+	std::vector<unsigned int> m_batchOffsets;
+	std::vector<unsigned int> m_batchCursors;
+	std::vector<glm::mat4> m_visibleTransforms;
+	unsigned int m_streamBuffer = 0;
+	RenderQueue m_renderQueue;
+	//frame constants as last uploaded, and a slot per pass for pass constants
+	FrameConstants m_frameConstants;
+	aie::UniformBuffer m_frameBuffer;
+	aie::UniformBuffer m_passBuffer;
 	const float m_shadowBiasMin = 0.001f;
 	const float m_shadowBiasMax = 0.01f;
 };
@@ -1,6 +1,9 @@
 #include "Shader.h"
 #include <cstdio>
 #include <cassert>
+#include <cstring>
+#include "GLState.h"
+#include "GeometryArena.h"
 #include "gl_core_4_4.h"
 
 namespace aie {
@@ -20,6 +23,7 @@ bool Shader::loadShader(unsigned int stage, const char* filename) {
 	case eShaderStage::TESSELLATION_CONTROL:	m_handle = glCreateShader(GL_TESS_CONTROL_SHADER);	break;
 	case eShaderStage::GEOMETRY:	m_handle = glCreateShader(GL_GEOMETRY_SHADER);	break;
 	case eShaderStage::FRAGMENT:	m_handle = glCreateShader(GL_FRAGMENT_SHADER);	break;
+	case eShaderStage::COMPUTE:	m_handle = glCreateShader(GL_COMPUTE_SHADER);	break;
 	default:	break;
 	};
 	
@@ -65,6 +69,7 @@ bool Shader::createShader(unsigned int stage, const char* string) {
 	case eShaderStage::TESSELLATION_CONTROL:	m_handle = glCreateShader(GL_TESS_CONTROL_SHADER);	break;
 	case eShaderStage::GEOMETRY:	m_handle = glCreateShader(GL_GEOMETRY_SHADER);	break;
 	case eShaderStage::FRAGMENT:	m_handle = glCreateShader(GL_FRAGMENT_SHADER);	break;
+	case eShaderStage::COMPUTE:	m_handle = glCreateShader(GL_COMPUTE_SHADER);	break;
 	default:	break;
 	};
 
@@ -86,7 +91,11 @@ bool Shader::createShader(unsigned int stage, const char* string) {
 	return true;
 }
 
+ShaderProgram* ShaderProgram::s_current = nullptr;
+
 ShaderProgram::~ShaderProgram() {
+	if (s_current == this)
+		s_current = nullptr;
 	delete[] m_lastError;
 	glDeleteProgram(m_program);
 }
@@ -126,21 +135,113 @@ bool ShaderProgram::link() {
 		glGetProgramInfoLog(m_program, infoLogLength, 0, m_lastError);
 		return false;
 	}
+
+	reflectUniforms();
 	return true;
 }
 
+void ShaderProgram::reflectUniforms() {
+	m_uniformSlots.clear();
+	m_uniformNames.clear();
+
+	int uniformCount = 0, maxNameLength = 0;
+	glGetProgramiv(m_program, GL_ACTIVE_UNIFORMS, &uniformCount);
+	glGetProgramiv(m_program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+
+	// arrays go in twice, so the table holds up to twice the uniforms and stays under half full
+	unsigned int capacity = 16;
+	while (capacity < (unsigned int)uniformCount * 4)
+		capacity *= 2;
+	m_uniformSlots.assign(capacity, UniformSlot{ 0, -1, 0 });
+	m_uniformMask = capacity - 1;
+
+	std::vector<char> name(maxNameLength + 1);
+	for (int i = 0; i < uniformCount; ++i) {
+		int length = 0, size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(m_program, (GLuint)i, (GLsizei)name.size(), &length, &size, &type, name.data());
+
+		// members of uniform blocks have no location
+		int location = glGetUniformLocation(m_program, name.data());
+		if (location < 0)
+			continue;
+
+		std::string uniformName(name.data(), length);
+		insertUniform(uniformName, location);
+		if (uniformName.size() > 3 && uniformName.compare(uniformName.size() - 3, 3, "[0]") == 0)
+			insertUniform(uniformName.substr(0, uniformName.size() - 3), location);
+	}
+
+	// a handful of blocks at most, so they're searched in order
+	m_uniformBlocks.clear();
+	int blockCount = 0, maxBlockNameLength = 0;
+	glGetProgramiv(m_program, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+	glGetProgramiv(m_program, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxBlockNameLength);
+
+	name.resize(maxBlockNameLength + 1);
+	for (int i = 0; i < blockCount; ++i) {
+		int length = 0;
+		glGetActiveUniformBlockName(m_program, (GLuint)i, (GLsizei)name.size(), &length, name.data());
+
+		std::string blockName(name.data(), length);
+		m_uniformBlocks.push_back(UniformBlock{ hashUniformName(blockName.c_str()), i, blockName });
+	}
+
+	// resolved here so batching never asks gl per draw
+	m_instanceMatrix = glGetAttribLocation(m_program, "InstanceModelMatrix") == (int)GeometryArena::INSTANCE_MATRIX_LOCATION;
+	m_instancedDraws = m_instanceMatrix &&
+		getUniform(UniformID("ProjectionViewModel")) < 0 && getUniform(UniformID("ModelMatrix")) < 0;
+}
+
+void ShaderProgram::insertUniform(const std::string& name, int location) {
+	unsigned int hash = hashUniformName(name.c_str());
+	unsigned int slot = hash & m_uniformMask;
+	while (m_uniformSlots[slot].location >= 0)
+		slot = (slot + 1) & m_uniformMask;
+
+	m_uniformSlots[slot] = UniformSlot{ hash, location, (unsigned int)m_uniformNames.size() };
+	m_uniformNames.push_back(name);
+}
+
 void ShaderProgram::bind() {
 	assert(m_program > 0 && "Invalid shader program");
-	glUseProgram(m_program);
+	GLState::useProgram(m_program);
+	s_current = this;
+}
+
+int ShaderProgram::getUniform(UniformID id) const {
+	if (m_uniformSlots.empty())
+		return -1;
+
+	// linear probing, the name only compared once the hash matches
+	for (unsigned int slot = id.hash & m_uniformMask;; slot = (slot + 1) & m_uniformMask) {
+		const UniformSlot& entry = m_uniformSlots[slot];
+		if (entry.location < 0)
+			return -1;
+		if (entry.hash == id.hash && m_uniformNames[entry.name] == id.name)
+			return entry.location;
+	}
 }
 
-int ShaderProgram::getUniform(const char* name) {
-	return glGetUniformLocation(m_program, name);
+int ShaderProgram::getUniformBlock(UniformID id) const {
+	for (auto& block : m_uniformBlocks)
+		if (block.hash == id.hash && block.name == id.name)
+			return block.index;
+	return -1;
+}
+
+int ShaderProgram::getUniform(const char* name) const {
+	int location = getUniform(UniformID(name));
+
+	// single elements past the first of an array aren't in the table
+	if (location < 0 && strchr(name, '[') != nullptr)
+		location = glGetUniformLocation(m_program, name);
+	return location;
 }
 
 bool ShaderProgram::bindUniform(const char* name, int value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -151,7 +252,7 @@ bool ShaderProgram::bindUniform(const char* name, int value) {
 
 bool ShaderProgram::bindUniform(const char* name, float value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -162,7 +263,7 @@ bool ShaderProgram::bindUniform(const char* name, float value) {
 
 bool ShaderProgram::bindUniform(const char* name, const glm::vec2& value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -173,7 +274,7 @@ bool ShaderProgram::bindUniform(const char* name, const glm::vec2& value) {
 
 bool ShaderProgram::bindUniform(const char* name, const glm::vec3& value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -184,7 +285,7 @@ bool ShaderProgram::bindUniform(const char* name, const glm::vec3& value) {
 
 bool ShaderProgram::bindUniform(const char* name, const glm::vec4& value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -195,7 +296,7 @@ bool ShaderProgram::bindUniform(const char* name, const glm::vec4& value) {
 
 bool ShaderProgram::bindUniform(const char* name, const glm::mat2& value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -206,7 +307,7 @@ bool ShaderProgram::bindUniform(const char* name, const glm::mat2& value) {
 
 bool ShaderProgram::bindUniform(const char* name, const glm::mat3& value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -217,7 +318,7 @@ bool ShaderProgram::bindUniform(const char* name, const glm::mat3& value) {
 
 bool ShaderProgram::bindUniform(const char* name, const glm::mat4& value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -228,7 +329,7 @@ bool ShaderProgram::bindUniform(const char* name, const glm::mat4& value) {
 
 bool ShaderProgram::bindUniform(const char* name, int count, int* value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -239,7 +340,7 @@ bool ShaderProgram::bindUniform(const char* name, int count, int* value) {
 
 bool ShaderProgram::bindUniform(const char* name, int count, float* value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -250,7 +351,7 @@ bool ShaderProgram::bindUniform(const char* name, int count, float* value) {
 
 bool ShaderProgram::bindUniform(const char* name, int count, const glm::vec2* value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -261,7 +362,7 @@ bool ShaderProgram::bindUniform(const char* name, int count, const glm::vec2* va
 
 bool ShaderProgram::bindUniform(const char* name, int count, const glm::vec3* value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -272,7 +373,7 @@ bool ShaderProgram::bindUniform(const char* name, int count, const glm::vec3* va
 
 bool ShaderProgram::bindUniform(const char* name, int count, const glm::vec4* value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -283,7 +384,7 @@ bool ShaderProgram::bindUniform(const char* name, int count, const glm::vec4* va
 
 bool ShaderProgram::bindUniform(const char* name, int count, const glm::mat2* value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -294,7 +395,7 @@ bool ShaderProgram::bindUniform(const char* name, int count, const glm::mat2* va
 
 bool ShaderProgram::bindUniform(const char* name, int count, const glm::mat3* value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -305,7 +406,7 @@ bool ShaderProgram::bindUniform(const char* name, int count, const glm::mat3* va
 
 bool ShaderProgram::bindUniform(const char* name, int count, const glm::mat4* value) {
 	assert(m_program > 0 && "Invalid shader program");
-	int i = glGetUniformLocation(m_program, name);
+	int i = getUniform(name);
 	if (i < 0) {
 		printf("Shader uniform [%s] not found! Is it being used?\n", name);
 		return false;
@@ -7,9 +7,24 @@
 #include <glm/mat3x3.hpp>
 #include <glm/mat4x4.hpp>
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace aie {
 
+// fnv-1a hash of a uniform name, evaluated by the compiler for constant names
+constexpr unsigned int hashUniformName(const char* name, unsigned int hash = 2166136261u) {
+	return *name == 0 ? hash : hashUniformName(name + 1, (hash ^ (unsigned char)*name) * 16777619u);
+}
+
+// a uniform name with its hash, declare these as constexpr so lookups never hash or call gl
+struct UniformID {
+	constexpr UniformID(const char* name) : name(name), hash(hashUniformName(name)) {}
+
+	const char*		name;
+	unsigned int	hash;
+};
+
 // simplified render pipeline shader stages
 enum eShaderStage : unsigned int {
 	UNDEFINED = 0,
@@ -19,6 +34,7 @@ enum eShaderStage : unsigned int {
 	TESSELLATION_CONTROL,
 	GEOMETRY,
 	FRAGMENT,
+	COMPUTE,	// linked on its own, a program can't mix it with the stages above
 
 	SHADER_STAGE_Count,
 };
@@ -55,7 +71,7 @@ protected:
 class ShaderProgram {
 public:
 
-	ShaderProgram() : m_program(0), m_lastError(nullptr) {
+	ShaderProgram() : m_program(0), m_uniformMask(0), m_instanceMatrix(false), m_instancedDraws(false), m_lastError(nullptr) {
 		m_shaders[0] = m_shaders[1] = m_shaders[2] = m_shaders[3] = m_shaders[4] = 0;
 	}
 	~ShaderProgram();
@@ -64,15 +80,29 @@ public:
 	bool createShader(unsigned int stage, const char* string);
 	void attachShader(const std::shared_ptr<Shader>& shader);
 
+	// links the stages and reads every active uniform's location into a table
 	bool link();
 
 	const char* getLastError() const { return m_lastError; }
 
 	void bind();
+	// the program last bound through bind(), nullptr before any
+	static ShaderProgram* getCurrent() { return s_current; }
 
 	unsigned int getHandle() const { return m_program; }
 
-	int getUniform(const char* name);
+	// locations come from the table filled by link(), -1 if the program doesn't use the uniform.
+	// arrays are found by their name with or without [0]
+	int getUniform(UniformID id) const;
+	int getUniform(const char* name) const;
+	// index of a uniform block the program reads, -1 if it has none by that name
+	int getUniformBlock(UniformID id) const;
+
+	// true when the program reads InstanceModelMatrix from GeometryArena::INSTANCE_MATRIX_LOCATION, found by link()
+	bool hasInstanceMatrix() const { return m_instanceMatrix; }
+	// true when the model matrix comes only from that attribute, with no ProjectionViewModel or ModelMatrix
+	// uniform, so any number of instances can share one draw
+	bool canDrawInstanced() const { return m_instancedDraws; }
 
 	void bindUniform(int ID, int value);
 	void bindUniform(int ID, float value);
@@ -111,8 +141,33 @@ public:
 
 private:
 
+	struct UniformSlot {
+		unsigned int	hash;
+		int				location;	// -1 marks an empty slot
+		unsigned int	name;		// index into m_uniformNames
+	};
+
+	struct UniformBlock {
+		unsigned int	hash;
+		int				index;
+		std::string		name;
+	};
+
+	// reads the active uniforms of the linked program into the open addressed table, and its blocks
+	void reflectUniforms();
+	void insertUniform(const std::string& name, int location);
+
+	static ShaderProgram* s_current;
+
 	unsigned int	m_program;
 
+	std::vector<UniformSlot>	m_uniformSlots;
+	std::vector<std::string>	m_uniformNames;
+	unsigned int				m_uniformMask;
+	std::vector<UniformBlock>	m_uniformBlocks;
+	bool						m_instanceMatrix;
+	bool						m_instancedDraws;
+
 	std::shared_ptr<Shader> m_shaders[eShaderStage::SHADER_STAGE_Count];
 
 	char*			m_lastError;
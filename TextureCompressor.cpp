@@ -0,0 +1,520 @@
+#include "TextureCompressor.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace aie {
+
+// texels of one 4x4 block as floats, in row order
+typedef float BlockTexels[16][4];
+
+static void loadBlock(const unsigned char* pixels, unsigned int width, unsigned int height,
+					  unsigned int blockX, unsigned int blockY, BlockTexels& texels) {
+	for (unsigned int y = 0; y < 4; ++y) {
+		unsigned int sy = std::min(blockY * 4 + y, height - 1);
+		for (unsigned int x = 0; x < 4; ++x) {
+			unsigned int sx = std::min(blockX * 4 + x, width - 1);
+			const unsigned char* p = pixels + ((size_t)sy * width + sx) * 4;
+			for (int c = 0; c < 4; ++c)
+				texels[y * 4 + x][c] = p[c];
+		}
+	}
+}
+
+static float clampUnit(float value) {
+	return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+// picks two endpoints spanning the texels over the first channelCount channels.
+// fast takes the bounding box diagonal, flipping channels that fall as the widest one rises,
+// high takes the extent of the texels along their principal axis
+static void findEndpoints(const BlockTexels& texels, int channelCount, TextureCompressor::Quality quality,
+						  float endpoint0[4], float endpoint1[4]) {
+
+	float mean[4] = {}, minimum[4], maximum[4];
+	for (int c = 0; c < channelCount; ++c) {
+		minimum[c] = maximum[c] = texels[0][c];
+		for (int i = 0; i < 16; ++i) {
+			mean[c] += texels[i][c];
+			minimum[c] = std::min(minimum[c], texels[i][c]);
+			maximum[c] = std::max(maximum[c], texels[i][c]);
+		}
+		mean[c] /= 16;
+	}
+
+	float covariance[4][4] = {};
+	for (int i = 0; i < 16; ++i) {
+		for (int a = 0; a < channelCount; ++a) {
+			for (int b = 0; b < channelCount; ++b)
+				covariance[a][b] += (texels[i][a] - mean[a]) * (texels[i][b] - mean[b]);
+		}
+	}
+
+	if (quality == TextureCompressor::Quality::FAST) {
+		int widest = 0;
+		for (int c = 1; c < channelCount; ++c) {
+			if (maximum[c] - minimum[c] > maximum[widest] - minimum[widest])
+				widest = c;
+		}
+		for (int c = 0; c < channelCount; ++c) {
+			// inset slightly, the end points of the palette are rarely the best fit for the extremes
+			float inset = (maximum[c] - minimum[c]) / 16;
+			bool flip = covariance[widest][c] < 0;
+			endpoint0[c] = flip ? maximum[c] - inset : minimum[c] + inset;
+			endpoint1[c] = flip ? minimum[c] + inset : maximum[c] - inset;
+		}
+		return;
+	}
+
+	// power iteration from the bounding box diagonal
+	float axis[4] = {};
+	for (int c = 0; c < channelCount; ++c)
+		axis[c] = maximum[c] - minimum[c];
+	for (int iteration = 0; iteration < 8; ++iteration) {
+		float next[4] = {};
+		float length = 0;
+		for (int a = 0; a < channelCount; ++a) {
+			for (int b = 0; b < channelCount; ++b)
+				next[a] += covariance[a][b] * axis[b];
+			length = std::max(length, std::fabs(next[a]));
+		}
+		if (length == 0)
+			break;
+		for (int c = 0; c < channelCount; ++c)
+			axis[c] = next[c] / length;
+	}
+
+	float lengthSquared = 0;
+	for (int c = 0; c < channelCount; ++c)
+		lengthSquared += axis[c] * axis[c];
+
+	float tMin = 0, tMax = 0;
+	if (lengthSquared > 0) {
+		tMin = tMax = 0;
+		for (int i = 0; i < 16; ++i) {
+			float t = 0;
+			for (int c = 0; c < channelCount; ++c)
+				t += (texels[i][c] - mean[c]) * axis[c];
+			t /= lengthSquared;
+			tMin = std::min(tMin, t);
+			tMax = std::max(tMax, t);
+		}
+	}
+
+	for (int c = 0; c < channelCount; ++c) {
+		endpoint0[c] = clampUnit(mean[c] + axis[c] * tMin);
+		endpoint1[c] = clampUnit(mean[c] + axis[c] * tMax);
+	}
+}
+
+// solves for the endpoints that best fit the texels given each texel's palette weight,
+// returns false when every texel has the same weight
+static bool refineEndpoints(const BlockTexels& texels, const float weights[16], int channelCount,
+							float endpoint0[4], float endpoint1[4]) {
+	float aa = 0, ab = 0, bb = 0;
+	float ax[4] = {}, bx[4] = {};
+	for (int i = 0; i < 16; ++i) {
+		float b = weights[i];
+		float a = 1 - b;
+		aa += a * a;
+		ab += a * b;
+		bb += b * b;
+		for (int c = 0; c < channelCount; ++c) {
+			ax[c] += a * texels[i][c];
+			bx[c] += b * texels[i][c];
+		}
+	}
+
+	float determinant = aa * bb - ab * ab;
+	if (std::fabs(determinant) < 1e-6f)
+		return false;
+
+	for (int c = 0; c < channelCount; ++c) {
+		endpoint0[c] = clampUnit((ax[c] * bb - bx[c] * ab) / determinant);
+		endpoint1[c] = clampUnit((bx[c] * aa - ax[c] * ab) / determinant);
+	}
+	return true;
+}
+
+// picks the nearest palette entry for every texel, returns the total squared error
+static float selectIndices(const BlockTexels& texels, int firstChannel, int channelCount,
+						   const float palette[][4], int paletteSize, unsigned char indices[16]) {
+	float total = 0;
+	for (int i = 0; i < 16; ++i) {
+		float best = 1e30f;
+		for (int p = 0; p < paletteSize; ++p) {
+			float error = 0;
+			for (int c = 0; c < channelCount; ++c) {
+				float d = texels[i][firstChannel + c] - palette[p][c];
+				error += d * d;
+			}
+			if (error < best) {
+				best = error;
+				indices[i] = (unsigned char)p;
+			}
+		}
+		total += best;
+	}
+	return total;
+}
+
+//
+// BC1
+//
+
+static unsigned short packRGB565(const float colour[4]) {
+	unsigned int r = (unsigned int)(colour[0] * 31 / 255 + 0.5f);
+	unsigned int g = (unsigned int)(colour[1] * 63 / 255 + 0.5f);
+	unsigned int b = (unsigned int)(colour[2] * 31 / 255 + 0.5f);
+	return (unsigned short)((r << 11) | (g << 5) | b);
+}
+
+static void unpackRGB565(unsigned short packed, float colour[4]) {
+	unsigned int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+	colour[0] = (float)((r << 3) | (r >> 2));
+	colour[1] = (float)((g << 2) | (g >> 4));
+	colour[2] = (float)((b << 3) | (b >> 2));
+	colour[3] = 255;
+}
+
+// four colour mode palette, c0 > c1
+static void buildBC1Palette(unsigned short c0, unsigned short c1, float palette[4][4]) {
+	unpackRGB565(c0, palette[0]);
+	unpackRGB565(c1, palette[1]);
+	for (int c = 0; c < 3; ++c) {
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+}
+
+static float encodeBC1Endpoints(const BlockTexels& texels, const float endpoint0[4], const float endpoint1[4],
+								unsigned short& c0, unsigned short& c1, unsigned char indices[16]) {
+	c0 = packRGB565(endpoint0);
+	c1 = packRGB565(endpoint1);
+	if (c0 < c1)
+		std::swap(c0, c1);
+
+	// equal end points would select the three colour mode, so every texel takes c0
+	if (c0 == c1) {
+		float palette[1][4];
+		unpackRGB565(c0, palette[0]);
+		return selectIndices(texels, 0, 3, palette, 1, indices);
+	}
+
+	float palette[4][4];
+	buildBC1Palette(c0, c1, palette);
+	return selectIndices(texels, 0, 3, palette, 4, indices);
+}
+
+static void encodeBC1(const BlockTexels& texels, TextureCompressor::Quality quality, unsigned char* destination) {
+
+	float endpoint0[4], endpoint1[4];
+	findEndpoints(texels, 3, quality, endpoint0, endpoint1);
+
+	unsigned short c0, c1;
+	unsigned char indices[16];
+	float error = encodeBC1Endpoints(texels, endpoint0, endpoint1, c0, c1, indices);
+
+	if (quality == TextureCompressor::Quality::HIGH) {
+		static const float weights[4] = { 0, 1, 1.0f / 3, 2.0f / 3 };
+		for (int iteration = 0; iteration < 2 && c0 != c1; ++iteration) {
+			float texelWeights[16];
+			for (int i = 0; i < 16; ++i)
+				texelWeights[i] = weights[indices[i]];
+
+			// the solve is against the palette as it stands, so keep the ends in that order
+			float palette[4][4];
+			buildBC1Palette(c0, c1, palette);
+			memcpy(endpoint0, palette[0], sizeof(endpoint0));
+			memcpy(endpoint1, palette[1], sizeof(endpoint1));
+			if (refineEndpoints(texels, texelWeights, 3, endpoint0, endpoint1) == false)
+				break;
+
+			unsigned short r0, r1;
+			unsigned char refined[16];
+			float refinedError = encodeBC1Endpoints(texels, endpoint0, endpoint1, r0, r1, refined);
+			if (refinedError >= error)
+				break;
+			error = refinedError;
+			c0 = r0;
+			c1 = r1;
+			memcpy(indices, refined, sizeof(indices));
+		}
+	}
+
+	unsigned int bits = 0;
+	for (int i = 0; i < 16; ++i)
+		bits |= (unsigned int)indices[i] << (i * 2);
+
+	destination[0] = (unsigned char)(c0 & 0xff);
+	destination[1] = (unsigned char)(c0 >> 8);
+	destination[2] = (unsigned char)(c1 & 0xff);
+	destination[3] = (unsigned char)(c1 >> 8);
+	memcpy(destination + 4, &bits, 4);
+}
+
+//
+// BC4
+//
+
+// eight value mode palette, a0 > a1
+static void buildBC4Palette(int a0, int a1, float palette[8][4]) {
+	palette[0][0] = (float)a0;
+	palette[1][0] = (float)a1;
+	for (int i = 2; i < 8; ++i)
+		palette[i][0] = (float)(((8 - i) * a0 + (i - 1) * a1) / 7);
+}
+
+static float encodeBC4Endpoints(const BlockTexels& texels, int channel, float endpoint0, float endpoint1,
+								int& a0, int& a1, unsigned char indices[16]) {
+	a0 = (int)(std::max(endpoint0, endpoint1) + 0.5f);
+	a1 = (int)(std::min(endpoint0, endpoint1) + 0.5f);
+	if (a0 == a1) {
+		memset(indices, 0, 16);
+		float error = 0;
+		for (int i = 0; i < 16; ++i)
+			error += (texels[i][channel] - a0) * (texels[i][channel] - a0);
+		return error;
+	}
+
+	float palette[8][4];
+	buildBC4Palette(a0, a1, palette);
+	return selectIndices(texels, channel, 1, palette, 8, indices);
+}
+
+static void encodeBC4(const BlockTexels& texels, int channel, TextureCompressor::Quality quality, unsigned char* destination) {
+
+	float minimum = texels[0][channel], maximum = minimum;
+	for (int i = 1; i < 16; ++i) {
+		minimum = std::min(minimum, texels[i][channel]);
+		maximum = std::max(maximum, texels[i][channel]);
+	}
+
+	int a0, a1;
+	unsigned char indices[16];
+	float error = encodeBC4Endpoints(texels, channel, maximum, minimum, a0, a1, indices);
+
+	if (quality == TextureCompressor::Quality::HIGH) {
+		static const float weights[8] = { 0, 1, 1.0f / 7, 2.0f / 7, 3.0f / 7, 4.0f / 7, 5.0f / 7, 6.0f / 7 };
+		for (int iteration = 0; iteration < 2 && a0 != a1; ++iteration) {
+			BlockTexels single;
+			float texelWeights[16];
+			for (int i = 0; i < 16; ++i) {
+				single[i][0] = texels[i][channel];
+				texelWeights[i] = weights[indices[i]];
+			}
+
+			float endpoint0[4] = { (float)a0 }, endpoint1[4] = { (float)a1 };
+			if (refineEndpoints(single, texelWeights, 1, endpoint0, endpoint1) == false)
+				break;
+
+			int r0, r1;
+			unsigned char refined[16];
+			float refinedError = encodeBC4Endpoints(texels, channel, endpoint0[0], endpoint1[0], r0, r1, refined);
+			if (refinedError >= error)
+				break;
+			error = refinedError;
+			a0 = r0;
+			a1 = r1;
+			memcpy(indices, refined, sizeof(indices));
+		}
+	}
+
+	unsigned long long bits = 0;
+	for (int i = 0; i < 16; ++i)
+		bits |= (unsigned long long)indices[i] << (i * 3);
+
+	destination[0] = (unsigned char)a0;
+	destination[1] = (unsigned char)a1;
+	for (int i = 0; i < 6; ++i)
+		destination[2 + i] = (unsigned char)(bits >> (i * 8));
+}
+
+//
+// BC7 mode 6: one subset, rgba 7.7.7.7 end points with a p-bit each, 4 bit indices
+//
+
+static const int BC7_WEIGHTS[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+static void quantiseBC7Endpoint(const float endpoint[4], int pBit, int quantised[4]) {
+	for (int c = 0; c < 4; ++c) {
+		int q = (int)std::floor((endpoint[c] - pBit) / 2 + 0.5f);
+		quantised[c] = std::min(std::max(q, 0), 127);
+	}
+}
+
+static float encodeBC7Endpoints(const BlockTexels& texels, const float endpoint0[4], const float endpoint1[4],
+								int p0, int p1, int q0[4], int q1[4], unsigned char indices[16]) {
+	quantiseBC7Endpoint(endpoint0, p0, q0);
+	quantiseBC7Endpoint(endpoint1, p1, q1);
+
+	float palette[16][4];
+	for (int c = 0; c < 4; ++c) {
+		int e0 = (q0[c] << 1) | p0;
+		int e1 = (q1[c] << 1) | p1;
+		for (int i = 0; i < 16; ++i)
+			palette[i][c] = (float)(((64 - BC7_WEIGHTS[i]) * e0 + BC7_WEIGHTS[i] * e1 + 32) >> 6);
+	}
+	return selectIndices(texels, 0, 4, palette, 16, indices);
+}
+
+// the p-bit that keeps an end point nearest its unquantised value
+static int nearestPBit(const float endpoint[4]) {
+	float error[2] = {};
+	for (int p = 0; p < 2; ++p) {
+		int q[4];
+		quantiseBC7Endpoint(endpoint, p, q);
+		for (int c = 0; c < 4; ++c) {
+			float d = ((q[c] << 1) | p) - endpoint[c];
+			error[p] += d * d;
+		}
+	}
+	return error[1] < error[0] ? 1 : 0;
+}
+
+static void encodeBC7(const BlockTexels& texels, TextureCompressor::Quality quality, unsigned char* destination) {
+
+	float endpoint0[4], endpoint1[4];
+	findEndpoints(texels, 4, quality, endpoint0, endpoint1);
+
+	int p0 = nearestPBit(endpoint0), p1 = nearestPBit(endpoint1);
+	int q0[4], q1[4];
+	unsigned char indices[16];
+	float error = encodeBC7Endpoints(texels, endpoint0, endpoint1, p0, p1, q0, q1, indices);
+
+	if (quality == TextureCompressor::Quality::HIGH) {
+		for (int iteration = 0; iteration < 2; ++iteration) {
+			float texelWeights[16];
+			for (int i = 0; i < 16; ++i)
+				texelWeights[i] = BC7_WEIGHTS[indices[i]] / 64.0f;
+
+			float refined0[4], refined1[4];
+			if (refineEndpoints(texels, texelWeights, 4, refined0, refined1) == false)
+				break;
+
+			// the p-bits are shared by every channel, so try all four pairings
+			bool improved = false;
+			for (int p = 0; p < 4; ++p) {
+				int r0[4], r1[4];
+				unsigned char refined[16];
+				float refinedError = encodeBC7Endpoints(texels, refined0, refined1, p & 1, p >> 1, r0, r1, refined);
+				if (refinedError < error) {
+					error = refinedError;
+					p0 = p & 1;
+					p1 = p >> 1;
+					memcpy(q0, r0, sizeof(q0));
+					memcpy(q1, r1, sizeof(q1));
+					memcpy(indices, refined, sizeof(indices));
+					improved = true;
+				}
+			}
+			if (improved == false)
+				break;
+		}
+	}
+
+	// the first texel's index has an implied zero top bit, so swap the ends if it needs it
+	if (indices[0] & 8) {
+		std::swap(q0, q1);
+		std::swap(p0, p1);
+		for (auto& index : indices)
+			index = (unsigned char)(15 - index);
+	}
+
+	unsigned long long bits[2] = {};
+	unsigned int position = 0;
+	auto write = [&](unsigned int value, unsigned int count) {
+		for (unsigned int i = 0; i < count; ++i, ++position)
+			bits[position >> 6] |= (unsigned long long)((value >> i) & 1) << (position & 63);
+	};
+
+	write(1 << 6, 7);
+	for (int c = 0; c < 4; ++c) {
+		write((unsigned int)q0[c], 7);
+		write((unsigned int)q1[c], 7);
+	}
+	write((unsigned int)p0, 1);
+	write((unsigned int)p1, 1);
+	write(indices[0], 3);
+	for (int i = 1; i < 16; ++i)
+		write(indices[i], 4);
+
+	for (int i = 0; i < 16; ++i)
+		destination[i] = (unsigned char)(bits[i >> 3] >> ((i & 7) * 8));
+}
+
+//
+// TextureCompressor
+//
+
+size_t TextureCompressor::getCompressedSize(Format format, unsigned int width, unsigned int height) {
+	return (size_t)((width + 3) / 4) * ((height + 3) / 4) * getBlockBytes(format);
+}
+
+void TextureCompressor::compress(const unsigned char* pixels, unsigned int width, unsigned int height,
+								 Format format, Quality quality, unsigned char* destination) {
+
+	unsigned int blocksWide = (width + 3) / 4;
+	unsigned int blocksHigh = (height + 3) / 4;
+	unsigned int blockBytes = getBlockBytes(format);
+
+	parallelFor(blocksHigh, [&](unsigned int blockY) {
+		unsigned char* output = destination + (size_t)blockY * blocksWide * blockBytes;
+		for (unsigned int blockX = 0; blockX < blocksWide; ++blockX, output += blockBytes) {
+			BlockTexels texels;
+			loadBlock(pixels, width, height, blockX, blockY, texels);
+
+			switch (format) {
+			case Format::BC1:	encodeBC1(texels, quality, output);	break;
+			case Format::BC3:
+				encodeBC4(texels, 3, quality, output);
+				encodeBC1(texels, quality, output + 8);
+				break;
+			case Format::BC4:	encodeBC4(texels, 0, quality, output);	break;
+			case Format::BC5:
+				encodeBC4(texels, 0, quality, output);
+				encodeBC4(texels, 1, quality, output + 8);
+				break;
+			case Format::BC7:	encodeBC7(texels, quality, output);	break;
+			}
+		}
+	});
+}
+
+void TextureCompressor::downsample(const unsigned char* pixels, unsigned int width, unsigned int height,
+								   bool normals, unsigned char* destination) {
+
+	unsigned int targetWidth = std::max(width / 2, 1u);
+	unsigned int targetHeight = std::max(height / 2, 1u);
+
+	for (unsigned int y = 0; y < targetHeight; ++y) {
+		unsigned int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+		for (unsigned int x = 0; x < targetWidth; ++x) {
+			unsigned int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+			const unsigned char* source[4] = {
+				pixels + ((size_t)y0 * width + x0) * 4, pixels + ((size_t)y0 * width + x1) * 4,
+				pixels + ((size_t)y1 * width + x0) * 4, pixels + ((size_t)y1 * width + x1) * 4,
+			};
+			unsigned char* output = destination + ((size_t)y * targetWidth + x) * 4;
+
+			for (int c = 0; c < 4; ++c)
+				output[c] = (unsigned char)((source[0][c] + source[1][c] + source[2][c] + source[3][c] + 2) / 4);
+
+			if (normals) {
+				float normal[3] = {};
+				for (int s = 0; s < 4; ++s) {
+					for (int c = 0; c < 3; ++c)
+						normal[c] += source[s][c] / 127.5f - 1;
+				}
+				float length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+				if (length > 0) {
+					for (int c = 0; c < 3; ++c)
+						output[c] = (unsigned char)clampUnit((normal[c] / length + 1) * 127.5f + 0.5f);
+				}
+			}
+		}
+	}
+}
+
+} // namespace aie
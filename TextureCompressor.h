@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+
+namespace aie {
+
+// cpu block compression for the BCn formats every desktop GL 4.x driver can sample.
+// input is always tightly packed rgba8, output is whole 4x4 blocks in row order, edge blocks
+// repeat the last row or column
+class TextureCompressor {
+public:
+
+	enum class Format {
+		BC1,	// rgb, 4bpp
+		BC3,	// rgb with BC4 alpha, 8bpp
+		BC4,	// red only, 4bpp
+		BC5,	// red and green as two BC4 blocks, 8bpp, for normal maps that rebuild z
+		BC7,	// rgba using mode 6 only, 8bpp
+	};
+
+	enum class Quality {
+		FAST,	// bounding box endpoints
+		HIGH,	// principal axis endpoints refined by least squares, every BC7 p-bit pair tried
+	};
+
+	static unsigned int getBlockBytes(Format format) { return format == Format::BC1 || format == Format::BC4 ? 8 : 16; }
+	static size_t getCompressedSize(Format format, unsigned int width, unsigned int height);
+
+	// block rows are shared across all hardware threads
+	static void compress(const unsigned char* pixels, unsigned int width, unsigned int height,
+						 Format format, Quality quality, unsigned char* destination);
+
+	// box filters to the next mip size, each side halved and at least 1.
+	// normals are unpacked, averaged and renormalised so lower mips don't shorten them
+	static void downsample(const unsigned char* pixels, unsigned int width, unsigned int height,
+						   bool normals, unsigned char* destination);
+};
+
+} // namespace aie
@@ -0,0 +1,42 @@
+#include "UniformBuffer.h"
+#include "gl_core_4_4.h"
+#include <cassert>
+
+namespace aie {
+
+UniformBuffer::~UniformBuffer() {
+	glDeleteBuffers(1, &m_buffer);
+}
+
+void UniformBuffer::create(unsigned int size, unsigned int slotCount /* = 1 */) {
+	assert(m_buffer == 0 && slotCount > 0);
+
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+
+	m_size = size;
+	m_stride = (size + alignment - 1) / alignment * alignment;
+	m_slotCount = slotCount;
+
+	glGenBuffers(1, &m_buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+	glBufferData(GL_UNIFORM_BUFFER, (GLsizeiptr)m_stride * slotCount, nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void UniformBuffer::update(unsigned int slot, const void* data, unsigned int binding) {
+	assert(m_buffer != 0 && slot < m_slotCount);
+
+	glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, (GLintptr)m_stride * slot, m_size, data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	bind(slot, binding);
+}
+
+void UniformBuffer::bind(unsigned int slot, unsigned int binding) const {
+	assert(m_buffer != 0 && slot < m_slotCount);
+	glBindBufferRange(GL_UNIFORM_BUFFER, binding, m_buffer, (GLintptr)m_stride * slot, m_size);
+}
+
+} // namespace aie
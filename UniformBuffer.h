@@ -0,0 +1,32 @@
+#pragma once
+
+namespace aie {
+
+// a uniform buffer split into equal slots, each starting on the alignment glBindBufferRange needs,
+// so every pass of a frame writes its own slot rather than one still read by earlier draws.
+// the structs uploaded to it should follow std140, with vec3s padded out to vec4
+class UniformBuffer {
+public:
+
+	UniformBuffer() : m_buffer(0), m_size(0), m_stride(0), m_slotCount(0) {}
+	~UniformBuffer();
+
+	void create(unsigned int size, unsigned int slotCount = 1);
+
+	// size bytes of data are written to the slot, which is then bound to the binding point
+	void update(unsigned int slot, const void* data, unsigned int binding);
+	void bind(unsigned int slot, unsigned int binding) const;
+
+	unsigned int getHandle() const { return m_buffer; }
+	unsigned int getSize() const { return m_size; }
+	unsigned int getSlotCount() const { return m_slotCount; }
+
+private:
+
+	unsigned int	m_buffer;
+	unsigned int	m_size;
+	unsigned int	m_stride;
+	unsigned int	m_slotCount;
+};
+
+} // namespace aie
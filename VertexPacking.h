@@ -0,0 +1,87 @@
+#pragma once
+
+#include <glm/vec4.hpp>
+#include <cmath>
+#include <cstring>
+
+namespace aie {
+
+// conversions for packed vertex attributes. everything here is decoded by the fixed function
+// vertex fetch (GL_HALF_FLOAT and normalised GL_INT_2_10_10_10_REV), so shaders see the same
+// vec4 / vec2 inputs as the float layouts and need no changes
+
+// float to IEEE half with round to nearest even, handles denormals, infinity and nan
+inline unsigned short packHalf(float value) {
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	unsigned int sign = (bits >> 16) & 0x8000;
+	unsigned int exponent = (bits >> 23) & 0xff;
+	unsigned int mantissa = bits & 0x7fffff;
+
+	// nan and infinity
+	if (exponent == 0xff)
+		return (unsigned short)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+
+	int halfExponent = (int)exponent - 127 + 15;
+
+	// overflow to infinity
+	if (halfExponent >= 31)
+		return (unsigned short)(sign | 0x7c00);
+
+	// underflow to a denormal or zero
+	if (halfExponent <= 0) {
+		if (halfExponent < -10)
+			return (unsigned short)sign;
+
+		mantissa |= 0x800000;
+		unsigned int shift = (unsigned int)(14 - halfExponent);
+		unsigned int half = mantissa >> shift;
+		unsigned int remainder = mantissa & ((1u << shift) - 1);
+		unsigned int halfway = 1u << (shift - 1);
+		if (remainder > halfway || (remainder == halfway && (half & 1)))
+			++half;
+		return (unsigned short)(sign | half);
+	}
+
+	unsigned int half = ((unsigned int)halfExponent << 10) | (mantissa >> 13);
+	unsigned int remainder = mantissa & 0x1fff;
+	// rounding may carry in to the exponent, which correctly rounds up to infinity
+	if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+		++half;
+	return (unsigned short)(sign | half);
+}
+
+inline float unpackHalf(unsigned short value) {
+	unsigned int sign = (unsigned int)(value & 0x8000) << 16;
+	unsigned int exponent = (value >> 10) & 0x1f;
+	unsigned int mantissa = value & 0x3ff;
+
+	float result;
+	if (exponent == 0)
+		result = std::ldexp((float)mantissa, -24);
+	else if (exponent == 31)
+		result = mantissa ? NAN : INFINITY;
+	else
+		result = std::ldexp((float)(mantissa | 0x400), (int)exponent - 25);
+
+	unsigned int bits;
+	memcpy(&bits, &result, sizeof(bits));
+	bits |= sign;
+	memcpy(&result, &bits, sizeof(bits));
+	return result;
+}
+
+// packs a vec4 with components in [-1, 1] as 10:10:10:2 signed normalised, x in the low bits
+inline unsigned int packSnorm1010102(const glm::vec4& value) {
+	auto pack = [](float v, float scale, unsigned int mask) {
+		v = v < -1.0f ? -1.0f : (v > 1.0f ? 1.0f : v);
+		return (unsigned int)(int)std::floor(v * scale + 0.5f) & mask;
+	};
+	return pack(value.x, 511.0f, 0x3ff) |
+		   (pack(value.y, 511.0f, 0x3ff) << 10) |
+		   (pack(value.z, 511.0f, 0x3ff) << 20) |
+		   (pack(value.w, 1.0f, 0x3) << 30);
+}
+
+} // namespace aie
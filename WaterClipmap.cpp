@@ -0,0 +1,143 @@
+#include "WaterClipmap.h"
+#include "GLState.h"
+#include <gl_core_4_4.h>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+
+//fraction of each ring's width, from its outer edge in, over which it morphs to the next ring
+static const float MORPH_BAND = 0.3f;
+//morph distances for the outermost ring, which never reaches its band
+static const float NO_MORPH_START = 1e30f;
+static const float NO_MORPH_END = 2e30f;
+
+
+WaterClipmap::~WaterClipmap()
+{
+	glDeleteVertexArrays(1, &m_vao);
+	glDeleteBuffers(1, &m_patchBuffer);
+}
+
+
+//builds the shared patch and the patch layout around the origin
+void WaterClipmap::initialise(unsigned int patchQuads, float cellSize, unsigned int levels, float height /* = 0.0f */)
+{
+	assert(patchQuads % 2 == 0 && levels > 0);
+
+	m_patchQuads = patchQuads;
+	m_cellSize = cellSize;
+	m_levels = levels;
+	m_height = height;
+
+	//corners land on whole cells from the patch centre, the surface's normal is always up
+	initialiseQuad(patchQuads, patchQuads, true);
+
+	glGenBuffers(1, &m_patchBuffer);
+	m_patchesDirty = true;
+
+	//a vertex array of its own, as the morph band would otherwise change the layout of every grid mesh,
+	//so the patch attributes can stay enabled. the morph band comes after the instance matrix in each patch
+	glGenVertexArrays(1, &m_vao);
+	aie::GLState::bindVertexArray(m_vao);
+	arena->formatVertexArray();
+	glVertexAttribFormat(MORPH_LOCATION, 4, GL_FLOAT, GL_FALSE, offsetof(Patch, morph));
+	glVertexAttribBinding(MORPH_LOCATION, aie::GeometryArena::INSTANCE_BINDING);
+	glBindVertexBuffer(aie::GeometryArena::INSTANCE_BINDING, m_patchBuffer, 0, sizeof(Patch));
+	for (unsigned int c = 0; c < 4; c++)
+		glEnableVertexAttribArray(aie::GeometryArena::INSTANCE_MATRIX_LOCATION + c);
+	glEnableVertexAttribArray(MORPH_LOCATION);
+	aie::GLState::bindVertexArray(0);
+}
+
+
+//the rings follow the x and z of the view position, snapped to the coarsest lattice
+void WaterClipmap::setViewPosition(const glm::vec3& viewPosition)
+{
+	//a step of the coarsest ring's parent lattice keeps every ring's vertices on their own lattice
+	float snap = 2.0f * m_cellSize * std::exp2((float)m_levels - 1.0f);
+	glm::vec3 centre = glm::vec3(std::floor(viewPosition.x / snap + 0.5f) * snap, m_height,
+		std::floor(viewPosition.z / snap + 0.5f) * snap);
+
+	if (centre != m_centre)
+	{
+		m_centre = centre;
+		m_patchesDirty = true;
+	}
+}
+
+
+//true when the program reads both instanced attributes, without them only one patch would show
+bool WaterClipmap::isSupported(unsigned int program)
+{
+	return glGetAttribLocation(program, "InstanceModelMatrix") == (int)aie::GeometryArena::INSTANCE_MATRIX_LOCATION &&
+		glGetAttribLocation(program, "PatchMorph") == (int)MORPH_LOCATION;
+}
+
+
+//half the width of the area covered, in world units
+float WaterClipmap::getExtent() const
+{
+	return 2.0f * m_patchQuads * m_cellSize * std::exp2((float)m_levels - 1.0f);
+}
+
+
+//rebuilds every patch around the snapped centre and uploads them
+void WaterClipmap::updatePatches()
+{
+	m_patchesDirty = false;
+	m_patches.clear();
+
+	for (unsigned int level = 0; level < m_levels; level++)
+	{
+		float cell = m_cellSize * std::exp2((float)level);
+		float patchSize = m_patchQuads * cell;
+
+		//ring distances are measured along the furthest axis, so the band follows the square edge
+		glm::vec4 morph = glm::vec4(m_centre.x, m_centre.z, NO_MORPH_START, NO_MORPH_END);
+		if (level + 1 < m_levels)
+		{
+			morph.w = 2.0f * patchSize;
+			morph.z = morph.w - MORPH_BAND * patchSize;
+		}
+
+		//a 4x4 block of patches, leaving a hole for the finer level inside
+		for (int i = 0; i < 4; i++)
+		{
+			for (int j = 0; j < 4; j++)
+			{
+				bool inner = (i == 1 || i == 2) && (j == 1 || j == 2);
+				if (level > 0 && inner)
+					continue;
+
+				Patch patch;
+				patch.transform = glm::mat4(1);
+				patch.transform[0][0] = cell;
+				patch.transform[2][2] = cell;
+				patch.transform[3] = glm::vec4(m_centre.x + (j - 1.5f) * patchSize, m_height,
+					m_centre.z + (i - 1.5f) * patchSize, 1);
+				patch.morph = morph;
+				m_patches.push_back(patch);
+			}
+		}
+	}
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_patchBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, m_patches.size() * sizeof(Patch), m_patches.data(), GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+
+void WaterClipmap::draw()
+{
+	if (m_patchesDirty)
+		updatePatches();
+
+	//the arena's buffers move when other meshes make it grow
+	aie::GLState::bindVertexArray(m_vao);
+	arena->bindBuffers();
+	glVertexAttrib4f(1, 0, 1, 0, 0);
+
+	//every patch in one draw, each instance reading its own matrix and morph band
+	glDrawElementsInstancedBaseVertex(GL_TRIANGLES, 3 * triCount, indexType, (void*)(size_t)allocation.indexOffset,
+		(GLsizei)m_patches.size(), allocation.baseVertex);
+}
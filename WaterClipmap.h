@@ -0,0 +1,78 @@
+#pragma once
+#include "Mesh.h"
+#include <vector>
+
+//a flat surface of any size drawn with a constant number of vertices. one indexed grid patch is
+//drawn instanced as a 4x4 block of patches around the centre, then rings of 12 patches each with
+//double the cell size of the ring inside, so detail falls off with distance from the camera.
+//every ring follows the view position snapped to the coarsest ring's lattice, so no vertex
+//ever swims, and each ring's outer band morphs on to the next ring's grid so the edges meet.
+//
+//each patch's world matrix arrives at GeometryArena::INSTANCE_MATRIX_LOCATION, in place of the
+//model matrix like indirect draws, and its morph band at MORPH_LOCATION. the instance's own
+//transform should be the identity. a vertex shader drawing it morphs the position like this:
+//
+//	layout(location = 4) in mat4 InstanceModelMatrix;
+//	layout(location = 8) in vec4 PatchMorph;	//centre x and z, morph start and end distances
+//
+//	vec4 world = InstanceModelMatrix * Position;
+//	float cell = InstanceModelMatrix[0][0];
+//	float ring = max(abs(world.x - PatchMorph.x), abs(world.z - PatchMorph.y));
+//	float morph = clamp((ring - PatchMorph.z) / (PatchMorph.w - PatchMorph.z), 0.0, 1.0);
+//	vec2 lattice = floor(world.xz / cell + 0.5);
+//	world.xz -= fract(lattice * 0.5) * 2.0 * cell * morph;
+//
+//then uses world as the model space position, with ProjectionViewModel as the projection view
+class WaterClipmap : public Mesh
+{
+public:
+
+	//the per instance attribute carrying PatchMorph
+	static const unsigned int MORPH_LOCATION = 8;
+
+	WaterClipmap() {}
+	virtual ~WaterClipmap();
+
+	//patchQuads is the quads along a patch's side and must be even, cellSize is the finest ring's
+	//quad size in world units, and each of the levels past the first adds a ring twice as coarse.
+	//the surface lies flat at the given height
+	void initialise(unsigned int patchQuads, float cellSize, unsigned int levels, float height = 0.0f);
+
+	//the rings follow the x and z of the view position, snapped to the coarsest lattice
+	void setViewPosition(const glm::vec3& viewPosition);
+
+	//true when the program reads both instanced attributes, without them only one patch would show
+	static bool isSupported(unsigned int program);
+
+	virtual void draw();
+	//every patch is placed by draw, so an index range alone can't draw the surface
+	virtual bool canDrawIndirect() const { return false; }
+
+	unsigned int getPatchCount() const { return (unsigned int)m_patches.size(); }
+	//half the width of the area covered, in world units
+	float getExtent() const;
+
+protected:
+
+	//per instance data, read from GeometryArena::INSTANCE_BINDING
+	struct Patch {
+		glm::mat4 transform;
+		glm::vec4 morph;
+	};
+
+	//rebuilds every patch around the snapped centre and uploads them
+	void updatePatches();
+
+	unsigned int m_patchQuads = 0;
+	float m_cellSize = 1.0f;
+	unsigned int m_levels = 0;
+	float m_height = 0.0f;
+
+	glm::vec3 m_centre = glm::vec3(0);
+	bool m_patchesDirty = true;
+
+	std::vector<Patch> m_patches;
+	unsigned int m_patchBuffer = 0;
+	//the grid arena's layout plus the morph band
+	unsigned int m_vao = 0;
+};